@@ -190,6 +190,11 @@ struct yyParser {
 #if YYSTACKDEPTH<=0
   int yystksz;                  /* Current side of the stack */
   yyStackEntry *yystack;        /* The parser's stack */
+#if __MOJOSHADER__
+  void *(*yymalloc)(int,void *);  /* Allocator the stack grows with */
+  void (*yyfree)(void *,void *);
+  void *yymalloc_data;
+#endif
 #else
   yyStackEntry yystack[YYSTACKDEPTH];  /* The parser's stack */
 #endif
@@ -257,7 +262,16 @@ static void yyGrowStack(yyParser *p){
   yyStackEntry *pNew;
 
   newSize = p->yystksz*2 + 100;
+#if __MOJOSHADER__
+  pNew = (yyStackEntry *)(*p->yymalloc)( (int)(newSize*sizeof(pNew[0])),
+                                          p->yymalloc_data );
+  if( pNew && p->yystack ){
+    memcpy(pNew, p->yystack, p->yystksz*sizeof(pNew[0]));
+    (*p->yyfree)(p->yystack, p->yymalloc_data);
+  }
+#else
   pNew = realloc(p->yystack, newSize*sizeof(pNew[0]));
+#endif
   if( pNew ){
     p->yystack = pNew;
     p->yystksz = newSize;
@@ -284,9 +298,17 @@ static void yyGrowStack(yyParser *p){
 ** to Parse and ParseFree.
 */
 #if __MOJOSHADER__
-static void *ParseAlloc(void *(*mallocProc)(int,void *), void *malloc_data){
+static void *ParseAlloc(void *(*mallocProc)(int,void *),
+                        void (*freeProc)(void *,void *), void *malloc_data){
   yyParser *pParser;
   pParser = (yyParser*)(*mallocProc)( (int)sizeof(yyParser), malloc_data );
+#if YYSTACKDEPTH<=0
+  if( pParser ){
+    pParser->yymalloc = mallocProc;
+    pParser->yyfree = freeProc;
+    pParser->yymalloc_data = malloc_data;
+  }
+#endif
 #else
 void *ParseAlloc(void *(*mallocProc)(size_t)){
   yyParser *pParser;
@@ -387,8 +409,12 @@ void ParseFree(
   if( pParser==0 ) return;
   while( pParser->yyidx>=0 ) yy_pop_parser_stack(pParser);
 #if YYSTACKDEPTH<=0
+#if __MOJOSHADER__
+  (*freeProc)((void*)pParser->yystack, malloc_data);
+#else
   free(pParser->yystack);
 #endif
+#endif
 #if __MOJOSHADER__
   (*freeProc)((void*)pParser, malloc_data);
 #else
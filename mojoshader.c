@@ -99,6 +99,7 @@ typedef struct Context
     Buffer *mainline_intro;
     Buffer *mainline;
     Buffer *ignore;
+    BufferPool *buffer_pool;
     Buffer *output_stack[2];
     int indent_stack[2];
     int output_stack_len;
@@ -133,6 +134,7 @@ typedef struct Context
     int last_address_reg_component;
     RegisterList used_registers;
     RegisterList defined_registers;
+    RegisterList *reglist_pool;  // recycled nodes, kept between parses.
     ErrorList *errors;
     int constant_count;
     ConstantsList *constants;
@@ -168,6 +170,9 @@ typedef struct Context
     int texm3x3pad_dst1;
     int texm3x3pad_src1;
     MOJOSHADER_preshader *preshader;
+    int inline_preshader;  // caller's setting, survives reset_context().
+    int profile_can_inline_preshader;
+    int preshader_inlined;
 
 #if SUPPORT_PROFILE_ARB1_NV
     int profile_supports_nv2;
@@ -315,9 +320,16 @@ static inline void Free(Context *ctx, void *ptr)
     ctx->free(ptr, ctx->malloc_data);
 } // Free
 
+// Only the output buffers and the error list allocate through here, so
+//  this is where an allocation tracer learns what is emitter output.
 static void *MallocBridge(int bytes, void *data)
 {
-    return Malloc((Context *) data, (size_t) bytes);
+    Context *ctx = (Context *) data;
+    const MOJOSHADER_allocPhase phase = alloc_phase(ctx->malloc,
+                        ctx->malloc_data, MOJOSHADER_ALLOCPHASE_EMITTER);
+    void *retval = Malloc(ctx, (size_t) bytes);
+    alloc_phase(ctx->malloc, ctx->malloc_data, phase);
+    return retval;
 } // MallocBridge
 
 static void FreeBridge(void *ptr, void *data)
@@ -333,7 +345,7 @@ static int set_output(Context *ctx, Buffer **section)
     // only create output sections on first use.
     if (*section == NULL)
     {
-        *section = buffer_create(256, MallocBridge, FreeBridge, ctx);
+        *section = buffer_create_pooled(256, ctx->buffer_pool);
         if (*section == NULL)
             return 0;
     } // if
@@ -540,7 +552,12 @@ static RegisterList *reglist_insert(Context *ctx, RegisterList *prev,
     } // while
 
     // we need to insert an entry after (prev).
-    item = (RegisterList *) Malloc(ctx, sizeof (RegisterList));
+    item = ctx->reglist_pool;
+    if (item != NULL)
+        ctx->reglist_pool = item->next;
+    else
+        item = (RegisterList *) Malloc(ctx, sizeof (RegisterList));
+
     if (item != NULL)
     {
         item->regtype = regtype;
@@ -2211,6 +2228,7 @@ static void emit_GLSL_start(Context *ctx, const char *profilestr)
 
     set_output(ctx, &ctx->mainline);
     ctx->indent++;
+    ctx->profile_can_inline_preshader = 1;
 } // emit_GLSL_start
 
 static void emit_GLSL_RET(Context *ctx);
@@ -2256,8 +2274,249 @@ static void output_GLSL_uniform_array(Context *ctx, const RegisterType regtype,
     } // if
 } // output_GLSL_uniform_array
 
+// Preshader literals are doubles, and floatstr()'s "%f" would round small
+//  ones to zero, so these get their own formatting.
+static void make_GLSL_preshader_literal(char *buf, const size_t buflen,
+                                        const double val)
+{
+    snprintf(buf, buflen, "%.9g", val);
+    if (strpbrk(buf, ".e") == NULL)
+        strncat(buf, ".0", buflen - strlen(buf) - 1);
+} // make_GLSL_preshader_literal
+
+static void make_GLSL_preshader_operand(Context *ctx,
+                                const MOJOSHADER_preshaderInstruction *inst,
+                                const unsigned int opiter,
+                                const unsigned int elem,
+                                char *buf, const size_t buflen)
+{
+    static const char comps[] = { 'x', 'y', 'z', 'w' };
+    const MOJOSHADER_preshaderOperand *operand = &inst->operands[opiter];
+    const int isscalar = ( (opiter == 0) &&
+                           (opiter != inst->operand_count - 1) &&
+                           (inst->opcode >= MOJOSHADER_PRESHADEROP_SCALAR_OPS) );
+    const unsigned int index = operand->index + (isscalar ? 0 : elem);
+    const char *shstr = ctx->shader_type_str;
+    char varname[64];
+
+    switch (operand->type)
+    {
+        case MOJOSHADER_PRESHADEROPERAND_LITERAL:
+            make_GLSL_preshader_literal(buf, buflen,
+                                        ctx->preshader->literals[index]);
+            break;
+
+        case MOJOSHADER_PRESHADEROPERAND_INPUT:
+            if (operand->indexingType == 2)
+            {
+                const unsigned int rel = operand->indexingIndex;
+                snprintf(buf, buflen,
+                         "%s_preshader_vec4[int(%s_preshader_vec4[%u].%c) + %u].%c",
+                         shstr, shstr, rel / 4, comps[rel % 4], index / 4,
+                         comps[index % 4]);
+            } // if
+            else
+            {
+                snprintf(buf, buflen, "%s_preshader_vec4[%u].%c",
+                         shstr, index / 4, comps[index % 4]);
+            } // else
+            break;
+
+        case MOJOSHADER_PRESHADEROPERAND_OUTPUT:
+            get_GLSL_varname_in_buf(ctx, REG_TYPE_CONST, index / 4,
+                                    varname, sizeof (varname));
+            snprintf(buf, buflen, "%s.%c", varname, comps[index % 4]);
+            break;
+
+        case MOJOSHADER_PRESHADEROPERAND_TEMP:
+            snprintf(buf, buflen, "%s_preshader_t%u", shstr, index);
+            break;
+
+        default:
+            fail(ctx, "BUG: unexpected preshader operand type");
+            buf[0] = '\0';
+            break;
+    } // switch
+} // make_GLSL_preshader_operand
+
+// Calculate the preshader at the top of main(), instead of on the CPU. It
+//  reads its inputs from its own uniform array, and writes to globals that
+//  stand in for the constant registers it would have set.
+static void emit_GLSL_preshader(Context *ctx)
+{
+    const MOJOSHADER_preshader *preshader = ctx->preshader;
+    const char *shstr = ctx->shader_type_str;
+    const int oldindent = ctx->indent;
+    char varname[64];
+    char src[3][128];
+    char dst[4][128];
+    char expr[4][640];
+    unsigned int i, e;
+
+    push_output(ctx, &ctx->preflight);
+    if (preshader->input_register_count > 0)
+    {
+        output_line(ctx, "uniform vec4 %s_preshader_vec4[%u];", shstr,
+                    preshader->input_register_count);
+    } // if
+    pop_output(ctx);
+
+    push_output(ctx, &ctx->globals);
+    for (i = 0; i < preshader->output_register_count; i++)
+    {
+        if (preshader->output_written[i / 32] & (1u << (i % 32)))
+        {
+            get_GLSL_varname_in_buf(ctx, REG_TYPE_CONST, i, varname,
+                                    sizeof (varname));
+            output_line(ctx, "vec4 %s;", varname);
+        } // if
+    } // for
+    pop_output(ctx);
+
+    push_output(ctx, &ctx->mainline_intro);
+    ctx->indent = 1;
+
+    // temps start out as zero on the CPU, too.
+    for (i = 0; i < preshader->temp_count; i++)
+        output_line(ctx, "float %s_preshader_t%u = 0.0;", shstr, i);
+
+    const MOJOSHADER_preshaderInstruction *inst = preshader->instructions;
+    for (i = 0; i < preshader->instruction_count; i++, inst++)
+    {
+        const unsigned int dstiter = inst->operand_count - 1;
+        const MOJOSHADER_preshaderOperand *dstop = &inst->operands[dstiter];
+        const unsigned int elems = inst->element_count;
+        int overlaps = 0;
+        unsigned int opiter;
+
+        for (e = 0; e < elems; e++)
+        {
+            make_GLSL_preshader_operand(ctx, inst, dstiter, e, dst[e],
+                                        sizeof (dst[e]));
+            for (opiter = 0; opiter < dstiter; opiter++)
+            {
+                make_GLSL_preshader_operand(ctx, inst, opiter, e, src[opiter],
+                                            sizeof (src[opiter]));
+            } // for
+
+            const char *s0 = src[0], *s1 = src[1], *s2 = src[2];
+            char *x = expr[e];
+            const size_t xlen = sizeof (expr[e]);
+            switch (inst->opcode)
+            {
+                case MOJOSHADER_PRESHADEROP_MOV:
+                    snprintf(x, xlen, "%s", s0); break;
+                case MOJOSHADER_PRESHADEROP_NEG:
+                    snprintf(x, xlen, "-(%s)", s0); break;
+                case MOJOSHADER_PRESHADEROP_RCP:
+                    snprintf(x, xlen, "(1.0 / %s)", s0); break;
+                case MOJOSHADER_PRESHADEROP_FRC:
+                    snprintf(x, xlen, "fract(%s)", s0); break;
+                case MOJOSHADER_PRESHADEROP_EXP:
+                    snprintf(x, xlen, "exp(%s)", s0); break;
+                case MOJOSHADER_PRESHADEROP_LOG:
+                    snprintf(x, xlen, "log(%s)", s0); break;
+                case MOJOSHADER_PRESHADEROP_RSQ:
+                    snprintf(x, xlen, "inversesqrt(%s)", s0); break;
+                case MOJOSHADER_PRESHADEROP_SIN:
+                    snprintf(x, xlen, "sin(%s)", s0); break;
+                case MOJOSHADER_PRESHADEROP_COS:
+                    snprintf(x, xlen, "cos(%s)", s0); break;
+                case MOJOSHADER_PRESHADEROP_ASIN:
+                    snprintf(x, xlen, "asin(%s)", s0); break;
+                case MOJOSHADER_PRESHADEROP_ACOS:
+                    snprintf(x, xlen, "acos(%s)", s0); break;
+                case MOJOSHADER_PRESHADEROP_ATAN:
+                    snprintf(x, xlen, "atan(%s)", s0); break;
+                case MOJOSHADER_PRESHADEROP_MIN:
+                case MOJOSHADER_PRESHADEROP_MIN_SCALAR:
+                    snprintf(x, xlen, "min(%s, %s)", s0, s1); break;
+                case MOJOSHADER_PRESHADEROP_MAX:
+                case MOJOSHADER_PRESHADEROP_MAX_SCALAR:
+                    snprintf(x, xlen, "max(%s, %s)", s0, s1); break;
+                case MOJOSHADER_PRESHADEROP_LT:
+                case MOJOSHADER_PRESHADEROP_LT_SCALAR:
+                    snprintf(x, xlen, "((%s < %s) ? 1.0 : 0.0)", s0, s1); break;
+                case MOJOSHADER_PRESHADEROP_GE:
+                case MOJOSHADER_PRESHADEROP_GE_SCALAR:
+                    snprintf(x, xlen, "((%s >= %s) ? 1.0 : 0.0)", s0, s1); break;
+                case MOJOSHADER_PRESHADEROP_ADD:
+                case MOJOSHADER_PRESHADEROP_ADD_SCALAR:
+                    snprintf(x, xlen, "(%s + %s)", s0, s1); break;
+                case MOJOSHADER_PRESHADEROP_MUL:
+                case MOJOSHADER_PRESHADEROP_MUL_SCALAR:
+                    snprintf(x, xlen, "(%s * %s)", s0, s1); break;
+                case MOJOSHADER_PRESHADEROP_ATAN2:
+                case MOJOSHADER_PRESHADEROP_ATAN2_SCALAR:
+                    snprintf(x, xlen, "atan(%s, %s)", s0, s1); break;
+                case MOJOSHADER_PRESHADEROP_DIV:
+                case MOJOSHADER_PRESHADEROP_DIV_SCALAR:
+                    snprintf(x, xlen, "(%s / %s)", s0, s1); break;
+                case MOJOSHADER_PRESHADEROP_CMP:
+                    snprintf(x, xlen, "((%s >= 0.0) ? %s : %s)", s0, s1, s2);
+                    break;
+                case MOJOSHADER_PRESHADEROP_DOT:
+                {
+                    // every element gets the whole sum.
+                    unsigned int j;
+                    size_t len;
+                    x[0] = '\0';
+                    for (j = 0; j < elems; j++)
+                    {
+                        make_GLSL_preshader_operand(ctx, inst, 0, j, src[0],
+                                                    sizeof (src[0]));
+                        make_GLSL_preshader_operand(ctx, inst, 1, j, src[1],
+                                                    sizeof (src[1]));
+                        len = strlen(x);
+                        snprintf(x + len, xlen - len, "%s(%s * %s)",
+                                 j ? " + " : "", src[0], src[1]);
+                    } // for
+                    break;
+                } // case
+                default:
+                    fail(ctx, "BUG: preshader opcode can't be inlined");
+                    x[0] = '\0';
+                    break;
+            } // switch
+        } // for
+
+        // if we write something a later element still reads, calculate
+        //  everything before storing anything.
+        for (opiter = 0; opiter < dstiter; opiter++)
+        {
+            const MOJOSHADER_preshaderOperand *srcop = &inst->operands[opiter];
+            if ( (elems > 1) && (srcop->type == dstop->type) &&
+                 (srcop->index < (dstop->index + elems)) &&
+                 ((srcop->index + elems) > dstop->index) )
+                overlaps = 1;
+        } // for
+
+        if (!overlaps)
+        {
+            for (e = 0; e < elems; e++)
+                output_line(ctx, "%s = %s;", dst[e], expr[e]);
+        } // if
+        else
+        {
+            output_line(ctx, "{");
+            ctx->indent++;
+            for (e = 0; e < elems; e++)
+                output_line(ctx, "float preshader_d%u = %s;", e, expr[e]);
+            for (e = 0; e < elems; e++)
+                output_line(ctx, "%s = preshader_d%u;", dst[e], e);
+            ctx->indent--;
+            output_line(ctx, "}");
+        } // else
+    } // for
+
+    ctx->indent = oldindent;
+    pop_output(ctx);
+} // emit_GLSL_preshader
+
 static void emit_GLSL_finalize(Context *ctx)
 {
+    if (ctx->preshader_inlined)
+        emit_GLSL_preshader(ctx);
     
     // throw some blank lines around to make source more readable.
     push_output(ctx, &ctx->globals);
@@ -8194,159 +8453,728 @@ typedef struct PreshaderBlockInfo
     int seen;
 } PreshaderBlockInfo;
 
-// Preshaders only show up in compiled Effect files. The format is
-//  undocumented, and even the instructions aren't the same opcodes as you
-//  would find in a regular shader. These things show up because the HLSL
-//  compiler can detect work that sets up constant registers that could
-//  be moved out of the shader itself. Preshaders run once, then the shader
-//  itself runs many times, using the constant registers the preshader has set
-//  up. There are cases where the preshaders are 3+ times as many instructions
-//  as the shader itself, so this can be a big performance win.
-// My presumption is that Microsoft's Effects framework runs the preshaders on
-//  the CPU, then loads the constant register file appropriately before handing
-//  off to the GPU. As such, we do the same.
-static void parse_preshader(Context *ctx, uint32 tokcount)
+// How many scalars operand (opiter) of (inst) touches.
+static inline unsigned int preshader_operand_elems(
+                                const MOJOSHADER_preshaderInstruction *inst,
+                                const unsigned int opiter)
 {
-    const uint32 *tokens = ctx->tokens;
-    
-    if (SWAP32(tokens[1]) == PRES_ID) {
-        if (tokcount <= 2) return;
-        //hax
-        tokens += 2;
-        tokcount -= 2;
-    }
-    
-    assert(ctx->have_preshader == 0);  // !!! FIXME: can you have more than one?
-    ctx->have_preshader = 1;
+    const int isdest = (opiter == (inst->operand_count - 1));
+    if ( (!isdest) && (opiter == 0) &&
+         (inst->opcode >= MOJOSHADER_PRESHADEROP_SCALAR_OPS) )
+        return 1;
+    return inst->element_count;
+} // preshader_operand_elems
 
-    // !!! FIXME: I don't know what specific versions signify, but we need to
-    // !!! FIXME:  save this to test against the CTAB version field, if
-    // !!! FIXME:  nothing else.
-    // !!! FIXME: 0x02 0x01 is probably the version (fx_2_1),
-    // !!! FIXME:  and 0x4658 is the magic, like a real shader's version token.
-    const uint32 okay_versions[] = {0x46580201, 0x46580200};
-    if (SWAP32(tokens[0]) != okay_versions[0] && SWAP32(tokens[0]) != okay_versions[1])
+static inline void set_register_bits(unsigned int *mask, unsigned int first,
+                                     unsigned int last)
+{
+    unsigned int i;
+    for (i = first; i <= last; i++)
+        mask[i / 32] |= (1u << (i % 32));
+} // set_register_bits
+
+static inline void or_register_masks(unsigned int *dst, const unsigned int *src,
+                                     const unsigned int words)
+{
+    unsigned int i;
+    for (i = 0; i < words; i++)
+        dst[i] |= src[i];
+} // or_register_masks
+
+// Is it safe to calculate this opcode when we parse the preshader?
+static int preshader_opcode_foldable(const MOJOSHADER_preshaderOpcode op)
+{
+    switch (op)
     {
-        failf(ctx, "Unsupported preshader version %6x.", tokens[0]);
-        return;  // fail because the shader will malfunction w/o this.
-    } // if
+        case MOJOSHADER_PRESHADEROP_NOP:
+        case MOJOSHADER_PRESHADEROP_MOVC:
+        case MOJOSHADER_PRESHADEROP_NOISE:
+        case MOJOSHADER_PRESHADEROP_DOT_SCALAR:
+        case MOJOSHADER_PRESHADEROP_NOISE_SCALAR:
+            return 0;  // MOJOSHADER_runPreshader() doesn't know these.
+        default:
+            return 1;
+    } // switch
+} // preshader_opcode_foldable
 
-    tokens += 1;
-    tokcount -= 1;
+// Find (vals) in the literal pool, adding them to the end if they aren't
+//  there yet. Returns the index of the first one, -1 if out of memory.
+static int add_preshader_literals(Context *ctx, MOJOSHADER_preshader *preshader,
+                                  unsigned int *capacity, const double *vals,
+                                  const unsigned int count)
+{
+    const size_t len = sizeof (double) * count;
+    unsigned int i;
 
-    // All sections of a preshader are packed into separate comment tokens,
-    //  inside the containing comment token block. Find them all before
-    //  we start, so we don't care about the order they appear in the file.
-    PreshaderBlockInfo ctab = { 0, 0, 0 };
-    PreshaderBlockInfo prsi = { 0, 0, 0 };
-    PreshaderBlockInfo fxlc = { 0, 0, 0 };
-    PreshaderBlockInfo clit = { 0, 0, 0 };
+    for (i = 0; (i + count) <= preshader->literal_count; i++)
+    {
+        if (memcmp(&preshader->literals[i], vals, len) == 0)
+            return (int) i;
+    } // for
 
-    while (tokcount > 0)
+    if ((preshader->literal_count + count) > *capacity)
     {
-        uint32 subtokcount = 0;
-        if ( (!is_comment_token(ctx, *tokens, &subtokcount)) ||
-             (subtokcount > tokcount) )
+        const unsigned int newcap = (preshader->literal_count + count) * 2;
+        double *ptr = (double *) Malloc(ctx, sizeof (double) * newcap);
+        if (ptr == NULL)
+            return -1;
+        if (preshader->literal_count > 0)
         {
-            fail(ctx, "Bogus preshader data.");
-            return;
+            memcpy(ptr, preshader->literals,
+                   sizeof (double) * preshader->literal_count);
         } // if
+        Free(ctx, preshader->literals);
+        preshader->literals = ptr;
+        *capacity = newcap;
+    } // if
 
-        tokens++;
-        tokcount--;
+    i = preshader->literal_count;
+    memcpy(&preshader->literals[i], vals, len);
+    preshader->literal_count += count;
+    return (int) i;
+} // add_preshader_literals
 
-        const uint32 *nexttokens = tokens + subtokcount;
-        const uint32 nexttokcount = tokcount - subtokcount;
+// What we know a temp scalar holds. TEMP means nothing better than itself.
+typedef struct PreshaderValue
+{
+    MOJOSHADER_preshaderOperandType type;
+    unsigned int index;
+} PreshaderValue;
 
-        if (subtokcount > 0)
-        {
-            switch (SWAP32(*tokens))
-            {
-                #define PRESHADER_BLOCK_CASE(id, var) \
-                    case id##_ID: { \
-                        if (var.seen) { \
-                            fail(ctx, "Multiple " #id " preshader blocks."); \
-                            return; \
-                        } \
-                        var.tokens = tokens; \
-                        var.tokcount = subtokcount; \
-                        var.seen = 1; \
-                        break; \
-                    }
-                PRESHADER_BLOCK_CASE(CTAB, ctab);
-                PRESHADER_BLOCK_CASE(PRSI, prsi);
-                PRESHADER_BLOCK_CASE(FXLC, fxlc);
-                PRESHADER_BLOCK_CASE(CLIT, clit);
-                default: fail(ctx, "Bogus preshader section."); return;
-                #undef PRESHADER_BLOCK_CASE
-            } // switch
-        } // if
+// Read a literal or input directly, instead of a temp that was copied from it.
+static void forward_preshader_operand(MOJOSHADER_preshaderOperand *operand,
+                                      const PreshaderValue *values,
+                                      const unsigned int elems)
+{
+    unsigned int i;
+    if ((operand->type != MOJOSHADER_PRESHADEROPERAND_TEMP) || (elems == 0))
+        return;
 
-        tokens = nexttokens;
-        tokcount = nexttokcount;
-    } // while
+    const PreshaderValue *val = &values[operand->index];
+    if (val->type == MOJOSHADER_PRESHADEROPERAND_TEMP)
+        return;
 
-    if (!ctab.seen) { fail(ctx, "No CTAB block in preshader."); return; }
-    //if (!prsi.seen) { fail(ctx, "No PRSI block in preshader."); return; }
-    if (!fxlc.seen) { fail(ctx, "No FXLC block in preshader."); return; }
-    if (!clit.seen) { fail(ctx, "No CLIT block in preshader."); return; }
+    for (i = 1; i < elems; i++)
+    {
+        if ((val[i].type != val->type) || (val[i].index != val->index + i))
+            return;  // not one contiguous source, leave it alone.
+    } // for
 
-    MOJOSHADER_preshader *preshader = (MOJOSHADER_preshader *)
-                                    Malloc(ctx, sizeof (MOJOSHADER_preshader));
-    if (preshader == NULL)
+    operand->type = val->type;
+    operand->index = val->index;
+    operand->indexingType = 0;
+    operand->indexingIndex = 0;
+} // forward_preshader_operand
+
+// Turn (b) into more elements of (a), if they're the same operation on
+//  neighbouring registers. Returns non-zero if (b) isn't needed anymore.
+static int merge_preshader_instructions(MOJOSHADER_preshaderInstruction *a,
+                                    const MOJOSHADER_preshaderInstruction *b)
+{
+    const int isscalarop = (a->opcode >= MOJOSHADER_PRESHADEROP_SCALAR_OPS);
+    const unsigned int elems = a->element_count;
+    unsigned int i;
+
+    if ( (a->opcode != b->opcode) || (!preshader_opcode_foldable(a->opcode)) )
+        return 0;
+    else if (a->opcode == MOJOSHADER_PRESHADEROP_DOT)
+        return 0;  // all elements get the sum, so this can't be split up.
+    else if ((a->operand_count != b->operand_count) || (a->operand_count < 2))
+        return 0;
+    else if ((elems == 0) || (b->element_count == 0))
+        return 0;
+    else if ((elems + b->element_count) > 4)
+        return 0;
+
+    const MOJOSHADER_preshaderOperand *adst = &a->operands[a->operand_count-1];
+    const MOJOSHADER_preshaderOperand *bdst = &b->operands[b->operand_count-1];
+    if ((adst->type != bdst->type) || (bdst->index != (adst->index + elems)))
+        return 0;
+
+    for (i = 0; i < a->operand_count - 1; i++)
+    {
+        const MOJOSHADER_preshaderOperand *asrc = &a->operands[i];
+        const MOJOSHADER_preshaderOperand *bsrc = &b->operands[i];
+        const int isscalar = ((isscalarop) && (i == 0));
+        const unsigned int belems = isscalar ? 1 : b->element_count;
+        if (asrc->type != bsrc->type)
+            return 0;
+        else if ((asrc->indexingType != 0) || (bsrc->indexingType != 0))
+            return 0;
+        else if (bsrc->index != (asrc->index + (isscalar ? 0 : elems)))
+            return 0;
+
+        // (b) mustn't read what (a) writes, as they'll run as one now.
+        if ( (bsrc->type == adst->type) &&
+             (bsrc->index < (adst->index + elems)) &&
+             ((bsrc->index + belems) > adst->index) )
+            return 0;
+    } // for
+
+    a->element_count += b->element_count;
+    return 1;
+} // merge_preshader_instructions
+
+// Simplify a preshader, so running it every draw call is cheaper. This does
+//  a forward pass that folds instructions that only use literals into new
+//  literals and forwards copies of literals and inputs to whatever reads
+//  them, then a backward pass that drops instructions writing temps nobody
+//  reads. What's left gets scalar ops on neighbouring registers merged into
+//  vector ops, and the temps renumbered to close the gaps.
+static void optimize_preshader(Context *ctx, MOJOSHADER_preshader *preshader)
+{
+    MOJOSHADER_preshaderInstruction *inst;
+    unsigned int litcapacity = preshader->literal_count;
+    unsigned int tempslots = 0;
+    unsigned int i, opiter, e;
+
+    if (preshader->instruction_count == 0)
         return;
-    memset(preshader, '\0', sizeof (MOJOSHADER_preshader));
-    ctx->preshader = preshader;
 
-    // Let's set up the constant literals first...
-    if (clit.tokcount == 0)
-        fail(ctx, "Bogus CLIT block in preshader.");
-    else
+    inst = preshader->instructions;
+    for (i = 0; i < preshader->instruction_count; i++, inst++)
     {
-        const uint32 lit_count = SWAP32(clit.tokens[1]);
-        if (lit_count > ((clit.tokcount - 2) / 2))
+        const MOJOSHADER_preshaderOperand *operand = inst->operands;
+        for (opiter = 0; opiter < inst->operand_count; opiter++, operand++)
         {
-            fail(ctx, "Bogus CLIT block in preshader.");
-            return;
-        } // if
-        else if (lit_count > 0)
+            if (operand->type == MOJOSHADER_PRESHADEROPERAND_TEMP)
+            {
+                const unsigned int end = operand->index +
+                                        preshader_operand_elems(inst, opiter);
+                if (end > tempslots)
+                    tempslots = end;
+            } // if
+        } // for
+    } // for
+
+    PreshaderValue *values = NULL;
+    uint8 *live = NULL;
+    uint8 *keep = (uint8 *) Malloc(ctx, preshader->instruction_count);
+    if (keep == NULL)
+        return;
+    memset(keep, '\0', preshader->instruction_count);
+
+    if (tempslots > 0)
+    {
+        values = (PreshaderValue *) Malloc(ctx, sizeof (*values) * tempslots);
+        live = (uint8 *) Malloc(ctx, tempslots);
+        if ((values == NULL) || (live == NULL))
+            goto optimize_preshader_done;
+        for (i = 0; i < tempslots; i++)
         {
-            preshader->literal_count = (unsigned int) lit_count;
-            assert(sizeof (double) == 8);  // just in case.
-            const size_t len = sizeof (double) * lit_count;
-            preshader->literals = (double *) Malloc(ctx, len);
-            if (preshader->literals == NULL)
-                return;  // oh well.
-            const double *litptr = (const double *) (clit.tokens + 2);
-            int i;
-            for (i = 0; i < lit_count; i++)
-                preshader->literals[i] = SWAPDBL(litptr[i]);
-        } // else if
-    } // else
+            values[i].type = MOJOSHADER_PRESHADEROPERAND_TEMP;
+            values[i].index = i;
+        } // for
+    } // if
 
+    // Forward pass: fold constants, forward copies.
+    inst = preshader->instructions;
+    for (i = 0; i < preshader->instruction_count; i++, inst++)
+    {
+        if (inst->operand_count == 0)
+            continue;
 
+        const unsigned int dstiter = inst->operand_count - 1;
+        MOJOSHADER_preshaderOperand *dst = &inst->operands[dstiter];
+        const unsigned int elems = inst->element_count;
+        int foldable = preshader_opcode_foldable(inst->opcode) &&
+                       (dstiter > 0) && (elems > 0) && (elems <= 4);
 
-    //const uint32 first_output_reg = SWAP32(prsi.tokens[1]);
-    // !!! FIXME: there are a lot of fields here I don't know about.
-    // !!! FIXME:  maybe [2] and [3] are for int4 and bool registers?
-    //const uint32 output_reg_count = SWAP32(prsi.tokens[4]);
-    // !!! FIXME:  maybe [5] and [6] are for int4 and bool registers?
-    uint32 output_map_count;
-    const uint32 *output_map = NULL;
-    if (prsi.seen) {
-        // Parse out the PRSI block. This is used to map the output registers.
-        if (prsi.tokcount < 8)
+        for (opiter = 0; opiter < dstiter; opiter++)
         {
-            fail(ctx, "Bogus preshader PRSI data");
-            return;
-        } // if
-        
-        output_map_count = SWAP32(prsi.tokens[7]);
-        
-        prsi.tokcount -= 8;
-        prsi.tokens += 8;
+            MOJOSHADER_preshaderOperand *operand = &inst->operands[opiter];
+            if (values != NULL)
+            {
+                forward_preshader_operand(operand, values,
+                                        preshader_operand_elems(inst, opiter));
+            } // if
 
-        if (prsi.tokcount < ((output_map_count + 1) * 2))
+            if ( (operand->type != MOJOSHADER_PRESHADEROPERAND_LITERAL) ||
+                 ((operand->index + elems) > preshader->literal_count) )
+                foldable = 0;
+        } // for
+
+        if (foldable)
+        {
+            double result[4] = { 0, 0, 0, 0 };
+            if (!run_preshader_instruction(preshader, inst, NULL, NULL, NULL,
+                                           result))
+                goto optimize_preshader_done;
+            const int lit = add_preshader_literals(ctx, preshader,
+                                                   &litcapacity, result, elems);
+            if (lit < 0)
+                goto optimize_preshader_done;
+
+            const MOJOSHADER_preshaderOperand dstcopy = *dst;
+            memset(inst->operands, '\0', sizeof (inst->operands));
+            inst->opcode = MOJOSHADER_PRESHADEROP_MOV;
+            inst->operand_count = 2;
+            inst->operands[0].type = MOJOSHADER_PRESHADEROPERAND_LITERAL;
+            inst->operands[0].index = (unsigned int) lit;
+            inst->operands[1] = dstcopy;
+            dst = &inst->operands[1];
+        } // if
+
+        if (dst->type != MOJOSHADER_PRESHADEROPERAND_TEMP)
+            continue;
+
+        const MOJOSHADER_preshaderOperand *src = &inst->operands[0];
+        const int copies = (inst->opcode == MOJOSHADER_PRESHADEROP_MOV) &&
+                           (src->indexingType == 0) &&
+                           ((src->type == MOJOSHADER_PRESHADEROPERAND_LITERAL) ||
+                            (src->type == MOJOSHADER_PRESHADEROPERAND_INPUT));
+        for (e = 0; e < elems; e++)
+        {
+            PreshaderValue *val = &values[dst->index + e];
+            val->type = copies ? src->type : MOJOSHADER_PRESHADEROPERAND_TEMP;
+            val->index = copies ? (src->index + e) : (dst->index + e);
+        } // for
+    } // for
+
+    // Backward pass: drop writes to temps that are never read.
+    if (live != NULL)
+        memset(live, '\0', tempslots);
+    i = preshader->instruction_count;
+    while (i--)
+    {
+        inst = &preshader->instructions[i];
+        if (inst->operand_count == 0)
+        {
+            keep[i] = 1;
+            continue;
+        } // if
+
+        const unsigned int dstiter = inst->operand_count - 1;
+        const MOJOSHADER_preshaderOperand *dst = &inst->operands[dstiter];
+        if (dst->type == MOJOSHADER_PRESHADEROPERAND_TEMP)
+        {
+            int used = 0;
+            for (e = 0; e < inst->element_count; e++)
+                used |= live[dst->index + e];
+            if (!used)
+                continue;
+            memset(live + dst->index, '\0', inst->element_count);
+        } // if
+
+        keep[i] = 1;
+        for (opiter = 0; opiter < dstiter; opiter++)
+        {
+            const MOJOSHADER_preshaderOperand *operand = &inst->operands[opiter];
+            if (operand->type == MOJOSHADER_PRESHADEROPERAND_TEMP)
+            {
+                memset(live + operand->index, 1,
+                       preshader_operand_elems(inst, opiter));
+            } // if
+        } // for
+    } // while
+
+    // Pack what's left, merging neighbouring scalar ops as we go.
+    unsigned int total = 0;
+    for (i = 0; i < preshader->instruction_count; i++)
+    {
+        if (!keep[i])
+            continue;
+        inst = &preshader->instructions[i];
+        if ( (total > 0) &&
+             (merge_preshader_instructions(&preshader->instructions[total-1],
+                                           inst)) )
+            continue;
+        if (total != i)
+            preshader->instructions[total] = *inst;
+        total++;
+    } // for
+    preshader->instruction_count = total;
+
+    // Renumber the temps that are still used, closing the gaps. Since this
+    //  keeps their order, vector operands stay contiguous.
+    if (tempslots > 0)
+    {
+        uint8 *used = live;  // reuse this buffer.
+        unsigned int *map = (unsigned int *) values;  // and this one.
+        memset(used, '\0', tempslots);
+        inst = preshader->instructions;
+        for (i = 0; i < total; i++, inst++)
+        {
+            const MOJOSHADER_preshaderOperand *operand = inst->operands;
+            for (opiter = 0; opiter < inst->operand_count; opiter++, operand++)
+            {
+                if (operand->type == MOJOSHADER_PRESHADEROPERAND_TEMP)
+                {
+                    memset(used + operand->index, 1,
+                           preshader_operand_elems(inst, opiter));
+                } // if
+            } // for
+        } // for
+
+        unsigned int count = 0;
+        for (i = 0; i < tempslots; i++)
+        {
+            map[i] = count;
+            count += used[i];
+        } // for
+
+        inst = preshader->instructions;
+        for (i = 0; i < total; i++, inst++)
+        {
+            MOJOSHADER_preshaderOperand *operand = inst->operands;
+            for (opiter = 0; opiter < inst->operand_count; opiter++, operand++)
+            {
+                if (operand->type == MOJOSHADER_PRESHADEROPERAND_TEMP)
+                    operand->index = map[operand->index];
+            } // for
+        } // for
+
+        preshader->temp_count = count;
+    } // if
+
+optimize_preshader_done:
+    Free(ctx, live);
+    Free(ctx, values);
+    Free(ctx, keep);
+} // optimize_preshader
+
+// Work out which input registers each output register depends on, so the
+//  preshader can be rerun for only the inputs that changed. We track a mask
+//  of inputs for each scalar temp and output as we walk the instructions,
+//  which is enough since preshaders don't branch.
+static void analyze_preshader(Context *ctx, MOJOSHADER_preshader *preshader)
+{
+    const MOJOSHADER_preshaderInstruction *inst;
+    unsigned int incount = 0;
+    unsigned int outslots = 0;
+    unsigned int tempslots = preshader->temp_count;
+    unsigned int i, opiter, e;
+
+    const MOJOSHADER_symbol *sym = preshader->symbols;
+    for (i = 0; i < preshader->symbol_count; i++, sym++)
+    {
+        const unsigned int val = sym->register_index + sym->register_count;
+        if (val > incount)
+            incount = val;
+    } // for
+
+    // Find the extents of everything. temp_count is bumped here too, since
+    //  a vector temp uses more than just its first scalar.
+    inst = preshader->instructions;
+    for (i = 0; i < preshader->instruction_count; i++, inst++)
+    {
+        const MOJOSHADER_preshaderOperand *operand = inst->operands;
+        for (opiter = 0; opiter < inst->operand_count; opiter++, operand++)
+        {
+            const unsigned int end = operand->index +
+                                     preshader_operand_elems(inst, opiter);
+            switch (operand->type)
+            {
+                case MOJOSHADER_PRESHADEROPERAND_INPUT:
+                    if (operand->indexingType == 2)
+                    {
+                        if ((operand->indexingIndex / 4) >= incount)
+                            incount = (operand->indexingIndex / 4) + 1;
+                    } // if
+                    else if (((end + 3) / 4) > incount)
+                        incount = (end + 3) / 4;
+                    break;
+
+                case MOJOSHADER_PRESHADEROPERAND_OUTPUT:
+                    if (end > outslots)
+                        outslots = end;
+                    break;
+
+                case MOJOSHADER_PRESHADEROPERAND_TEMP:
+                    if (end > tempslots)
+                        tempslots = end;
+                    break;
+
+                default: break;
+            } // switch
+        } // for
+    } // for
+
+    preshader->temp_count = tempslots;
+    preshader->input_register_count = incount;
+    preshader->output_register_count = (outslots + 3) / 4;
+
+    const unsigned int outcount = preshader->output_register_count;
+    const unsigned int inwords = MOJOSHADER_PRESHADER_MASK_WORDS(incount);
+    const unsigned int outwords = MOJOSHADER_PRESHADER_MASK_WORDS(outcount);
+    if (outcount == 0)
+        return;  // nothing to write, nothing to depend on.
+
+    size_t len = sizeof (unsigned int) * outwords;
+    preshader->output_written = (unsigned int *) Malloc(ctx, len);
+    if (preshader->output_written == NULL)
+        return;
+    memset(preshader->output_written, '\0', len);
+
+    if (inwords > 0)
+    {
+        len = sizeof (unsigned int) * outcount * inwords;
+        preshader->output_dependencies = (unsigned int *) Malloc(ctx, len);
+        if (preshader->output_dependencies == NULL)
+            return;
+        memset(preshader->output_dependencies, '\0', len);
+    } // if
+
+    // one mask per scalar temp, one per scalar output, one for the sources.
+    unsigned int *deps = NULL;
+    if (inwords > 0)
+    {
+        len = sizeof (unsigned int) * (tempslots + outslots + 1) * inwords;
+        deps = (unsigned int *) Malloc(ctx, len);
+        if (deps == NULL)
+            return;
+        memset(deps, '\0', len);
+    } // if
+
+    unsigned int *tempdeps = deps;
+    unsigned int *outdeps = deps + (tempslots * inwords);
+    unsigned int *srcdeps = outdeps + (outslots * inwords);
+
+    inst = preshader->instructions;
+    for (i = 0; i < preshader->instruction_count; i++, inst++)
+    {
+        if (inst->operand_count == 0)
+            continue;
+
+        const MOJOSHADER_preshaderOperand *operand = inst->operands;
+        const unsigned int dstiter = inst->operand_count - 1;
+
+        if (deps != NULL)
+        {
+            memset(srcdeps, '\0', sizeof (unsigned int) * inwords);
+            for (opiter = 0; opiter < dstiter; opiter++, operand++)
+            {
+                const unsigned int index = operand->index;
+                const unsigned int elems = preshader_operand_elems(inst, opiter);
+                if (elems == 0)
+                    continue;
+
+                switch (operand->type)
+                {
+                    case MOJOSHADER_PRESHADEROPERAND_INPUT:
+                        // relative addressing could read any input at all.
+                        if (operand->indexingType == 2)
+                            set_register_bits(srcdeps, 0, incount - 1);
+                        else
+                        {
+                            set_register_bits(srcdeps, index / 4,
+                                              (index + elems - 1) / 4);
+                        } // else
+                        break;
+
+                    case MOJOSHADER_PRESHADEROPERAND_TEMP:
+                        for (e = 0; e < elems; e++)
+                        {
+                            or_register_masks(srcdeps,
+                                        tempdeps + ((index + e) * inwords),
+                                        inwords);
+                        } // for
+                        break;
+
+                    case MOJOSHADER_PRESHADEROPERAND_OUTPUT:
+                        for (e = 0; e < elems; e++)
+                        {
+                            or_register_masks(srcdeps,
+                                        outdeps + ((index + e) * inwords),
+                                        inwords);
+                        } // for
+                        break;
+
+                    default: break;  // literals don't depend on anything.
+                } // switch
+            } // for
+        } // if
+
+        operand = &inst->operands[dstiter];
+        unsigned int *dstdeps = NULL;
+        if (operand->type == MOJOSHADER_PRESHADEROPERAND_TEMP)
+            dstdeps = tempdeps;
+        else if (operand->type == MOJOSHADER_PRESHADEROPERAND_OUTPUT)
+        {
+            dstdeps = outdeps;
+            if (inst->element_count > 0)
+            {
+                set_register_bits(preshader->output_written,
+                            operand->index / 4,
+                            (operand->index + inst->element_count - 1) / 4);
+            } // if
+        } // else if
+
+        if ((deps != NULL) && (dstdeps != NULL))
+        {
+            for (e = 0; e < inst->element_count; e++)
+            {
+                memcpy(dstdeps + ((operand->index + e) * inwords), srcdeps,
+                       sizeof (unsigned int) * inwords);
+            } // for
+        } // if
+    } // for
+
+    if (deps != NULL)
+    {
+        for (i = 0; i < outslots; i++)
+        {
+            or_register_masks(preshader->output_dependencies +
+                                ((i / 4) * inwords),
+                              outdeps + (i * inwords), inwords);
+        } // for
+        Free(ctx, deps);
+    } // if
+} // analyze_preshader
+
+// Preshaders only show up in compiled Effect files. The format is
+//  undocumented, and even the instructions aren't the same opcodes as you
+//  would find in a regular shader. These things show up because the HLSL
+//  compiler can detect work that sets up constant registers that could
+//  be moved out of the shader itself. Preshaders run once, then the shader
+//  itself runs many times, using the constant registers the preshader has set
+//  up. There are cases where the preshaders are 3+ times as many instructions
+//  as the shader itself, so this can be a big performance win.
+// My presumption is that Microsoft's Effects framework runs the preshaders on
+//  the CPU, then loads the constant register file appropriately before handing
+//  off to the GPU. As such, we do the same.
+static void parse_preshader(Context *ctx, uint32 tokcount)
+{
+    const uint32 *tokens = ctx->tokens;
+    
+    if (SWAP32(tokens[1]) == PRES_ID) {
+        if (tokcount <= 2) return;
+        //hax
+        tokens += 2;
+        tokcount -= 2;
+    }
+    
+    assert(ctx->have_preshader == 0);  // !!! FIXME: can you have more than one?
+    ctx->have_preshader = 1;
+
+    // !!! FIXME: I don't know what specific versions signify, but we need to
+    // !!! FIXME:  save this to test against the CTAB version field, if
+    // !!! FIXME:  nothing else.
+    // !!! FIXME: 0x02 0x01 is probably the version (fx_2_1),
+    // !!! FIXME:  and 0x4658 is the magic, like a real shader's version token.
+    const uint32 okay_versions[] = {0x46580201, 0x46580200};
+    if (SWAP32(tokens[0]) != okay_versions[0] && SWAP32(tokens[0]) != okay_versions[1])
+    {
+        failf(ctx, "Unsupported preshader version %6x.", tokens[0]);
+        return;  // fail because the shader will malfunction w/o this.
+    } // if
+
+    tokens += 1;
+    tokcount -= 1;
+
+    // All sections of a preshader are packed into separate comment tokens,
+    //  inside the containing comment token block. Find them all before
+    //  we start, so we don't care about the order they appear in the file.
+    PreshaderBlockInfo ctab = { 0, 0, 0 };
+    PreshaderBlockInfo prsi = { 0, 0, 0 };
+    PreshaderBlockInfo fxlc = { 0, 0, 0 };
+    PreshaderBlockInfo clit = { 0, 0, 0 };
+
+    while (tokcount > 0)
+    {
+        uint32 subtokcount = 0;
+        if ( (!is_comment_token(ctx, *tokens, &subtokcount)) ||
+             (subtokcount > tokcount) )
+        {
+            fail(ctx, "Bogus preshader data.");
+            return;
+        } // if
+
+        tokens++;
+        tokcount--;
+
+        const uint32 *nexttokens = tokens + subtokcount;
+        const uint32 nexttokcount = tokcount - subtokcount;
+
+        if (subtokcount > 0)
+        {
+            switch (SWAP32(*tokens))
+            {
+                #define PRESHADER_BLOCK_CASE(id, var) \
+                    case id##_ID: { \
+                        if (var.seen) { \
+                            fail(ctx, "Multiple " #id " preshader blocks."); \
+                            return; \
+                        } \
+                        var.tokens = tokens; \
+                        var.tokcount = subtokcount; \
+                        var.seen = 1; \
+                        break; \
+                    }
+                PRESHADER_BLOCK_CASE(CTAB, ctab);
+                PRESHADER_BLOCK_CASE(PRSI, prsi);
+                PRESHADER_BLOCK_CASE(FXLC, fxlc);
+                PRESHADER_BLOCK_CASE(CLIT, clit);
+                default: fail(ctx, "Bogus preshader section."); return;
+                #undef PRESHADER_BLOCK_CASE
+            } // switch
+        } // if
+
+        tokens = nexttokens;
+        tokcount = nexttokcount;
+    } // while
+
+    if (!ctab.seen) { fail(ctx, "No CTAB block in preshader."); return; }
+    //if (!prsi.seen) { fail(ctx, "No PRSI block in preshader."); return; }
+    if (!fxlc.seen) { fail(ctx, "No FXLC block in preshader."); return; }
+    if (!clit.seen) { fail(ctx, "No CLIT block in preshader."); return; }
+
+    MOJOSHADER_preshader *preshader = (MOJOSHADER_preshader *)
+                                    Malloc(ctx, sizeof (MOJOSHADER_preshader));
+    if (preshader == NULL)
+        return;
+    memset(preshader, '\0', sizeof (MOJOSHADER_preshader));
+    ctx->preshader = preshader;
+
+    // Let's set up the constant literals first...
+    if (clit.tokcount == 0)
+        fail(ctx, "Bogus CLIT block in preshader.");
+    else
+    {
+        const uint32 lit_count = SWAP32(clit.tokens[1]);
+        if (lit_count > ((clit.tokcount - 2) / 2))
+        {
+            fail(ctx, "Bogus CLIT block in preshader.");
+            return;
+        } // if
+        else if (lit_count > 0)
+        {
+            preshader->literal_count = (unsigned int) lit_count;
+            assert(sizeof (double) == 8);  // just in case.
+            const size_t len = sizeof (double) * lit_count;
+            preshader->literals = (double *) Malloc(ctx, len);
+            if (preshader->literals == NULL)
+                return;  // oh well.
+            const double *litptr = (const double *) (clit.tokens + 2);
+            int i;
+            for (i = 0; i < lit_count; i++)
+                preshader->literals[i] = SWAPDBL(litptr[i]);
+        } // else if
+    } // else
+
+
+
+    //const uint32 first_output_reg = SWAP32(prsi.tokens[1]);
+    // !!! FIXME: there are a lot of fields here I don't know about.
+    // !!! FIXME:  maybe [2] and [3] are for int4 and bool registers?
+    //const uint32 output_reg_count = SWAP32(prsi.tokens[4]);
+    // !!! FIXME:  maybe [5] and [6] are for int4 and bool registers?
+    uint32 output_map_count;
+    const uint32 *output_map = NULL;
+    if (prsi.seen) {
+        // Parse out the PRSI block. This is used to map the output registers.
+        if (prsi.tokcount < 8)
+        {
+            fail(ctx, "Bogus preshader PRSI data");
+            return;
+        } // if
+        
+        output_map_count = SWAP32(prsi.tokens[7]);
+        
+        prsi.tokcount -= 8;
+        prsi.tokens += 8;
+
+        if (prsi.tokcount < ((output_map_count + 1) * 2))
         {
             fail(ctx, "Bogus preshader PRSI data");
             return;
@@ -8437,6 +9265,12 @@ static void parse_preshader(Context *ctx, uint32 tokcount)
         } // switch
 
         uint32 operand_count = SWAP32(fxlc.tokens[1]) + 1;  // +1 for dest.
+        if ( (operand_count > STATICARRAYLEN(inst->operands)) ||
+             ((opcodetok & 0xFF) > 4) )
+        {
+            fail(ctx, "Bogus preshader FXLC block.");
+            return;
+        } // if
 
         inst->opcode = opcode;
         inst->element_count = (unsigned int) (opcodetok & 0xFF);
@@ -8553,6 +9387,11 @@ static void parse_preshader(Context *ctx, uint32 tokcount)
 
         inst++;
     } // while
+
+    if (!isfail(ctx))
+        optimize_preshader(ctx, preshader);
+    if (!isfail(ctx))
+        analyze_preshader(ctx, preshader);
 } // parse_preshader
 
 
@@ -8660,26 +9499,16 @@ static int find_profile_id(const char *profile)
 } // find_profile_id
 
 
-static Context *build_context(const char *profile,
-                              const unsigned char *tokenbuf,
-                              const unsigned int bufsize,
-                              const MOJOSHADER_swizzle *swiz,
-                              const unsigned int swizcount,
-                              const MOJOSHADER_samplerMap *smap,
-                              const unsigned int smapcount,
-                              MOJOSHADER_malloc m, MOJOSHADER_free f, void *d)
+// Set up the per-parse state. Everything in here gets wiped by
+//  reset_context() before the next parse.
+static void init_context(Context *ctx, const char *profile,
+                         const unsigned char *tokenbuf,
+                         const unsigned int bufsize,
+                         const MOJOSHADER_swizzle *swiz,
+                         const unsigned int swizcount,
+                         const MOJOSHADER_samplerMap *smap,
+                         const unsigned int smapcount)
 {
-    if (m == NULL) m = MOJOSHADER_internal_malloc;
-    if (f == NULL) f = MOJOSHADER_internal_free;
-
-    Context *ctx = (Context *) m(sizeof (Context), d);
-    if (ctx == NULL)
-        return NULL;
-
-    memset(ctx, '\0', sizeof (Context));
-    ctx->malloc = m;
-    ctx->free = f;
-    ctx->malloc_data = d;
     ctx->tokens = (const uint32 *) tokenbuf;
     ctx->orig_tokens = (const uint32 *) tokenbuf;
     ctx->tokencount = bufsize / sizeof (uint32);
@@ -8698,6 +9527,33 @@ static Context *build_context(const char *profile,
     ctx->texm3x3pad_dst1 = -1;
     ctx->texm3x3pad_src1 = -1;
 
+    if (!set_output(ctx, &ctx->mainline))
+        return;
+
+    const int profileid = find_profile_id(profile);
+    ctx->profileid = profileid;
+    if (profileid >= 0)
+        ctx->profile = &profiles[profileid];
+    else
+        failf(ctx, "Profile '%s' is unknown or unsupported", profile);
+} // init_context
+
+
+// Allocate a context and the things that can outlive a single parse.
+static Context *create_context(MOJOSHADER_malloc m, MOJOSHADER_free f, void *d)
+{
+    if (m == NULL) m = MOJOSHADER_internal_malloc;
+    if (f == NULL) f = MOJOSHADER_internal_free;
+
+    Context *ctx = (Context *) m(sizeof (Context), d);
+    if (ctx == NULL)
+        return NULL;
+
+    memset(ctx, '\0', sizeof (Context));
+    ctx->malloc = m;
+    ctx->free = f;
+    ctx->malloc_data = d;
+
     ctx->errors = errorlist_create(MallocBridge, FreeBridge, ctx);
     if (ctx->errors == NULL)
     {
@@ -8705,22 +9561,17 @@ static Context *build_context(const char *profile,
         return NULL;
     } // if
 
-    if (!set_output(ctx, &ctx->mainline))
+    // all the output sections share one pool of buffer blocks.
+    ctx->buffer_pool = bufferpool_create(MallocBridge, FreeBridge, ctx);
+    if (ctx->buffer_pool == NULL)
     {
         errorlist_destroy(ctx->errors);
         f(ctx, d);
         return NULL;
     } // if
 
-    const int profileid = find_profile_id(profile);
-    ctx->profileid = profileid;
-    if (profileid >= 0)
-        ctx->profile = &profiles[profileid];
-    else
-        failf(ctx, "Profile '%s' is unknown or unsupported", profile);
-
     return ctx;
-} // build_context
+} // create_context
 
 
 static void free_constants_list(MOJOSHADER_free f, void *d, ConstantsList *item)
@@ -8778,18 +9629,83 @@ static void free_preshader(MOJOSHADER_free f, void *d,
     {
         f((void *) preshader->literals, d);
         f((void *) preshader->instructions, d);
+        f((void *) preshader->output_written, d);
+        f((void *) preshader->output_dependencies, d);
         free_symbols(f, d, preshader->symbols, preshader->symbol_count);
         f((void *) preshader, d);
     } // if
 } // free_preshader
 
 
+static void recycle_reglist(Context *ctx, RegisterList *item)
+{
+    while (item != NULL)
+    {
+        RegisterList *next = item->next;
+        item->next = ctx->reglist_pool;
+        ctx->reglist_pool = item;
+        item = next;
+    } // while
+} // recycle_reglist
+
+
+// Throw away everything from the last parse, but hang on to the allocator,
+//  output buffers, error list and recycled register nodes, so the next
+//  parse on this context can skip most of its allocations.
+static void reset_context(Context *ctx)
+{
+    MOJOSHADER_free f = ctx->free;
+    void *d = ctx->malloc_data;
+
+    free_constants_list(f, d, ctx->constants);
+    recycle_reglist(ctx, ctx->used_registers.next);
+    recycle_reglist(ctx, ctx->defined_registers.next);
+    recycle_reglist(ctx, ctx->uniforms.next);
+    recycle_reglist(ctx, ctx->attributes.next);
+    recycle_reglist(ctx, ctx->samplers.next);
+    free_variable_list(f, d, ctx->variables);
+    free_symbols(f, d, ctx->ctab.symbols, ctx->ctab.symbol_count);
+    free_preshader(f, d, ctx->preshader);
+    errorlist_empty(ctx->errors);
+
+    Buffer *sections[] = {
+        ctx->preflight, ctx->globals, ctx->helpers, ctx->subroutines,
+        ctx->mainline_intro, ctx->mainline, ctx->ignore
+    };
+    size_t i;
+    for (i = 0; i < STATICARRAYLEN(sections); i++)
+    {
+        if (sections[i] != NULL)
+            buffer_empty(sections[i]);
+    } // for
+
+    Context saved;
+    memcpy(&saved, ctx, sizeof (Context));
+    memset(ctx, '\0', sizeof (Context));
+    ctx->malloc = saved.malloc;
+    ctx->free = saved.free;
+    ctx->malloc_data = saved.malloc_data;
+    ctx->preflight = saved.preflight;
+    ctx->globals = saved.globals;
+    ctx->helpers = saved.helpers;
+    ctx->subroutines = saved.subroutines;
+    ctx->mainline_intro = saved.mainline_intro;
+    ctx->mainline = saved.mainline;
+    ctx->ignore = saved.ignore;
+    ctx->buffer_pool = saved.buffer_pool;
+    ctx->reglist_pool = saved.reglist_pool;
+    ctx->errors = saved.errors;
+    ctx->inline_preshader = saved.inline_preshader;
+} // reset_context
+
+
 static void destroy_context(Context *ctx)
 {
     if (ctx != NULL)
     {
         MOJOSHADER_free f = ((ctx->free != NULL) ? ctx->free : MOJOSHADER_internal_free);
         void *d = ctx->malloc_data;
+        reset_context(ctx);
         buffer_destroy(ctx->preflight);
         buffer_destroy(ctx->globals);
         buffer_destroy(ctx->helpers);
@@ -8797,21 +9713,39 @@ static void destroy_context(Context *ctx)
         buffer_destroy(ctx->mainline_intro);
         buffer_destroy(ctx->mainline);
         buffer_destroy(ctx->ignore);
-        free_constants_list(f, d, ctx->constants);
-        free_reglist(f, d, ctx->used_registers.next);
-        free_reglist(f, d, ctx->defined_registers.next);
-        free_reglist(f, d, ctx->uniforms.next);
-        free_reglist(f, d, ctx->attributes.next);
-        free_reglist(f, d, ctx->samplers.next);
-        free_variable_list(f, d, ctx->variables);
+        bufferpool_destroy(ctx->buffer_pool);
+        free_reglist(f, d, ctx->reglist_pool);
         errorlist_destroy(ctx->errors);
-        free_symbols(f, d, ctx->ctab.symbols, ctx->ctab.symbol_count);
-        free_preshader(f, d, ctx->preshader);
         f(ctx, d);
     } // if
 } // destroy_context
 
 
+static Context *build_context(const char *profile,
+                              const unsigned char *tokenbuf,
+                              const unsigned int bufsize,
+                              const MOJOSHADER_swizzle *swiz,
+                              const unsigned int swizcount,
+                              const MOJOSHADER_samplerMap *smap,
+                              const unsigned int smapcount,
+                              MOJOSHADER_malloc m, MOJOSHADER_free f, void *d)
+{
+    Context *ctx = create_context(m, f, d);
+    if (ctx == NULL)
+        return NULL;
+
+    init_context(ctx, profile, tokenbuf, bufsize, swiz, swizcount,
+                 smap, smapcount);
+    if (ctx->out_of_memory)
+    {
+        destroy_context(ctx);
+        return NULL;
+    } // if
+
+    return ctx;
+} // build_context
+
+
 static char *build_output(Context *ctx, size_t *len)
 {
     // add a byte for a null terminator.
@@ -9239,6 +10173,7 @@ static MOJOSHADER_parseData *build_parsedata(Context *ctx)
         retval->symbol_count = ctx->ctab.symbol_count;
         retval->symbols = ctx->ctab.symbols;
         retval->preshader = ctx->preshader;
+        retval->preshader_inlined = ctx->preshader_inlined;
 
         // we don't own these now, retval does.
         ctx->ctab.symbols = NULL;
@@ -9256,6 +10191,108 @@ static MOJOSHADER_parseData *build_parsedata(Context *ctx)
 } // build_parsedata
 
 
+// Can the profile calculate this shader's preshader itself? Everything it
+//  writes has to be a whole constant register that isn't part of an array or
+//  a def, and it can't read back a register before it sets all of it.
+static int can_inline_preshader(Context *ctx)
+{
+    const MOJOSHADER_preshader *preshader = ctx->preshader;
+    const MOJOSHADER_preshaderInstruction *inst;
+    unsigned int i, opiter, e;
+    int retval = 1;
+
+    if ((!ctx->inline_preshader) || (!ctx->profile_can_inline_preshader))
+        return 0;
+    else if ((preshader == NULL) || (preshader->output_written == NULL))
+        return 0;
+
+    const unsigned int outslots = preshader->output_register_count * 4;
+    uint8 *written = (uint8 *) Malloc(ctx, outslots);
+    if (written == NULL)
+        return 0;
+    memset(written, '\0', outslots);
+
+    inst = preshader->instructions;
+    for (i = 0; (retval) && (i < preshader->instruction_count); i++, inst++)
+    {
+        if ( (!preshader_opcode_foldable(inst->opcode)) ||
+             (inst->operand_count < 2) )
+        {
+            retval = 0;
+            break;
+        } // if
+
+        const unsigned int dstiter = inst->operand_count - 1;
+        for (opiter = 0; (retval) && (opiter <= dstiter); opiter++)
+        {
+            const MOJOSHADER_preshaderOperand *operand = &inst->operands[opiter];
+            const unsigned int elems = preshader_operand_elems(inst, opiter);
+            for (e = 0; e < elems; e++)
+            {
+                const unsigned int index = operand->index + e;
+                if (operand->type == MOJOSHADER_PRESHADEROPERAND_OUTPUT)
+                {
+                    if (opiter == dstiter)
+                        written[index] = 1;
+                    else if (!written[index])
+                        retval = 0;  // would read the app's value.
+                } // if
+                else if (operand->type == MOJOSHADER_PRESHADEROPERAND_LITERAL)
+                {
+                    if (index >= preshader->literal_count)
+                        retval = 0;
+                    else if ((preshader->literals[index] -
+                              preshader->literals[index]) != 0.0)
+                        retval = 0;  // inf or nan, GLSL can't spell these.
+                } // else if
+            } // for
+        } // for
+    } // for
+
+    for (i = 0; (retval) && (i < preshader->output_register_count); i++)
+    {
+        if ((preshader->output_written[i / 32] & (1u << (i % 32))) == 0)
+            continue;
+
+        const VariableList *var;
+        const ConstantsList *item;
+        for (e = 0; e < 4; e++)
+        {
+            if (!written[(i * 4) + e])
+                retval = 0;  // the rest of it would come from the app.
+        } // for
+
+        for (var = ctx->variables; var != NULL; var = var->next)
+        {
+            if ( (var->used) && (var->type == MOJOSHADER_UNIFORM_FLOAT) &&
+                 (((int) i) >= var->index) &&
+                 (((int) i) < (var->index + var->count)) )
+                retval = 0;
+        } // for
+
+        for (item = ctx->constants; item != NULL; item = item->next)
+        {
+            if ( (item->constant.type == MOJOSHADER_UNIFORM_FLOAT) &&
+                 (item->constant.index == (int) i) )
+                retval = 0;
+        } // for
+    } // for
+
+    Free(ctx, written);
+    return retval;
+} // can_inline_preshader
+
+static inline int preshader_output_inlined(Context *ctx, const int regnum)
+{
+    const MOJOSHADER_preshader *preshader = ctx->preshader;
+    if ((!ctx->preshader_inlined) || (regnum < 0))
+        return 0;
+    else if (((unsigned int) regnum) >= preshader->output_register_count)
+        return 0;
+    return (preshader->output_written[regnum / 32] & (1u << (regnum % 32)));
+} // preshader_output_inlined
+
+
 static void process_definitions(Context *ctx)
 {
     // !!! FIXME: apparently, pre ps_3_0, sampler registers don't need to be
@@ -9264,6 +10301,8 @@ static void process_definitions(Context *ctx)
 
     determine_constants_arrays(ctx);  // in case this hasn't been called yet.
 
+    ctx->preshader_inlined = can_inline_preshader(ctx);
+
     RegisterList *uitem = &ctx->uniforms;
     RegisterList *prev = &ctx->used_registers;
     RegisterList *item = prev->next;
@@ -9340,6 +10379,11 @@ static void process_definitions(Context *ctx)
                 case REG_TYPE_CONST:
                 case REG_TYPE_CONSTINT:
                 case REG_TYPE_CONSTBOOL:
+                    // the profile declares inlined preshader outputs itself.
+                    if ( (regtype == REG_TYPE_CONST) &&
+                         (preshader_output_inlined(ctx, regnum)) )
+                        break;
+
                     // separate uniforms into a different list for now.
                     prev->next = next;
                     item->next = NULL;
@@ -9469,17 +10513,24 @@ const MOJOSHADER_parseData *MOJOSHADER_parseExpression(const unsigned char *toke
                                       MOJOSHADER_free f, void *d)
 {
     MOJOSHADER_parseData *retval;
+    MOJOSHADER_allocPhase phase;
     Context *ctx = NULL;
     if ( ((m == NULL) && (f != NULL)) || ((m != NULL) && (f == NULL)) )
         return NULL;  // supply both or neither.
     
+    phase = alloc_phase(m, d, MOJOSHADER_ALLOCPHASE_CONTEXT);
     ctx = build_context("glsl120", tokenbuf, bufsize, NULL, 0, NULL, 0, m, f, d);
     if (ctx == NULL)
+    {
+        alloc_phase(m, d, phase);
         return NULL;
+    } // if
     
     parse_preshader(ctx, bufsize/4-1);
+    alloc_phase(m, d, MOJOSHADER_ALLOCPHASE_PARSEDATA);
     retval = build_parsedata(ctx);
     destroy_context(ctx);
+    alloc_phase(m, d, phase);
     
     return retval;
 }
@@ -9491,35 +10542,17 @@ const MOJOSHADER_parseData *MOJOSHADER_parseExpression(const unsigned char *toke
 //  attempts to read from a temporary register that has not been written by a
 //  previous instruction."  (true for ps_1_*, maybe others). Check this.
 
-DLLEXPORT
-const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
-                                             const unsigned char *tokenbuf,
-                                             const unsigned int bufsize,
-                                             const MOJOSHADER_swizzle *swiz,
-                                             const unsigned int swizcount,
-                                             const MOJOSHADER_samplerMap *smap,
-                                             const unsigned int smapcount,
-                                             MOJOSHADER_malloc m,
-                                             MOJOSHADER_free f, void *d)
+// Run a context that init_context() has set up and package up the results.
+static MOJOSHADER_parseData *parse_shader(Context *ctx, const char *profile)
 {
     MOJOSHADER_parseData *retval = NULL;
-    Context *ctx = NULL;
     int rc = 0;
     int failed = 0;
 
-    if ( ((m == NULL) && (f != NULL)) || ((m != NULL) && (f == NULL)) )
-        return &MOJOSHADER_out_of_mem_data;  // supply both or neither.
-
-    ctx = build_context(profile, tokenbuf, bufsize, swiz, swizcount,
-                        smap, smapcount, m, f, d);
-    if (ctx == NULL)
-        return &MOJOSHADER_out_of_mem_data;
-	
     if (isfail(ctx))
     {
-        retval = build_parsedata(ctx);
-        destroy_context(ctx);
-        return retval;
+        alloc_phase(ctx->malloc, ctx->malloc_data, MOJOSHADER_ALLOCPHASE_PARSEDATA);
+        return build_parsedata(ctx);
     } // if
 
     verify_swizzles(ctx);
@@ -9532,9 +10565,8 @@ const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
     //  meaningless errors flooding through.
     if (rc < 0)
     {
-        retval = build_parsedata(ctx);
-        destroy_context(ctx);
-        return retval;
+        alloc_phase(ctx->malloc, ctx->malloc_data, MOJOSHADER_ALLOCPHASE_PARSEDATA);
+        return build_parsedata(ctx);
     } // if
 
     if ( ((uint32) rc) > ctx->tokencount )
@@ -9553,6 +10585,10 @@ const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
         {
             failed = 1;
             ctx->isfail = 0;
+
+            // nobody will see any more errors, so don't go looking for them.
+            if (errorlist_full(ctx->errors))
+                break;
         } // if
 
         rc = parse_token(ctx);
@@ -9586,12 +10622,135 @@ const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
         ctx->profile->finalize_emitter(ctx);
 
     ctx->isfail = failed;
+    alloc_phase(ctx->malloc, ctx->malloc_data, MOJOSHADER_ALLOCPHASE_PARSEDATA);
     retval = build_parsedata(ctx);
+    return retval;
+} // parse_shader
+
+
+DLLEXPORT
+const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
+                                             const unsigned char *tokenbuf,
+                                             const unsigned int bufsize,
+                                             const MOJOSHADER_swizzle *swiz,
+                                             const unsigned int swizcount,
+                                             const MOJOSHADER_samplerMap *smap,
+                                             const unsigned int smapcount,
+                                             MOJOSHADER_malloc m,
+                                             MOJOSHADER_free f, void *d)
+{
+    MOJOSHADER_parseData *retval = NULL;
+    MOJOSHADER_allocPhase phase;
+    Context *ctx = NULL;
+
+    if ( ((m == NULL) && (f != NULL)) || ((m != NULL) && (f == NULL)) )
+        return &MOJOSHADER_out_of_mem_data;  // supply both or neither.
+
+    phase = alloc_phase(m, d, MOJOSHADER_ALLOCPHASE_CONTEXT);
+    ctx = build_context(profile, tokenbuf, bufsize, swiz, swizcount,
+                        smap, smapcount, m, f, d);
+    if (ctx == NULL)
+    {
+        alloc_phase(m, d, phase);
+        return &MOJOSHADER_out_of_mem_data;
+    } // if
+
+    retval = parse_shader(ctx, profile);
     destroy_context(ctx);
+    alloc_phase(m, d, phase);
     return retval;
 } // MOJOSHADER_parse
 
 
+// Reusable translators...
+//
+// A translator is just a Context that we reset instead of destroying, so
+//  the output buffers, block pool, error list and register nodes carry
+//  over from one parse to the next.
+
+DLLEXPORT
+MOJOSHADER_translator *MOJOSHADER_createTranslator(MOJOSHADER_malloc m,
+                                                   MOJOSHADER_free f,
+                                                   void *d)
+{
+    MOJOSHADER_allocPhase phase;
+    Context *ctx = NULL;
+
+    if ( ((m == NULL) && (f != NULL)) || ((m != NULL) && (f == NULL)) )
+        return NULL;  // supply both or neither.
+
+    phase = alloc_phase(m, d, MOJOSHADER_ALLOCPHASE_CONTEXT);
+    ctx = create_context(m, f, d);
+    alloc_phase(m, d, phase);
+    return (MOJOSHADER_translator *) ctx;
+} // MOJOSHADER_createTranslator
+
+
+DLLEXPORT
+const MOJOSHADER_parseData *MOJOSHADER_translate(
+                                        MOJOSHADER_translator *translator,
+                                        const char *profile,
+                                        const unsigned char *tokenbuf,
+                                        const unsigned int bufsize,
+                                        const MOJOSHADER_swizzle *swiz,
+                                        const unsigned int swizcount,
+                                        const MOJOSHADER_samplerMap *smap,
+                                        const unsigned int smapcount)
+{
+    MOJOSHADER_parseData *retval = NULL;
+    MOJOSHADER_allocPhase phase;
+    Context *ctx = (Context *) translator;
+    MOJOSHADER_malloc m;
+    void *d;
+
+    // MOJOSHADER_createTranslator() returns NULL when it runs out of memory,
+    //  so don't make callers check for that separately.
+    if (ctx == NULL)
+        return &MOJOSHADER_out_of_mem_data;
+
+    m = ctx->malloc;
+    d = ctx->malloc_data;
+    phase = alloc_phase(m, d, MOJOSHADER_ALLOCPHASE_CONTEXT);
+    init_context(ctx, profile, tokenbuf, bufsize, swiz, swizcount,
+                 smap, smapcount);
+    if (ctx->out_of_memory)
+        retval = &MOJOSHADER_out_of_mem_data;
+    else
+        retval = parse_shader(ctx, profile);
+    reset_context(ctx);
+    alloc_phase(m, d, phase);
+    return retval;
+} // MOJOSHADER_translate
+
+
+DLLEXPORT
+void MOJOSHADER_setTranslatorErrorLimit(MOJOSHADER_translator *translator,
+                                        const int limit)
+{
+    Context *ctx = (Context *) translator;
+    if (ctx != NULL)
+        errorlist_set_limit(ctx->errors, limit);
+} // MOJOSHADER_setTranslatorErrorLimit
+
+
+DLLEXPORT
+void MOJOSHADER_setTranslatorPreshaderInlining(
+                                        MOJOSHADER_translator *translator,
+                                        const int enable)
+{
+    Context *ctx = (Context *) translator;
+    if (ctx != NULL)
+        ctx->inline_preshader = enable;
+} // MOJOSHADER_setTranslatorPreshaderInlining
+
+
+DLLEXPORT
+void MOJOSHADER_destroyTranslator(MOJOSHADER_translator *translator)
+{
+    destroy_context((Context *) translator);
+} // MOJOSHADER_destroyTranslator
+
+
 void MOJOSHADER_freeParseData(const MOJOSHADER_parseData *_data)
 {
     MOJOSHADER_parseData *data = (MOJOSHADER_parseData *) _data;
@@ -9638,6 +10797,40 @@ void MOJOSHADER_freeParseData(const MOJOSHADER_parseData *_data)
 } // MOJOSHADER_freeParseData
 
 
+void MOJOSHADER_trimParseData(const MOJOSHADER_parseData *_data)
+{
+    MOJOSHADER_parseData *data = (MOJOSHADER_parseData *) _data;
+    if ((data == NULL) || (data == &MOJOSHADER_out_of_mem_data))
+        return;  // no-op.
+
+    MOJOSHADER_free f = (data->free == NULL) ? MOJOSHADER_internal_free : data->free;
+    void *d = data->malloc_data;
+    int i;
+
+    f((void *) data->output, d);
+    data->output = NULL;
+    data->output_len = 0;
+
+    f((void *) data->swizzles, d);
+    data->swizzles = NULL;
+    data->swizzle_count = 0;
+
+    for (i = 0; i < data->error_count; i++)
+    {
+        f((void *) data->errors[i].error, d);
+        f((void *) data->errors[i].filename, d);
+    } // for
+    f((void *) data->errors, d);
+    data->errors = NULL;
+    data->error_count = 0;
+
+    // the preshader has its own copy of the symbols it needs.
+    free_symbols(f, d, data->symbols, data->symbol_count);
+    data->symbols = NULL;
+    data->symbol_count = 0;
+} // MOJOSHADER_trimParseData
+
+
 int MOJOSHADER_version(void)
 {
     return MOJOSHADER_VERSION;
@@ -450,8 +450,29 @@ typedef struct MOJOSHADER_preshader
     MOJOSHADER_symbol *symbols;
     unsigned int instruction_count;
     MOJOSHADER_preshaderInstruction *instructions;
+
+    /*
+     * Dependency information, calculated when the preshader is parsed.
+     *  Registers here are float4 registers, not scalars. Register masks are
+     *  arrays of MOJOSHADER_PRESHADER_MASK_WORDS(count) unsigned ints, with
+     *  register (n) at bit (n % 32) of element (n / 32).
+     */
+    unsigned int input_register_count;  /* highest input used, plus one. */
+    unsigned int output_register_count;  /* highest output used, plus one. */
+
+    /* mask of output registers the preshader writes. */
+    unsigned int *output_written;
+
+    /*
+     * (output_register_count) masks of input registers, one after another.
+     *  Mask (n) lists every input register that output register (n) depends
+     *  on, through any number of temps and other outputs.
+     */
+    unsigned int *output_dependencies;
 } MOJOSHADER_preshader;
 
+#define MOJOSHADER_PRESHADER_MASK_WORDS(count) (((count) + 31) / 32)
+
 /*
  * Structure used to return data from parsing of a shader...
  */
@@ -616,6 +637,15 @@ typedef struct MOJOSHADER_parseData
      */
     MOJOSHADER_preshader *preshader;
 
+    /*
+     * Non-zero if the generated shader calculates (preshader) itself, so it
+     *  doesn't need to be run on the CPU. Its inputs are then read from a
+     *  uniform vec4 array named "vs_preshader_vec4" or "ps_preshader_vec4",
+     *  and the constant registers it writes aren't listed in (uniforms).
+     *  See MOJOSHADER_setTranslatorPreshaderInlining().
+     */
+    int preshader_inlined;
+
     /*
      * This is the malloc implementation you passed to MOJOSHADER_parse().
      */
@@ -691,6 +721,36 @@ const MOJOSHADER_parseData *MOJOSHADER_parseExpression(const unsigned char *toke
 DLLEXPORT
 void MOJOSHADER_runPreshader(const MOJOSHADER_preshader*, const float*, float*);
 
+/*
+ * Run a preshader, only recalculating what depends on changed inputs.
+ *
+ * (inregs) and (outregs) are the same as MOJOSHADER_runPreshader().
+ *
+ * (results) is your scratch space of (preshader->instruction_count * 4)
+ *  doubles. It holds every instruction's result from the last run, so keep
+ *  it intact between calls for the same preshader.
+ *
+ * (dirty_inputs) is a register mask (see MOJOSHADER_preshader) of the input
+ *  registers that changed since the last call. Pass NULL to recalculate
+ *  everything; you must do this the first time, as (results) is empty.
+ *
+ * (changed_outputs), if not NULL, is filled in with a register mask of
+ *  MOJOSHADER_PRESHADER_MASK_WORDS(preshader->output_register_count) ints,
+ *  listing the output registers whose value in (outregs) changed, so you
+ *  only have to upload those.
+ *
+ * Every output the preshader writes is stored to (outregs) regardless, so
+ *  it doesn't matter if you changed (outregs) between calls.
+ *
+ * Returns the number of instructions that actually ran.
+ */
+DLLEXPORT
+int MOJOSHADER_runPreshaderIncremental(const MOJOSHADER_preshader *preshader,
+                                       const float *inregs, float *outregs,
+                                       double *results,
+                                       const unsigned int *dirty_inputs,
+                                       unsigned int *changed_outputs);
+
 /*
  * Parse a compiled Direct3D shader's bytecode.
  *
@@ -763,6 +823,236 @@ const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
  */
 void MOJOSHADER_freeParseData(const MOJOSHADER_parseData *data);
 
+/*
+ * Free the parts of parsing results that are only needed while setting up
+ *  a shader: the output source code, the CTAB symbols, the swizzles and any
+ *  error strings. Those fields are set to NULL and their counts to zero.
+ *  Everything that describes the shader's interface at runtime (uniforms,
+ *  constants, samplers, attributes, outputs) and the preshader are kept.
+ *
+ * You still need to call MOJOSHADER_freeParseData() on (data) later.
+ *  Passing a NULL here is a safe no-op.
+ *
+ * This function is thread safe, so long as any allocator you passed into
+ *  MOJOSHADER_parse() is, too, and nothing else is using (data).
+ */
+DLLEXPORT
+void MOJOSHADER_trimParseData(const MOJOSHADER_parseData *data);
+
+
+/* Reusable translators... */
+
+/*
+ * An opaque object that holds the scratch state MOJOSHADER_parse() would
+ *  otherwise build up and tear down on every call: the parse context,
+ *  output buffers, register tables and error list. Between shaders it is
+ *  reset instead of reallocated, so translating many shaders in a row
+ *  mostly reuses memory it already has.
+ */
+typedef struct MOJOSHADER_translator MOJOSHADER_translator;
+
+/*
+ * Create a reusable translator. The allocator works like the one you pass
+ *  to MOJOSHADER_parse(), and is used both for the translator and for any
+ *  MOJOSHADER_parseData it returns. Pass NULL for both to use malloc/free.
+ *
+ * Returns NULL on error (out of memory, or only one of (m) and (f) given).
+ *
+ * A translator is not thread safe; make one per thread.
+ */
+DLLEXPORT
+MOJOSHADER_translator *MOJOSHADER_createTranslator(MOJOSHADER_malloc m,
+                                                   MOJOSHADER_free f,
+                                                   void *d);
+
+/*
+ * This works exactly like MOJOSHADER_parse(), but uses (translator)'s
+ *  scratch state instead of allocating its own. The returned data is
+ *  yours; free it with MOJOSHADER_freeParseData() as usual. It does not
+ *  need to be freed before the next call, or before the translator is
+ *  destroyed.
+ *
+ * A NULL (translator), as from a failed MOJOSHADER_createTranslator(), gets
+ *  you the usual out-of-memory parse data. This function will never return
+ *  NULL.
+ */
+DLLEXPORT
+const MOJOSHADER_parseData *MOJOSHADER_translate(
+                                        MOJOSHADER_translator *translator,
+                                        const char *profile,
+                                        const unsigned char *tokenbuf,
+                                        const unsigned int bufsize,
+                                        const MOJOSHADER_swizzle *swiz,
+                                        const unsigned int swizcount,
+                                        const MOJOSHADER_samplerMap *smap,
+                                        const unsigned int smapcount);
+
+/*
+ * Stop collecting errors after (limit) of them. Further errors aren't
+ *  formatted or stored; they're summarized as one extra error at the end
+ *  of the list, and translation stops as soon as it can once the limit is
+ *  reached. This makes scanning piles of broken shaders much cheaper when
+ *  you only care about the first error or two. Zero, the default, means
+ *  no limit.
+ */
+DLLEXPORT
+void MOJOSHADER_setTranslatorErrorLimit(MOJOSHADER_translator *translator,
+                                        const int limit);
+
+/*
+ * Ask (translator) to move preshaders into the shaders it generates, instead
+ *  of leaving them to MOJOSHADER_runPreshader() on every draw. A few extra
+ *  ALU ops per vertex or pixel are often cheaper than the CPU work and the
+ *  uniform uploads it causes. Zero, the default, turns this off.
+ *
+ * Only the GLSL profiles can do this, and only when every constant register
+ *  the preshader writes is written whole and isn't part of an array. Check
+ *  the parse data's (preshader_inlined) to see if it happened. The OpenGL
+ *  glue honors it if you hand the results to
+ *  MOJOSHADER_glCompileShaderFromParseData(), so you can pick the strategy
+ *  shader by shader.
+ */
+DLLEXPORT
+void MOJOSHADER_setTranslatorPreshaderInlining(
+                                        MOJOSHADER_translator *translator,
+                                        const int enable);
+
+/*
+ * Free a translator and everything it has been holding on to.
+ *  Passing a NULL here is a safe no-op.
+ */
+DLLEXPORT
+void MOJOSHADER_destroyTranslator(MOJOSHADER_translator *translator);
+
+
+/* Allocation tracing interface... */
+
+/*
+ * These are the phases that allocations are attributed to by an allocation
+ *  tracer. MojoShader tells the tracer which phase it is in as it works, so
+ *  the counts reflect what each subsystem costs in your workload.
+ */
+typedef enum
+{
+    MOJOSHADER_ALLOCPHASE_OTHER,         /* anything not listed below. */
+    MOJOSHADER_ALLOCPHASE_PREPROCESSOR,  /* macros, includes, conditionals. */
+    MOJOSHADER_ALLOCPHASE_LEXER,         /* tokens and interned strings. */
+    MOJOSHADER_ALLOCPHASE_AST,           /* syntax tree, semantic analysis. */
+    MOJOSHADER_ALLOCPHASE_IR,            /* intermediate representation. */
+    MOJOSHADER_ALLOCPHASE_CONTEXT,       /* parse context, register tracking. */
+    MOJOSHADER_ALLOCPHASE_EMITTER,       /* output buffers. */
+    MOJOSHADER_ALLOCPHASE_PARSEDATA,     /* results handed back to the app. */
+    MOJOSHADER_ALLOCPHASE_TOTAL          /* sum of all phases. */
+} MOJOSHADER_allocPhase;
+
+/*
+ * Histograms have this many buckets. Bucket (i) counts values from
+ *  (1 << (i-1)) up to, but not including, (1 << i). Bucket zero counts
+ *  zeroes, and the last bucket also counts everything too big for it.
+ */
+#define MOJOSHADER_ALLOC_HISTOGRAM_BUCKETS 32
+
+/*
+ * Statistics for one allocation phase.
+ */
+typedef struct MOJOSHADER_allocStats
+{
+    /*
+     * Number of successful malloc calls, and the number of those that were
+     *  later freed. Failed allocations are counted in (failures).
+     */
+    unsigned int allocations;
+    unsigned int frees;
+    unsigned int failures;
+
+    /*
+     * Bytes requested over the life of the tracer.
+     */
+    unsigned long long bytes;
+
+    /*
+     * Allocations and bytes that are currently not freed, and the highest
+     *  (live_bytes) has ever been. For MOJOSHADER_ALLOCPHASE_TOTAL, this is
+     *  the true peak, not the sum of each phase's peak.
+     */
+    unsigned int live_allocations;
+    unsigned long long live_bytes;
+    unsigned long long peak_bytes;
+
+    /*
+     * Histogram of allocation sizes, in bytes.
+     */
+    unsigned int sizes[MOJOSHADER_ALLOC_HISTOGRAM_BUCKETS];
+
+    /*
+     * Histogram of allocation lifetimes, for blocks that have been freed.
+     *  Lifetime is measured in allocations: a block that was freed before
+     *  anything else was allocated has a lifetime of zero. Lots of short
+     *  lifetimes suggest a pool or arena would pay off.
+     */
+    unsigned int lifetimes[MOJOSHADER_ALLOC_HISTOGRAM_BUCKETS];
+} MOJOSHADER_allocStats;
+
+typedef struct MOJOSHADER_allocTracer MOJOSHADER_allocTracer;
+
+/*
+ * Create an allocation tracer. It wraps the allocator (m), (f) and (d).
+ *  Pass NULL for both (m) and (f) to use MojoShader's default allocator.
+ *  Get the wrapped allocator from MOJOSHADER_getAllocTracerCallbacks() and
+ *  pass it to any MojoShader function that takes one, in place of your own.
+ *
+ * The tracer itself is allocated with (m), but isn't counted.
+ *
+ * Returns NULL on error (out of memory, or only one of (m) and (f) given).
+ *
+ * A tracer is not thread safe. Use one per thread if you want to trace
+ *  work on several threads at once.
+ */
+DLLEXPORT
+MOJOSHADER_allocTracer *MOJOSHADER_createAllocTracer(MOJOSHADER_malloc m,
+                                                     MOJOSHADER_free f,
+                                                     void *d);
+
+/*
+ * Get the allocator callbacks to use with (tracer). Pass these through to
+ *  MojoShader as-is; (*d) points to the tracer, not to your data.
+ */
+DLLEXPORT
+void MOJOSHADER_getAllocTracerCallbacks(MOJOSHADER_allocTracer *tracer,
+                                        MOJOSHADER_malloc *m,
+                                        MOJOSHADER_free *f, void **d);
+
+/*
+ * Get the statistics for (phase) so far. Use MOJOSHADER_ALLOCPHASE_TOTAL
+ *  for the whole picture. The returned pointer stays valid until the tracer
+ *  is destroyed, and is updated as more allocations happen.
+ */
+DLLEXPORT
+const MOJOSHADER_allocStats *MOJOSHADER_getAllocStats(
+                                        const MOJOSHADER_allocTracer *tracer,
+                                        MOJOSHADER_allocPhase phase);
+
+/*
+ * Get a human-readable name for (phase), like "preprocessor". Do not free
+ *  this string; it's statically allocated.
+ */
+DLLEXPORT
+const char *MOJOSHADER_allocPhaseName(MOJOSHADER_allocPhase phase);
+
+/*
+ * Zero out all the statistics in (tracer), except that blocks that are
+ *  still live stay counted as live, so later frees balance out.
+ */
+DLLEXPORT
+void MOJOSHADER_resetAllocTracer(MOJOSHADER_allocTracer *tracer);
+
+/*
+ * Destroy an allocation tracer. Everything allocated through it must have
+ *  been freed first.
+ */
+DLLEXPORT
+void MOJOSHADER_destroyAllocTracer(MOJOSHADER_allocTracer *tracer);
+
 
 /* Effects interface... */  /* !!! FIXME: THIS API IS NOT STABLE YET! */
 
@@ -1109,6 +1399,67 @@ const MOJOSHADER_preprocessData *MOJOSHADER_preprocess(const char *filename,
 void MOJOSHADER_freePreprocessData(const MOJOSHADER_preprocessData *data);
 
 
+/*
+ * An include cache remembers what each #include'd file preprocessed to, so
+ *  builds that pull the same headers into many shaders (or compile one
+ *  shader under many sets of #defines) only lex and macro-expand each
+ *  header once per distinct set of macros.
+ *
+ * An entry is reused when the include has the same name, the include
+ *  callback hands back the exact same bytes, and the macros defined at the
+ *  #include line are the same (compared by a 64-bit fingerprint of every
+ *  #define's name, parameters and body). A hit replays the recorded tokens
+ *  and applies the #defines and #undefs the file made, without running the
+ *  file through the preprocessor again. Headers that #include other files,
+ *  or that fail to preprocess, are never cached.
+ *
+ * The include callbacks still run for every #include, since the cache needs
+ *  the file's contents to know if it changed.
+ *
+ * Parsing and semantic analysis still happen for every compile; the syntax
+ *  tree belongs to each compile's results, and the type checker updates it
+ *  as it goes, so that part can't be shared.
+ */
+typedef struct MOJOSHADER_includeCache MOJOSHADER_includeCache;
+
+/*
+ * Create an empty include cache. The allocator is used for everything the
+ *  cache holds on to, for as long as it lives. Pass NULL for both to use
+ *  malloc/free.
+ *
+ * Returns NULL on error (out of memory, or only one of (m) and (f) given).
+ *
+ * An include cache is not thread safe; make one per thread. Entries only
+ *  ever get added, so destroy the cache when you are done with a batch.
+ */
+DLLEXPORT
+MOJOSHADER_includeCache *MOJOSHADER_createIncludeCache(MOJOSHADER_malloc m,
+                                                  MOJOSHADER_free f, void *d);
+
+/*
+ * This works exactly like MOJOSHADER_preprocess(), but reuses and adds to
+ *  (include_cache), which may be NULL. The results are the same either way.
+ */
+DLLEXPORT
+const MOJOSHADER_preprocessData *MOJOSHADER_preprocessWithIncludeCache(
+                             MOJOSHADER_includeCache *include_cache,
+                             const char *filename,
+                             const char *source, unsigned int sourcelen,
+                             const MOJOSHADER_preprocessorDefine *defines,
+                             unsigned int define_count,
+                             MOJOSHADER_includeOpen include_open,
+                             MOJOSHADER_includeClose include_close,
+                             MOJOSHADER_malloc m, MOJOSHADER_free f, void *d);
+
+/*
+ * Free an include cache and everything it remembers. Nothing returned by
+ *  the functions that used it refers to it, so this can happen at any time
+ *  the cache isn't in use. Passing a NULL here is a safe no-op.
+ */
+DLLEXPORT
+void MOJOSHADER_destroyIncludeCache(MOJOSHADER_includeCache *cache);
+
+
 /* Assembler interface... */
 
 /*
@@ -2029,6 +2380,23 @@ const MOJOSHADER_astData *MOJOSHADER_parseAst(const char *srcprofile,
                                     MOJOSHADER_malloc m, MOJOSHADER_free f,
                                     void *d);
 
+/*
+ * This works exactly like MOJOSHADER_parseAst(), but preprocesses through
+ *  (include_cache), which may be NULL. See MOJOSHADER_createIncludeCache().
+ */
+DLLEXPORT
+const MOJOSHADER_astData *MOJOSHADER_parseAstWithIncludeCache(
+                                    MOJOSHADER_includeCache *include_cache,
+                                    const char *srcprofile,
+                                    const char *filename, const char *source,
+                                    unsigned int sourcelen,
+                                    const MOJOSHADER_preprocessorDefine *defs,
+                                    unsigned int define_count,
+                                    MOJOSHADER_includeOpen include_open,
+                                    MOJOSHADER_includeClose include_close,
+                                    MOJOSHADER_malloc m, MOJOSHADER_free f,
+                                    void *d);
+
 
 /* !!! FIXME: expose semantic analysis to the public API? */
 
@@ -2045,6 +2413,145 @@ const MOJOSHADER_astData *MOJOSHADER_parseAst(const char *srcprofile,
 void MOJOSHADER_freeAstData(const MOJOSHADER_astData *data);
 
 
+/* Compact AST interface... */
+
+/*
+ * A node index that refers to nothing (the parent of a top-level node, etc).
+ */
+#define MOJOSHADER_AST_NO_NODE 0xFFFFFFFF
+
+/*
+ * One node of a MOJOSHADER_astCompact. Nodes are stored in a single array in
+ *  pre-order: a node's first child, if it has one, is always the next element
+ *  of the array, and each following sibling starts (subtree_size) elements
+ *  after the previous one. A node's subtree is exactly the range
+ *  [index, index + subtree_size), so you can skip it without looking inside.
+ *
+ * Children are listed in the order their fields appear in the node's
+ *  structure; linked lists (statements, arguments, parameters, struct
+ *  members, annotations, switch cases, variable declarations) are flattened
+ *  into consecutive siblings under the node that owns the list.
+ *
+ * (node) points back to the original tree for type-specific details like
+ *  identifiers, literal values and datatypes.
+ */
+typedef struct MOJOSHADER_astCompactNode
+{
+    MOJOSHADER_astNodeType type;
+    unsigned int parent;  /* MOJOSHADER_AST_NO_NODE for top-level nodes. */
+    unsigned int subtree_size;  /* this node plus all its descendants. */
+    unsigned int child_count;
+    const MOJOSHADER_astNode *node;
+} MOJOSHADER_astCompactNode;
+
+/*
+ * A flattened copy of the structure of a MOJOSHADER_astData's tree.
+ *  Every compilation unit is a top-level node; they are listed in source
+ *  order, so the first one (if any) is always node zero.
+ *
+ * Source positions are kept in side tables instead of in the nodes, since
+ *  most passes over the tree never look at them.
+ */
+typedef struct MOJOSHADER_astCompact
+{
+    /*
+     * The number of elements pointed to by (nodes), (lines) and (files).
+     */
+    unsigned int node_count;
+
+    /*
+     * (node_count) nodes, in pre-order.
+     */
+    const MOJOSHADER_astCompactNode *nodes;
+
+    /*
+     * The source line of each node, indexed like (nodes).
+     */
+    const unsigned int *lines;
+
+    /*
+     * The source file of each node, as an index into (filenames), indexed
+     *  like (nodes). A node with no filename uses MOJOSHADER_AST_NO_NODE.
+     */
+    const unsigned int *files;
+
+    /*
+     * The number of elements pointed to by (filenames).
+     */
+    unsigned int filename_count;
+
+    /*
+     * Every distinct filename referenced by the tree. These strings belong
+     *  to the MOJOSHADER_astData this was built from.
+     */
+    const char **filenames;
+
+    /*
+     * This is the malloc implementation you passed to MOJOSHADER_parseAst().
+     */
+    MOJOSHADER_malloc malloc;
+
+    /*
+     * This is the free implementation you passed to MOJOSHADER_parseAst().
+     */
+    MOJOSHADER_free free;
+
+    /*
+     * This is the pointer you passed as opaque data for your allocator.
+     */
+    void *malloc_data;
+} MOJOSHADER_astCompact;
+
+/*
+ * Build a compact, index-based copy of the tree in (data), which came from
+ *  MOJOSHADER_parseAst(). Walking this array is much friendlier to the CPU
+ *  cache than chasing the pointers in the original tree, and it can be
+ *  walked without recursion.
+ *
+ * The result refers to the nodes and strings of (data), so you must call
+ *  MOJOSHADER_freeCompactAst() on it before you call
+ *  MOJOSHADER_freeAstData() on (data). Memory comes from the allocator
+ *  that was passed to MOJOSHADER_parseAst().
+ *
+ * Returns NULL if (data) is NULL or if we ran out of memory. If (data) has
+ *  no tree (parsing failed, etc), you get a compact AST with no nodes.
+ *
+ * This function is thread safe, so long as any allocator you passed into
+ *  MOJOSHADER_parseAst() is, too.
+ */
+DLLEXPORT
+const MOJOSHADER_astCompact *MOJOSHADER_compactAst(
+                                            const MOJOSHADER_astData *data);
+
+/*
+ * Callback for MOJOSHADER_visitCompactAst(). (index) is the node being
+ *  visited. Return non-zero to visit this node's children next, zero to
+ *  skip them.
+ */
+typedef int (*MOJOSHADER_astCompactVisitor)(const MOJOSHADER_astCompact *ast,
+                                            unsigned int index, void *data);
+
+/*
+ * Visit the subtree rooted at (index) in pre-order, calling (visitor) once
+ *  per node. Pass MOJOSHADER_AST_NO_NODE for (index) to visit every node.
+ *  (data) is passed as-is to (visitor).
+ *
+ * This does not recurse, no matter how deep the tree is.
+ */
+DLLEXPORT
+void MOJOSHADER_visitCompactAst(const MOJOSHADER_astCompact *ast,
+                                unsigned int index,
+                                MOJOSHADER_astCompactVisitor visitor,
+                                void *data);
+
+/*
+ * Call this to dispose of a compact AST when you are done with it.
+ *  Passing a NULL here is a safe no-op.
+ */
+DLLEXPORT
+void MOJOSHADER_freeCompactAst(const MOJOSHADER_astCompact *ast);
+
+
 /* Intermediate Representation interface... */
 /* !!! FIXME: there is currently no way to access the IR via the public API. */
 typedef enum MOJOSHADER_irNodeType
@@ -2469,6 +2976,66 @@ const MOJOSHADER_compileData *MOJOSHADER_compile(const char *srcprofile,
                                     MOJOSHADER_malloc m, MOJOSHADER_free f,
                                     void *d);
 
+/*
+ * This works exactly like MOJOSHADER_compile(), but preprocesses through
+ *  (include_cache), which may be NULL. See MOJOSHADER_createIncludeCache().
+ */
+DLLEXPORT
+const MOJOSHADER_compileData *MOJOSHADER_compileWithIncludeCache(
+                                    MOJOSHADER_includeCache *include_cache,
+                                    const char *srcprofile,
+                                    const char *filename, const char *source,
+                                    unsigned int sourcelen,
+                                    const MOJOSHADER_preprocessorDefine *defs,
+                                    unsigned int define_count,
+                                    MOJOSHADER_includeOpen include_open,
+                                    MOJOSHADER_includeClose include_close,
+                                    MOJOSHADER_malloc m, MOJOSHADER_free f,
+                                    void *d);
+
+/*
+ * Compile several entry points out of one source file, such as the vertex
+ *  and pixel shaders of an effect. The source is preprocessed, parsed and
+ *  checked once, instead of once per entry point like calling
+ *  MOJOSHADER_compile() in a loop would.
+ *
+ * (entry_points) points to (entry_count) NULL-terminated function names.
+ *  (results) must have room for (entry_count) pointers; when this returns,
+ *  results[i] holds the MOJOSHADER_compileData for entry_points[i]. Each one
+ *  is never NULL, and must be passed to MOJOSHADER_freeCompileData() on its
+ *  own.
+ *
+ * Only the parts of the source that the requested entry points can reach
+ *  are checked and turned into IR: functions nothing calls, and globals,
+ *  structs and samplers nothing mentions, are skipped (function signatures
+ *  are still checked). Mistakes inside skipped code aren't reported, just
+ *  like a C compiler won't complain about a macro nobody expands.
+ *
+ * Every result reports all the errors and warnings from the shared source.
+ *  An entry point that isn't defined, or is defined more than once, fails
+ *  on its own without affecting the others.
+ *
+ * (include_cache) may be NULL. Everything else works like
+ *  MOJOSHADER_compile(). The entry points are compiled one after another
+ *  on the calling thread; this function is thread safe under the same
+ *  conditions as MOJOSHADER_compile(), so separate sources can still be
+ *  compiled on separate CPU cores.
+ */
+DLLEXPORT
+void MOJOSHADER_compileEntryPoints(MOJOSHADER_includeCache *include_cache,
+                                   const char *srcprofile,
+                                   const char * const *entry_points,
+                                   unsigned int entry_count,
+                                   const MOJOSHADER_compileData **results,
+                                   const char *filename, const char *source,
+                                   unsigned int sourcelen,
+                                   const MOJOSHADER_preprocessorDefine *defs,
+                                   unsigned int define_count,
+                                   MOJOSHADER_includeOpen include_open,
+                                   MOJOSHADER_includeClose include_close,
+                                   MOJOSHADER_malloc m, MOJOSHADER_free f,
+                                   void *d);
+
 
 /*
  * Call this to dispose of compile results when you are done with them.
@@ -2518,6 +3085,8 @@ typedef void *(*MOJOSHADER_glGetProcAddress)(const char *fnname, void *data);
 typedef struct MOJOSHADER_glContext MOJOSHADER_glContext;
 typedef struct MOJOSHADER_glShader MOJOSHADER_glShader;
 typedef struct MOJOSHADER_glProgram MOJOSHADER_glProgram;
+typedef struct MOJOSHADER_glCommandBuffer MOJOSHADER_glCommandBuffer;
+typedef struct MOJOSHADER_glCapabilities MOJOSHADER_glCapabilities;
 
 
 /*
@@ -2617,6 +3186,80 @@ MOJOSHADER_glContext *MOJOSHADER_glCreateContext(const char *profile,
                                         MOJOSHADER_malloc m, MOJOSHADER_free f,
                                         void *malloc_d);
 
+/*
+ * Probe the GL once and keep the results around.
+ *
+ * MOJOSHADER_glAvailableProfiles(), MOJOSHADER_glBestProfile() and
+ *  MOJOSHADER_glCreateContext() each look up every entry point through
+ *  (lookup), query the GL version and check the extension list. If you make
+ *  a lot of contexts (or ask about profiles before making one), do that work
+ *  once here, and use the snapshot with
+ *  MOJOSHADER_glCapabilitiesAvailableProfiles(),
+ *  MOJOSHADER_glCapabilitiesBestProfile() and
+ *  MOJOSHADER_glCreateContextFromCapabilities() instead.
+ *
+ * A GL context must be current when you call this, and (lookup), (lookup_d),
+ *  (m), (f) and (malloc_d) mean what they do for MOJOSHADER_glCreateContext().
+ *  The snapshot keeps the entry points (lookup) returned, so only use it
+ *  with GL contexts that those entry points are valid for (on some platforms,
+ *  like Windows, that means contexts with the same pixel format on the same
+ *  device).
+ *
+ * Returns a new snapshot, or NULL on error (out of memory). Free it with
+ *  MOJOSHADER_glDestroyCapabilities(); contexts made from it don't need it
+ *  to stay around.
+ *
+ * This call is NOT thread safe! As most OpenGL implementations are not thread
+ *  safe, you should probably only call this from the same thread that created
+ *  the GL context.
+ */
+DLLEXPORT
+MOJOSHADER_glCapabilities *MOJOSHADER_glCreateCapabilities(
+                                        MOJOSHADER_glGetProcAddress lookup,
+                                        void *lookup_d,
+                                        MOJOSHADER_malloc m, MOJOSHADER_free f,
+                                        void *malloc_d);
+
+/*
+ * MOJOSHADER_glAvailableProfiles() for a capability snapshot. This doesn't
+ *  touch the GL at all.
+ */
+DLLEXPORT
+int MOJOSHADER_glCapabilitiesAvailableProfiles(
+                                        const MOJOSHADER_glCapabilities *caps,
+                                        const char **profs, const int size);
+
+/*
+ * MOJOSHADER_glBestProfile() for a capability snapshot. This doesn't
+ *  touch the GL at all.
+ */
+DLLEXPORT
+const char *MOJOSHADER_glCapabilitiesBestProfile(
+                                        const MOJOSHADER_glCapabilities *caps);
+
+/*
+ * MOJOSHADER_glCreateContext(), but with the entry points, versions and
+ *  extensions from (caps) instead of asking the GL for them again.
+ *
+ * This call is NOT thread safe! It must return success before you may call
+ *  any other MOJOSHADER_gl* function. Also, as most OpenGL implementations
+ *  are not thread safe, you should probably only call this from the same
+ *  thread that created the GL context.
+ */
+DLLEXPORT
+MOJOSHADER_glContext *MOJOSHADER_glCreateContextFromCapabilities(
+                                        const char *profile,
+                                        const MOJOSHADER_glCapabilities *caps,
+                                        MOJOSHADER_malloc m, MOJOSHADER_free f,
+                                        void *malloc_d);
+
+/*
+ * Free a snapshot from MOJOSHADER_glCreateCapabilities(). Contexts created
+ *  from it are not affected.
+ */
+DLLEXPORT
+void MOJOSHADER_glDestroyCapabilities(MOJOSHADER_glCapabilities *caps);
+
 /*
  * You must call this before using the context that you got from
  *  MOJOSHADER_glCreateContext(), and must use it when you switch to a new GL
@@ -2674,6 +3317,43 @@ const char *MOJOSHADER_glGetError(void);
  */
 int MOJOSHADER_glMaxUniforms(MOJOSHADER_shaderType shader_type);
 
+/*
+ * Get the MojoShader profile the current GL context compiles shaders with.
+ *  This is the string that was passed to MOJOSHADER_glCreateContext().
+ *
+ * Pass this to MOJOSHADER_parse() if you want to translate shaders yourself,
+ *  perhaps on other threads, and hand the results to
+ *  MOJOSHADER_glCompileShaderFromParseData().
+ *
+ * The returned string is owned by the context and remains valid until the
+ *  context is destroyed. You may copy it and use the copy from any thread.
+ *
+ * This call requires a valid MOJOSHADER_glContext to have been made current,
+ *  or it will crash your program. See MOJOSHADER_glMakeContextCurrent().
+ */
+DLLEXPORT
+const char *MOJOSHADER_glGetContextProfile(void);
+
+/*
+ * Turn parse data trimming on or off for the current context. It is off
+ *  by default.
+ *
+ * While it's on, every shader that is successfully linked into a program
+ *  has its MOJOSHADER_parseData trimmed with MOJOSHADER_trimParseData(), so
+ *  the generated source code and reflection data the GL layer doesn't need
+ *  at runtime aren't kept around for the life of the shader. After that,
+ *  MOJOSHADER_glGetShaderParseData() returns the trimmed data.
+ *
+ * This call is NOT thread safe! As most OpenGL implementations are not thread
+ *  safe, you should probably only call this from the same thread that created
+ *  the GL context.
+ *
+ * This call requires a valid MOJOSHADER_glContext to have been made current,
+ *  or it will crash your program. See MOJOSHADER_glMakeContextCurrent().
+ */
+DLLEXPORT
+void MOJOSHADER_glSetParseDataTrimming(int enable);
+
 /*
  * Compile a buffer of Direct3D shader bytecode into an OpenGL shader.
  *  You still need to link the shader before you may render with it.
@@ -2685,6 +3365,11 @@ int MOJOSHADER_glMaxUniforms(MOJOSHADER_shaderType shader_type);
  *
  * Returns NULL on error, or a shader handle on success.
  *
+ * If a shader compiled from the same bytecode, swizzles and sampler map
+ *  still exists in this context, you get that shader back instead of a new
+ *  one. Each successful call must still be balanced by a call to
+ *  MOJOSHADER_glDeleteShader(); the shader goes away after the last one.
+ *
  * This call is NOT thread safe! As most OpenGL implementations are not thread
  *  safe, you should probably only call this from the same thread that created
  *  the GL context.
@@ -2701,10 +3386,40 @@ MOJOSHADER_glShader *MOJOSHADER_glCompileShader(const unsigned char *tokenbuf,
                                                 const MOJOSHADER_samplerMap *smap,
                                                 const unsigned int smapcount);
 
+/*
+ * Compile an OpenGL shader from parse data you already have.
+ *
+ * This is MOJOSHADER_glCompileShader() without the MOJOSHADER_parse() step,
+ *  so the translation can happen somewhere other than the GL thread: parse
+ *  the bytecode with the profile from MOJOSHADER_glGetContextProfile() on a
+ *  worker thread, then pass the result here to hand it to OpenGL.
+ *
+ *   (pd) must have been parsed with the current context's profile, and
+ *   must not contain errors.
+ *
+ * Returns NULL on error, or a shader handle on success. On success, the
+ *  shader takes ownership of (pd) and will free it with
+ *  MOJOSHADER_freeParseData() when the shader is deleted; you must not free
+ *  it yourself. On failure, (pd) is still yours to free.
+ *
+ * This call is NOT thread safe! As most OpenGL implementations are not thread
+ *  safe, you should probably only call this from the same thread that created
+ *  the GL context.
+ *
+ * This call requires a valid MOJOSHADER_glContext to have been made current,
+ *  or it will crash your program. See MOJOSHADER_glMakeContextCurrent().
+ *
+ * Compiled shaders from this function may not be shared between contexts.
+ */
+DLLEXPORT
+MOJOSHADER_glShader *MOJOSHADER_glCompileShaderFromParseData(
+                                        const MOJOSHADER_parseData *pd);
+
 
 /*
  * Get the MOJOSHADER_parseData structure that was produced from the
- *  call to MOJOSHADER_glCompileShader().
+ *  call to MOJOSHADER_glCompileShader() or handed to
+ *  MOJOSHADER_glCompileShaderFromParseData().
  *
  * This data is read-only, and you should NOT attempt to free it. This
  *  pointer remains valid until the shader is deleted.
@@ -3174,6 +3889,155 @@ void MOJOSHADER_glGetPixelPreshaderUniformF(unsigned int idx, float *data,
  */
 void MOJOSHADER_glProgramReady(void);
 
+/*
+ * A command buffer records a sequence of shader binds, uniform updates,
+ *  vertex attributes and draws, to be played back later with
+ *  MOJOSHADER_glExecuteCommandBuffer(). This is the same work you'd do with
+ *  MOJOSHADER_glBindShaders(), MOJOSHADER_glSetVertexShaderUniformF() (etc),
+ *  MOJOSHADER_glSetVertexAttribute() and MOJOSHADER_glProgramReady(), but
+ *  playback can skip redundant binds and uniform values that haven't changed
+ *  across the whole sequence, so uniforms only get pushed to the GL when they
+ *  actually changed.
+ *
+ * Draws are made by your callback; MojoShader calls
+ *  MOJOSHADER_glProgramReady() right before each one, so the callback just
+ *  needs to issue its glDrawArrays() (or whatever).
+ *
+ * (data) is passed to the callback unmolested.
+ */
+typedef void (*MOJOSHADER_glDrawCallback)(void *data);
+
+/*
+ * Create an empty command buffer.
+ *
+ * Returns NULL on error (out of memory). Free it with
+ *  MOJOSHADER_glDestroyCommandBuffer() when you're done with it. A command
+ *  buffer can be cleared and reused as often as you like, and played back
+ *  as many times as you like.
+ *
+ * This call is NOT thread safe! As most OpenGL implementations are not thread
+ *  safe, you should probably only call this from the same thread that created
+ *  the GL context.
+ *
+ * This call requires a valid MOJOSHADER_glContext to have been made current,
+ *  or it will crash your program. See MOJOSHADER_glMakeContextCurrent().
+ *  The command buffer must only be used with that context.
+ */
+DLLEXPORT
+MOJOSHADER_glCommandBuffer *MOJOSHADER_glCreateCommandBuffer(void);
+
+/*
+ * These record the equivalent immediate calls into (buf); nothing happens
+ *  to the GL or MojoShader's register files until the buffer is executed.
+ *
+ * Uniform data is copied into the buffer, so (data) doesn't have to live
+ *  past this call. Vertex attribute pointers are stored as-is, so whatever
+ *  they point to (or the VBO they're an offset into) must still be valid
+ *  when the buffer is executed.
+ *
+ * If the buffer runs out of memory while recording, it stops recording and
+ *  the next MOJOSHADER_glExecuteCommandBuffer() will fail without doing
+ *  anything. Clear the buffer to start over.
+ *
+ * This call is NOT thread safe! As most OpenGL implementations are not thread
+ *  safe, you should probably only call this from the same thread that created
+ *  the GL context.
+ *
+ * This call requires a valid MOJOSHADER_glContext to have been made current,
+ *  or it will crash your program. See MOJOSHADER_glMakeContextCurrent().
+ */
+DLLEXPORT
+void MOJOSHADER_glCommandBindShaders(MOJOSHADER_glCommandBuffer *buf,
+                                     MOJOSHADER_glShader *vshader,
+                                     MOJOSHADER_glShader *pshader);
+DLLEXPORT
+void MOJOSHADER_glCommandSetVertexShaderUniformF(
+                                        MOJOSHADER_glCommandBuffer *buf,
+                                        unsigned int idx, const float *data,
+                                        unsigned int vec4count);
+DLLEXPORT
+void MOJOSHADER_glCommandSetVertexShaderUniformI(
+                                        MOJOSHADER_glCommandBuffer *buf,
+                                        unsigned int idx, const int *data,
+                                        unsigned int ivec4count);
+DLLEXPORT
+void MOJOSHADER_glCommandSetVertexShaderUniformB(
+                                        MOJOSHADER_glCommandBuffer *buf,
+                                        unsigned int idx, const int *data,
+                                        unsigned int bcount);
+DLLEXPORT
+void MOJOSHADER_glCommandSetPixelShaderUniformF(
+                                        MOJOSHADER_glCommandBuffer *buf,
+                                        unsigned int idx, const float *data,
+                                        unsigned int vec4count);
+DLLEXPORT
+void MOJOSHADER_glCommandSetPixelShaderUniformI(
+                                        MOJOSHADER_glCommandBuffer *buf,
+                                        unsigned int idx, const int *data,
+                                        unsigned int ivec4count);
+DLLEXPORT
+void MOJOSHADER_glCommandSetPixelShaderUniformB(
+                                        MOJOSHADER_glCommandBuffer *buf,
+                                        unsigned int idx, const int *data,
+                                        unsigned int bcount);
+DLLEXPORT
+void MOJOSHADER_glCommandSetVertexAttribute(MOJOSHADER_glCommandBuffer *buf,
+                                            MOJOSHADER_usage usage,
+                                            int index, unsigned int size,
+                                            MOJOSHADER_attributeType type,
+                                            int normalized,
+                                            unsigned int stride,
+                                            const void *ptr);
+DLLEXPORT
+void MOJOSHADER_glCommandDraw(MOJOSHADER_glCommandBuffer *buf,
+                              MOJOSHADER_glDrawCallback callback, void *data);
+
+/*
+ * Play back everything recorded in (buf), in order, against the current
+ *  context. The buffer is not changed, and can be executed again later.
+ *
+ * If (reorder) is non-zero, MojoShader may move draws around so draws with
+ *  the same shaders run together, which cuts down on program switches. Each
+ *  draw moves along with the commands recorded between it and the previous
+ *  draw, and gets the shaders that were bound for it in the recording, but
+ *  it will NOT see uniforms or attributes set for draws that were recorded
+ *  before it. Only allow this if every draw sets all the uniforms and
+ *  attributes it depends on, and if your draws don't depend on each other's
+ *  results (blending, etc). Commands after the last draw always run last.
+ *
+ * Returns non-zero on success, zero on error (the buffer ran out of memory
+ *  while recording, etc). Call MOJOSHADER_glGetError() for details.
+ *
+ * This call is NOT thread safe! As most OpenGL implementations are not thread
+ *  safe, you should probably only call this from the same thread that created
+ *  the GL context.
+ *
+ * This call requires a valid MOJOSHADER_glContext to have been made current,
+ *  or it will crash your program. See MOJOSHADER_glMakeContextCurrent().
+ */
+DLLEXPORT
+int MOJOSHADER_glExecuteCommandBuffer(const MOJOSHADER_glCommandBuffer *buf,
+                                      int reorder);
+
+/*
+ * Throw away everything recorded in (buf), so you can record something new.
+ *  The memory it used is kept around for the next recording.
+ *
+ * This call requires a valid MOJOSHADER_glContext to have been made current,
+ *  or it will crash your program. See MOJOSHADER_glMakeContextCurrent().
+ */
+DLLEXPORT
+void MOJOSHADER_glClearCommandBuffer(MOJOSHADER_glCommandBuffer *buf);
+
+/*
+ * Free a command buffer from MOJOSHADER_glCreateCommandBuffer().
+ *
+ * This call requires a valid MOJOSHADER_glContext to have been made current,
+ *  or it will crash your program. See MOJOSHADER_glMakeContextCurrent().
+ */
+DLLEXPORT
+void MOJOSHADER_glDestroyCommandBuffer(MOJOSHADER_glCommandBuffer *buf);
+
 /*
  * Free the resources of a linked program. This will delete the GL object
  *  and free memory.
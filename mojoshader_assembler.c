@@ -169,9 +169,12 @@ static Token nexttoken(Context *ctx)
     {
         while (1)
         {
+            const MOJOSHADER_allocPhase phase = alloc_phase(ctx->malloc,
+                    ctx->malloc_data, MOJOSHADER_ALLOCPHASE_PREPROCESSOR);
             ctx->token = preprocessor_nexttoken(ctx->preprocessor,
                                                 &ctx->tokenlen,
                                                 &ctx->tokenval);
+            alloc_phase(ctx->malloc, ctx->malloc_data, phase);
 
             if (preprocessor_outofmemory(ctx->preprocessor))
             {
@@ -299,6 +302,9 @@ static int check_token(Context *ctx, const char *str)
 } // check_token
 
 
+// Register numbers, version numbers and the like are always decimal, and
+//  often run straight into more token text ("c0x" is c0, then an "x"), so
+//  this doesn't use literal_uint32(), which would see a hex prefix there.
 static int ui32fromtoken(Context *ctx, uint32 *_val)
 {
     unsigned int i;
@@ -811,8 +817,7 @@ static int parse_num(Context *ctx, const int floatok, uint32 *value)
 
     if (token == TOKEN_INT_LITERAL)
     {
-        int d = 0;
-        sscanf(ctx->token, "%d", &d);
+        const int d = (int) literal_int64(ctx->token, ctx->tokenlen);
         if (floatok)
             cvt.f = (float) ((negative) ? -d : d);
         else
@@ -826,7 +831,7 @@ static int parse_num(Context *ctx, const int floatok, uint32 *value)
             *value = 0;
             return 0;
         } // if
-        sscanf(ctx->token, "%f", &cvt.f);
+        cvt.f = literal_float(ctx->token, ctx->tokenlen);
         if (negative)
             cvt.f = -cvt.f;
     } // if
@@ -1441,7 +1446,7 @@ static Context *build_context(const char *filename,
 
     ctx->preprocessor = preprocessor_start(filename, source, sourcelen,
                                            include_open, include_close,
-                                           defines, define_count, 1,
+                                           defines, define_count, 1, NULL,
                                            MallocBridge, FreeBridge, ctx);
 
     if (ctx->preprocessor == NULL)
@@ -1737,15 +1742,23 @@ const MOJOSHADER_parseData *MOJOSHADER_assemble(const char *filename,
                              MOJOSHADER_malloc m, MOJOSHADER_free f, void *d)
 {
     const MOJOSHADER_parseData *retval = NULL;
+    MOJOSHADER_allocPhase phase;
     Context *ctx = NULL;
 
     if ( ((m == NULL) && (f != NULL)) || ((m != NULL) && (f == NULL)) )
         return &MOJOSHADER_out_of_mem_data;  // supply both or neither.
 
+    phase = alloc_phase(m, d, MOJOSHADER_ALLOCPHASE_CONTEXT);
     ctx = build_context(filename, source, sourcelen, defines, define_count,
                         include_open, include_close, m, f, d);
     if (ctx == NULL)
+    {
+        alloc_phase(m, d, phase);
         return &MOJOSHADER_out_of_mem_data;
+    } // if
+
+    // the assembler is mostly tokenizing and writing bytecode out as it goes.
+    alloc_phase(m, d, MOJOSHADER_ALLOCPHASE_EMITTER);
 
     // Version token always comes first.
     parse_version_token(ctx);
@@ -1761,8 +1774,10 @@ const MOJOSHADER_parseData *MOJOSHADER_assemble(const char *filename,
 
     output_token(ctx, 0x0000FFFF);   // end token always 0x0000FFFF.
 
+    alloc_phase(m, d, MOJOSHADER_ALLOCPHASE_PARSEDATA);
     retval = build_final_assembly(ctx);
     destroy_context(ctx);
+    alloc_phase(m, d, phase);
     return retval;
 } // MOJOSHADER_assemble
 
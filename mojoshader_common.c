@@ -1,6 +1,8 @@
 #define __MOJOSHADER_INTERNAL__ 1
 #include "mojoshader_internal.h"
 
+#include <float.h>
+
 typedef struct HashItem
 {
     const void *key;
@@ -468,6 +470,8 @@ struct ErrorList
     ErrorItem head;
     ErrorItem *tail;
     int count;
+    int limit;  // zero for no limit.
+    int dropped;  // errors past the limit; we only count these.
     MOJOSHADER_malloc m;
     MOJOSHADER_free f;
     void *d;
@@ -507,9 +511,29 @@ int errorlist_add_fmt(ErrorList *list, const char *fname,
 } // errorlist_add_fmt
 
 
+void errorlist_set_limit(ErrorList *list, const int limit)
+{
+    list->limit = (limit > 0) ? limit : 0;
+} // errorlist_set_limit
+
+
+int errorlist_full(ErrorList *list)
+{
+    return ((list->limit > 0) && (list->count >= list->limit));
+} // errorlist_full
+
+
 int errorlist_add_va(ErrorList *list, const char *_fname,
                      const int errpos, const char *fmt, va_list va)
 {
+    // Past the limit, nobody is going to read these, so don't bother
+    //  formatting or allocating anything.
+    if (errorlist_full(list))
+    {
+        list->dropped++;
+        return 1;
+    } // if
+
     ErrorItem *error = (ErrorItem *) list->m(sizeof (ErrorItem), list->d);
     if (error == NULL)
         return 0;
@@ -552,8 +576,6 @@ int errorlist_add_va(ErrorList *list, const char *_fname,
         va_end(ap);
     } // else
 
-    printf("fail - %s\n", failstr);
-
     error->error.error = failstr;
     error->error.filename = fname;
     error->error.error_position = errpos;
@@ -569,12 +591,27 @@ int errorlist_add_va(ErrorList *list, const char *_fname,
 
 int errorlist_count(ErrorList *list)
 {
-    return list->count;
+    return list->count + ((list->dropped > 0) ? 1 : 0);
 } // errorlist_count
 
 
 MOJOSHADER_error *errorlist_flatten(ErrorList *list)
 {
+    // Summarize anything we dropped as one last error.
+    if (list->dropped > 0)
+    {
+        const int dropped = list->dropped;
+        const int limit = list->limit;
+        list->limit = 0;  // make room for it.
+        list->dropped = 0;
+        const int rc = errorlist_add_fmt(list, NULL, MOJOSHADER_POSITION_NONE,
+                                    "Too many errors; %d more not reported",
+                                    dropped);
+        list->limit = limit;
+        if (!rc)
+            return NULL;
+    } // if
+
     if (list->count == 0)
         return NULL;
 
@@ -603,11 +640,8 @@ MOJOSHADER_error *errorlist_flatten(ErrorList *list)
 } // errorlist_flatten
 
 
-void errorlist_destroy(ErrorList *list)
+void errorlist_empty(ErrorList *list)
 {
-    if (list == NULL)
-        return;
-
     MOJOSHADER_free f = list->f;
     void *d = list->d;
     ErrorItem *item = list->head.next;
@@ -619,28 +653,158 @@ void errorlist_destroy(ErrorList *list)
         f(item, d);
         item = next;
     } // while
-    f(list, d);
+    list->count = 0;
+    list->dropped = 0;
+    list->head.next = NULL;
+    list->tail = &list->head;
+} // errorlist_empty
+
+
+void errorlist_destroy(ErrorList *list)
+{
+    if (list == NULL)
+        return;
+
+    errorlist_empty(list);
+    list->f(list, list->d);
 } // errorlist_destroy
 
 
+// Dynamic buffers...
+//
+// Each block is a single allocation: data first (plus room for a null),
+//  then the BufferBlock header, so a one-block buffer can be flattened by
+//  handing its allocation to the caller without a copy. Blocks double in
+//  size as a buffer fills, up to BUFFER_MAX_BLOCK_SIZE. Pooled buffers
+//  recycle their blocks through a BufferPool instead of freeing them.
+
+#ifndef BUFFER_MAX_BLOCK_SIZE
+#define BUFFER_MAX_BLOCK_SIZE (64 * 1024)
+#endif
+
+// a one-block buffer is only handed over without a copy if the block has
+//  no more unused space than this, or than the data it holds.
+#ifndef BUFFER_MAX_STEAL_SLACK
+#define BUFFER_MAX_STEAL_SLACK 1024
+#endif
+
+#define BUFFER_POOL_BINS (sizeof (size_t) * 8)
+
 typedef struct BufferBlock
 {
     uint8 *data;
     size_t bytes;
+    size_t capacity;
     struct BufferBlock *next;
 } BufferBlock;
 
+struct BufferPool
+{
+    BufferBlock *bins[BUFFER_POOL_BINS];  // binned by floor(log2(capacity)).
+    MOJOSHADER_malloc m;
+    MOJOSHADER_free f;
+    void *d;
+};
+
 struct Buffer
 {
     size_t total_bytes;
     BufferBlock *head;
     BufferBlock *tail;
-    size_t block_size;
+    size_t block_size;  // size of the next block we allocate.
+    size_t max_block_size;
+    BufferPool *pool;
     MOJOSHADER_malloc m;
     MOJOSHADER_free f;
     void *d;
 };
 
+static inline size_t buffer_block_offset(const size_t capacity)
+{
+    // data, plus a byte for the null terminator, rounded up so the header
+    //  that follows is aligned.
+    const size_t align = sizeof (void *);
+    return (capacity + 1 + (align - 1)) & ~(align - 1);
+} // buffer_block_offset
+
+static inline BufferBlock *buffer_block_header(uint8 *data,
+                                               const size_t capacity)
+{
+    return (BufferBlock *) (data + buffer_block_offset(capacity));
+} // buffer_block_header
+
+static inline int bufferpool_bin(size_t len)
+{
+    int retval = 0;
+    while (len >>= 1)
+        retval++;
+    return retval;
+} // bufferpool_bin
+
+BufferPool *bufferpool_create(MOJOSHADER_malloc m, MOJOSHADER_free f, void *d)
+{
+    BufferPool *pool = (BufferPool *) m(sizeof (BufferPool), d);
+    if (pool != NULL)
+    {
+        memset(pool, '\0', sizeof (BufferPool));
+        pool->m = m;
+        pool->f = f;
+        pool->d = d;
+    } // if
+    return pool;
+} // bufferpool_create
+
+static BufferBlock *bufferpool_get(BufferPool *pool, const size_t len)
+{
+    // In len's own bin, we have to check, since that bin covers
+    //  [2^n, 2^(n+1)). Anything in the next bin up is big enough. We don't
+    //  look further than that: a small request would pin a huge block.
+    const int bin = bufferpool_bin(len);
+    BufferBlock **prev = &pool->bins[bin];
+    BufferBlock *item = *prev;
+    while ((item != NULL) && (item->capacity < len))
+    {
+        prev = &item->next;
+        item = item->next;
+    } // while
+
+    if ((item == NULL) && ((bin + 1) < (int) BUFFER_POOL_BINS))
+    {
+        prev = &pool->bins[bin + 1];
+        item = *prev;
+    } // if
+
+    if (item != NULL)
+        *prev = item->next;
+    return item;
+} // bufferpool_get
+
+static void bufferpool_put(BufferPool *pool, BufferBlock *item)
+{
+    const int bin = bufferpool_bin(item->capacity);
+    item->next = pool->bins[bin];
+    pool->bins[bin] = item;
+} // bufferpool_put
+
+void bufferpool_destroy(BufferPool *pool)
+{
+    if (pool != NULL)
+    {
+        size_t i;
+        for (i = 0; i < BUFFER_POOL_BINS; i++)
+        {
+            BufferBlock *item = pool->bins[i];
+            while (item != NULL)
+            {
+                BufferBlock *next = item->next;
+                pool->f(item->data, pool->d);
+                item = next;
+            } // while
+        } // for
+        pool->f(pool, pool->d);
+    } // if
+} // bufferpool_destroy
+
 Buffer *buffer_create(size_t blksz, MOJOSHADER_malloc m,
                       MOJOSHADER_free f, void *d)
 {
@@ -648,7 +812,12 @@ Buffer *buffer_create(size_t blksz, MOJOSHADER_malloc m,
     if (buffer != NULL)
     {
         memset(buffer, '\0', sizeof (Buffer));
+        if (blksz == 0)
+            blksz = 1;
         buffer->block_size = blksz;
+        buffer->max_block_size = blksz;
+        if (buffer->max_block_size < BUFFER_MAX_BLOCK_SIZE)
+            buffer->max_block_size = BUFFER_MAX_BLOCK_SIZE;
         buffer->m = m;
         buffer->f = f;
         buffer->d = d;
@@ -656,45 +825,88 @@ Buffer *buffer_create(size_t blksz, MOJOSHADER_malloc m,
     return buffer;
 } // buffer_create
 
-char *buffer_reserve(Buffer *buffer, const size_t len)
+Buffer *buffer_create_pooled(size_t blksz, BufferPool *pool)
+{
+    Buffer *buffer = buffer_create(blksz, pool->m, pool->f, pool->d);
+    if (buffer != NULL)
+        buffer->pool = pool;
+    return buffer;
+} // buffer_create_pooled
+
+static void buffer_release_block(Buffer *buffer, BufferBlock *item)
+{
+    if (buffer->pool != NULL)
+        bufferpool_put(buffer->pool, item);
+    else
+        buffer->f(item->data, buffer->d);
+} // buffer_release_block
+
+// Add a fresh, empty block to the end of the buffer with room for at
+//  least (len) bytes.
+static BufferBlock *buffer_grow(Buffer *buffer, const size_t len)
 {
     // note that we make the blocks bigger than blocksize when we have enough
     //  data to overfill a fresh block, to reduce allocations.
     const size_t blocksize = buffer->block_size;
+    const size_t capacity = len > blocksize ? len : blocksize;
+    BufferBlock *item = NULL;
+
+    if (buffer->pool != NULL)
+        item = bufferpool_get(buffer->pool, capacity);
+
+    if (item == NULL)
+    {
+        const size_t malloc_len = buffer_block_offset(capacity) + sizeof (BufferBlock);
+        uint8 *data = (uint8 *) buffer->m(malloc_len, buffer->d);
+        if (data == NULL)
+            return NULL;
+        item = buffer_block_header(data, capacity);
+        item->data = data;
+        item->capacity = capacity;
+    } // if
+
+    item->bytes = 0;
+    item->next = NULL;
+    if (buffer->tail != NULL)
+        buffer->tail->next = item;
+    else
+        buffer->head = item;
+    buffer->tail = item;
+
+    // a buffer that keeps needing blocks gets bigger ones.
+    if (blocksize < buffer->max_block_size)
+    {
+        const size_t grown = blocksize * 2;
+        buffer->block_size = (grown < buffer->max_block_size) ? grown : buffer->max_block_size;
+    } // if
+
+    return item;
+} // buffer_grow
 
+char *buffer_reserve(Buffer *buffer, const size_t len)
+{
     if (len == 0)
         return NULL;
 
     if (buffer->tail != NULL)
     {
         const size_t tailbytes = buffer->tail->bytes;
-        const size_t avail = (tailbytes >= blocksize) ? 0 : blocksize - tailbytes;
+        const size_t avail = buffer->tail->capacity - tailbytes;
         if (len <= avail)
         {
             buffer->tail->bytes += len;
             buffer->total_bytes += len;
-            assert(buffer->tail->bytes <= blocksize);
             return (char *) buffer->tail->data + tailbytes;
         } // if
     } // if
 
     // need to allocate a new block (even if a previous block wasn't filled,
     //  so this buffer is contiguous).
-    const size_t bytecount = len > blocksize ? len : blocksize;
-    const size_t malloc_len = sizeof (BufferBlock) + bytecount;
-    BufferBlock *item = (BufferBlock *) buffer->m(malloc_len, buffer->d);
+    BufferBlock *item = buffer_grow(buffer, len);
     if (item == NULL)
         return NULL;
 
-    item->data = ((uint8 *) item) + sizeof (BufferBlock);
     item->bytes = len;
-    item->next = NULL;
-    if (buffer->tail != NULL)
-        buffer->tail->next = item;
-    else
-        buffer->head = item;
-    buffer->tail = item;
-
     buffer->total_bytes += len;
 
     return (char *) item->data;
@@ -704,17 +916,13 @@ int buffer_append(Buffer *buffer, const void *_data, size_t len)
 {
     const uint8 *data = (const uint8 *) _data;
 
-    // note that we make the blocks bigger than blocksize when we have enough
-    //  data to overfill a fresh block, to reduce allocations.
-    const size_t blocksize = buffer->block_size;
-
     if (len == 0)
         return 1;
 
     if (buffer->tail != NULL)
     {
         const size_t tailbytes = buffer->tail->bytes;
-        const size_t avail = (tailbytes >= blocksize) ? 0 : blocksize - tailbytes;
+        const size_t avail = buffer->tail->capacity - tailbytes;
         const size_t cpy = (avail > len) ? len : avail;
         if (cpy > 0)
         {
@@ -723,29 +931,18 @@ int buffer_append(Buffer *buffer, const void *_data, size_t len)
             data += cpy;
             buffer->tail->bytes += cpy;
             buffer->total_bytes += cpy;
-            assert(buffer->tail->bytes <= blocksize);
         } // if
     } // if
 
     if (len > 0)
     {
-        assert((!buffer->tail) || (buffer->tail->bytes == blocksize));
-        const size_t bytecount = len > blocksize ? len : blocksize;
-        const size_t malloc_len = sizeof (BufferBlock) + bytecount;
-        BufferBlock *item = (BufferBlock *) buffer->m(malloc_len, buffer->d);
+        assert((!buffer->tail) || (buffer->tail->bytes == buffer->tail->capacity));
+        BufferBlock *item = buffer_grow(buffer, len);
         if (item == NULL)
             return 0;
 
-        item->data = ((uint8 *) item) + sizeof (BufferBlock);
-        item->bytes = len;
-        item->next = NULL;
-        if (buffer->tail != NULL)
-            buffer->tail->next = item;
-        else
-            buffer->head = item;
-        buffer->tail = item;
-
         memcpy(item->data, data, len);
+        item->bytes = len;
         buffer->total_bytes += len;
     } // if
 
@@ -783,7 +980,7 @@ int buffer_append_va(Buffer *buffer, const char *fmt, va_list va)
     va_copy(ap, va);
     vsnprintf(buf, len + 1, fmt, ap);  // rebuild it.
     va_end(ap);
-    const int retval = buffer_append(buffer, scratch, len);
+    const int retval = buffer_append(buffer, buf, len);
     buffer->f(buf, buffer->d);
     return retval;
 } // buffer_append_va
@@ -799,15 +996,44 @@ void buffer_empty(Buffer *buffer)
     while (item != NULL)
     {
         BufferBlock *next = item->next;
-        buffer->f(item, buffer->d);
+        buffer_release_block(buffer, item);
         item = next;
     } // while
     buffer->head = buffer->tail = NULL;
     buffer->total_bytes = 0;
 } // buffer_empty
 
+// Is everything in one block that isn't much bigger than its data? A
+//  block with lots of slack gets copied instead, so the caller doesn't hold
+//  on to all that memory, and a pooled block goes back to the pool.
+static int buffer_can_steal_block(const Buffer *buffer)
+{
+    const BufferBlock *item = buffer->head;
+    size_t slack;
+    if ((item == NULL) || (item != buffer->tail))
+        return 0;
+    slack = item->capacity - item->bytes;
+    return ((slack <= BUFFER_MAX_STEAL_SLACK) || (slack <= item->bytes));
+} // buffer_can_steal_block
+
+// If everything is in one block, hand that block's allocation to the caller
+//  instead of copying it. The header at the end just goes along for the ride.
+static char *buffer_steal_block(Buffer *buffer)
+{
+    BufferBlock *item = buffer->head;
+    char *retval = (char *) item->data;
+    assert(item == buffer->tail);
+    retval[item->bytes] = '\0';
+    buffer->head = buffer->tail = NULL;
+    buffer->total_bytes = 0;
+    return retval;
+} // buffer_steal_block
+
 char *buffer_flatten(Buffer *buffer)
 {
+    if (buffer_can_steal_block(buffer))
+        return buffer_steal_block(buffer);
+
     char *retval = (char *) buffer->m(buffer->total_bytes + 1, buffer->d);
     if (retval == NULL)
         return NULL;
@@ -818,7 +1044,7 @@ char *buffer_flatten(Buffer *buffer)
         BufferBlock *next = item->next;
         memcpy(ptr, item->data, item->bytes);
         ptr += item->bytes;
-        buffer->f(item, buffer->d);
+        buffer_release_block(buffer, item);
         item = next;
     } // while
     *ptr = '\0';
@@ -834,6 +1060,8 @@ char *buffer_flatten(Buffer *buffer)
 char *buffer_merge(Buffer **buffers, const size_t n, size_t *_len)
 {
     Buffer *first = NULL;
+    Buffer *only = NULL;
+    size_t blocks = 0;
     size_t len = 0;
     size_t i;
     for (i = 0; i < n; i++)
@@ -843,9 +1071,21 @@ char *buffer_merge(Buffer **buffers, const size_t n, size_t *_len)
             continue;
         if (first == NULL)
             first = buffer;
+        if (buffer->head != NULL)
+        {
+            only = buffer;
+            blocks += (buffer->head == buffer->tail) ? 1 : 2;
+        } // if
         len += buffer->total_bytes;
     } // for
 
+    // all the data is in one block? Skip the copy.
+    if ((blocks == 1) && (buffer_can_steal_block(only)))
+    {
+        *_len = len;
+        return buffer_steal_block(only);
+    } // if
+
     char *retval = (char *) (first ? first->m(len + 1, first->d) : NULL);
     if (retval == NULL)
     {
@@ -866,7 +1106,7 @@ char *buffer_merge(Buffer **buffers, const size_t n, size_t *_len)
             BufferBlock *next = item->next;
             memcpy(ptr, item->data, item->bytes);
             ptr += item->bytes;
-            buffer->f(item, buffer->d);
+            buffer_release_block(buffer, item);
             item = next;
         } // while
 
@@ -985,5 +1225,440 @@ ssize_t buffer_find(Buffer *buffer, const size_t start,
     return -1;  // no match found.
 } // buffer_find
 
+
+// Numeric literals...
+
+// These convert token text straight out of the source buffer (which isn't
+//  null-terminated at the end of the token) without copying it first.
+//  Integers are decimal, or hex with a "0x" prefix; anything that doesn't
+//  look like a digit ends the number, so type suffixes are ignored.
+
+static inline int literal_hexdigit(const char ch)
+{
+    if ((ch >= '0') && (ch <= '9'))
+        return ch - '0';
+    else if ((ch >= 'a') && (ch <= 'f'))
+        return (ch - 'a') + 10;
+    else if ((ch >= 'A') && (ch <= 'F'))
+        return (ch - 'A') + 10;
+    return -1;
+} // literal_hexdigit
+
+// Returns the number of chars consumed, zero if there were no digits.
+//  Values that don't fit wrap around, like the old hand-rolled parsers did.
+static unsigned int literal_uint64(const char *str, const unsigned int len,
+                                   uint64 *_val)
+{
+    uint64 val = 0;
+    unsigned int i = 0;
+
+    if ((len > 2) && (str[0] == '0') && ((str[1] == 'x') || (str[1] == 'X'))
+        && (literal_hexdigit(str[2]) >= 0))
+    {
+        int digit;
+        for (i = 2; (i < len) && ((digit = literal_hexdigit(str[i])) >= 0); i++)
+            val = (val << 4) | ((uint64) digit);
+    } // if
+    else
+    {
+        for (i = 0; (i < len) && (str[i] >= '0') && (str[i] <= '9'); i++)
+            val = (val * 10) + ((uint64) (str[i] - '0'));
+    } // else
+
+    *_val = val;
+    return i;
+} // literal_uint64
+
+int64 literal_int64(const char *str, unsigned int len)
+{
+    int negative = 0;
+    uint64 val = 0;
+
+    while ((len) && (*str == ' '))
+    {
+        str++;
+        len--;
+    } // while
+
+    if ((len) && (*str == '-'))
+    {
+        negative = 1;
+        str++;
+        len--;
+    } // if
+
+    literal_uint64(str, len, &val);
+    return (int64) (negative ? (0 - val) : val);
+} // literal_int64
+
+
+// Floats are split into a decimal mantissa and a power of ten first. When
+//  the mantissa and the power of ten are both exactly representable, one
+//  IEEE multiply or divide gives the correctly rounded result (Clinger's
+//  fast path), and that covers nearly every literal in real shaders. The
+//  rest (lots of significant digits, huge exponents) go to the C runtime.
+//  This only holds if the FPU evaluates at the type's own precision, so
+//  x87 builds always take the slow path.
+
+#define LITERAL_MAX_DIGITS 19  // most decimal digits a uint64 always holds.
+
+typedef struct DecimalLiteral
+{
+    uint64 mantissa;
+    int exponent;
+    int truncated;  // non-zero if digits didn't fit in (mantissa).
+    unsigned int len;  // chars consumed.
+} DecimalLiteral;
+
+static void literal_decimal(const char *str, const unsigned int len,
+                            DecimalLiteral *lit)
+{
+    unsigned int i = 0;
+    int digits = 0;
+
+    lit->mantissa = 0;
+    lit->exponent = 0;
+    lit->truncated = 0;
+
+    for (; (i < len) && (str[i] >= '0') && (str[i] <= '9'); i++)
+    {
+        if (digits < LITERAL_MAX_DIGITS)
+        {
+            lit->mantissa = (lit->mantissa * 10) + (str[i] - '0');
+            if (lit->mantissa)
+                digits++;
+        } // if
+        else
+        {
+            lit->exponent++;
+            if (str[i] != '0')
+                lit->truncated = 1;
+        } // else
+    } // for
+
+    if ((i < len) && (str[i] == '.'))
+    {
+        for (i++; (i < len) && (str[i] >= '0') && (str[i] <= '9'); i++)
+        {
+            if (digits < LITERAL_MAX_DIGITS)
+            {
+                lit->mantissa = (lit->mantissa * 10) + (str[i] - '0');
+                lit->exponent--;
+                if (lit->mantissa)
+                    digits++;
+            } // if
+            else if (str[i] != '0')
+            {
+                lit->truncated = 1;
+            } // else if
+        } // for
+    } // if
+
+    if ((i < len) && ((str[i] == 'e') || (str[i] == 'E')))
+    {
+        unsigned int j = i + 1;
+        int negexp = 0;
+        int exp = 0;
+
+        if ((j < len) && ((str[j] == '+') || (str[j] == '-')))
+            negexp = (str[j++] == '-');
+
+        if ((j < len) && (str[j] >= '0') && (str[j] <= '9'))
+        {
+            for (; (j < len) && (str[j] >= '0') && (str[j] <= '9'); j++)
+            {
+                if (exp < 100000)  // way past overflow/underflow already.
+                    exp = (exp * 10) + (str[j] - '0');
+            } // for
+            lit->exponent += negexp ? -exp : exp;
+            i = j;
+        } // if
+    } // if
+
+    lit->len = i;
+} // literal_decimal
+
+// Fallback for the cases the fast paths can't do exactly. Floats go through
+//  strtof() so they aren't rounded twice; the double holds them exactly.
+static double literal_strtod(const char *str, const DecimalLiteral *lit,
+                             const int isfloat)
+{
+    char buf[64];
+    char *ptr = buf;
+    if (lit->len >= sizeof (buf))
+        ptr = (char *) alloca(lit->len + 1);
+    memcpy(ptr, str, lit->len);
+    ptr[lit->len] = '\0';
+    return isfloat ? (double) strtof(ptr, NULL) : strtod(ptr, NULL);
+} // literal_strtod
+
+double literal_double(const char *str, const unsigned int len)
+{
+    DecimalLiteral lit;
+
+    literal_decimal(str, len, &lit);
+    if (lit.mantissa == 0)
+        return 0.0;
+
+#if defined(FLT_EVAL_METHOD) && (FLT_EVAL_METHOD == 0)
+    if ((!lit.truncated) && (lit.mantissa <= (((uint64) 1) << 53)))
+    {
+        static const double powers[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        const int maxpower = STATICARRAYLEN(powers) - 1;
+
+        double val = (double) lit.mantissa;
+        int exponent = lit.exponent;
+
+        // "12e25" is still exact as 12000000e19, etc.
+        while ((exponent > maxpower) && ((val * 10.0) <= 9007199254740992.0))
+        {
+            val *= 10.0;
+            exponent--;
+        } // while
+
+        if ((exponent >= 0) && (exponent <= maxpower))
+            return val * powers[exponent];
+        else if ((exponent < 0) && (exponent >= -maxpower))
+            return val / powers[-exponent];
+    } // if
+#endif
+
+    return literal_strtod(str, &lit, 0);
+} // literal_double
+
+float literal_float(const char *str, const unsigned int len)
+{
+    DecimalLiteral lit;
+
+    literal_decimal(str, len, &lit);
+    if (lit.mantissa == 0)
+        return 0.0f;
+
+#if defined(FLT_EVAL_METHOD) && (FLT_EVAL_METHOD == 0)
+    if ((!lit.truncated) && (lit.mantissa <= (((uint64) 1) << 24)))
+    {
+        static const float powers[] = {
+            1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+        };
+        const int maxpower = STATICARRAYLEN(powers) - 1;
+
+        const float val = (float) lit.mantissa;
+        if ((lit.exponent >= 0) && (lit.exponent <= maxpower))
+            return val * powers[lit.exponent];
+        else if ((lit.exponent < 0) && (lit.exponent >= -maxpower))
+            return val / powers[-lit.exponent];
+    } // if
+#endif
+
+    return (float) literal_strtod(str, &lit, 1);
+} // literal_float
+
+
+// Allocation tracing...
+
+// This sits in front of every traced allocation. It's a union so the
+//  pointer we hand back keeps the alignment malloc() would have given us.
+typedef union AllocHeader
+{
+    struct
+    {
+        uint32 len;
+        uint32 phase;
+        uint64 birth;
+    } info;
+    double alignment_double;
+    void *alignment_ptr;
+    uint64 alignment_pad[2];
+} AllocHeader;
+
+struct MOJOSHADER_allocTracer
+{
+    MOJOSHADER_malloc m;
+    MOJOSHADER_free f;
+    void *d;
+    MOJOSHADER_allocPhase phase;
+    uint64 ticks;
+    MOJOSHADER_allocStats stats[MOJOSHADER_ALLOCPHASE_TOTAL + 1];
+};
+
+static inline int histogram_bucket(uint64 val)
+{
+    int retval = 0;
+    while ((val != 0) && (retval < (MOJOSHADER_ALLOC_HISTOGRAM_BUCKETS-1)))
+    {
+        val >>= 1;
+        retval++;
+    } // while
+    return retval;
+} // histogram_bucket
+
+static void *trace_malloc(int bytes, void *d)
+{
+    MOJOSHADER_allocTracer *tracer = (MOJOSHADER_allocTracer *) d;
+    MOJOSHADER_allocStats *phase = &tracer->stats[tracer->phase];
+    MOJOSHADER_allocStats *total = &tracer->stats[MOJOSHADER_ALLOCPHASE_TOTAL];
+    const int bucket = histogram_bucket((uint64) bytes);
+    AllocHeader *hdr;
+
+    hdr = (AllocHeader *) tracer->m(bytes + sizeof (AllocHeader), tracer->d);
+    if (hdr == NULL)
+    {
+        phase->failures++;
+        total->failures++;
+        return NULL;
+    } // if
+
+    hdr->info.len = (uint32) bytes;
+    hdr->info.phase = (uint32) tracer->phase;
+    hdr->info.birth = tracer->ticks++;
+
+    #define TRACE_ALLOC(st) \
+        st->allocations++; \
+        st->bytes += bytes; \
+        st->live_allocations++; \
+        st->live_bytes += bytes; \
+        if (st->live_bytes > st->peak_bytes) \
+            st->peak_bytes = st->live_bytes; \
+        st->sizes[bucket]++;
+    TRACE_ALLOC(phase);
+    TRACE_ALLOC(total);
+    #undef TRACE_ALLOC
+
+    return hdr + 1;
+} // trace_malloc
+
+static void trace_free(void *ptr, void *d)
+{
+    MOJOSHADER_allocTracer *tracer = (MOJOSHADER_allocTracer *) d;
+    MOJOSHADER_allocStats *total = &tracer->stats[MOJOSHADER_ALLOCPHASE_TOTAL];
+    MOJOSHADER_allocStats *phase;
+    AllocHeader *hdr;
+    int bucket;
+
+    if (ptr == NULL)
+        return;  // free(NULL) is legal, and we do it a lot.
+
+    // frees count against the phase that allocated the block, not the
+    //  current one, so live/peak numbers per phase make sense.
+    hdr = ((AllocHeader *) ptr) - 1;
+    phase = &tracer->stats[hdr->info.phase];
+    bucket = histogram_bucket((tracer->ticks - 1) - hdr->info.birth);
+
+    #define TRACE_FREE(st) \
+        st->frees++; \
+        st->live_allocations--; \
+        st->live_bytes -= hdr->info.len; \
+        st->lifetimes[bucket]++;
+    TRACE_FREE(phase);
+    TRACE_FREE(total);
+    #undef TRACE_FREE
+
+    tracer->f(hdr, tracer->d);
+} // trace_free
+
+MOJOSHADER_allocPhase alloc_phase(MOJOSHADER_malloc m, void *d,
+                                  const MOJOSHADER_allocPhase phase)
+{
+    MOJOSHADER_allocTracer *tracer = (MOJOSHADER_allocTracer *) d;
+    MOJOSHADER_allocPhase retval;
+    if (m != trace_malloc)
+        return MOJOSHADER_ALLOCPHASE_OTHER;  // not tracing, don't care.
+    retval = tracer->phase;
+    tracer->phase = phase;
+    return retval;
+} // alloc_phase
+
+DLLEXPORT
+MOJOSHADER_allocTracer *MOJOSHADER_createAllocTracer(MOJOSHADER_malloc m,
+                                                     MOJOSHADER_free f,
+                                                     void *d)
+{
+    MOJOSHADER_allocTracer *retval = NULL;
+    if ( ((m == NULL) && (f != NULL)) || ((m != NULL) && (f == NULL)) )
+        return NULL;  // supply both or neither.
+    if (m == NULL) m = MOJOSHADER_internal_malloc;
+    if (f == NULL) f = MOJOSHADER_internal_free;
+    if ((m == NULL) || (f == NULL))
+        return NULL;  // MOJOSHADER_FORCE_ALLOCATOR and no allocator given.
+
+    retval = (MOJOSHADER_allocTracer *) m(sizeof (MOJOSHADER_allocTracer), d);
+    if (retval == NULL)
+        return NULL;
+
+    memset(retval, '\0', sizeof (MOJOSHADER_allocTracer));
+    retval->m = m;
+    retval->f = f;
+    retval->d = d;
+    retval->phase = MOJOSHADER_ALLOCPHASE_OTHER;
+    return retval;
+} // MOJOSHADER_createAllocTracer
+
+DLLEXPORT
+void MOJOSHADER_getAllocTracerCallbacks(MOJOSHADER_allocTracer *tracer,
+                                        MOJOSHADER_malloc *m,
+                                        MOJOSHADER_free *f, void **d)
+{
+    *m = trace_malloc;
+    *f = trace_free;
+    *d = tracer;
+} // MOJOSHADER_getAllocTracerCallbacks
+
+DLLEXPORT
+const MOJOSHADER_allocStats *MOJOSHADER_getAllocStats(
+                                        const MOJOSHADER_allocTracer *tracer,
+                                        MOJOSHADER_allocPhase phase)
+{
+    if (((int) phase < 0) || (phase > MOJOSHADER_ALLOCPHASE_TOTAL))
+        return NULL;
+    return &tracer->stats[phase];
+} // MOJOSHADER_getAllocStats
+
+DLLEXPORT
+const char *MOJOSHADER_allocPhaseName(MOJOSHADER_allocPhase phase)
+{
+    switch (phase)
+    {
+        case MOJOSHADER_ALLOCPHASE_OTHER: return "other";
+        case MOJOSHADER_ALLOCPHASE_PREPROCESSOR: return "preprocessor";
+        case MOJOSHADER_ALLOCPHASE_LEXER: return "lexer";
+        case MOJOSHADER_ALLOCPHASE_AST: return "ast";
+        case MOJOSHADER_ALLOCPHASE_IR: return "ir";
+        case MOJOSHADER_ALLOCPHASE_CONTEXT: return "context";
+        case MOJOSHADER_ALLOCPHASE_EMITTER: return "emitter";
+        case MOJOSHADER_ALLOCPHASE_PARSEDATA: return "parsedata";
+        case MOJOSHADER_ALLOCPHASE_TOTAL: return "total";
+    } // switch
+
+    return "???";
+} // MOJOSHADER_allocPhaseName
+
+DLLEXPORT
+void MOJOSHADER_resetAllocTracer(MOJOSHADER_allocTracer *tracer)
+{
+    int i;
+    for (i = 0; i <= MOJOSHADER_ALLOCPHASE_TOTAL; i++)
+    {
+        MOJOSHADER_allocStats *st = &tracer->stats[i];
+        const unsigned int live_allocations = st->live_allocations;
+        const unsigned long long live_bytes = st->live_bytes;
+        memset(st, '\0', sizeof (*st));
+        st->live_allocations = live_allocations;
+        st->live_bytes = st->peak_bytes = live_bytes;
+    } // for
+} // MOJOSHADER_resetAllocTracer
+
+DLLEXPORT
+void MOJOSHADER_destroyAllocTracer(MOJOSHADER_allocTracer *tracer)
+{
+    if (tracer != NULL)
+    {
+        assert(tracer->stats[MOJOSHADER_ALLOCPHASE_TOTAL].live_allocations == 0);
+        tracer->f(tracer, tracer->d);
+    } // if
+} // MOJOSHADER_destroyAllocTracer
+
 // end of mojoshader_common.c ...
 
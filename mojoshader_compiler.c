@@ -14,6 +14,9 @@
 #define __MOJOSHADER_INTERNAL__ 1
 #include "mojoshader_internal.h"
 
+#include <math.h>
+#include <float.h>
+
 #if DEBUG_COMPILER_PARSER
 #define LEMON_SUPPORT_TRACING 1
 #endif
@@ -52,6 +55,15 @@ static inline int operator_is_ternary(const MOJOSHADER_astNodeType op)
              (op < MOJOSHADER_AST_OP_END_RANGE_TERNARY) );
 } // operator_is_ternary
 
+// The left-associative binary operators: everything but assignments and
+//  array dereferences. "a + b + c" parses as "(a + b) + c", so a long run of
+//  these builds a tree as deep as the expression is long.
+static inline int operator_is_left_chain(const MOJOSHADER_astNodeType op)
+{
+    return ( (op > MOJOSHADER_AST_OP_START_RANGE_BINARY) &&
+             (op < MOJOSHADER_AST_OP_ASSIGN) );
+} // operator_is_left_chain
+
 
 typedef union TokenData
 {
@@ -86,6 +98,12 @@ typedef struct LoopLabels
     struct LoopLabels *prev;
 } LoopLabels;
 
+typedef struct WalkItem
+{
+    void *node;
+    unsigned int depth;
+} WalkItem;
+
 // Compile state, passed around all over the place.
 
 typedef struct Context
@@ -103,6 +121,7 @@ typedef struct Context
     SymbolMap usertypes;
     SymbolMap variables;
     MOJOSHADER_astNode *ast;  // Abstract Syntax Tree
+    uint8 *reachable_units;  // per compunit, in order. NULL if all are used.
     const char *source_profile;
     int is_func_scope; // non-zero if semantic analysis is in function scope.
     int loop_count;
@@ -119,6 +138,11 @@ typedef struct Context
     int ir_ret; // temp that holds current function's retval during IR build.
     LoopLabels *ir_loop;  // nested loop boundary labels during IR build.
 
+    WalkItem *walk;  // explicit stack for trees too deep to recurse down.
+    size_t walk_count;
+    size_t walk_space;
+    int expr_depth;  // how many expressions we've recursed into right now.
+
     // Cache intrinsic types for fast lookup and consistent pointer values.
     MOJOSHADER_astDataType dt_none;
     MOJOSHADER_astDataType dt_bool;
@@ -145,7 +169,7 @@ typedef struct Context
     MOJOSHADER_astDataType dt_buf_float_snorm;
     MOJOSHADER_astDataType dt_buf_float_unorm;
 
-    Buffer *garbage;  // this is sort of hacky.
+    Buffer *arena;  // AST nodes and datatypes live here until we're done.
 } Context;
 
 
@@ -181,6 +205,73 @@ static inline void Free(Context *ctx, void *ptr)
     ctx->free(ptr, ctx->malloc_data);
 } // Free
 
+// Expressions can be as deep as they are long, so anything that walks
+//  them keeps its own stack here instead of recursing, or it could run out
+//  of C stack (and some apps compile on small fiber stacks). Walkers share
+//  this, each popping only what it pushed. Returns zero if out of memory.
+static int walk_push(Context *ctx, void *node, const unsigned int depth)
+{
+    if (ctx->walk_count == ctx->walk_space)
+    {
+        const size_t space = ctx->walk_space ? ctx->walk_space * 2 : 64;
+        WalkItem *ptr = (WalkItem *) Malloc(ctx, sizeof (WalkItem) * space);
+        if (ptr == NULL)
+            return 0;
+        else if (ctx->walk != NULL)
+        {
+            memcpy(ptr, ctx->walk, sizeof (WalkItem) * ctx->walk_count);
+            Free(ctx, ctx->walk);
+        } // else if
+        ctx->walk = ptr;
+        ctx->walk_space = space;
+    } // if
+
+    ctx->walk[ctx->walk_count].node = node;
+    ctx->walk[ctx->walk_count].depth = depth;
+    ctx->walk_count++;
+    return 1;
+} // walk_push
+
+static inline void *walk_pop(Context *ctx)
+{
+    assert(ctx->walk_count > 0);
+    return ctx->walk[--ctx->walk_count].node;
+} // walk_pop
+
+// Push a node's children, last to first, so they pop off in order. NULL
+//  children are skipped. If we run out of memory partway, this returns how
+//  many of the leading children didn't make it, for the caller to handle
+//  some other way; otherwise it returns zero.
+static int walk_push_children(Context *ctx, void **kids,
+                              const unsigned int depth)
+{
+    int i;
+    for (i = 1; i >= 0; i--)
+    {
+        if ((kids[i] != NULL) && (!walk_push(ctx, kids[i], depth)))
+            return i + 1;
+    } // for
+    return 0;
+} // walk_push_children
+
+// Push the left-associative chain starting at (ast) onto the walk stack,
+//  and return its deepest link, whose left operand isn't part of the chain.
+//  Walkers handle that link first, then pop the rest, innermost first, so
+//  each one's left operand is done before they get to it.
+static MOJOSHADER_astExpressionBinary *push_left_chain(Context *ctx,
+                                        MOJOSHADER_astExpressionBinary *ast)
+{
+    assert(operator_is_left_chain(ast->ast.type));
+    while ( (ast->left != NULL) &&
+            (operator_is_left_chain(ast->left->ast.type)) )
+    {
+        if (!walk_push(ctx, ast, 0))
+            break;  // out of memory; the walkers give up when they see it.
+        ast = (MOJOSHADER_astExpressionBinary *) ast->left;
+    } // while
+    return ast;
+} // push_left_chain
+
 static void *MallocBridge(int bytes, void *data)
 {
     return Malloc((Context *) data, (size_t) bytes);
@@ -191,6 +282,37 @@ static void FreeBridge(void *ptr, void *data)
     Free((Context *) data, ptr);
 } // FreeBridge
 
+// Everything in the AST, and the datatypes it points to, comes out of one
+//  arena, so building the tree is a handful of block allocations and
+//  tearing it down is freeing those blocks. Nothing in the arena is ever
+//  freed on its own.
+static void *ArenaMalloc(Context *ctx, size_t len)
+{
+    const size_t align = sizeof (double) > sizeof (void *) ? sizeof (double) : sizeof (void *);
+    void *retval;
+    len = (len + (align - 1)) & ~(align - 1);
+    retval = buffer_reserve(ctx->arena, len ? len : align);
+    if (retval == NULL)
+        out_of_memory(ctx);
+    return retval;
+} // ArenaMalloc
+
+static void *ArenaBridge(int bytes, void *data)
+{
+    return ArenaMalloc((Context *) data, (size_t) bytes);
+} // ArenaBridge
+
+static void ArenaFreeBridge(void *ptr, void *data)
+{
+    // no-op: arena memory goes away with the arena.
+} // ArenaFreeBridge
+
+static inline MOJOSHADER_allocPhase set_alloc_phase(Context *ctx,
+                                            const MOJOSHADER_allocPhase phase)
+{
+    return alloc_phase(ctx->malloc, ctx->malloc_data, phase);
+} // set_alloc_phase
+
 static void failf(Context *ctx, const char *fmt, ...) ISPRINTF(2,3);
 static void failf(Context *ctx, const char *fmt, ...)
 {
@@ -375,16 +497,9 @@ static void push_usertype(Context *ctx, const char *sym, const MOJOSHADER_astDat
     if (sym != NULL)
     {
         MOJOSHADER_astDataType *userdt;
-        userdt = (MOJOSHADER_astDataType *) Malloc(ctx, sizeof (*userdt));
+        userdt = (MOJOSHADER_astDataType *) ArenaMalloc(ctx, sizeof (*userdt));
         if (userdt != NULL)
         {
-            // !!! FIXME: this is hacky.
-            if (!buffer_append(ctx->garbage, &userdt, sizeof (userdt)))
-            {
-                Free(ctx, userdt);
-                return;
-            } // if
-
             userdt->type = MOJOSHADER_AST_DATATYPE_USER;
             userdt->user.details = dt;
             userdt->user.name = sym;
@@ -533,17 +648,10 @@ static const MOJOSHADER_astDataType *new_datatype_vector(Context *ctx,
                                             const int columns)
 {
     MOJOSHADER_astDataType *retval;
-    retval = (MOJOSHADER_astDataType *) Malloc(ctx, sizeof (*retval));
-    if (retval == NULL)
-        return NULL;
-
-    // !!! FIXME: this is hacky.
     // !!! FIXME:  I'd like to cache these anyhow and reuse types.
-    if (!buffer_append(ctx->garbage, &retval, sizeof (retval)))
-    {
-        Free(ctx, retval);
+    retval = (MOJOSHADER_astDataType *) ArenaMalloc(ctx, sizeof (*retval));
+    if (retval == NULL)
         return NULL;
-    } // if
 
     if ((columns < 1) || (columns > 4))
         fail(ctx, "Vector must have between 1 and 4 elements");
@@ -560,17 +668,10 @@ static const MOJOSHADER_astDataType *new_datatype_matrix(Context *ctx,
 {
     MOJOSHADER_astDataType *retval;
     // !!! FIXME: allocate enough for a matrix, but we need to cleanup things that copy without checking for subsize.
-    retval = (MOJOSHADER_astDataType *) Malloc(ctx, sizeof (*retval));
-    if (retval == NULL)
-        return NULL;
-
-    // !!! FIXME: this is hacky.
     // !!! FIXME:  I'd like to cache these anyhow and reuse types.
-    if (!buffer_append(ctx->garbage, &retval, sizeof (retval)))
-    {
-        Free(ctx, retval);
+    retval = (MOJOSHADER_astDataType *) ArenaMalloc(ctx, sizeof (*retval));
+    if (retval == NULL)
         return NULL;
-    } // if
 
     if ((rows < 1) || (rows > 4))
         fail(ctx, "Matrix must have between 1 and 4 rows");
@@ -594,7 +695,7 @@ static const MOJOSHADER_astDataType *new_datatype_matrix(Context *ctx,
 //  afterwards.
 
 #define NEW_AST_NODE(retval, cls, typ) \
-    cls *retval = (cls *) Malloc(ctx, sizeof (cls)); \
+    cls *retval = (cls *) ArenaMalloc(ctx, sizeof (cls)); \
     do { \
         if (retval == NULL) { return NULL; } \
         retval->ast.type = typ; \
@@ -602,13 +703,6 @@ static const MOJOSHADER_astDataType *new_datatype_matrix(Context *ctx,
         retval->ast.line = ctx->sourceline; \
     } while (0)
 
-#define DELETE_AST_NODE(cls) do { \
-    if (!cls) return; \
-} while (0)
-
-
-static void delete_compilation_unit(Context*, MOJOSHADER_astCompilationUnit*);
-static void delete_statement(Context *ctx, MOJOSHADER_astStatement *stmt);
 
 static MOJOSHADER_astExpression *new_identifier_expr(Context *ctx,
                                                      const char *string)
@@ -749,49 +843,6 @@ static MOJOSHADER_astExpression *new_literal_boolean_expr(Context *ctx,
     return (MOJOSHADER_astExpression *) retval;
 } // new_literal_boolean_expr
 
-static void delete_arguments(Context *ctx, MOJOSHADER_astArguments *args);
-
-static void delete_expr(Context *ctx, MOJOSHADER_astExpression *_expr)
-{
-    MOJOSHADER_astNode *expr = (MOJOSHADER_astNode *) _expr;
-
-    DELETE_AST_NODE(expr);
-
-    if (expr->ast.type == MOJOSHADER_AST_OP_CAST)
-        delete_expr(ctx, expr->cast.operand);
-
-    else if (expr->ast.type == MOJOSHADER_AST_OP_CONSTRUCTOR)
-        delete_arguments(ctx, expr->constructor.args);
-
-    else if (expr->ast.type == MOJOSHADER_AST_OP_DEREF_STRUCT)
-        delete_expr(ctx, expr->derefstruct.identifier);
-
-    else if (operator_is_unary(expr->ast.type))
-        delete_expr(ctx, expr->unary.operand);
-
-    else if (operator_is_binary(expr->ast.type))
-    {
-        delete_expr(ctx, expr->binary.left);
-        delete_expr(ctx, expr->binary.right);
-    } // else if
-
-    else if (operator_is_ternary(expr->ast.type))
-    {
-        delete_expr(ctx, expr->ternary.left);
-        delete_expr(ctx, expr->ternary.center);
-        delete_expr(ctx, expr->ternary.right);
-    } // else if
-
-    else if (expr->ast.type == MOJOSHADER_AST_OP_CALLFUNC)
-    {
-        delete_expr(ctx, (MOJOSHADER_astExpression*)expr->callfunc.identifier);
-        delete_arguments(ctx, expr->callfunc.args);
-    } // else if
-
-    // rest of operators don't have extra data to free.
-
-    Free(ctx, expr);
-} // delete_expr
 
 static MOJOSHADER_astArguments *new_argument(Context *ctx,
                                              MOJOSHADER_astExpression *arg)
@@ -802,14 +853,6 @@ static MOJOSHADER_astArguments *new_argument(Context *ctx,
     return retval;
 } // new_argument
 
-static void delete_arguments(Context *ctx, MOJOSHADER_astArguments *args)
-{
-    DELETE_AST_NODE(args);
-    delete_arguments(ctx, args->next);
-    delete_expr(ctx, args->argument);
-    Free(ctx, args);
-} // delete_arguments
-
 static MOJOSHADER_astFunctionParameters *new_function_param(Context *ctx,
                         const MOJOSHADER_astInputModifier inputmod,
                         const MOJOSHADER_astDataType *dt,
@@ -829,15 +872,6 @@ static MOJOSHADER_astFunctionParameters *new_function_param(Context *ctx,
     return retval;
 } // new_function_param
 
-static void delete_function_params(Context *ctx,
-                                   MOJOSHADER_astFunctionParameters *params)
-{
-    DELETE_AST_NODE(params);
-    delete_function_params(ctx, params->next);
-    delete_expr(ctx, params->initializer);
-    Free(ctx, params);
-} // delete_function_params
-
 static MOJOSHADER_astFunctionSignature *new_function_signature(Context *ctx,
                                     const MOJOSHADER_astDataType *dt,
                                     const char *identifier,
@@ -853,14 +887,6 @@ static MOJOSHADER_astFunctionSignature *new_function_signature(Context *ctx,
     return retval;
 } // new_function_signature
 
-static void delete_function_signature(Context *ctx,
-                                      MOJOSHADER_astFunctionSignature *sig)
-{
-    DELETE_AST_NODE(sig);
-    delete_function_params(ctx, sig->params);
-    Free(ctx, sig);
-} // delete_function_signature
-
 static MOJOSHADER_astCompilationUnit *new_function(Context *ctx,
                                 MOJOSHADER_astFunctionSignature *declaration,
                                 MOJOSHADER_astStatement *definition)
@@ -874,16 +900,6 @@ static MOJOSHADER_astCompilationUnit *new_function(Context *ctx,
     return (MOJOSHADER_astCompilationUnit *) retval;
 } // new_function
 
-static void delete_function(Context *ctx,
-                            MOJOSHADER_astCompilationUnitFunction *unitfn)
-{
-    DELETE_AST_NODE(unitfn);
-    delete_compilation_unit(ctx, unitfn->next);
-    delete_function_signature(ctx, unitfn->declaration);
-    delete_statement(ctx, unitfn->definition);
-    Free(ctx, unitfn);
-} // delete_function
-
 static MOJOSHADER_astScalarOrArray *new_scalar_or_array(Context *ctx,
                                           const char *ident, const int isvec,
                                           MOJOSHADER_astExpression *dim)
@@ -896,13 +912,6 @@ static MOJOSHADER_astScalarOrArray *new_scalar_or_array(Context *ctx,
     return retval;
 } // new_scalar_or_array
 
-static void delete_scalar_or_array(Context *ctx,MOJOSHADER_astScalarOrArray *s)
-{
-    DELETE_AST_NODE(s);
-    delete_expr(ctx, s->dimension);
-    Free(ctx, s);
-} // delete_scalar_or_array
-
 static MOJOSHADER_astTypedef *new_typedef(Context *ctx, const int isconst,
                                           const MOJOSHADER_astDataType *dt,
                                           MOJOSHADER_astScalarOrArray *soa)
@@ -915,13 +924,6 @@ static MOJOSHADER_astTypedef *new_typedef(Context *ctx, const int isconst,
     return retval;
 } // new_typedef
 
-static void delete_typedef(Context *ctx, MOJOSHADER_astTypedef *td)
-{
-    DELETE_AST_NODE(td);
-    delete_scalar_or_array(ctx, td->details);
-    Free(ctx, td);
-} // delete_typedef
-
 static MOJOSHADER_astPackOffset *new_pack_offset(Context *ctx,
                                                  const char *a, const char *b)
 {
@@ -931,12 +933,6 @@ static MOJOSHADER_astPackOffset *new_pack_offset(Context *ctx,
     return retval;
 } // new_pack_offset
 
-static void delete_pack_offset(Context *ctx, MOJOSHADER_astPackOffset *o)
-{
-    DELETE_AST_NODE(o);
-    Free(ctx, o);
-} // delete_pack_offset
-
 static MOJOSHADER_astVariableLowLevel *new_variable_lowlevel(Context *ctx,
                                                MOJOSHADER_astPackOffset *po,
                                                const char *reg)
@@ -948,14 +944,6 @@ static MOJOSHADER_astVariableLowLevel *new_variable_lowlevel(Context *ctx,
     return retval;
 } // new_variable_lowlevel
 
-static void delete_variable_lowlevel(Context *ctx,
-                                     MOJOSHADER_astVariableLowLevel *vll)
-{
-    DELETE_AST_NODE(vll);
-    delete_pack_offset(ctx, vll->packoffset);
-    Free(ctx, vll);
-} // delete_variable_lowlevel
-
 static MOJOSHADER_astAnnotations *new_annotation(Context *ctx,
                                         const MOJOSHADER_astDataType *dt,
                                         MOJOSHADER_astExpression *initializer)
@@ -967,14 +955,6 @@ static MOJOSHADER_astAnnotations *new_annotation(Context *ctx,
     return retval;
 } // new_annotation
 
-static void delete_annotation(Context *ctx, MOJOSHADER_astAnnotations *annos)
-{
-    DELETE_AST_NODE(annos);
-    delete_annotation(ctx, annos->next);
-    delete_expr(ctx, annos->initializer);
-    Free(ctx, annos);
-} // delete_annotation
-
 static MOJOSHADER_astVariableDeclaration *new_variable_declaration(
                             Context *ctx, MOJOSHADER_astScalarOrArray *soa,
                             const char *semantic,
@@ -996,18 +976,6 @@ static MOJOSHADER_astVariableDeclaration *new_variable_declaration(
     return retval;
 } // new_variable_declaration
 
-static void delete_variable_declaration(Context *ctx,
-                                        MOJOSHADER_astVariableDeclaration *dcl)
-{
-    DELETE_AST_NODE(dcl);
-    delete_variable_declaration(ctx, dcl->next);
-    delete_scalar_or_array(ctx, dcl->details);
-    delete_annotation(ctx, dcl->annotations);
-    delete_expr(ctx, dcl->initializer);
-    delete_variable_lowlevel(ctx, dcl->lowlevel);
-    Free(ctx, dcl);
-} // delete_variable_declaration
-
 static MOJOSHADER_astCompilationUnit *new_global_variable(Context *ctx,
                                       MOJOSHADER_astVariableDeclaration *decl)
 {
@@ -1018,15 +986,6 @@ static MOJOSHADER_astCompilationUnit *new_global_variable(Context *ctx,
     return (MOJOSHADER_astCompilationUnit *) retval;
 } // new_global_variable
 
-static void delete_global_variable(Context *ctx,
-                                   MOJOSHADER_astCompilationUnitVariable *var)
-{
-    DELETE_AST_NODE(var);
-    delete_compilation_unit(ctx, var->next);
-    delete_variable_declaration(ctx, var->declaration);
-    Free(ctx, var);
-} // delete_global_variable
-
 static MOJOSHADER_astCompilationUnit *new_global_typedef(Context *ctx,
                                                      MOJOSHADER_astTypedef *td)
 {
@@ -1037,15 +996,6 @@ static MOJOSHADER_astCompilationUnit *new_global_typedef(Context *ctx,
     return (MOJOSHADER_astCompilationUnit *) retval;
 } // new_global_typedef
 
-static void delete_global_typedef(Context *ctx,
-                                  MOJOSHADER_astCompilationUnitTypedef *unit)
-{
-    DELETE_AST_NODE(unit);
-    delete_compilation_unit(ctx, unit->next);
-    delete_typedef(ctx, unit->type_info);
-    Free(ctx, unit);
-} // delete_global_typedef
-
 static MOJOSHADER_astStructMembers *new_struct_member(Context *ctx,
                                             MOJOSHADER_astScalarOrArray *soa,
                                             const char *semantic)
@@ -1060,15 +1010,6 @@ static MOJOSHADER_astStructMembers *new_struct_member(Context *ctx,
     return retval;
 } // new_struct_member
 
-static void delete_struct_member(Context *ctx,
-                                 MOJOSHADER_astStructMembers *member)
-{
-    DELETE_AST_NODE(member);
-    delete_struct_member(ctx, member->next);
-    delete_scalar_or_array(ctx, member->details);
-    Free(ctx, member);
-} // delete_struct_member
-
 static MOJOSHADER_astStructDeclaration *new_struct_declaration(Context *ctx,
                                         const char *name,
                                         MOJOSHADER_astStructMembers *members)
@@ -1081,14 +1022,6 @@ static MOJOSHADER_astStructDeclaration *new_struct_declaration(Context *ctx,
     return retval;
 } // new_struct_declaration
 
-static void delete_struct_declaration(Context *ctx,
-                                      MOJOSHADER_astStructDeclaration *decl)
-{
-    DELETE_AST_NODE(decl);
-    delete_struct_member(ctx, decl->members);
-    Free(ctx, decl);
-} // delete_struct_declaration
-
 static MOJOSHADER_astCompilationUnit *new_global_struct(Context *ctx,
                                            MOJOSHADER_astStructDeclaration *sd)
 {
@@ -1099,53 +1032,6 @@ static MOJOSHADER_astCompilationUnit *new_global_struct(Context *ctx,
     return (MOJOSHADER_astCompilationUnit *) retval;
 } // new_global_struct
 
-static void delete_global_struct(Context *ctx,
-                                 MOJOSHADER_astCompilationUnitStruct *unit)
-{
-    DELETE_AST_NODE(unit);
-    delete_compilation_unit(ctx, unit->next);
-    delete_struct_declaration(ctx, unit->struct_info);
-    Free(ctx, unit);
-} // delete_global_struct
-
-static void delete_compilation_unit(Context *ctx,
-                                    MOJOSHADER_astCompilationUnit *unit)
-{
-    if (!unit) return;
-
-    // it's important to not recurse too deeply here, since you may have
-    //  thousands of items in this linked list (each line of a massive
-    //  function, for example). To avoid this, we iterate the list here,
-    //  deleting all children and making them think they have no reason
-    //  to recurse in their own delete methods.
-    // Please note that everyone should _try_ to delete their "next" member,
-    //  just in case, but hopefully this cleaned it out.
-
-    MOJOSHADER_astCompilationUnit *i = unit->next;
-    unit->next = NULL;
-    while (i)
-    {
-        MOJOSHADER_astCompilationUnit *next = i->next;
-        i->next = NULL;
-        delete_compilation_unit(ctx, i);
-        i = next;
-    } // while
-
-    switch (unit->ast.type)
-    {
-        #define DELETE_UNIT(typ, cls, fn) \
-            case MOJOSHADER_AST_COMPUNIT_##typ: delete_##fn(ctx, (cls *) unit); break;
-        DELETE_UNIT(FUNCTION, MOJOSHADER_astCompilationUnitFunction, function);
-        DELETE_UNIT(TYPEDEF, MOJOSHADER_astCompilationUnitTypedef, global_typedef);
-        DELETE_UNIT(VARIABLE, MOJOSHADER_astCompilationUnitVariable, global_variable);
-        DELETE_UNIT(STRUCT, MOJOSHADER_astCompilationUnitStruct, global_struct);
-        #undef DELETE_UNIT
-        default: assert(0 && "missing cleanup code"); break;
-    } // switch
-
-    // don't free (unit) here, the class-specific functions do it.
-} // delete_compilation_unit
-
 static MOJOSHADER_astStatement *new_typedef_statement(Context *ctx,
                                                       MOJOSHADER_astTypedef *td)
 {
@@ -1156,15 +1042,6 @@ static MOJOSHADER_astStatement *new_typedef_statement(Context *ctx,
     return (MOJOSHADER_astStatement *) retval;
 } // new_typedef_statement
 
-static void delete_typedef_statement(Context *ctx,
-                                     MOJOSHADER_astTypedefStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->next);
-    delete_typedef(ctx, stmt->type_info);
-    Free(ctx, stmt);
-} // delete_typedef_statement
-
 static MOJOSHADER_astStatement *new_return_statement(Context *ctx,
                                                 MOJOSHADER_astExpression *expr)
 {
@@ -1175,15 +1052,6 @@ static MOJOSHADER_astStatement *new_return_statement(Context *ctx,
     return (MOJOSHADER_astStatement *) retval;
 } // new_return_statement
 
-static void delete_return_statement(Context *ctx,
-                                    MOJOSHADER_astReturnStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->next);
-    delete_expr(ctx, stmt->expr);
-    Free(ctx, stmt);
-} // delete_return_statement
-
 static MOJOSHADER_astStatement *new_block_statement(Context *ctx,
                                                MOJOSHADER_astStatement *stmts)
 {
@@ -1194,15 +1062,6 @@ static MOJOSHADER_astStatement *new_block_statement(Context *ctx,
     return (MOJOSHADER_astStatement *) retval;
 } // new_block_statement
 
-static void delete_block_statement(Context *ctx,
-                                   MOJOSHADER_astBlockStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->statements);
-    delete_statement(ctx, stmt->next);
-    Free(ctx, stmt);
-} // delete_statement_block
-
 static MOJOSHADER_astStatement *new_for_statement(Context *ctx,
                                     MOJOSHADER_astVariableDeclaration *decl,
                                     MOJOSHADER_astExpression *initializer,
@@ -1222,18 +1081,6 @@ static MOJOSHADER_astStatement *new_for_statement(Context *ctx,
     return (MOJOSHADER_astStatement *) retval;
 } // new_for_statement
 
-static void delete_for_statement(Context *ctx,MOJOSHADER_astForStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->next);
-    delete_variable_declaration(ctx, stmt->var_decl);
-    delete_expr(ctx, stmt->initializer);
-    delete_expr(ctx, stmt->looptest);
-    delete_expr(ctx, stmt->counter);
-    delete_statement(ctx, stmt->statement);
-    Free(ctx, stmt);
-} // delete_for_statement
-
 static MOJOSHADER_astStatement *new_do_statement(Context *ctx,
                                                 const int unroll,
                                                 MOJOSHADER_astStatement *stmt,
@@ -1247,15 +1094,6 @@ static MOJOSHADER_astStatement *new_do_statement(Context *ctx,
     return (MOJOSHADER_astStatement *) retval;
 } // new_do_statement
 
-static void delete_do_statement(Context *ctx, MOJOSHADER_astDoStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->next);
-    delete_statement(ctx, stmt->statement);
-    delete_expr(ctx, stmt->expr);
-    Free(ctx, stmt);
-} // delete_do_statement
-
 static MOJOSHADER_astStatement *new_while_statement(Context *ctx,
                                                 const int unroll,
                                                 MOJOSHADER_astExpression *expr,
@@ -1270,16 +1108,6 @@ static MOJOSHADER_astStatement *new_while_statement(Context *ctx,
     return (MOJOSHADER_astStatement *) retval;
 } // new_while_statement
 
-static void delete_while_statement(Context *ctx,
-                                   MOJOSHADER_astWhileStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->next);
-    delete_statement(ctx, stmt->statement);
-    delete_expr(ctx, stmt->expr);
-    Free(ctx, stmt);
-} // delete_while_statement
-
 static MOJOSHADER_astStatement *new_if_statement(Context *ctx,
                                             const int attr,
                                             MOJOSHADER_astExpression *expr,
@@ -1295,16 +1123,6 @@ static MOJOSHADER_astStatement *new_if_statement(Context *ctx,
     return (MOJOSHADER_astStatement *) retval;
 } // new_if_statement
 
-static void delete_if_statement(Context *ctx, MOJOSHADER_astIfStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->next);
-    delete_expr(ctx, stmt->expr);
-    delete_statement(ctx, stmt->statement);
-    delete_statement(ctx, stmt->else_statement);
-    Free(ctx, stmt);
-} // delete_if_statement
-
 static MOJOSHADER_astSwitchCases *new_switch_case(Context *ctx,
                                                 MOJOSHADER_astExpression *expr,
                                                 MOJOSHADER_astStatement *stmt)
@@ -1316,15 +1134,6 @@ static MOJOSHADER_astSwitchCases *new_switch_case(Context *ctx,
     return retval;
 } // new_switch_case
 
-static void delete_switch_case(Context *ctx, MOJOSHADER_astSwitchCases *sc)
-{
-    DELETE_AST_NODE(sc);
-    delete_switch_case(ctx, sc->next);
-    delete_expr(ctx, sc->expr);
-    delete_statement(ctx, sc->statement);
-    Free(ctx, sc);
-} // delete_switch_case
-
 static MOJOSHADER_astStatement *new_empty_statement(Context *ctx)
 {
     NEW_AST_NODE(retval, MOJOSHADER_astEmptyStatement,
@@ -1333,14 +1142,6 @@ static MOJOSHADER_astStatement *new_empty_statement(Context *ctx)
     return (MOJOSHADER_astStatement *) retval;
 } // new_empty_statement
 
-static void delete_empty_statement(Context *ctx,
-                                   MOJOSHADER_astEmptyStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->next);
-    Free(ctx, stmt);
-} // delete_empty_statement
-
 static MOJOSHADER_astStatement *new_break_statement(Context *ctx)
 {
     NEW_AST_NODE(retval, MOJOSHADER_astBreakStatement,
@@ -1349,14 +1150,6 @@ static MOJOSHADER_astStatement *new_break_statement(Context *ctx)
     return (MOJOSHADER_astStatement *) retval;
 } // new_break_statement
 
-static void delete_break_statement(Context *ctx,
-                                   MOJOSHADER_astBreakStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->next);
-    Free(ctx, stmt);
-} // delete_break_statement
-
 static MOJOSHADER_astStatement *new_continue_statement(Context *ctx)
 {
     NEW_AST_NODE(retval, MOJOSHADER_astContinueStatement,
@@ -1365,14 +1158,6 @@ static MOJOSHADER_astStatement *new_continue_statement(Context *ctx)
     return (MOJOSHADER_astStatement *) retval;
 } // new_continue_statement
 
-static void delete_continue_statement(Context *ctx,
-                                      MOJOSHADER_astContinueStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->next);
-    Free(ctx, stmt);
-} // delete_continue_statement
-
 static MOJOSHADER_astStatement *new_discard_statement(Context *ctx)
 {
     NEW_AST_NODE(retval, MOJOSHADER_astDiscardStatement,
@@ -1381,14 +1166,6 @@ static MOJOSHADER_astStatement *new_discard_statement(Context *ctx)
     return (MOJOSHADER_astStatement *) retval;
 } // new_discard_statement
 
-static void delete_discard_statement(Context *ctx,
-                                     MOJOSHADER_astDiscardStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->next);
-    Free(ctx, stmt);
-} // delete_discard_statement
-
 static MOJOSHADER_astStatement *new_expr_statement(Context *ctx,
                                                 MOJOSHADER_astExpression *expr)
 {
@@ -1399,15 +1176,6 @@ static MOJOSHADER_astStatement *new_expr_statement(Context *ctx,
     return (MOJOSHADER_astStatement *) retval;
 } // new_expr_statement
 
-static void delete_expr_statement(Context *ctx,
-                                  MOJOSHADER_astExpressionStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->next);
-    delete_expr(ctx, stmt->expr);
-    Free(ctx, stmt);
-} // delete_expr_statement
-
 static MOJOSHADER_astStatement *new_switch_statement(Context *ctx,
                                             const int attr,
                                             MOJOSHADER_astExpression *expr,
@@ -1422,15 +1190,6 @@ static MOJOSHADER_astStatement *new_switch_statement(Context *ctx,
     return (MOJOSHADER_astStatement *) retval;
 } // new_switch_statement
 
-static void delete_switch_statement(Context *ctx,
-                                    MOJOSHADER_astSwitchStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_expr(ctx, stmt->expr);
-    delete_switch_case(ctx, stmt->cases);
-    Free(ctx, stmt);
-} // delete_switch_statement
-
 static MOJOSHADER_astStatement *new_struct_statement(Context *ctx,
                                         MOJOSHADER_astStructDeclaration *sd)
 {
@@ -1441,15 +1200,6 @@ static MOJOSHADER_astStatement *new_struct_statement(Context *ctx,
     return (MOJOSHADER_astStatement *) retval;
 } // new_struct_statement
 
-static void delete_struct_statement(Context *ctx,
-                                    MOJOSHADER_astStructStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->next);
-    delete_struct_declaration(ctx, stmt->struct_info);
-    Free(ctx, stmt);
-} // delete_struct_statement
-
 static MOJOSHADER_astStatement *new_vardecl_statement(Context *ctx,
                                         MOJOSHADER_astVariableDeclaration *vd)
 {
@@ -1460,63 +1210,6 @@ static MOJOSHADER_astStatement *new_vardecl_statement(Context *ctx,
     return (MOJOSHADER_astStatement *) retval;
 } // new_vardecl_statement
 
-static void delete_vardecl_statement(Context *ctx,
-                                     MOJOSHADER_astVarDeclStatement *stmt)
-{
-    DELETE_AST_NODE(stmt);
-    delete_statement(ctx, stmt->next);
-    delete_variable_declaration(ctx, stmt->declaration);
-    Free(ctx, stmt);
-} // delete_vardecl_statement
-
-static void delete_statement(Context *ctx, MOJOSHADER_astStatement *stmt)
-{
-    if (!stmt) return;
-
-    // it's important to not recurse too deeply here, since you may have
-    //  thousands of items in this linked list (each line of a massive
-    //  function, for example). To avoid this, we iterate the list here,
-    //  deleting all children and making them think they have no reason
-    //  to recurse in their own delete methods.
-    // Please note that everyone should _try_ to delete their "next" member,
-    //  just in case, but hopefully this cleaned it out.
-
-    MOJOSHADER_astStatement *i = stmt->next;
-    stmt->next = NULL;
-    while (i)
-    {
-        MOJOSHADER_astStatement *next = i->next;
-        i->next = NULL;
-        delete_statement(ctx, i);
-        i = next;
-    } // while
-
-    switch (stmt->ast.type)
-    {
-        #define DELETE_STATEMENT(typ, cls, fn) \
-            case MOJOSHADER_AST_STATEMENT_##typ: \
-                delete_##fn##_statement(ctx, (cls *) stmt); break;
-        DELETE_STATEMENT(BLOCK, MOJOSHADER_astBlockStatement, block);
-        DELETE_STATEMENT(EMPTY, MOJOSHADER_astEmptyStatement, empty);
-        DELETE_STATEMENT(IF, MOJOSHADER_astIfStatement, if);
-        DELETE_STATEMENT(SWITCH, MOJOSHADER_astSwitchStatement, switch);
-        DELETE_STATEMENT(EXPRESSION, MOJOSHADER_astExpressionStatement, expr);
-        DELETE_STATEMENT(FOR, MOJOSHADER_astForStatement, for);
-        DELETE_STATEMENT(DO, MOJOSHADER_astDoStatement, do);
-        DELETE_STATEMENT(WHILE, MOJOSHADER_astWhileStatement, while);
-        DELETE_STATEMENT(RETURN, MOJOSHADER_astReturnStatement, return);
-        DELETE_STATEMENT(BREAK, MOJOSHADER_astBreakStatement, break);
-        DELETE_STATEMENT(CONTINUE, MOJOSHADER_astContinueStatement, continue);
-        DELETE_STATEMENT(DISCARD, MOJOSHADER_astDiscardStatement, discard);
-        DELETE_STATEMENT(TYPEDEF, MOJOSHADER_astTypedefStatement, typedef);
-        DELETE_STATEMENT(STRUCT, MOJOSHADER_astStructStatement, struct);
-        DELETE_STATEMENT(VARDECL, MOJOSHADER_astVarDeclStatement, vardecl);
-        #undef DELETE_STATEMENT
-        default: assert(0 && "missing cleanup code"); break;
-    } // switch
-    // don't free (stmt) here, the class-specific functions do it.
-} // delete_statement
-
 
 static const MOJOSHADER_astDataType *get_usertype(const Context *ctx,
                                                   const char *token)
@@ -1568,225 +1261,283 @@ typedef struct AstCalcData
     } value;
 } AstCalcData;
 
-// returns 0 if this expression is non-constant, 1 if it is.
-//  calculation results land in (data).
-static int calc_ast_const_expr(Context *ctx, void *_expr, AstCalcData *data)
+// Long operator chains are walked without recursing (see push_left_chain()),
+//  but everything else nested in an expression (parentheses, calls, unary
+//  operators, etc) still recurses, so we cap how deep that can go. Anything
+//  past this fails to compile instead of running off the end of the stack.
+#ifndef MAX_EXPRESSION_DEPTH
+#define MAX_EXPRESSION_DEPTH 64
+#endif
+
+static int enter_expression(Context *ctx, const MOJOSHADER_astNode *ast)
+{
+    if (ctx->expr_depth >= MAX_EXPRESSION_DEPTH)
+    {
+        ctx->sourcefile = ast->ast.filename;
+        ctx->sourceline = ast->ast.line;
+        fail(ctx, "expression too complex");
+        return 0;
+    } // if
+
+    ctx->expr_depth++;
+    return 1;
+} // enter_expression
+
+static inline void leave_expression(Context *ctx)
+{
+    assert(ctx->expr_depth > 0);
+    ctx->expr_depth--;
+} // leave_expression
+
+static int calc_ast_const_expr(Context *ctx, void *_expr, AstCalcData *data);
+
+// Finish a binary operator whose left operand has already been calculated
+//  into (data).
+static int calc_ast_const_link(Context *ctx,
+                               const MOJOSHADER_astExpressionBinary *expr,
+                               AstCalcData *data)
 {
-    const MOJOSHADER_astNode *expr = (MOJOSHADER_astNode *) _expr;
     const MOJOSHADER_astNodeType op = expr->ast.type;
+    AstCalcData subdata2;
+
+    if (!calc_ast_const_expr(ctx, expr->right, &subdata2))
+        return 0;
 
     ctx->sourcefile = expr->ast.filename;
     ctx->sourceline = expr->ast.line;
 
-    if (operator_is_unary(op))
+    // upgrade to float if either operand is float.
+    if ((data->isflt) || (subdata2.isflt))
     {
-        if (!calc_ast_const_expr(ctx, expr->unary.operand, data))
-            return 0;
-
-        if (data->isflt)
-        {
-            switch (op)
-            {
-                case MOJOSHADER_AST_OP_NEGATE:
-                    data->value.f = -data->value.f;
-                    return 1;
-                case MOJOSHADER_AST_OP_NOT:
-                    data->value.f = !data->value.f;
-                    return 1;
-                case MOJOSHADER_AST_OP_COMPLEMENT:
-                    fail(ctx, "integer operation on floating point value");
-                    return 0;
-                case MOJOSHADER_AST_OP_CAST:
-                    // !!! FIXME: this should work, but it's complicated.
-                    assert(0 && "write me");
-                    return 0;
-                default: break;
-            } // switch
-        } // if
-
-        else  // integer version
-        {
-            switch (op)
-            {
-                case MOJOSHADER_AST_OP_NEGATE:
-                    data->value.i = -data->value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_NOT:
-                    data->value.i = !data->value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_COMPLEMENT:
-                    data->value.i = ~data->value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_CAST:
-                    // !!! FIXME: this should work, but it's complicated.
-                    assert(0 && "write me");
-                    return 0;
-                default: break;
-            } // switch
-        } // else
-        assert(0 && "unhandled operation?");
-        return 0;
+        if (!data->isflt) data->value.f = (double) data->value.i;
+        if (!subdata2.isflt) subdata2.value.f = (double) subdata2.value.i;
+        data->isflt = subdata2.isflt = 1;
     } // if
 
-    else if (operator_is_binary(op))
+    switch (op)
     {
-        AstCalcData subdata2;
-        if ( (!calc_ast_const_expr(ctx, expr->binary.left, data)) ||
-             (!calc_ast_const_expr(ctx, expr->binary.right, &subdata2)) )
-            return 0;
-
-        // upgrade to float if either operand is float.
-        if ((data->isflt) || (subdata2.isflt))
-        {
-            if (!data->isflt) data->value.f = (double) data->value.i;
-            if (!subdata2.isflt) subdata2.value.f = (double) subdata2.value.i;
-            data->isflt = subdata2.isflt = 1;
-        } // if
+        // gcc doesn't handle commas here, either (fails to parse!).
+        case MOJOSHADER_AST_OP_COMMA:
+        case MOJOSHADER_AST_OP_ASSIGN:
+        case MOJOSHADER_AST_OP_MULASSIGN:
+        case MOJOSHADER_AST_OP_DIVASSIGN:
+        case MOJOSHADER_AST_OP_MODASSIGN:
+        case MOJOSHADER_AST_OP_ADDASSIGN:
+        case MOJOSHADER_AST_OP_SUBASSIGN:
+        case MOJOSHADER_AST_OP_LSHIFTASSIGN:
+        case MOJOSHADER_AST_OP_RSHIFTASSIGN:
+        case MOJOSHADER_AST_OP_ANDASSIGN:
+        case MOJOSHADER_AST_OP_XORASSIGN:
+        case MOJOSHADER_AST_OP_ORASSIGN:
+            return 0;  // assignment is non-constant.
+        default: break;
+    } // switch
 
+    if (data->isflt)
+    {
         switch (op)
         {
-            // gcc doesn't handle commas here, either (fails to parse!).
-            case MOJOSHADER_AST_OP_COMMA:
-            case MOJOSHADER_AST_OP_ASSIGN:
-            case MOJOSHADER_AST_OP_MULASSIGN:
-            case MOJOSHADER_AST_OP_DIVASSIGN:
-            case MOJOSHADER_AST_OP_MODASSIGN:
-            case MOJOSHADER_AST_OP_ADDASSIGN:
-            case MOJOSHADER_AST_OP_SUBASSIGN:
-            case MOJOSHADER_AST_OP_LSHIFTASSIGN:
-            case MOJOSHADER_AST_OP_RSHIFTASSIGN:
-            case MOJOSHADER_AST_OP_ANDASSIGN:
-            case MOJOSHADER_AST_OP_XORASSIGN:
-            case MOJOSHADER_AST_OP_ORASSIGN:
-                return 0;  // assignment is non-constant.
-            default: break;
-        } // switch
-
-        if (data->isflt)
-        {
-            switch (op)
-            {
-                case MOJOSHADER_AST_OP_MULTIPLY:
-                    data->value.f *= subdata2.value.f;
-                    return 1;
-                case MOJOSHADER_AST_OP_DIVIDE:
-                    data->value.f /= subdata2.value.f;
-                    return 1;
-                case MOJOSHADER_AST_OP_ADD:
-                    data->value.f += subdata2.value.f;
-                    return 1;
-                case MOJOSHADER_AST_OP_SUBTRACT:
-                    data->value.f -= subdata2.value.f;
-                    return 1;
-                case MOJOSHADER_AST_OP_LESSTHAN:
-                    data->isflt = 0;
-                    data->value.i = data->value.f < subdata2.value.f;
-                    return 1;
-                case MOJOSHADER_AST_OP_GREATERTHAN:
-                    data->isflt = 0;
-                    data->value.i = data->value.f > subdata2.value.f;
-                    return 1;
-                case MOJOSHADER_AST_OP_LESSTHANOREQUAL:
-                    data->isflt = 0;
-                    data->value.i = data->value.f <= subdata2.value.f;
-                    return 1;
-                case MOJOSHADER_AST_OP_GREATERTHANOREQUAL:
-                    data->isflt = 0;
-                    data->value.i = data->value.f >= subdata2.value.f;
-                    return 1;
-                case MOJOSHADER_AST_OP_EQUAL:
-                    data->isflt = 0;
-                    data->value.i = data->value.f == subdata2.value.f;
-                    return 1;
-                case MOJOSHADER_AST_OP_NOTEQUAL:
-                    data->isflt = 0;
-                    data->value.i = data->value.f != subdata2.value.f;
-                    return 1;
-                case MOJOSHADER_AST_OP_LOGICALAND:
-                    data->isflt = 0;
-                    data->value.i = data->value.f && subdata2.value.f;
+            case MOJOSHADER_AST_OP_MULTIPLY:
+                data->value.f *= subdata2.value.f;
+                return 1;
+            case MOJOSHADER_AST_OP_DIVIDE:
+                data->value.f /= subdata2.value.f;
+                return 1;
+            case MOJOSHADER_AST_OP_ADD:
+                data->value.f += subdata2.value.f;
+                return 1;
+            case MOJOSHADER_AST_OP_SUBTRACT:
+                data->value.f -= subdata2.value.f;
+                return 1;
+            case MOJOSHADER_AST_OP_LESSTHAN:
+                data->isflt = 0;
+                data->value.i = data->value.f < subdata2.value.f;
+                return 1;
+            case MOJOSHADER_AST_OP_GREATERTHAN:
+                data->isflt = 0;
+                data->value.i = data->value.f > subdata2.value.f;
+                return 1;
+            case MOJOSHADER_AST_OP_LESSTHANOREQUAL:
+                data->isflt = 0;
+                data->value.i = data->value.f <= subdata2.value.f;
+                return 1;
+            case MOJOSHADER_AST_OP_GREATERTHANOREQUAL:
+                data->isflt = 0;
+                data->value.i = data->value.f >= subdata2.value.f;
+                return 1;
+            case MOJOSHADER_AST_OP_EQUAL:
+                data->isflt = 0;
+                data->value.i = data->value.f == subdata2.value.f;
+                return 1;
+            case MOJOSHADER_AST_OP_NOTEQUAL:
+                data->isflt = 0;
+                data->value.i = data->value.f != subdata2.value.f;
+                return 1;
+            case MOJOSHADER_AST_OP_LOGICALAND:
+                data->isflt = 0;
+                data->value.i = data->value.f && subdata2.value.f;
+                return 1;
+            case MOJOSHADER_AST_OP_LOGICALOR:
+                data->isflt = 0;
+                data->value.i = data->value.f || subdata2.value.f;
+                return 1;
+
+            case MOJOSHADER_AST_OP_LSHIFT:
+            case MOJOSHADER_AST_OP_RSHIFT:
+            case MOJOSHADER_AST_OP_MODULO:
+            case MOJOSHADER_AST_OP_BINARYAND:
+            case MOJOSHADER_AST_OP_BINARYXOR:
+            case MOJOSHADER_AST_OP_BINARYOR:
+                fail(ctx, "integer operation on floating point value");
+                return 0;
+            default: break;
+        } // switch
+    } // if
+
+    else   // integer version.
+    {
+        switch (op)
+        {
+            case MOJOSHADER_AST_OP_MULTIPLY:
+                data->value.i *= subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_DIVIDE:
+                data->value.i /= subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_ADD:
+                data->value.i += subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_SUBTRACT:
+                data->value.i -= subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_LESSTHAN:
+                data->value.i = data->value.i < subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_GREATERTHAN:
+                data->value.i = data->value.i > subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_LESSTHANOREQUAL:
+                data->value.i = data->value.i <= subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_GREATERTHANOREQUAL:
+                data->value.i = data->value.i >= subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_EQUAL:
+                data->value.i = data->value.i == subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_NOTEQUAL:
+                data->value.i = data->value.i != subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_LOGICALAND:
+                data->value.i = data->value.i && subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_LOGICALOR:
+                data->value.i = data->value.i || subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_LSHIFT:
+                data->value.i = data->value.i << subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_RSHIFT:
+                data->value.i = data->value.i >> subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_MODULO:
+                data->value.i = data->value.i % subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_BINARYAND:
+                data->value.i = data->value.i & subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_BINARYXOR:
+                data->value.i = data->value.i ^ subdata2.value.i;
+                return 1;
+            case MOJOSHADER_AST_OP_BINARYOR:
+                data->value.i = data->value.i | subdata2.value.i;
+                return 1;
+            default: break;
+        } // switch
+    } // else
+
+    assert(0 && "unhandled operation?");
+    return 0;
+} // calc_ast_const_link
+
+static int calc_ast_const_node(Context *ctx, const MOJOSHADER_astNode *expr,
+                               AstCalcData *data)
+{
+    const MOJOSHADER_astNodeType op = expr->ast.type;
+
+    ctx->sourcefile = expr->ast.filename;
+    ctx->sourceline = expr->ast.line;
+
+    if (operator_is_unary(op))
+    {
+        if (!calc_ast_const_expr(ctx, expr->unary.operand, data))
+            return 0;
+
+        if (data->isflt)
+        {
+            switch (op)
+            {
+                case MOJOSHADER_AST_OP_NEGATE:
+                    data->value.f = -data->value.f;
                     return 1;
-                case MOJOSHADER_AST_OP_LOGICALOR:
-                    data->isflt = 0;
-                    data->value.i = data->value.f || subdata2.value.f;
+                case MOJOSHADER_AST_OP_NOT:
+                    data->value.f = !data->value.f;
                     return 1;
-
-                case MOJOSHADER_AST_OP_LSHIFT:
-                case MOJOSHADER_AST_OP_RSHIFT:
-                case MOJOSHADER_AST_OP_MODULO:
-                case MOJOSHADER_AST_OP_BINARYAND:
-                case MOJOSHADER_AST_OP_BINARYXOR:
-                case MOJOSHADER_AST_OP_BINARYOR:
+                case MOJOSHADER_AST_OP_COMPLEMENT:
                     fail(ctx, "integer operation on floating point value");
                     return 0;
+                case MOJOSHADER_AST_OP_CAST:
+                    // !!! FIXME: this should work, but it's complicated.
+                    assert(0 && "write me");
+                    return 0;
                 default: break;
             } // switch
         } // if
 
-        else   // integer version.
+        else  // integer version
         {
             switch (op)
             {
-                case MOJOSHADER_AST_OP_MULTIPLY:
-                    data->value.i *= subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_DIVIDE:
-                    data->value.i /= subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_ADD:
-                    data->value.i += subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_SUBTRACT:
-                    data->value.i -= subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_LESSTHAN:
-                    data->value.i = data->value.i < subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_GREATERTHAN:
-                    data->value.i = data->value.i > subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_LESSTHANOREQUAL:
-                    data->value.i = data->value.i <= subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_GREATERTHANOREQUAL:
-                    data->value.i = data->value.i >= subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_EQUAL:
-                    data->value.i = data->value.i == subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_NOTEQUAL:
-                    data->value.i = data->value.i != subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_LOGICALAND:
-                    data->value.i = data->value.i && subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_LOGICALOR:
-                    data->value.i = data->value.i || subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_LSHIFT:
-                    data->value.i = data->value.i << subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_RSHIFT:
-                    data->value.i = data->value.i >> subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_MODULO:
-                    data->value.i = data->value.i % subdata2.value.i;
-                    return 1;
-                case MOJOSHADER_AST_OP_BINARYAND:
-                    data->value.i = data->value.i & subdata2.value.i;
+                case MOJOSHADER_AST_OP_NEGATE:
+                    data->value.i = -data->value.i;
                     return 1;
-                case MOJOSHADER_AST_OP_BINARYXOR:
-                    data->value.i = data->value.i ^ subdata2.value.i;
+                case MOJOSHADER_AST_OP_NOT:
+                    data->value.i = !data->value.i;
                     return 1;
-                case MOJOSHADER_AST_OP_BINARYOR:
-                    data->value.i = data->value.i | subdata2.value.i;
+                case MOJOSHADER_AST_OP_COMPLEMENT:
+                    data->value.i = ~data->value.i;
                     return 1;
+                case MOJOSHADER_AST_OP_CAST:
+                    // !!! FIXME: this should work, but it's complicated.
+                    assert(0 && "write me");
+                    return 0;
                 default: break;
             } // switch
         } // else
-
         assert(0 && "unhandled operation?");
         return 0;
+    } // if
+
+    else if (operator_is_binary(op))
+    {
+        if (!operator_is_left_chain(op))
+        {
+            return ( (calc_ast_const_expr(ctx, expr->binary.left, data)) &&
+                     (calc_ast_const_link(ctx, &expr->binary, data)) );
+        } // if
+
+        const size_t base = ctx->walk_count;
+        MOJOSHADER_astExpressionBinary *link;
+        int retval;
+        link = push_left_chain(ctx, (MOJOSHADER_astExpressionBinary *) expr);
+        retval = ( (calc_ast_const_expr(ctx, link->left, data)) &&
+                   (calc_ast_const_link(ctx, link, data)) );
+        while (ctx->walk_count > base)
+        {
+            link = (MOJOSHADER_astExpressionBinary *) walk_pop(ctx);
+            retval = retval && calc_ast_const_link(ctx, link, data);
+        } // while
+        return retval;
     } // else if
 
     else if (operator_is_ternary(op))
@@ -1848,14 +1599,62 @@ static int calc_ast_const_expr(Context *ctx, void *_expr, AstCalcData *data)
     } // switch
 
     return 0;  // not constant, or unhandled.
+} // calc_ast_const_node
+
+// returns 0 if this expression is non-constant, 1 if it is.
+//  calculation results land in (data).
+static int calc_ast_const_expr(Context *ctx, void *_expr, AstCalcData *data)
+{
+    const MOJOSHADER_astNode *expr = (MOJOSHADER_astNode *) _expr;
+    int retval;
+
+    if (!enter_expression(ctx, expr))
+        return 0;
+    retval = calc_ast_const_node(ctx, expr, data);
+    leave_expression(ctx);
+    return retval;
 } // calc_ast_const_expr
 
 
+// the cached, non-const datatype for a scalar type, or NULL if not a scalar.
+static const MOJOSHADER_astDataType *scalar_datatype(Context *ctx,
+                                        const MOJOSHADER_astDataTypeType type)
+{
+    switch (type)
+    {
+        case MOJOSHADER_AST_DATATYPE_BOOL: return &ctx->dt_bool;
+        case MOJOSHADER_AST_DATATYPE_INT: return &ctx->dt_int;
+        case MOJOSHADER_AST_DATATYPE_UINT: return &ctx->dt_uint;
+        case MOJOSHADER_AST_DATATYPE_FLOAT: return &ctx->dt_float;
+        case MOJOSHADER_AST_DATATYPE_FLOAT_SNORM: return &ctx->dt_float_snorm;
+        case MOJOSHADER_AST_DATATYPE_FLOAT_UNORM: return &ctx->dt_float_unorm;
+        case MOJOSHADER_AST_DATATYPE_HALF: return &ctx->dt_half;
+        case MOJOSHADER_AST_DATATYPE_DOUBLE: return &ctx->dt_double;
+        default: return NULL;
+    } // switch
+} // scalar_datatype
+
 static const MOJOSHADER_astDataType *reduce_datatype(Context *ctx, const MOJOSHADER_astDataType *dt)
 {
     const MOJOSHADER_astDataType *retval = dt;
-    while (retval && retval->type == MOJOSHADER_AST_DATATYPE_USER)
+    while (retval != NULL)
     {
+        // build_datatype() marks "const" variables by setting a bit in a
+        //  copy of the datatype. Nothing after parsing cares about that, so
+        //  strip it here, or nothing will recognize the type underneath.
+        const MOJOSHADER_astDataTypeType type = (MOJOSHADER_astDataTypeType)
+                        (retval->type & ~MOJOSHADER_AST_DATATYPE_CONST);
+        if (type != MOJOSHADER_AST_DATATYPE_USER)
+        {
+            if (type != retval->type)
+            {
+                const MOJOSHADER_astDataType *scalar = scalar_datatype(ctx, type);
+                if (scalar != NULL)
+                    retval = scalar;
+            } // if
+            break;
+        } // if
+
         // !!! FIXME: Ugh, const removal.
         MOJOSHADER_astDataTypeUser *user = (MOJOSHADER_astDataTypeUser *) &retval->user;
         if (user->details->type == MOJOSHADER_AST_DATATYPE_NONE)
@@ -1892,27 +1691,16 @@ static const MOJOSHADER_astDataType *build_function_datatype(Context *ctx,
          ((paramcount == 0) && (params != NULL)) )
         return NULL;
 
-    // !!! FIXME: this is hacky.
     const MOJOSHADER_astDataType **dtparams;
-    void *ptr = Malloc(ctx, sizeof (*params) * paramcount);
+    void *ptr = ArenaMalloc(ctx, sizeof (*params) * paramcount);
     if (ptr == NULL)
         return NULL;
-    if (!buffer_append(ctx->garbage, &ptr, sizeof (ptr)))
-    {
-        Free(ctx, ptr);
-        return NULL;
-    } // if
     dtparams = (const MOJOSHADER_astDataType **) ptr;
     memcpy(dtparams, params, sizeof (*params) * paramcount);
 
-    ptr = Malloc(ctx, sizeof (MOJOSHADER_astDataType));
+    ptr = ArenaMalloc(ctx, sizeof (MOJOSHADER_astDataType));
     if (ptr == NULL)
         return NULL;
-    if (!buffer_append(ctx->garbage, &ptr, sizeof (ptr)))
-    {
-        Free(ctx, ptr);
-        return NULL;
-    } // if
 
     MOJOSHADER_astDataType *dt = (MOJOSHADER_astDataType *) ptr;
     dt->type = MOJOSHADER_AST_DATATYPE_FUNCTION;
@@ -1945,17 +1733,10 @@ static const MOJOSHADER_astDataType *build_datatype(Context *ctx,
             return dt;  // reuse existing datatype!
     } // if
 
-    retval = (MOJOSHADER_astDataType *) Malloc(ctx, sizeof (*retval));
+    retval = (MOJOSHADER_astDataType *) ArenaMalloc(ctx, sizeof (*retval));
     if (retval == NULL)
         return NULL;
 
-    // !!! FIXME: this is hacky.
-    if (!buffer_append(ctx->garbage, &retval, sizeof (retval)))
-    {
-        Free(ctx, retval);
-        return NULL;
-    } // if
-
     if (!soa->isarray)
     {
         assert(soa->dimension == NULL);
@@ -2070,15 +1851,16 @@ static void require_array_datatype(Context *ctx,
 } // require_array_datatype
 
 
-static void require_struct_datatype(Context *ctx,
-                                    const MOJOSHADER_astDataType *datatype)
+static int require_struct_datatype(Context *ctx,
+                                   const MOJOSHADER_astDataType *datatype)
 {
     datatype = reduce_datatype(ctx, datatype);
-    if (datatype->type == MOJOSHADER_AST_DATATYPE_STRUCT)
-        return;
+    if ((datatype) && (datatype->type == MOJOSHADER_AST_DATATYPE_STRUCT))
+        return 1;
 
     fail(ctx, "expected struct");
     // !!! FIXME: delete struct dereference for further processing.
+    return 0;
 } // require_struct_datatype
 
 
@@ -2231,7 +2013,6 @@ static const MOJOSHADER_astDataType *add_type_coercion(Context *ctx,
     // Ditch original (*right), force a literal value that matches
     //  ldatatype, so further processing is normalized.
     // !!! FIXME: force (right) to match (left).
-    delete_expr(ctx, *right);
     *right = new_cast_expr(ctx, _ldatatype, new_literal_int_expr(ctx, 0));
     return ldatatype;
 } // add_type_coercion
@@ -2585,6 +2366,105 @@ static const MOJOSHADER_astDataType *vectype_from_base(Context *ctx,
 } // vectype_from_base
 
 
+// Check a left-associative binary operator whose left operand has already
+//  been checked and has the type (datatype).
+static const MOJOSHADER_astDataType *type_check_link(Context *ctx,
+                                        MOJOSHADER_astExpressionBinary *ast,
+                                        const MOJOSHADER_astDataType *datatype)
+{
+    const MOJOSHADER_astDataType *datatype2 = NULL;
+
+    // upkeep so we report correct error locations...
+    ctx->sourcefile = ast->ast.filename;
+    ctx->sourceline = ast->ast.line;
+
+    switch (ast->ast.type)
+    {
+        case MOJOSHADER_AST_OP_COMMA:
+            // evaluate and throw away left, return right.
+            ast->datatype = type_check_ast(ctx, ast->right);
+            return ast->datatype;
+
+        case MOJOSHADER_AST_OP_MULTIPLY:
+        case MOJOSHADER_AST_OP_DIVIDE:
+        case MOJOSHADER_AST_OP_ADD:
+        case MOJOSHADER_AST_OP_SUBTRACT:
+            datatype2 = type_check_ast(ctx, ast->right);
+            require_numeric_datatype(ctx, datatype);
+            require_numeric_datatype(ctx, datatype2);
+            ast->datatype = add_type_coercion(ctx, &ast->left, datatype,
+                                              &ast->right, datatype2);
+            return ast->datatype;
+
+        case MOJOSHADER_AST_OP_LSHIFT:
+        case MOJOSHADER_AST_OP_RSHIFT:
+        case MOJOSHADER_AST_OP_MODULO:
+            datatype2 = type_check_ast(ctx, ast->right);
+            require_integer_datatype(ctx, datatype);
+            require_integer_datatype(ctx, datatype2);
+            ast->datatype = add_type_coercion(ctx, &ast->left, datatype,
+                                              &ast->right, datatype2);
+            return ast->datatype;
+
+        case MOJOSHADER_AST_OP_LESSTHAN:
+        case MOJOSHADER_AST_OP_GREATERTHAN:
+        case MOJOSHADER_AST_OP_LESSTHANOREQUAL:
+        case MOJOSHADER_AST_OP_GREATERTHANOREQUAL:
+        case MOJOSHADER_AST_OP_NOTEQUAL:
+        case MOJOSHADER_AST_OP_EQUAL:
+            datatype2 = type_check_ast(ctx, ast->right);
+            add_type_coercion(ctx, &ast->left, datatype,
+                              &ast->right, datatype2);
+            ast->datatype = &ctx->dt_bool;
+            return ast->datatype;
+
+        case MOJOSHADER_AST_OP_BINARYAND:
+        case MOJOSHADER_AST_OP_BINARYXOR:
+        case MOJOSHADER_AST_OP_BINARYOR:
+            datatype2 = type_check_ast(ctx, ast->right);
+            require_integer_datatype(ctx, datatype);
+            require_integer_datatype(ctx, datatype2);
+            ast->datatype = add_type_coercion(ctx, &ast->left, datatype,
+                                              &ast->right, datatype2);
+            return ast->datatype;
+
+        case MOJOSHADER_AST_OP_LOGICALAND:
+        case MOJOSHADER_AST_OP_LOGICALOR:
+            datatype2 = type_check_ast(ctx, ast->right);
+            require_boolean_datatype(ctx, datatype);
+            require_boolean_datatype(ctx, datatype2);
+            // !!! FIXME: coerce each to bool here, separately.
+            add_type_coercion(ctx, &ast->left, datatype,
+                              &ast->right, datatype2);
+            ast->datatype = &ctx->dt_bool;
+            return ast->datatype;
+
+        default: break;
+    } // switch
+
+    assert(0 && "not a left-associative operator");
+    return NULL;
+} // type_check_link
+
+// This checks a whole chain of left-associative operators without
+//  recursing down it; see push_left_chain().
+static const MOJOSHADER_astDataType *type_check_left_chain(Context *ctx,
+                                        MOJOSHADER_astExpressionBinary *ast)
+{
+    const size_t base = ctx->walk_count;
+    MOJOSHADER_astExpressionBinary *link = push_left_chain(ctx, ast);
+    const MOJOSHADER_astDataType *datatype = type_check_ast(ctx, link->left);
+
+    datatype = type_check_link(ctx, link, datatype);
+    while (ctx->walk_count > base)
+    {
+        link = (MOJOSHADER_astExpressionBinary *) walk_pop(ctx);
+        datatype = type_check_link(ctx, link, datatype);
+    } // while
+
+    return datatype;
+} // type_check_left_chain
+
 // Go through the AST and make sure all datatypes check out okay. For datatypes
 //  that are compatible but are relying on an implicit cast, we add explicit
 //  casts to the AST here, so further processing doesn't have to worry about
@@ -2597,7 +2477,8 @@ static const MOJOSHADER_astDataType *vectype_from_base(Context *ctx,
 // This stage will also set every AST node's datatype field, if it is
 //  meaningful to do so. This will allow conversion to IR to know what
 //  type/size a given node is.
-static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
+// This checks a single node; type_check_ast() walks the "next" chains.
+static const MOJOSHADER_astDataType *type_check_node(Context *ctx, void *_ast)
 {
     MOJOSHADER_astNode *ast = (MOJOSHADER_astNode *) _ast;
     const MOJOSHADER_astDataType *datatype = NULL;
@@ -2666,7 +2547,7 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
             const MOJOSHADER_astDataType *reduced = reduce_datatype(ctx, datatype);
 
             // Is this a swizzle and not a struct deref?
-            if (reduced->type == MOJOSHADER_AST_DATATYPE_VECTOR)
+            if ((reduced) && (reduced->type == MOJOSHADER_AST_DATATYPE_VECTOR))
             {
                 const int veclen = reduced->vector.elements;
                 ast->derefstruct.isswizzle = 1;
@@ -2687,8 +2568,11 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
             } // if
 
             // maybe this is an actual struct?
-            // !!! FIXME: replace with an int or something if not.
-            require_struct_datatype(ctx, reduced);
+            if (!require_struct_datatype(ctx, reduced))
+            {
+                ast->derefstruct.datatype = &ctx->dt_int;  // sane default.
+                return ast->derefstruct.datatype;
+            } // if
 
             // map member to datatype
             assert(ast->derefstruct.datatype == NULL);
@@ -2706,76 +2590,33 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
 
             if (ast->derefstruct.datatype == NULL)
             {
-                // !!! FIXME: replace with an int or something.
                 failf(ctx, "Struct has no member named '%s'", member);
+                ast->derefstruct.datatype = &ctx->dt_int;  // sane default.
             } // if
 
             return ast->derefstruct.datatype;
         } // case
 
         case MOJOSHADER_AST_OP_COMMA:
-            // evaluate and throw away left, return right.
-            type_check_ast(ctx, ast->binary.left);
-            ast->binary.datatype = type_check_ast(ctx, ast->binary.right);
-            return ast->binary.datatype;
-
         case MOJOSHADER_AST_OP_MULTIPLY:
         case MOJOSHADER_AST_OP_DIVIDE:
+        case MOJOSHADER_AST_OP_MODULO:
         case MOJOSHADER_AST_OP_ADD:
         case MOJOSHADER_AST_OP_SUBTRACT:
-            datatype = type_check_ast(ctx, ast->binary.left);
-            datatype2 = type_check_ast(ctx, ast->binary.right);
-            require_numeric_datatype(ctx, datatype);
-            require_numeric_datatype(ctx, datatype2);
-            ast->binary.datatype = add_type_coercion(ctx, &ast->binary.left,
-                                      datatype, &ast->binary.right, datatype2);
-            return ast->binary.datatype;
-
         case MOJOSHADER_AST_OP_LSHIFT:
         case MOJOSHADER_AST_OP_RSHIFT:
-        case MOJOSHADER_AST_OP_MODULO:
-            datatype = type_check_ast(ctx, ast->binary.left);
-            datatype2 = type_check_ast(ctx, ast->binary.right);
-            require_integer_datatype(ctx, datatype);
-            require_integer_datatype(ctx, datatype2);
-            ast->binary.datatype = add_type_coercion(ctx, &ast->binary.left,
-                                     datatype,  &ast->binary.right, datatype2);
-            return ast->binary.datatype;
-
         case MOJOSHADER_AST_OP_LESSTHAN:
         case MOJOSHADER_AST_OP_GREATERTHAN:
         case MOJOSHADER_AST_OP_LESSTHANOREQUAL:
         case MOJOSHADER_AST_OP_GREATERTHANOREQUAL:
-        case MOJOSHADER_AST_OP_NOTEQUAL:
         case MOJOSHADER_AST_OP_EQUAL:
-            datatype = type_check_ast(ctx, ast->binary.left);
-            datatype2 = type_check_ast(ctx, ast->binary.right);
-            add_type_coercion(ctx, &ast->binary.left, datatype,
-                              &ast->binary.right, datatype2);
-            ast->binary.datatype = &ctx->dt_bool;
-            return ast->binary.datatype;
-
+        case MOJOSHADER_AST_OP_NOTEQUAL:
         case MOJOSHADER_AST_OP_BINARYAND:
         case MOJOSHADER_AST_OP_BINARYXOR:
         case MOJOSHADER_AST_OP_BINARYOR:
-            datatype = type_check_ast(ctx, ast->binary.left);
-            datatype2 = type_check_ast(ctx, ast->binary.right);
-            require_integer_datatype(ctx, datatype);
-            require_integer_datatype(ctx, datatype2);
-            ast->binary.datatype = add_type_coercion(ctx, &ast->binary.left,
-                                      datatype, &ast->binary.right, datatype2);
-            return ast->binary.datatype;
-
         case MOJOSHADER_AST_OP_LOGICALAND:
         case MOJOSHADER_AST_OP_LOGICALOR:
-            datatype = type_check_ast(ctx, ast->binary.left);
-            datatype2 = type_check_ast(ctx, ast->binary.right);
-            require_boolean_datatype(ctx, datatype);
-            require_boolean_datatype(ctx, datatype2);
-            // !!! FIXME: coerce each to bool here, separately.
-            add_type_coercion(ctx, &ast->binary.left, datatype,
-                              &ast->binary.right, datatype2);
-            ast->binary.datatype = &ctx->dt_bool;
+            return type_check_left_chain(ctx, &ast->binary);
 
         case MOJOSHADER_AST_OP_ASSIGN:
         case MOJOSHADER_AST_OP_MULASSIGN:
@@ -2895,7 +2736,6 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
 
                 default:
                     fail(ctx, "Invalid type for constructor");
-                    delete_arguments(ctx, ast->constructor.args);
                     ast->constructor.args = new_argument(ctx, new_literal_int_expr(ctx, 0));
                     ast->constructor.datatype = &ctx->dt_int;
                     return ast->constructor.datatype;
@@ -2945,7 +2785,6 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
                     type_check_ast(ctx, argi->argument);
                 if (prev != NULL)
                     prev->next = NULL;
-                delete_arguments(ctx, arg);
             } // if
 
             return ast->constructor.datatype;
@@ -2963,29 +2802,24 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
             if ((ctx->loop_count == 0) && (ctx->switch_count == 0))
                 fail(ctx, "Break outside loop or switch");
             // !!! FIXME: warn if unreachable statements follow?
-            type_check_ast(ctx, ast->stmt.next);
             return NULL;
 
         case MOJOSHADER_AST_STATEMENT_CONTINUE:
             if (ctx->loop_count == 0)
                 fail(ctx, "Continue outside loop");
             // !!! FIXME: warn if unreachable statements follow?
-            type_check_ast(ctx, ast->stmt.next);
             return NULL;
 
         case MOJOSHADER_AST_STATEMENT_DISCARD:
             // !!! FIXME: warn if unreachable statements follow?
-            type_check_ast(ctx, ast->stmt.next);
             return NULL;
 
         case MOJOSHADER_AST_STATEMENT_EMPTY:
-            type_check_ast(ctx, ast->stmt.next);
             return NULL;
 
         case MOJOSHADER_AST_STATEMENT_EXPRESSION:
             // !!! FIXME: warn about expressions without a side-effect here?
             type_check_ast(ctx, ast->exprstmt.expr);  // !!! FIXME: This is named badly...
-            type_check_ast(ctx, ast->exprstmt.next);
             return NULL;
 
         case MOJOSHADER_AST_STATEMENT_IF:
@@ -2993,12 +2827,10 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
             type_check_ast(ctx, ast->ifstmt.expr);
             type_check_ast(ctx, ast->ifstmt.statement);
             pop_scope(ctx);
-            type_check_ast(ctx, ast->ifstmt.next);
             return NULL;
 
         case MOJOSHADER_AST_STATEMENT_TYPEDEF:
             type_check_ast(ctx, ast->typedefstmt.type_info);
-            type_check_ast(ctx, ast->typedefstmt.next);
             return NULL;
 
         case MOJOSHADER_AST_STATEMENT_SWITCH:
@@ -3017,7 +2849,6 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
                 cases = cases->next;
             } // while
             ctx->switch_count--;
-            type_check_ast(ctx, ast->switchstmt.next);
             return NULL;
         } // case
 
@@ -3027,19 +2858,16 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
 
         case MOJOSHADER_AST_STATEMENT_STRUCT:
             type_check_ast(ctx, ast->structstmt.struct_info);
-            type_check_ast(ctx, ast->structstmt.next);
             return NULL;
 
         case MOJOSHADER_AST_STATEMENT_VARDECL:
             type_check_ast(ctx, ast->vardeclstmt.declaration);
-            type_check_ast(ctx, ast->vardeclstmt.next);
             return NULL;
 
         case MOJOSHADER_AST_STATEMENT_BLOCK:
             push_scope(ctx);  // new vars declared here live until '}'.
             type_check_ast(ctx, ast->blockstmt.statements);
             pop_scope(ctx);
-            type_check_ast(ctx, ast->blockstmt.next);
             return NULL;
 
         case MOJOSHADER_AST_STATEMENT_FOR:
@@ -3052,7 +2880,6 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
             type_check_ast(ctx, ast->forstmt.statement);
             pop_scope(ctx);
             ctx->loop_count--;
-            type_check_ast(ctx, ast->forstmt.next);
             return NULL;
 
         case MOJOSHADER_AST_STATEMENT_DO:
@@ -3063,7 +2890,6 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
             type_check_ast(ctx, ast->dostmt.expr);
             pop_scope(ctx);
             ctx->loop_count--;
-            type_check_ast(ctx, ast->dostmt.next);
             return NULL;
 
         case MOJOSHADER_AST_STATEMENT_WHILE:
@@ -3073,14 +2899,12 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
             type_check_ast(ctx, ast->whilestmt.statement);
             pop_scope(ctx);
             ctx->loop_count--;
-            type_check_ast(ctx, ast->whilestmt.next);
             return NULL;
 
         case MOJOSHADER_AST_STATEMENT_RETURN:
             // !!! FIXME: type coercion to outer function's return type.
             // !!! FIXME: warn if unreachable statements follow?
             type_check_ast(ctx, ast->returnstmt.expr);
-            type_check_ast(ctx, ast->returnstmt.next);
             return NULL;
 
         case MOJOSHADER_AST_COMPUNIT_FUNCTION:
@@ -3113,22 +2937,18 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
                 assert(ctx->switch_count == 0);
             } // else
 
-            type_check_ast(ctx, ast->funcunit.next);
             return NULL;
 
         case MOJOSHADER_AST_COMPUNIT_TYPEDEF:
             type_check_ast(ctx, ast->typedefunit.type_info);
-            type_check_ast(ctx, ast->typedefunit.next);
             return NULL;
 
         case MOJOSHADER_AST_COMPUNIT_STRUCT:
             type_check_ast(ctx, ast->structunit.struct_info);
-            type_check_ast(ctx, ast->structunit.next);
             return NULL;
 
         case MOJOSHADER_AST_COMPUNIT_VARIABLE:
             type_check_ast(ctx, ast->varunit.declaration);
-            type_check_ast(ctx, ast->varunit.next);
             return NULL;
 
         case MOJOSHADER_AST_SCALAR_OR_ARRAY:
@@ -3206,26 +3026,15 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
                 mbrs = mbrs->next;
             } // while
 
-            // !!! FIXME: this is hacky.
             MOJOSHADER_astDataTypeStructMember *dtmbrs;
-            void *ptr = Malloc(ctx, sizeof (*dtmbrs) * count);
+            void *ptr = ArenaMalloc(ctx, sizeof (*dtmbrs) * count);
             if (ptr == NULL)
                 return NULL;
-            if (!buffer_append(ctx->garbage, &ptr, sizeof (ptr)))
-            {
-                Free(ctx, ptr);
-                return NULL;
-            } // if
             dtmbrs = (MOJOSHADER_astDataTypeStructMember *) ptr;
 
-            ptr = Malloc(ctx, sizeof (MOJOSHADER_astDataType));
+            ptr = ArenaMalloc(ctx, sizeof (MOJOSHADER_astDataType));
             if (ptr == NULL)
                 return NULL;
-            if (!buffer_append(ctx->garbage, &ptr, sizeof (ptr)))
-            {
-                Free(ctx, ptr);
-                return NULL;
-            } // if
             MOJOSHADER_astDataType *dt = (MOJOSHADER_astDataType *) ptr;
 
             mbrs = ast->structdecl.members;
@@ -3308,61 +3117,90 @@ static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
     } // switch
 
     return NULL;
-} // type_check_ast
-
+} // type_check_node
 
-static inline void semantic_analysis(Context *ctx)
+// Statements and compilation units are linked lists that can be thousands
+//  of items long (each line of a massive function, for example), so we walk
+//  them here instead of having every node recurse into its "next" member.
+static const MOJOSHADER_astDataType *type_check_ast(Context *ctx, void *_ast)
 {
-    type_check_ast(ctx, ctx->ast);
-} // semantic_analysis
+    MOJOSHADER_astNode *ast = (MOJOSHADER_astNode *) _ast;
 
-// !!! FIXME: isn't this a cut-and-paste of somewhere else?
-static inline int64 strtoi64(const char *str, unsigned int len)
-{
-    int64 retval = 0;
-    int64 mult = 1;
-    int i = 0;
+    if (ast == NULL)
+        return NULL;
 
-    while ((len) && (*str == ' '))
+    else if ( (ast->ast.type > MOJOSHADER_AST_STATEMENT_START_RANGE) &&
+              (ast->ast.type < MOJOSHADER_AST_STATEMENT_END_RANGE) )
     {
-        str++;
-        len--;
-    } // while
+        MOJOSHADER_astStatement *stmt;
+        for (stmt = &ast->stmt; stmt != NULL; stmt = stmt->next)
+            type_check_node(ctx, stmt);
+        return NULL;
+    } // else if
 
-    if ((len) && (*str == '-'))
+    else if ( (ast->ast.type > MOJOSHADER_AST_COMPUNIT_START_RANGE) &&
+              (ast->ast.type < MOJOSHADER_AST_COMPUNIT_END_RANGE) )
     {
-        mult = -1;
-        str++;
-        len--;
-    } // if
+        MOJOSHADER_astCompilationUnit *unit;
+        for (unit = &ast->compunit; unit != NULL; unit = unit->next)
+            type_check_node(ctx, unit);
+        return NULL;
+    } // else if
 
-    while (i < len)
+    else if ( (ast->ast.type > MOJOSHADER_AST_OP_START_RANGE) &&
+              (ast->ast.type < MOJOSHADER_AST_OP_END_RANGE) )
     {
-        const char ch = str[i];
-        if ((ch < '0') || (ch > '9'))
-            break;
-        i++;
-    } // while
+        const MOJOSHADER_astDataType *datatype;
+        if (!enter_expression(ctx, ast))
+        {
+            // a sane default, so we can move on. Some callers look at the
+            //  node's datatype instead of our return value, so set it too.
+            ast->expression.datatype = &ctx->dt_int;
+            return ast->expression.datatype;
+        } // if
+        datatype = type_check_node(ctx, ast);
+        leave_expression(ctx);
+        return datatype;
+    } // else if
 
-    while (--i >= 0)
-    {
-        const char ch = str[i];
-        retval += ((int64) (ch - '0')) * mult;
-        mult *= 10;
-    } // while
+    return type_check_node(ctx, ast);
+} // type_check_ast
 
-    return retval;
-} // strtoi64
 
-// !!! FIXME: isn't this a cut-and-paste of somewhere else?
-static inline double strtodouble(const char *_str, unsigned int len)
+static inline int unit_is_reachable(const Context *ctx, const int index)
+{
+    return ((ctx->reachable_units == NULL) || (ctx->reachable_units[index]));
+} // unit_is_reachable
+
+static void semantic_analysis(Context *ctx)
 {
-    // !!! FIXME: laziness prevails.
-    char *str = (char *) alloca(len+1);
-    memcpy(str, _str, len);
-    str[len] = '\0';
-    return strtod(str, NULL);
-} // strtodouble
+    MOJOSHADER_astCompilationUnit *unit;
+    int i = 0;
+
+    if (ctx->reachable_units == NULL)
+    {
+        type_check_ast(ctx, ctx->ast);
+        return;
+    } // if
+
+    // Nothing the entry points can reach refers to the units we skip, so
+    //  they don't need any checking at all, except for function signatures,
+    //  which are always checked so declarations still agree with each other.
+    for (unit = &ctx->ast->compunit; unit != NULL; unit = unit->next, i++)
+    {
+        if (unit_is_reachable(ctx, i))
+            type_check_node(ctx, unit);
+        else if (unit->ast.type == MOJOSHADER_AST_COMPUNIT_FUNCTION)
+        {
+            MOJOSHADER_astCompilationUnitFunction *fn;
+            fn = (MOJOSHADER_astCompilationUnitFunction *) unit;
+            const MOJOSHADER_astDataType *datatype;
+            datatype = type_check_ast(ctx, fn->declaration);
+            fn->index = push_function(ctx, fn->declaration->identifier,
+                                      datatype, fn->definition == NULL);
+        } // else if
+    } // for
+} // semantic_analysis
 
 #if 0
 // This does not check correctness (POSITIONT993842 passes, etc).
@@ -3401,9 +3239,144 @@ static int is_semantic(const Context *ctx, const char *token,
 } // is_semantic
 #endif
 
+// Keywords are only checked against others of the same length, so this is
+//  a jump on the length and then a handful of small compares at most.
+// Returns 0 if (token) isn't a keyword.
+static int keyword_to_lemon_token(const char *token,
+                                  const unsigned int tokenlen)
+{
+    #define tokencmp(t) (memcmp(token, t, tokenlen) == 0)
+    switch (tokenlen)
+    {
+        case 2:
+            if (tokencmp("in")) return TOKEN_HLSL_IN;
+            if (tokencmp("do")) return TOKEN_HLSL_DO;
+            if (tokencmp("if")) return TOKEN_HLSL_IF;
+            break;
+
+        case 3:
+            if (tokencmp("out")) return TOKEN_HLSL_OUT;
+            if (tokencmp("int")) return TOKEN_HLSL_INT;
+            if (tokencmp("for")) return TOKEN_HLSL_FOR;
+            if (tokencmp("xps")) return TOKEN_HLSL_XPS;
+            break;
+
+        case 4:
+            if (tokencmp("else")) return TOKEN_HLSL_ELSE;
+            if (tokencmp("void")) return TOKEN_HLSL_VOID;
+            if (tokencmp("bool")) return TOKEN_HLSL_BOOL;
+            if (tokencmp("uint")) return TOKEN_HLSL_UINT;
+            if (tokencmp("half")) return TOKEN_HLSL_HALF;
+            if (tokencmp("loop")) return TOKEN_HLSL_LOOP;
+            if (tokencmp("call")) return TOKEN_HLSL_CALL;
+            if (tokencmp("case")) return TOKEN_HLSL_CASE;
+            if (tokencmp("true")) return TOKEN_HLSL_TRUE;
+            break;
+
+        case 5:
+            if (tokencmp("inout")) return TOKEN_HLSL_INOUT;
+            if (tokencmp("const")) return TOKEN_HLSL_CONST;
+            if (tokencmp("float")) return TOKEN_HLSL_FLOAT;
+            if (tokencmp("snorm")) return TOKEN_HLSL_SNORM;
+            if (tokencmp("unorm")) return TOKEN_HLSL_UNORM;
+            if (tokencmp("break")) return TOKEN_HLSL_BREAK;
+            if (tokencmp("while")) return TOKEN_HLSL_WHILE;
+            if (tokencmp("false")) return TOKEN_HLSL_FALSE;
+            break;
+
+        case 6:
+            if (tokencmp("inline")) return TOKEN_HLSL_INLINE;
+            if (tokencmp("linear")) return TOKEN_HLSL_LINEAR;
+            if (tokencmp("sample")) return TOKEN_HLSL_SAMPLE;
+            if (tokencmp("struct")) return TOKEN_HLSL_STRUCT;
+            if (tokencmp("extern")) return TOKEN_HLSL_EXTERN;
+            if (tokencmp("shared")) return TOKEN_HLSL_SHARED;
+            if (tokencmp("static")) return TOKEN_HLSL_STATIC;
+            if (tokencmp("double")) return TOKEN_HLSL_DOUBLE;
+            if (tokencmp("string")) return TOKEN_HLSL_STRING;
+            if (tokencmp("buffer")) return TOKEN_HLSL_BUFFER;
+            if (tokencmp("vector")) return TOKEN_HLSL_VECTOR;
+            if (tokencmp("matrix")) return TOKEN_HLSL_MATRIX;
+            if (tokencmp("return")) return TOKEN_HLSL_RETURN;
+            if (tokencmp("unroll")) return TOKEN_HLSL_UNROLL;
+            if (tokencmp("branch")) return TOKEN_HLSL_BRANCH;
+            if (tokencmp("switch")) return TOKEN_HLSL_SWITCH;
+            if (tokencmp("unused")) return TOKEN_HLSL_UNUSED;
+            break;
+
+        case 7:
+            if (tokencmp("uniform")) return TOKEN_HLSL_UNIFORM;
+            if (tokencmp("typedef")) return TOKEN_HLSL_TYPEDEF;
+            if (tokencmp("discard")) return TOKEN_HLSL_DISCARD;
+            if (tokencmp("flatten")) return TOKEN_HLSL_FLATTEN;
+            if (tokencmp("default")) return TOKEN_HLSL_DEFAULT;
+            if (tokencmp("sampler")) return TOKEN_HLSL_SAMPLER;
+            if (tokencmp("isolate")) return TOKEN_HLSL_ISOLATE;
+            break;
+
+        case 8:
+            if (tokencmp("centroid")) return TOKEN_HLSL_CENTROID;
+            if (tokencmp("register")) return TOKEN_HLSL_REGISTER;
+            if (tokencmp("volatile")) return TOKEN_HLSL_VOLATILE;
+            if (tokencmp("continue")) return TOKEN_HLSL_CONTINUE;
+            break;
+
+        case 9:
+            if (tokencmp("row_major")) return TOKEN_HLSL_ROWMAJOR;
+            if (tokencmp("forcecase")) return TOKEN_HLSL_FORCECASE;
+            if (tokencmp("sampler1D")) return TOKEN_HLSL_SAMPLER1D;
+            if (tokencmp("sampler2D")) return TOKEN_HLSL_SAMPLER2D;
+            if (tokencmp("sampler3D")) return TOKEN_HLSL_SAMPLER3D;
+            break;
+
+        case 10:
+            if (tokencmp("packoffset")) return TOKEN_HLSL_PACKOFFSET;
+            break;
+
+        case 11:
+            if (tokencmp("samplerCUBE")) return TOKEN_HLSL_SAMPLERCUBE;
+            break;
+
+        case 12:
+            if (tokencmp("column_major")) return TOKEN_HLSL_COLUMNMAJOR;
+            if (tokencmp("SamplerState")) return TOKEN_HLSL_SAMPLERSTATE;
+            break;
+
+        case 13:
+            if (tokencmp("noperspective")) return TOKEN_HLSL_NOPERSPECTIVE;
+            if (tokencmp("sampler_state")) return TOKEN_HLSL_SAMPLER_STATE;
+            break;
+
+        case 15:
+            if (tokencmp("nointerpolation")) return TOKEN_HLSL_NOINTERPOLATION;
+            break;
+
+        case 19:
+            if (tokencmp("maxInstructionCount")) return TOKEN_HLSL_MAXINSTRUCTIONCOUNT;
+            break;
+
+        case 22:
+            if (tokencmp("SamplerComparisonState")) return TOKEN_HLSL_SAMPLERCOMPARISONSTATE;
+            break;
+
+        case 25:
+            if (tokencmp("noExpressionOptimizations")) return TOKEN_HLSL_NOEXPRESSIONOPTIMIZATIONS;
+            break;
+    } // switch
+    #undef tokencmp
+
+    return 0;
+} // keyword_to_lemon_token
+
+
+// Identifiers are interned into (data) here, so the caller doesn't have to.
 static int convert_to_lemon_token(Context *ctx, const char *token,
-                                  unsigned int tokenlen, const Token tokenval)
+                                  unsigned int tokenlen, const Token tokenval,
+                                  TokenData *data)
 {
+    const MOJOSHADER_astDataType *datatype = NULL;
+    int retval = 0;
+
     switch (tokenval)
     {
         case ((Token) ','): return TOKEN_HLSL_COMMA;
@@ -3457,84 +3430,20 @@ static int convert_to_lemon_token(Context *ctx, const char *token,
         //case ((Token) '\n'): return TOKEN_HLSL_NEWLINE;
 
         case ((Token) TOKEN_IDENTIFIER):
-            #define tokencmp(t) ((tokenlen == strlen(t)) && (memcmp(token, t, tokenlen) == 0))
             //case ((Token) ''): return TOKEN_HLSL_TYPECAST
             //if (tokencmp("")) return TOKEN_HLSL_TYPE_NAME
             //if (tokencmp("...")) return TOKEN_HLSL_ELIPSIS
-            if (tokencmp("else")) return TOKEN_HLSL_ELSE;
-            if (tokencmp("inline")) return TOKEN_HLSL_INLINE;
-            if (tokencmp("void")) return TOKEN_HLSL_VOID;
-            if (tokencmp("in")) return TOKEN_HLSL_IN;
-            if (tokencmp("inout")) return TOKEN_HLSL_INOUT;
-            if (tokencmp("out")) return TOKEN_HLSL_OUT;
-            if (tokencmp("uniform")) return TOKEN_HLSL_UNIFORM;
-            if (tokencmp("linear")) return TOKEN_HLSL_LINEAR;
-            if (tokencmp("centroid")) return TOKEN_HLSL_CENTROID;
-            if (tokencmp("nointerpolation")) return TOKEN_HLSL_NOINTERPOLATION;
-            if (tokencmp("noperspective")) return TOKEN_HLSL_NOPERSPECTIVE;
-            if (tokencmp("sample")) return TOKEN_HLSL_SAMPLE;
-            if (tokencmp("struct")) return TOKEN_HLSL_STRUCT;
-            if (tokencmp("typedef")) return TOKEN_HLSL_TYPEDEF;
-            if (tokencmp("const")) return TOKEN_HLSL_CONST;
-            if (tokencmp("packoffset")) return TOKEN_HLSL_PACKOFFSET;
-            if (tokencmp("register")) return TOKEN_HLSL_REGISTER;
-            if (tokencmp("extern")) return TOKEN_HLSL_EXTERN;
-            if (tokencmp("shared")) return TOKEN_HLSL_SHARED;
-            if (tokencmp("static")) return TOKEN_HLSL_STATIC;
-            if (tokencmp("volatile")) return TOKEN_HLSL_VOLATILE;
-            if (tokencmp("row_major")) return TOKEN_HLSL_ROWMAJOR;
-            if (tokencmp("column_major")) return TOKEN_HLSL_COLUMNMAJOR;
-            if (tokencmp("bool")) return TOKEN_HLSL_BOOL;
-            if (tokencmp("int")) return TOKEN_HLSL_INT;
-            if (tokencmp("uint")) return TOKEN_HLSL_UINT;
-            if (tokencmp("half")) return TOKEN_HLSL_HALF;
-            if (tokencmp("float")) return TOKEN_HLSL_FLOAT;
-            if (tokencmp("double")) return TOKEN_HLSL_DOUBLE;
-            if (tokencmp("string")) return TOKEN_HLSL_STRING;
-            if (tokencmp("snorm")) return TOKEN_HLSL_SNORM;
-            if (tokencmp("unorm")) return TOKEN_HLSL_UNORM;
-            if (tokencmp("buffer")) return TOKEN_HLSL_BUFFER;
-            if (tokencmp("vector")) return TOKEN_HLSL_VECTOR;
-            if (tokencmp("matrix")) return TOKEN_HLSL_MATRIX;
-            if (tokencmp("break")) return TOKEN_HLSL_BREAK;
-            if (tokencmp("continue")) return TOKEN_HLSL_CONTINUE;
-            if (tokencmp("discard")) return TOKEN_HLSL_DISCARD;
-            if (tokencmp("return")) return TOKEN_HLSL_RETURN;
-            if (tokencmp("while")) return TOKEN_HLSL_WHILE;
-            if (tokencmp("for")) return TOKEN_HLSL_FOR;
-            if (tokencmp("unroll")) return TOKEN_HLSL_UNROLL;
-            if (tokencmp("loop")) return TOKEN_HLSL_LOOP;
-            if (tokencmp("do")) return TOKEN_HLSL_DO;
-            if (tokencmp("if")) return TOKEN_HLSL_IF;
-            if (tokencmp("branch")) return TOKEN_HLSL_BRANCH;
-            if (tokencmp("flatten")) return TOKEN_HLSL_FLATTEN;
-            if (tokencmp("switch")) return TOKEN_HLSL_SWITCH;
-            if (tokencmp("forcecase")) return TOKEN_HLSL_FORCECASE;
-            if (tokencmp("call")) return TOKEN_HLSL_CALL;
-            if (tokencmp("case")) return TOKEN_HLSL_CASE;
-            if (tokencmp("default")) return TOKEN_HLSL_DEFAULT;
-            if (tokencmp("sampler")) return TOKEN_HLSL_SAMPLER;
-            if (tokencmp("sampler1D")) return TOKEN_HLSL_SAMPLER1D;
-            if (tokencmp("sampler2D")) return TOKEN_HLSL_SAMPLER2D;
-            if (tokencmp("sampler3D")) return TOKEN_HLSL_SAMPLER3D;
-            if (tokencmp("samplerCUBE")) return TOKEN_HLSL_SAMPLERCUBE;
-            if (tokencmp("sampler_state")) return TOKEN_HLSL_SAMPLER_STATE;
-            if (tokencmp("SamplerState")) return TOKEN_HLSL_SAMPLERSTATE;
-            if (tokencmp("true")) return TOKEN_HLSL_TRUE;
-            if (tokencmp("false")) return TOKEN_HLSL_FALSE;
-            if (tokencmp("SamplerComparisonState")) return TOKEN_HLSL_SAMPLERCOMPARISONSTATE;
-            if (tokencmp("isolate")) return TOKEN_HLSL_ISOLATE;
-            if (tokencmp("maxInstructionCount")) return TOKEN_HLSL_MAXINSTRUCTIONCOUNT;
-            if (tokencmp("noExpressionOptimizations")) return TOKEN_HLSL_NOEXPRESSIONOPTIMIZATIONS;
-            if (tokencmp("unused")) return TOKEN_HLSL_UNUSED;
-            if (tokencmp("xps")) return TOKEN_HLSL_XPS;
-            #undef tokencmp
+            retval = keyword_to_lemon_token(token, tokenlen);
+            if (retval != 0)
+                return retval;
 
             // get a canonical copy of the string now, as we'll need it.
-            token = stringcache_len(ctx->strcache, token, tokenlen);
-            if (get_usertype(ctx, token) != NULL)
-                return TOKEN_HLSL_USERTYPE;
-            return TOKEN_HLSL_IDENTIFIER;
+            data->string = stringcache_len(ctx->strcache, token, tokenlen);
+            datatype = get_usertype(ctx, data->string);
+            if (datatype == NULL)
+                return TOKEN_HLSL_IDENTIFIER;
+            data->datatype = datatype;  // !!! FIXME: do we need this? It's kind of useless during parsing.
+            return TOKEN_HLSL_USERTYPE;
 
         case TOKEN_EOI: return 0;
         default: assert(0 && "unexpected token from lexer\n"); return 0;
@@ -3554,21 +3463,6 @@ static void destroy_context(Context *ctx)
         void *d = ctx->malloc_data;
         size_t i = 0;
 
-        // !!! FIXME: this is kinda hacky.
-        const size_t count = buffer_size(ctx->garbage) / sizeof (void *);
-        if (count > 0)
-        {
-            void **garbage = (void **) buffer_flatten(ctx->garbage);
-            if (garbage != NULL)
-            {
-                for (i = 0; i < count; i++)
-                    f(garbage[i], d);
-                f(garbage, d);
-            } // if
-        } // if
-        buffer_destroy(ctx->garbage);
-
-        delete_compilation_unit(ctx, (MOJOSHADER_astCompilationUnit*)ctx->ast);
         destroy_symbolmap(ctx, &ctx->usertypes);
         destroy_symbolmap(ctx, &ctx->variables);
         stringcache_destroy(ctx->strcache);
@@ -3582,6 +3476,13 @@ static void destroy_context(Context *ctx)
             f(ctx->ir, d);
         } // if
 
+        f(ctx->reachable_units, d);
+        f(ctx->walk, d);
+
+        // this takes the whole AST with it.
+        if (ctx->arena != NULL)
+            buffer_destroy(ctx->arena);
+
         // !!! FIXME: more to clean up here, now.
 
         f(ctx, d);
@@ -3608,8 +3509,7 @@ static Context *build_context(MOJOSHADER_malloc m, MOJOSHADER_free f, void *d)
     ctx->errors = errorlist_create(MallocBridge, FreeBridge, ctx);  // !!! FIXME: check for failure.
     ctx->warnings = errorlist_create(MallocBridge, FreeBridge, ctx);  // !!! FIXME: check for failure.
 
-    // !!! FIXME: this feels hacky.
-    ctx->garbage = buffer_create(256*sizeof(void*),MallocBridge,FreeBridge,ctx);  // !!! FIXME: check for failure.
+    ctx->arena = buffer_create(4096, MallocBridge, FreeBridge, ctx);  // !!! FIXME: check for failure.
 
     ctx->dt_none.type = MOJOSHADER_AST_DATATYPE_NONE;
     ctx->dt_bool.type = MOJOSHADER_AST_DATATYPE_BOOL;
@@ -4387,14 +4287,17 @@ static void parse_source(Context *ctx, const char *filename,
                          const MOJOSHADER_preprocessorDefine *defines,
                          unsigned int define_count,
                          MOJOSHADER_includeOpen include_open,
-                         MOJOSHADER_includeClose include_close)
+                         MOJOSHADER_includeClose include_close,
+                         MOJOSHADER_includeCache *include_cache)
 {
-    TokenData data;
+    TokenData data = { 0 };
     unsigned int tokenlen;
     Token tokenval;
     const char *token;
     int lemon_token;
     const char *fname;
+    const char *prev_fname = NULL;
+    const char *sourcefile = NULL;
     Preprocessor *pp;
     void *parser;
 
@@ -4403,14 +4306,14 @@ static void parse_source(Context *ctx, const char *filename,
 
     pp = preprocessor_start(filename, source, sourcelen, include_open,
                             include_close, defines, define_count, 0,
-                            MallocBridge, FreeBridge, ctx);
+                            include_cache, MallocBridge, FreeBridge, ctx);
     if (pp == NULL)
     {
         assert(ctx->out_of_memory);  // shouldn't fail for any other reason.
         return;
     } // if
 
-    parser = ParseHLSLAlloc(ctx->malloc, ctx->malloc_data);
+    parser = ParseHLSLAlloc(ArenaBridge, ArenaFreeBridge, ctx);
     if (parser == NULL)
     {
         assert(ctx->out_of_memory);  // shouldn't fail for any other reason.
@@ -4432,13 +4335,23 @@ static void parse_source(Context *ctx, const char *filename,
     int is_pragma = 0;   // !!! FIXME: remove this later when we can parse #pragma.
     int skipping = 0; // !!! FIXME: remove this later when we can parse #pragma.
     do {
+        set_alloc_phase(ctx, MOJOSHADER_ALLOCPHASE_PREPROCESSOR);
         token = preprocessor_nexttoken(pp, &tokenlen, &tokenval);
+        set_alloc_phase(ctx, MOJOSHADER_ALLOCPHASE_LEXER);
 
         if (ctx->out_of_memory)
             break;
 
+        // The preprocessor caches its filenames, so the pointer only changes
+        //  when the file does (#include, #line, etc), and we only have to
+        //  make our own copy then, instead of hashing it for every token.
         fname = preprocessor_sourcepos(pp, &ctx->sourceline);
-        ctx->sourcefile = fname ? stringcache(ctx->strcache, fname) : 0;
+        if (fname != prev_fname)
+        {
+            sourcefile = fname ? stringcache(ctx->strcache, fname) : 0;
+            prev_fname = fname;
+        } // if
+        ctx->sourcefile = sourcefile;
 
         if ((tokenval == TOKEN_HASH) || (tokenval == TOKEN_HASHHASH))
             tokenval = TOKEN_BAD_CHARS;
@@ -4477,25 +4390,23 @@ static void parse_source(Context *ctx, const char *filename,
         }
 
         // !!! FIXME: this is a mess, decide who should be doing this stuff, and only do it once.
-        lemon_token = convert_to_lemon_token(ctx, token, tokenlen, tokenval);
+        lemon_token = convert_to_lemon_token(ctx, token, tokenlen, tokenval,
+                                             &data);
         switch (lemon_token)
         {
             case TOKEN_HLSL_INT_CONSTANT:
-                data.i64 = strtoi64(token, tokenlen);
+                data.i64 = literal_int64(token, tokenlen);
                 break;
 
             case TOKEN_HLSL_FLOAT_CONSTANT:
-                data.dbl = strtodouble(token, tokenlen);
+                data.dbl = literal_double(token, tokenlen);
                 break;
 
             case TOKEN_HLSL_USERTYPE:
-                data.string = stringcache_len(ctx->strcache, token, tokenlen);
-                data.datatype = get_usertype(ctx, data.string);  // !!! FIXME: do we need this? It's kind of useless during parsing.
-                assert(data.datatype != NULL);
-                break;
+            case TOKEN_HLSL_IDENTIFIER:
+                break;  // convert_to_lemon_token() filled these in.
 
             case TOKEN_HLSL_STRING_LITERAL:
-            case TOKEN_HLSL_IDENTIFIER:
                 data.string = stringcache_len(ctx->strcache, token, tokenlen);
                 break;
 
@@ -4504,6 +4415,7 @@ static void parse_source(Context *ctx, const char *filename,
                 break;
         } // switch
 
+        set_alloc_phase(ctx, MOJOSHADER_ALLOCPHASE_AST);
         ParseHLSL(parser, lemon_token, data, ctx);
 
         // this probably isn't perfect, but it's good enough for surviving
@@ -4518,7 +4430,7 @@ static void parse_source(Context *ctx, const char *filename,
     while (ctx->usertypes.scope != start_scope)
         pop_symbol(ctx, &ctx->usertypes);
 
-    ParseHLSLFree(parser, ctx->free, ctx->malloc_data);
+    ParseHLSLFree(parser, ArenaFreeBridge, ctx);
     preprocessor_end(pp);
 } // parse_source
 
@@ -4589,13 +4501,7 @@ static inline MOJOSHADER_irExpression *build_ir_expr(Context *ctx, void *_ast)
     return (MOJOSHADER_irExpression *) retval;
 } // build_ir_expr
 
-static inline MOJOSHADER_irStatement *build_ir_stmt(Context *ctx, void *_ast)
-{
-    MOJOSHADER_irNode *retval = build_ir(ctx, _ast);
-    assert(!retval || (retval->ir.type > MOJOSHADER_IR_START_RANGE_STMT));
-    assert(!retval || (retval->ir.type < MOJOSHADER_IR_END_RANGE_STMT));
-    return (MOJOSHADER_irStatement *) retval;
-} // build_ir_stmt
+static MOJOSHADER_irStatement *build_ir_stmt(Context *ctx, void *_ast);
 
 
 static MOJOSHADER_irExpression *new_ir_binop(Context *ctx,
@@ -4637,8 +4543,7 @@ static MOJOSHADER_irExpression *new_ir_temp(Context *ctx, const int index,
 
 #define NEW_IR_BINOP(op,l,r) new_ir_binop(ctx, MOJOSHADER_IR_BINOP_##op, l, r)
 #define EASY_IR_BINOP(op) \
-    NEW_IR_BINOP(op, build_ir_expr(ctx, ast->binary.left), \
-                 build_ir_expr(ctx, ast->binary.right))
+    NEW_IR_BINOP(op, left, build_ir_expr(ctx, ast->right))
 
 // You have to fill in ->value yourself!
 static MOJOSHADER_irExpression *new_ir_constant(Context *ctx,
@@ -4749,6 +4654,55 @@ static MOJOSHADER_irStatement *new_ir_seq(Context *ctx,
     return (MOJOSHADER_irStatement *) retval;
 } // new_ir_seq
 
+// Build IR for a list of statements, chained together in order. We walk
+//  the "next" pointers here instead of recursing, since a massive function
+//  can have thousands of statements in a row.
+static MOJOSHADER_irStatement *build_ir_stmt(Context *ctx, void *_ast)
+{
+    MOJOSHADER_astStatement *ast = (MOJOSHADER_astStatement *) _ast;
+    MOJOSHADER_irStatement *retval = NULL;
+    MOJOSHADER_irSeq *tail = NULL;  // the last SEQ we added to (retval).
+
+    for ( ; ast != NULL; ast = ast->next)
+    {
+        const MOJOSHADER_astNodeType type = ast->ast.type;
+        MOJOSHADER_irNode *ir = build_ir(ctx, ast);
+        assert(!ir || (ir->ir.type > MOJOSHADER_IR_START_RANGE_STMT));
+        assert(!ir || (ir->ir.type < MOJOSHADER_IR_END_RANGE_STMT));
+
+        if (ir == NULL)
+        {
+            if (ctx->out_of_memory)
+                return NULL;
+        } // if
+
+        else if (retval == NULL)
+            retval = (MOJOSHADER_irStatement *) ir;
+
+        else
+        {
+            MOJOSHADER_irStatement *stmt = (MOJOSHADER_irStatement *) ir;
+            MOJOSHADER_irStatement *seq;
+            seq = new_ir_seq(ctx, (tail == NULL) ? retval : tail->next, stmt);
+            if (seq == NULL)
+                return NULL;  // out of memory.
+            else if (tail == NULL)
+                retval = seq;
+            else
+                tail->next = seq;
+            tail = (MOJOSHADER_irSeq *) seq;
+        } // else
+
+        // nothing after these is reachable, so don't bother with it.
+        if ( (type == MOJOSHADER_AST_STATEMENT_BREAK) ||
+             (type == MOJOSHADER_AST_STATEMENT_CONTINUE) ||
+             (type == MOJOSHADER_AST_STATEMENT_RETURN) )
+            break;
+    } // for
+
+    return retval;
+} // build_ir_stmt
+
 static MOJOSHADER_irStatement *new_ir_jump(Context *ctx, const int label)
 {
     NEW_IR_NODE(retval, MOJOSHADER_irJump, MOJOSHADER_IR_JUMP);
@@ -4855,9 +4809,8 @@ static MOJOSHADER_irExpression *build_ir_compare(Context *ctx,
 } // build_ir_compare
 
 #define EASY_IR_COMPARE(op) \
-    build_ir_compare(ctx, MOJOSHADER_IR_COND_##op, \
-                   build_ir_expr(ctx, ast->binary.left), \
-                   build_ir_expr(ctx, ast->binary.right), \
+    build_ir_compare(ctx, MOJOSHADER_IR_COND_##op, left, \
+                   build_ir_expr(ctx, ast->right), \
                    new_ir_constbool(ctx, 1), \
                    new_ir_constbool(ctx, 0))
 
@@ -4865,6 +4818,7 @@ static MOJOSHADER_irExpression *build_ir_compare(Context *ctx,
 // This handles && and || operators.
 static MOJOSHADER_irExpression *build_ir_logical_and_or(Context *ctx,
                                     const MOJOSHADER_astExpressionBinary *ast,
+                                    MOJOSHADER_irExpression *left,
                                     const int left_testval)
 {
     /* The gist...
@@ -4889,7 +4843,7 @@ static MOJOSHADER_irExpression *build_ir_logical_and_or(Context *ctx,
     const int tmp = generate_ir_temp(ctx);
 
     return new_ir_eseq(ctx,
-                new_ir_seq(ctx, new_ir_cjump(ctx, MOJOSHADER_IR_COND_EQL, build_ir_expr(ctx, ast->left), new_ir_constbool(ctx, left_testval), maybe, f),
+                new_ir_seq(ctx, new_ir_cjump(ctx, MOJOSHADER_IR_COND_EQL, left, new_ir_constbool(ctx, left_testval), maybe, f),
                 new_ir_seq(ctx, new_ir_label(ctx, maybe),
                 new_ir_seq(ctx, new_ir_cjump(ctx, MOJOSHADER_IR_COND_EQL, build_ir_expr(ctx, ast->right), new_ir_constbool(ctx, 1), t, f),
                 new_ir_seq(ctx, new_ir_label(ctx, t),
@@ -4902,20 +4856,88 @@ static MOJOSHADER_irExpression *build_ir_logical_and_or(Context *ctx,
 } // build_ir_logical_and_or
 
 static inline MOJOSHADER_irExpression *build_ir_logical_and(Context *ctx,
-                                    const MOJOSHADER_astExpressionBinary *ast)
+                                    const MOJOSHADER_astExpressionBinary *ast,
+                                    MOJOSHADER_irExpression *left)
 {
     // this needs to not evaluate (right) if (left) is false!
-    return build_ir_logical_and_or(ctx, ast, 1);
+    return build_ir_logical_and_or(ctx, ast, left, 1);
 } // build_ir_logical_and
 
 static inline MOJOSHADER_irExpression *build_ir_logical_or(Context *ctx,
-                                    const MOJOSHADER_astExpressionBinary *ast)
+                                    const MOJOSHADER_astExpressionBinary *ast,
+                                    MOJOSHADER_irExpression *left)
 {
     // this needs to not evaluate (right) if (left) is true!
-    return build_ir_logical_and_or(ctx, ast, 0);
+    return build_ir_logical_and_or(ctx, ast, left, 0);
 } // build_ir_logical_or
 
-static inline MOJOSHADER_irStatement *build_ir_no_op(Context *ctx)
+// Build a left-associative binary operator, given the IR for its left side.
+static MOJOSHADER_irExpression *build_ir_link(Context *ctx,
+                                    const MOJOSHADER_astExpressionBinary *ast,
+                                    MOJOSHADER_irExpression *left)
+{
+    // upkeep so we report correct error locations...
+    ctx->sourcefile = ast->ast.filename;
+    ctx->sourceline = ast->ast.line;
+
+    switch (ast->ast.type)
+    {
+        case MOJOSHADER_AST_OP_COMMA:
+            // evaluate and throw away left, return right.
+            return new_ir_eseq(ctx, new_ir_expr_stmt(ctx, left),
+                               build_ir_expr(ctx, ast->right));
+
+        case MOJOSHADER_AST_OP_LESSTHAN: return EASY_IR_COMPARE(LT);
+        case MOJOSHADER_AST_OP_GREATERTHAN: return EASY_IR_COMPARE(GT);
+        case MOJOSHADER_AST_OP_LESSTHANOREQUAL: return EASY_IR_COMPARE(LEQ);
+        case MOJOSHADER_AST_OP_GREATERTHANOREQUAL: return EASY_IR_COMPARE(GEQ);
+        case MOJOSHADER_AST_OP_NOTEQUAL: return EASY_IR_COMPARE(NEQ);
+        case MOJOSHADER_AST_OP_EQUAL: return EASY_IR_COMPARE(EQL);
+
+        case MOJOSHADER_AST_OP_MULTIPLY: return EASY_IR_BINOP(MULTIPLY);
+        case MOJOSHADER_AST_OP_DIVIDE: return EASY_IR_BINOP(DIVIDE);
+        case MOJOSHADER_AST_OP_MODULO: return EASY_IR_BINOP(MODULO);
+        case MOJOSHADER_AST_OP_ADD: return EASY_IR_BINOP(ADD);
+        case MOJOSHADER_AST_OP_SUBTRACT: return EASY_IR_BINOP(SUBTRACT);
+        case MOJOSHADER_AST_OP_LSHIFT: return EASY_IR_BINOP(LSHIFT);
+        case MOJOSHADER_AST_OP_RSHIFT: return EASY_IR_BINOP(RSHIFT);
+        case MOJOSHADER_AST_OP_BINARYAND: return EASY_IR_BINOP(AND);
+        case MOJOSHADER_AST_OP_BINARYXOR: return EASY_IR_BINOP(XOR);
+        case MOJOSHADER_AST_OP_BINARYOR: return EASY_IR_BINOP(OR);
+
+        case MOJOSHADER_AST_OP_LOGICALAND:
+            return build_ir_logical_and(ctx, ast, left);
+
+        case MOJOSHADER_AST_OP_LOGICALOR:
+            return build_ir_logical_or(ctx, ast, left);
+
+        default: break;
+    } // switch
+
+    assert(0 && "not a left-associative operator");
+    return NULL;
+} // build_ir_link
+
+// This builds a whole chain of left-associative operators without recursing
+//  down it; see push_left_chain().
+static MOJOSHADER_irExpression *build_ir_left_chain(Context *ctx,
+                                        MOJOSHADER_astExpressionBinary *ast)
+{
+    const size_t base = ctx->walk_count;
+    MOJOSHADER_astExpressionBinary *link = push_left_chain(ctx, ast);
+    MOJOSHADER_irExpression *retval = build_ir_expr(ctx, link->left);
+
+    retval = build_ir_link(ctx, link, retval);
+    while (ctx->walk_count > base)
+    {
+        link = (MOJOSHADER_astExpressionBinary *) walk_pop(ctx);
+        retval = build_ir_link(ctx, link, retval);
+    } // while
+
+    return retval;
+} // build_ir_left_chain
+
+static inline MOJOSHADER_irStatement *build_ir_no_op(Context *ctx)
 {
     return new_ir_label(ctx, generate_ir_label(ctx));
 } // build_ir_no_op
@@ -4943,8 +4965,7 @@ static MOJOSHADER_irStatement *build_ir_ifstmt(Context *ctx,
         return new_ir_seq(ctx, new_ir_cjump(ctx, MOJOSHADER_IR_COND_EQL, build_ir_expr(ctx, ast->expr), new_ir_constbool(ctx, 1), t, join),
                new_ir_seq(ctx, new_ir_label(ctx, t),
                new_ir_seq(ctx, build_ir_stmt(ctx, ast->statement),
-               new_ir_seq(ctx, new_ir_label(ctx, join),
-                               build_ir_stmt(ctx, ast->next)))));
+                               new_ir_label(ctx, join))));
     } // if
 
     // IF statement _with_ an ELSE.
@@ -4968,8 +4989,7 @@ static MOJOSHADER_irStatement *build_ir_ifstmt(Context *ctx,
            new_ir_seq(ctx, new_ir_jump(ctx, join),
            new_ir_seq(ctx, new_ir_label(ctx, f),
            new_ir_seq(ctx, build_ir_stmt(ctx, ast->else_statement),
-           new_ir_seq(ctx, new_ir_label(ctx, join),
-                           build_ir_stmt(ctx, ast->next))))))));
+                           new_ir_label(ctx, join)))))));
 } // build_ir_ifstmt
 
 
@@ -5032,7 +5052,7 @@ static MOJOSHADER_irStatement *build_ir_forstmt(Context *ctx,
 
     pop_ir_loop(ctx);
 
-    return new_ir_seq(ctx, retval, build_ir_stmt(ctx, ast->next));
+    return retval;
 } // build_ir_forstmt
 
 static MOJOSHADER_irStatement *build_ir_whilestmt(Context *ctx,
@@ -5069,7 +5089,7 @@ static MOJOSHADER_irStatement *build_ir_whilestmt(Context *ctx,
 
     pop_ir_loop(ctx);
 
-    return new_ir_seq(ctx, retval, build_ir_stmt(ctx, ast->next));
+    return retval;
 } // build_ir_whilestmt
 
 static MOJOSHADER_irStatement *build_ir_dostmt(Context *ctx,
@@ -5101,7 +5121,7 @@ static MOJOSHADER_irStatement *build_ir_dostmt(Context *ctx,
 
     pop_ir_loop(ctx);
 
-    return new_ir_seq(ctx, retval, build_ir_stmt(ctx, ast->next));
+    return retval;
 } // build_ir_dostmt
 
 static MOJOSHADER_irStatement *build_ir_switch(Context *ctx, const MOJOSHADER_astSwitchStatement *ast)
@@ -5163,7 +5183,7 @@ static MOJOSHADER_irStatement *build_ir_switch(Context *ctx, const MOJOSHADER_as
 
     pop_ir_loop(ctx);
 
-    return new_ir_seq(ctx, startseqs, new_ir_seq(ctx, startcaseseqs, build_ir_stmt(ctx, ast->next)));
+    return new_ir_seq(ctx, startseqs, startcaseseqs);
 } // build_ir_switch
 
 static MOJOSHADER_irExpression *build_ir_increxpr(Context *ctx, const MOJOSHADER_astDataType *_dt,
@@ -5253,9 +5273,10 @@ static MOJOSHADER_irExprList *build_ir_exprlist(Context *ctx, MOJOSHADER_astArgu
 
         MOJOSHADER_irExprList *item = new_ir_exprlist(ctx, build_ir_expr(ctx, args->argument));
         if (prev == NULL)
-            prev = retval = item;
+            retval = item;
         else
             prev->next = item;
+        prev = item;
 
         args = args->next;
     } // while
@@ -5263,12 +5284,65 @@ static MOJOSHADER_irExprList *build_ir_exprlist(Context *ctx, MOJOSHADER_astArgu
     return retval;
 } // build_ir_exprlist
 
+// Constant folding leaves constructors full of literals; those can be a
+//  single constant instead of one per element.
+static int constructor_is_constant(const MOJOSHADER_astExpressionConstructor *ast,
+                                   const MOJOSHADER_astDataTypeType type,
+                                   const int elems)
+{
+    MOJOSHADER_astNodeType littype;
+    const MOJOSHADER_astArguments *arg;
+    int count = 0;
+
+    switch (type)
+    {
+        case MOJOSHADER_AST_DATATYPE_BOOL: littype = MOJOSHADER_AST_OP_BOOLEAN_LITERAL; break;
+        case MOJOSHADER_AST_DATATYPE_INT: littype = MOJOSHADER_AST_OP_INT_LITERAL; break;
+        case MOJOSHADER_AST_DATATYPE_FLOAT: littype = MOJOSHADER_AST_OP_FLOAT_LITERAL; break;
+        default: return 0;
+    } // switch
+
+    for (arg = ast->args; arg != NULL; arg = arg->next, count++)
+    {
+        if (arg->argument->ast.type != littype)
+            return 0;
+    } // for
+
+    return (count == elems);
+} // constructor_is_constant
+
+static MOJOSHADER_irExpression *build_ir_constconstructor(Context *ctx, const MOJOSHADER_astExpressionConstructor *ast,
+                                                          const MOJOSHADER_astDataTypeType type, const int elems)
+{
+    MOJOSHADER_irConstant *retval = (MOJOSHADER_irConstant *) new_ir_constant(ctx, type, elems);
+    const MOJOSHADER_astArguments *arg = ast->args;
+    int i;
+
+    if (retval == NULL)
+        return NULL;
+
+    for (i = 0; i < elems; i++, arg = arg->next)
+    {
+        const MOJOSHADER_astNode *lit = (const MOJOSHADER_astNode *) arg->argument;
+        if (type == MOJOSHADER_AST_DATATYPE_FLOAT)
+            retval->value.fval[i] = (float) lit->floatliteral.value;
+        else if (type == MOJOSHADER_AST_DATATYPE_INT)
+            retval->value.ival[i] = lit->intliteral.value;
+        else
+            retval->value.ival[i] = lit->boolliteral.value;
+    } // for
+
+    return (MOJOSHADER_irExpression *) retval;
+} // build_ir_constconstructor
+
 static MOJOSHADER_irExpression *build_ir_constructor(Context *ctx, const MOJOSHADER_astExpressionConstructor *ast)
 {
     const MOJOSHADER_astDataType *dt = reduce_datatype(ctx, ast->datatype);
     const MOJOSHADER_astDataTypeType type = datatype_base(ctx, dt)->type;
     const int elems = datatype_elems(ctx, dt);
     assert(elems <= 16);  // just in case (matrix4x4 constructor is largest).
+    if (constructor_is_constant(ast, type, elems))
+        return build_ir_constconstructor(ctx, ast, type, elems);
     return new_ir_construct(ctx, build_ir_exprlist(ctx, ast->args), type, elems);
 } // build_ir_constructor
 
@@ -5476,33 +5550,25 @@ static void *build_ir_internal(Context *ctx, void *_ast)
             return build_ir_derefstruct(ctx, &ast->derefstruct);
 
         case MOJOSHADER_AST_OP_COMMA:
-            // evaluate and throw away left, return right.
-            return new_ir_eseq(ctx, new_ir_expr_stmt(ctx, build_ir_expr(ctx, ast->binary.left)),
-                               build_ir_expr(ctx, ast->binary.right));
-
-        case MOJOSHADER_AST_OP_LESSTHAN: return EASY_IR_COMPARE(LT);
-        case MOJOSHADER_AST_OP_GREATERTHAN: return EASY_IR_COMPARE(GT);
-        case MOJOSHADER_AST_OP_LESSTHANOREQUAL: return EASY_IR_COMPARE(LEQ);
-        case MOJOSHADER_AST_OP_GREATERTHANOREQUAL: return EASY_IR_COMPARE(GEQ);
-        case MOJOSHADER_AST_OP_NOTEQUAL: return EASY_IR_COMPARE(NEQ);
-        case MOJOSHADER_AST_OP_EQUAL: return EASY_IR_COMPARE(EQL);
-
-        case MOJOSHADER_AST_OP_MULTIPLY: return EASY_IR_BINOP(MULTIPLY);
-        case MOJOSHADER_AST_OP_DIVIDE: return EASY_IR_BINOP(DIVIDE);
-        case MOJOSHADER_AST_OP_MODULO: return EASY_IR_BINOP(MODULO);
-        case MOJOSHADER_AST_OP_ADD: return EASY_IR_BINOP(ADD);
-        case MOJOSHADER_AST_OP_SUBTRACT: return EASY_IR_BINOP(SUBTRACT);
-        case MOJOSHADER_AST_OP_LSHIFT: return EASY_IR_BINOP(LSHIFT);
-        case MOJOSHADER_AST_OP_RSHIFT: return EASY_IR_BINOP(RSHIFT);
-        case MOJOSHADER_AST_OP_BINARYAND: return EASY_IR_BINOP(AND);
-        case MOJOSHADER_AST_OP_BINARYXOR: return EASY_IR_BINOP(XOR);
-        case MOJOSHADER_AST_OP_BINARYOR: return EASY_IR_BINOP(OR);
-
+        case MOJOSHADER_AST_OP_MULTIPLY:
+        case MOJOSHADER_AST_OP_DIVIDE:
+        case MOJOSHADER_AST_OP_MODULO:
+        case MOJOSHADER_AST_OP_ADD:
+        case MOJOSHADER_AST_OP_SUBTRACT:
+        case MOJOSHADER_AST_OP_LSHIFT:
+        case MOJOSHADER_AST_OP_RSHIFT:
+        case MOJOSHADER_AST_OP_LESSTHAN:
+        case MOJOSHADER_AST_OP_GREATERTHAN:
+        case MOJOSHADER_AST_OP_LESSTHANOREQUAL:
+        case MOJOSHADER_AST_OP_GREATERTHANOREQUAL:
+        case MOJOSHADER_AST_OP_EQUAL:
+        case MOJOSHADER_AST_OP_NOTEQUAL:
+        case MOJOSHADER_AST_OP_BINARYAND:
+        case MOJOSHADER_AST_OP_BINARYXOR:
+        case MOJOSHADER_AST_OP_BINARYOR:
         case MOJOSHADER_AST_OP_LOGICALAND:
-            return build_ir_logical_and(ctx, &ast->binary);
-
         case MOJOSHADER_AST_OP_LOGICALOR:
-            return build_ir_logical_or(ctx, &ast->binary);
+            return build_ir_left_chain(ctx, &ast->binary);
 
         case MOJOSHADER_AST_OP_ASSIGN:
             return build_ir_assign(ctx, &ast->binary);
@@ -5562,31 +5628,31 @@ static void *build_ir_internal(Context *ctx, void *_ast)
         } // case
 
         case MOJOSHADER_AST_STATEMENT_DISCARD:
-            return new_ir_seq(ctx, new_ir_discard(ctx), build_ir_stmt(ctx, ast->discardstmt.next));
+            return new_ir_discard(ctx);
 
         case MOJOSHADER_AST_STATEMENT_EMPTY:
-            return build_ir(ctx, ast->stmt.next);  // skip it, do next thing.
+            return NULL;  // skip it, build_ir_stmt() does the next thing.
 
         case MOJOSHADER_AST_STATEMENT_EXPRESSION:
-            return new_ir_seq(ctx, new_ir_expr_stmt(ctx, build_ir_expr(ctx, ast->exprstmt.expr)), build_ir_stmt(ctx, ast->exprstmt.next));
+            return new_ir_expr_stmt(ctx, build_ir_expr(ctx, ast->exprstmt.expr));
 
         case MOJOSHADER_AST_STATEMENT_IF:
             return build_ir_ifstmt(ctx, &ast->ifstmt);
 
         case MOJOSHADER_AST_STATEMENT_TYPEDEF:  // ignore this, move on.
-            return build_ir(ctx, ast->typedefstmt.next);
+            return NULL;
 
         case MOJOSHADER_AST_STATEMENT_SWITCH:
             return build_ir_switch(ctx, &ast->switchstmt);
 
         case MOJOSHADER_AST_STATEMENT_STRUCT:  // ignore this, move on.
-            return build_ir(ctx, ast->structstmt.next);
+            return NULL;
 
         case MOJOSHADER_AST_STATEMENT_VARDECL: // ignore this, move on.
-            return build_ir(ctx, ast->vardeclstmt.next);
+            return NULL;
 
         case MOJOSHADER_AST_STATEMENT_BLOCK:
-            return new_ir_seq(ctx, build_ir_stmt(ctx, ast->blockstmt.statements), build_ir_stmt(ctx, ast->blockstmt.next));
+            return build_ir_stmt(ctx, ast->blockstmt.statements);
 
         case MOJOSHADER_AST_STATEMENT_FOR:
             return build_ir_forstmt(ctx, &ast->forstmt);
@@ -5640,187 +5706,207 @@ static void *build_ir_internal(Context *ctx, void *_ast)
     } // switch
 } // build_ir
 
-static void print_ir(FILE *io, unsigned int depth, void *_ir)
+static void print_ir(Context *ctx, FILE *io, unsigned int depth, void *_ir)
 {
+    const size_t base = ctx->walk_count;
     MOJOSHADER_irNode *ir = (MOJOSHADER_irNode *) _ir;
-    if (ir == NULL)
-        return;
 
-    const char *fname = strrchr(ir->ir.filename, '/');
-    if (fname != NULL)
-        fname++;
-    else
+    // IR trees are as deep as the expressions they came from, and SEQ and
+    //  EXPRLIST chains can be thousands of nodes long, so we walk them
+    //  with an explicit stack instead of recursing.
+    while (1)
     {
-        fname = strrchr(ir->ir.filename, '\\');
+        void *kids[2] = { NULL, NULL };
+
+        if (ir == NULL)
+            break;
+
+        const char *fname = strrchr(ir->ir.filename, '/');
         if (fname != NULL)
             fname++;
         else
-            fname = ir->ir.filename;
-    } // else
+        {
+            fname = strrchr(ir->ir.filename, '\\');
+            if (fname != NULL)
+                fname++;
+            else
+                fname = ir->ir.filename;
+        } // else
 
-    int i;
-    for (i = 0; i < depth; i++)
-        fprintf(io, "  ");
-    depth++;
+        int i;
+        for (i = 0; i < depth; i++)
+            fprintf(io, "  ");
+        depth++;
 
-    fprintf(io, "[ %s:%d ", fname, ir->ir.line);
+        fprintf(io, "[ %s:%d ", fname, ir->ir.line);
 
-    switch (ir->ir.type)
-    {
-        case MOJOSHADER_IR_LABEL:
-            fprintf(io, "LABEL %d ]\n", ir->stmt.label.index);
-            break;
+        switch (ir->ir.type)
+        {
+            case MOJOSHADER_IR_LABEL:
+                fprintf(io, "LABEL %d ]\n", ir->stmt.label.index);
+                break;
 
-        case MOJOSHADER_IR_CONSTANT:
-            fprintf(io, "CONSTANT ");
-            switch (ir->expr.constant.info.type)
-            {
-                case MOJOSHADER_AST_DATATYPE_BOOL:
-                case MOJOSHADER_AST_DATATYPE_INT:
-                case MOJOSHADER_AST_DATATYPE_UINT:
-                    for (i = 0; i < ir->expr.constant.info.elements-1; i++)
-                        fprintf(io, "%d, ", ir->expr.constant.value.ival[i]);
-                    if (ir->expr.constant.info.elements > 0)
-                        fprintf(io, "%d", ir->expr.constant.value.ival[i]);
-                    break;
+            case MOJOSHADER_IR_CONSTANT:
+                fprintf(io, "CONSTANT ");
+                switch (ir->expr.constant.info.type)
+                {
+                    case MOJOSHADER_AST_DATATYPE_BOOL:
+                    case MOJOSHADER_AST_DATATYPE_INT:
+                    case MOJOSHADER_AST_DATATYPE_UINT:
+                        for (i = 0; i < ir->expr.constant.info.elements-1; i++)
+                            fprintf(io, "%d, ", ir->expr.constant.value.ival[i]);
+                        if (ir->expr.constant.info.elements > 0)
+                            fprintf(io, "%d", ir->expr.constant.value.ival[i]);
+                        break;
+
+                    case MOJOSHADER_AST_DATATYPE_FLOAT:
+                    case MOJOSHADER_AST_DATATYPE_FLOAT_SNORM:
+                    case MOJOSHADER_AST_DATATYPE_FLOAT_UNORM:
+                    case MOJOSHADER_AST_DATATYPE_HALF:
+                    case MOJOSHADER_AST_DATATYPE_DOUBLE:
+                        for (i = 0; i < ir->expr.constant.info.elements-1; i++)
+                            fprintf(io, "%ff, ", ir->expr.constant.value.fval[i]);
+                        if (ir->expr.constant.info.elements > 0)
+                            fprintf(io, "%ff", ir->expr.constant.value.fval[i]);
+                        break;
+
+                    default: assert(0 && "shouldn't happen");
+                } // switch
+                fprintf(io, " ]\n");
+                break;
 
-                case MOJOSHADER_AST_DATATYPE_FLOAT:
-                case MOJOSHADER_AST_DATATYPE_FLOAT_SNORM:
-                case MOJOSHADER_AST_DATATYPE_FLOAT_UNORM:
-                case MOJOSHADER_AST_DATATYPE_HALF:
-                case MOJOSHADER_AST_DATATYPE_DOUBLE:
-                    for (i = 0; i < ir->expr.constant.info.elements-1; i++)
-                        fprintf(io, "%ff, ", ir->expr.constant.value.fval[i]);
-                    if (ir->expr.constant.info.elements > 0)
-                        fprintf(io, "%ff", ir->expr.constant.value.fval[i]);
-                    break;
+            case MOJOSHADER_IR_TEMP:
+                fprintf(io, "TEMP %d ]\n", ir->expr.temp.index);
+                break;
 
-                default: assert(0 && "shouldn't happen");
-            } // switch
-            fprintf(io, " ]\n");
-            break;
+            case MOJOSHADER_IR_DISCARD:
+                fprintf(io, "DISCARD ]\n");
+                break;
 
-        case MOJOSHADER_IR_TEMP:
-            fprintf(io, "TEMP %d ]\n", ir->expr.temp.index);
-            break;
+            case MOJOSHADER_IR_SWIZZLE:
+                fprintf(io, "SWIZZLE");
+                for (i = 0; i < ir->expr.swizzle.info.elements-1; i++)
+                    fprintf(io, " %d", (int) ir->expr.swizzle.channels[i]);
+                fprintf(io, " ]\n");
+                kids[0] = ir->expr.swizzle.expr;
+                break;
 
-        case MOJOSHADER_IR_DISCARD:
-            fprintf(io, "DISCARD ]\n");
-            break;
+            case MOJOSHADER_IR_CONSTRUCT:
+                fprintf(io, "CONSTRUCT ]\n");
+                kids[0] = ir->expr.construct.args;
+                break;
 
-        case MOJOSHADER_IR_SWIZZLE:
-            fprintf(io, "SWIZZLE");
-            for (i = 0; i < ir->expr.swizzle.info.elements-1; i++)
-                fprintf(io, " %d", (int) ir->expr.swizzle.channels[i]);
-            fprintf(io, " ]\n");
-            print_ir(io, depth, ir->expr.swizzle.expr);
-            break;
+            case MOJOSHADER_IR_CONVERT:
+                fprintf(io, "CONVERT ]\n");
+                kids[0] = ir->expr.convert.expr;
+                break;
 
-        case MOJOSHADER_IR_CONSTRUCT:
-            fprintf(io, "CONSTRUCT ]\n");
-            print_ir(io, depth, ir->expr.construct.args);
-            break;
+            case MOJOSHADER_IR_BINOP:
+                fprintf(io, "BINOP ");
+                switch (ir->expr.binop.op)
+                {
+                    #define PRINT_IR_BINOP(x) \
+                        case MOJOSHADER_IR_BINOP_##x: fprintf(io, #x); break;
+                    PRINT_IR_BINOP(ADD)
+                    PRINT_IR_BINOP(SUBTRACT)
+                    PRINT_IR_BINOP(MULTIPLY)
+                    PRINT_IR_BINOP(DIVIDE)
+                    PRINT_IR_BINOP(MODULO)
+                    PRINT_IR_BINOP(AND)
+                    PRINT_IR_BINOP(OR)
+                    PRINT_IR_BINOP(XOR)
+                    PRINT_IR_BINOP(LSHIFT)
+                    PRINT_IR_BINOP(RSHIFT)
+                    PRINT_IR_BINOP(UNKNOWN)
+                    #undef PRINT_IR_BINOP
+                    default: assert(0 && "unexpected case"); break;
+                } // switch
+                fprintf(io, " ]\n");
+                kids[0] = ir->expr.binop.left;
+                kids[1] = ir->expr.binop.right;
+                break;
 
-        case MOJOSHADER_IR_CONVERT:
-            fprintf(io, "CONVERT ]\n");
-            print_ir(io, depth, ir->expr.convert.expr);
-            break;
+            case MOJOSHADER_IR_MEMORY:
+                fprintf(io, "MEMORY %d ]\n", ir->expr.memory.index);
+                break;
 
-        case MOJOSHADER_IR_BINOP:
-            fprintf(io, "BINOP ");
-            switch (ir->expr.binop.op)
-            {
-                #define PRINT_IR_BINOP(x) \
-                    case MOJOSHADER_IR_BINOP_##x: fprintf(io, #x); break;
-                PRINT_IR_BINOP(ADD)
-                PRINT_IR_BINOP(SUBTRACT)
-                PRINT_IR_BINOP(MULTIPLY)
-                PRINT_IR_BINOP(DIVIDE)
-                PRINT_IR_BINOP(MODULO)
-                PRINT_IR_BINOP(AND)
-                PRINT_IR_BINOP(OR)
-                PRINT_IR_BINOP(XOR)
-                PRINT_IR_BINOP(LSHIFT)
-                PRINT_IR_BINOP(RSHIFT)
-                PRINT_IR_BINOP(UNKNOWN)
-                #undef PRINT_IR_BINOP
-                default: assert(0 && "unexpected case"); break;
-            } // switch
-            fprintf(io, " ]\n");
-            print_ir(io, depth, ir->expr.binop.left);
-            print_ir(io, depth, ir->expr.binop.right);
-            break;
+            case MOJOSHADER_IR_CALL:
+                fprintf(io, "CALL %d ]\n", ir->expr.call.index);
+                kids[0] = ir->expr.call.args;
+                break;
 
-        case MOJOSHADER_IR_MEMORY:
-            fprintf(io, "MEMORY %d ]\n", ir->expr.memory.index);
-            break;
+            case MOJOSHADER_IR_ESEQ:
+                fprintf(io, "ESEQ ]\n");
+                kids[0] = ir->expr.eseq.stmt;
+                break;
 
-        case MOJOSHADER_IR_CALL:
-            fprintf(io, "CALL %d ]\n", ir->expr.call.index);
-            print_ir(io, depth, ir->expr.call.args);
-            break;
+            case MOJOSHADER_IR_ARRAY:
+                fprintf(io, "ARRAY ]\n");
+                kids[0] = ir->expr.array.array;
+                kids[1] = ir->expr.array.element;
+                break;
 
-        case MOJOSHADER_IR_ESEQ:
-            fprintf(io, "ESEQ ]\n");
-            print_ir(io, depth, ir->expr.eseq.stmt);
-            break;
+            case MOJOSHADER_IR_MOVE:
+                fprintf(io, "MOVE ]\n");
+                kids[0] = ir->stmt.move.dst;
+                kids[1] = ir->stmt.move.src;
+                break;
 
-        case MOJOSHADER_IR_ARRAY:
-            fprintf(io, "ARRAY ]\n");
-            print_ir(io, depth, ir->expr.array.array);
-            print_ir(io, depth, ir->expr.array.element);
-            break;
+            case MOJOSHADER_IR_EXPR_STMT:
+                fprintf(io, "EXPRSTMT ]\n");
+                kids[0] = ir->stmt.expr.expr;
+                break;
 
-        case MOJOSHADER_IR_MOVE:
-            fprintf(io, "MOVE ]\n");
-            print_ir(io, depth, ir->stmt.move.dst);
-            print_ir(io, depth, ir->stmt.move.src);
-            break;
+            case MOJOSHADER_IR_JUMP:
+                fprintf(io, "JUMP %d ]\n", ir->stmt.jump.label);
+                break;
 
-        case MOJOSHADER_IR_EXPR_STMT:
-            fprintf(io, "EXPRSTMT ]\n");
-            print_ir(io, depth, ir->stmt.expr.expr);
-            break;
+            case MOJOSHADER_IR_CJUMP:
+                fprintf(io, "CJUMP ");
+                switch (ir->stmt.cjump.cond)
+                {
+                    #define PRINT_IR_COND(x) \
+                        case MOJOSHADER_IR_COND_##x: fprintf(io, #x); break;
+                    PRINT_IR_COND(EQL)
+                    PRINT_IR_COND(NEQ)
+                    PRINT_IR_COND(LT)
+                    PRINT_IR_COND(GT)
+                    PRINT_IR_COND(LEQ)
+                    PRINT_IR_COND(GEQ)
+                    PRINT_IR_COND(UNKNOWN)
+                    #undef PRINT_IR_COND
+                    default: assert(0 && "unexpected case"); break;
+                } // switch
+                fprintf(io, " %d %d ]\n", ir->stmt.cjump.iftrue, ir->stmt.cjump.iffalse);
+                kids[0] = ir->stmt.cjump.left;
+                kids[1] = ir->stmt.cjump.right;
+                break;
 
-        case MOJOSHADER_IR_JUMP:
-            fprintf(io, "JUMP %d ]\n", ir->stmt.jump.label);
-            break;
+            case MOJOSHADER_IR_SEQ:
+                fprintf(io, "SEQ ]\n");
+                kids[0] = ir->stmt.seq.first;
+                kids[1] = ir->stmt.seq.next;
+                break;
 
-        case MOJOSHADER_IR_CJUMP:
-            fprintf(io, "CJUMP ");
-            switch (ir->stmt.cjump.cond)
-            {
-                #define PRINT_IR_COND(x) \
-                    case MOJOSHADER_IR_COND_##x: fprintf(io, #x); break;
-                PRINT_IR_COND(EQL)
-                PRINT_IR_COND(NEQ)
-                PRINT_IR_COND(LT)
-                PRINT_IR_COND(GT)
-                PRINT_IR_COND(LEQ)
-                PRINT_IR_COND(GEQ)
-                PRINT_IR_COND(UNKNOWN)
-                #undef PRINT_IR_COND
-                default: assert(0 && "unexpected case"); break;
-            } // switch
-            fprintf(io, " %d %d ]\n", ir->stmt.cjump.iftrue, ir->stmt.cjump.iffalse);
-            print_ir(io, depth, ir->stmt.cjump.left);
-            print_ir(io, depth, ir->stmt.cjump.right);
-            break;
+            case MOJOSHADER_IR_EXPRLIST:
+                fprintf(io, "EXPRLIST ]\n");
+                kids[0] = ir->misc.exprlist.expr;
+                kids[1] = ir->misc.exprlist.next;
+                break;
 
-        case MOJOSHADER_IR_SEQ:
-            fprintf(io, "SEQ ]\n");
-            print_ir(io, depth, ir->stmt.seq.first);
-            print_ir(io, depth, ir->stmt.seq.next);  // !!! FIXME: don't recurse?
-            break;
+            default: assert(0 && "unexpected IR node"); break;
+        } // switch
 
-        case MOJOSHADER_IR_EXPRLIST:
-            fprintf(io, "EXPRLIST ]\n");
-            print_ir(io, depth, ir->misc.exprlist.expr);
-            print_ir(io, depth, ir->misc.exprlist.next);  // !!! FIXME: don't recurse?
-            break;
+        // if we ran out of memory, fall back to recursing on what's left.
+        const int unpushed = walk_push_children(ctx, kids, depth);
+        for (i = 0; i < unpushed; i++)
+            print_ir(ctx, io, depth, kids[i]);
 
-        default: assert(0 && "unexpected IR node"); break;
-    } // switch
+        if (ctx->walk_count == base)
+            break;
+        depth = ctx->walk[ctx->walk_count - 1].depth;
+        ir = (MOJOSHADER_irNode *) walk_pop(ctx);
+    } // while
 } // print_ir
 
 static void print_whole_ir(Context *ctx, FILE *io)
@@ -5831,86 +5917,104 @@ static void print_whole_ir(Context *ctx, FILE *io)
         for (i = 0; i <= ctx->user_func_index; i++)
         {
             printf("[FUNCTION %d ]\n", i);
-            print_ir(io, 1, ctx->ir[i]);
+            print_ir(ctx, io, 1, ctx->ir[i]);
         } // for
     } // if
 } // print_whole_ir
 
 static void delete_ir(Context *ctx, void *_ir)
 {
+    const size_t base = ctx->walk_count;
     MOJOSHADER_irNode *ir = (MOJOSHADER_irNode *) _ir;
-    if (ir == NULL)
-        return;
 
-    switch (ir->ir.type)
+    // walk with an explicit stack instead of recursing; see print_ir().
+    while (1)
     {
-        case MOJOSHADER_IR_JUMP:
-        case MOJOSHADER_IR_LABEL:
-        case MOJOSHADER_IR_CONSTANT:
-        case MOJOSHADER_IR_TEMP:
-        case MOJOSHADER_IR_DISCARD:
-        case MOJOSHADER_IR_MEMORY:
-            break;  // nothing extra to free here.
+        void *kids[2] = { NULL, NULL };
+        int unpushed, i;
 
-        case MOJOSHADER_IR_BINOP:
-            delete_ir(ctx, ir->expr.binop.left);
-            delete_ir(ctx, ir->expr.binop.right);
+        if (ir == NULL)
             break;
 
-        case MOJOSHADER_IR_CALL:
-            delete_ir(ctx, ir->expr.call.args);
-            break;
+        switch (ir->ir.type)
+        {
+            case MOJOSHADER_IR_JUMP:
+            case MOJOSHADER_IR_LABEL:
+            case MOJOSHADER_IR_CONSTANT:
+            case MOJOSHADER_IR_TEMP:
+            case MOJOSHADER_IR_DISCARD:
+            case MOJOSHADER_IR_MEMORY:
+                break;  // nothing extra to free here.
+
+            case MOJOSHADER_IR_BINOP:
+                kids[0] = ir->expr.binop.left;
+                kids[1] = ir->expr.binop.right;
+                break;
 
-        case MOJOSHADER_IR_ESEQ:
-            delete_ir(ctx, ir->expr.eseq.stmt);
-            delete_ir(ctx, ir->expr.eseq.expr);
-            break;
+            case MOJOSHADER_IR_CALL:
+                kids[0] = ir->expr.call.args;
+                break;
 
-        case MOJOSHADER_IR_ARRAY:
-            delete_ir(ctx, ir->expr.array.array);
-            delete_ir(ctx, ir->expr.array.element);
-            break;
+            case MOJOSHADER_IR_ESEQ:
+                kids[0] = ir->expr.eseq.stmt;
+                kids[1] = ir->expr.eseq.expr;
+                break;
 
-        case MOJOSHADER_IR_MOVE:
-            delete_ir(ctx, ir->stmt.move.dst);
-            delete_ir(ctx, ir->stmt.move.src);
-            break;
+            case MOJOSHADER_IR_ARRAY:
+                kids[0] = ir->expr.array.array;
+                kids[1] = ir->expr.array.element;
+                break;
 
-        case MOJOSHADER_IR_EXPR_STMT:
-            delete_ir(ctx, ir->stmt.expr.expr);
-            break;
+            case MOJOSHADER_IR_MOVE:
+                kids[0] = ir->stmt.move.dst;
+                kids[1] = ir->stmt.move.src;
+                break;
 
-        case MOJOSHADER_IR_CJUMP:
-            delete_ir(ctx, ir->stmt.cjump.left);
-            delete_ir(ctx, ir->stmt.cjump.right);
-            break;
+            case MOJOSHADER_IR_EXPR_STMT:
+                kids[0] = ir->stmt.expr.expr;
+                break;
 
-        case MOJOSHADER_IR_SEQ:
-            delete_ir(ctx, ir->stmt.seq.first);
-            delete_ir(ctx, ir->stmt.seq.next);  // !!! FIXME: don't recurse?
-            break;
+            case MOJOSHADER_IR_CJUMP:
+                kids[0] = ir->stmt.cjump.left;
+                kids[1] = ir->stmt.cjump.right;
+                break;
 
-        case MOJOSHADER_IR_EXPRLIST:
-            delete_ir(ctx, ir->misc.exprlist.expr);
-            delete_ir(ctx, ir->misc.exprlist.next);  // !!! FIXME: don't recurse?
-            break;
+            case MOJOSHADER_IR_SEQ:
+                kids[0] = ir->stmt.seq.first;
+                kids[1] = ir->stmt.seq.next;
+                break;
 
-        case MOJOSHADER_IR_SWIZZLE:
-            delete_ir(ctx, ir->expr.swizzle.expr);
-            break;
+            case MOJOSHADER_IR_EXPRLIST:
+                kids[0] = ir->misc.exprlist.expr;
+                kids[1] = ir->misc.exprlist.next;
+                break;
 
-        case MOJOSHADER_IR_CONSTRUCT:
-            delete_ir(ctx, ir->expr.construct.args);
-            break;
+            case MOJOSHADER_IR_SWIZZLE:
+                kids[0] = ir->expr.swizzle.expr;
+                break;
 
-        case MOJOSHADER_IR_CONVERT:
-            delete_ir(ctx, ir->expr.convert.expr);
-            break;
+            case MOJOSHADER_IR_CONSTRUCT:
+                kids[0] = ir->expr.construct.args;
+                break;
 
-        default: assert(0 && "unexpected IR node"); break;
-    } // switch
+            case MOJOSHADER_IR_CONVERT:
+                kids[0] = ir->expr.convert.expr;
+                break;
+
+            default: assert(0 && "unexpected IR node"); break;
+        } // switch
+
+        Free(ctx, ir);
+
+        // if we ran out of memory, fall back to recursing on what's left.
+        unpushed = walk_push_children(ctx, kids, 0);
+        for (i = 0; i < unpushed; i++)
+            delete_ir(ctx, kids[i]);
 
-    Free(ctx, ir);
+        if (ctx->walk_count == base)
+            break;
+        ir = (MOJOSHADER_irNode *) walk_pop(ctx);
+    } // while
 } // delete_ir
 
 static void intermediate_representation(Context *ctx)
@@ -5927,12 +6031,15 @@ static void intermediate_representation(Context *ctx)
     ctx->ir_end = -1;
     ctx->ir_ret = -1;
 
-    for (ast = &ctx->ast->compunit; ast != NULL; ast = ast->next)
+    int i = 0;
+    for (ast = &ctx->ast->compunit; ast != NULL; ast = ast->next, i++)
     {
         assert(ast->ast.type > MOJOSHADER_AST_COMPUNIT_START_RANGE);
         assert(ast->ast.type < MOJOSHADER_AST_COMPUNIT_END_RANGE);
         if (ast->ast.type != MOJOSHADER_AST_COMPUNIT_FUNCTION)
             continue;  // only care about functions right now.
+        else if (!unit_is_reachable(ctx, i))
+            continue;  // nothing calls this, don't bother.
 
         astfn = (MOJOSHADER_astCompilationUnitFunction *) ast;
         if (astfn->definition == NULL)  // just a predeclare; skip.
@@ -5961,56 +6068,1312 @@ static void intermediate_representation(Context *ctx)
 
     print_whole_ir(ctx, stdout);
 
-    // done with the AST, nuke it.
+    // done with the AST. Its memory goes with the arena, since the IR
+    //  still points at datatypes that live there.
     // !!! FIXME: we're going to need CTAB data from this at some point.
-    delete_compilation_unit(ctx, (MOJOSHADER_astCompilationUnit *) ctx->ast);
     ctx->ast = NULL;
 } // intermediate_representation
 
 
+// Constant folding...
 
-static MOJOSHADER_astData MOJOSHADER_out_of_mem_ast_data = {
-    1, &MOJOSHADER_out_of_mem_error, 0, 0, 0, 0, 0, 0
-};
+// Semantic analysis turns every implicit conversion into an explicit cast,
+//  so anything built only from literals (and "static const" globals that
+//  were initialized with them) can be evaluated right here and replaced with
+//  literals before the IR ever sees it. This is deliberately conservative:
+//  anything that might act differently at runtime (division by zero,
+//  out-of-range conversions, results that aren't finite) is left alone.
+// Like the preshader, the math is done in doubles, but float results are
+//  rounded to float after every step, so we get what the hardware would.
 
+typedef union FoldScalar
+{
+    double f;  // half, float, double.
+    int64 i;  // bool, int, uint; always wrapped to fit the type.
+} FoldScalar;
 
-// !!! FIXME: cut and paste from assembler.
-static const MOJOSHADER_astData *build_failed_ast(Context *ctx)
+typedef struct FoldShape
 {
-    assert(isfail(ctx));
+    MOJOSHADER_astDataTypeType type;  // scalar type of every element.
+    int elems;
+    int ismatrix;
+} FoldShape;
 
-    if (ctx->out_of_memory)
-        return &MOJOSHADER_out_of_mem_ast_data;
-        
-    MOJOSHADER_astData *retval = NULL;
-    retval = (MOJOSHADER_astData *) Malloc(ctx, sizeof (MOJOSHADER_astData));
-    if (retval == NULL)
-        return &MOJOSHADER_out_of_mem_ast_data;
+typedef struct FoldValue
+{
+    FoldShape shape;
+    FoldScalar value[16];
+} FoldValue;
 
-    memset(retval, '\0', sizeof (MOJOSHADER_astData));
-    retval->source_profile = ctx->source_profile;
-    retval->malloc = (ctx->malloc == MOJOSHADER_internal_malloc) ? NULL : ctx->malloc;
-    retval->free = (ctx->free == MOJOSHADER_internal_free) ? NULL : ctx->free;
-    retval->malloc_data = ctx->malloc_data;
-    retval->error_count = errorlist_count(ctx->errors);
-    retval->errors = errorlist_flatten(ctx->errors);
+typedef struct FoldConstant
+{
+    int usable;  // zero if this global isn't something we can substitute.
+    FoldValue value;
+} FoldConstant;
 
-    if (ctx->out_of_memory)
-    {
-        Free(ctx, retval);
-        return &MOJOSHADER_out_of_mem_ast_data;
-    } // if
+typedef struct Folding
+{
+    HashTable *globals;  // global variable name -> FoldConstant.
+} Folding;
 
-    return retval;
-} // build_failed_ast
+static void fold_nuke(const void *k, const void *v, void *d) {/*no-op*/}
 
+static int fold_expr(Context *ctx, Folding *fold,
+                     MOJOSHADER_astExpression **_expr, FoldValue *val);
 
-static const MOJOSHADER_astData *build_astdata(Context *ctx)
+static inline int fold_isfloat(const MOJOSHADER_astDataTypeType type)
 {
-    MOJOSHADER_astData *retval = NULL;
-
-    if (ctx->out_of_memory)
-        return &MOJOSHADER_out_of_mem_ast_data;
+    switch (type)
+    {
+        case MOJOSHADER_AST_DATATYPE_HALF:
+        case MOJOSHADER_AST_DATATYPE_FLOAT:
+        case MOJOSHADER_AST_DATATYPE_DOUBLE:
+            return 1;
+        default:
+            return 0;
+    } // switch
+} // fold_isfloat
+
+static inline void fold_scalar_shape(FoldShape *shape,
+                                     const MOJOSHADER_astDataTypeType type)
+{
+    shape->type = type;
+    shape->elems = 1;
+    shape->ismatrix = 0;
+} // fold_scalar_shape
+
+static inline int fold_same_shape(const FoldShape *a, const FoldShape *b)
+{
+    return ( (a->type == b->type) && (a->elems == b->elems) &&
+             (a->ismatrix == b->ismatrix) );
+} // fold_same_shape
+
+// Figure out the element type and count of a datatype, if it's something
+//  we know how to fold at all.
+static int fold_shape(Context *ctx, const MOJOSHADER_astDataType *dt,
+                      FoldShape *shape)
+{
+    dt = reduce_datatype(ctx, dt);
+    if (dt == NULL)
+        return 0;
+
+    fold_scalar_shape(shape, MOJOSHADER_AST_DATATYPE_NONE);
+    if (dt->type == MOJOSHADER_AST_DATATYPE_VECTOR)
+    {
+        shape->elems = dt->vector.elements;
+        dt = reduce_datatype(ctx, dt->vector.base);
+    } // if
+    else if (dt->type == MOJOSHADER_AST_DATATYPE_MATRIX)
+    {
+        shape->elems = dt->matrix.rows * dt->matrix.columns;
+        shape->ismatrix = 1;
+        dt = reduce_datatype(ctx, dt->matrix.base);
+    } // else if
+
+    if ((dt == NULL) || (shape->elems < 1) || (shape->elems > 16))
+        return 0;
+
+    switch (dt->type)
+    {
+        case MOJOSHADER_AST_DATATYPE_BOOL:
+        case MOJOSHADER_AST_DATATYPE_INT:
+        case MOJOSHADER_AST_DATATYPE_UINT:
+        case MOJOSHADER_AST_DATATYPE_HALF:
+        case MOJOSHADER_AST_DATATYPE_FLOAT:
+        case MOJOSHADER_AST_DATATYPE_DOUBLE:
+            shape->type = dt->type;
+            return 1;
+        default:
+            return 0;  // snorm/unorm clamp, and the rest aren't numbers.
+    } // switch
+} // fold_shape
+
+// Round or wrap an element the way its type would store it. Fails if it
+//  isn't finite, since the hardware might not agree with us about those.
+static int fold_store(FoldScalar *s, const MOJOSHADER_astDataTypeType type)
+{
+    switch (type)
+    {
+        case MOJOSHADER_AST_DATATYPE_BOOL:
+            s->i = (s->i != 0);
+            return 1;
+        case MOJOSHADER_AST_DATATYPE_INT:
+            s->i = (int64) ((int32) ((uint32) s->i));
+            return 1;
+        case MOJOSHADER_AST_DATATYPE_UINT:
+            s->i = (int64) ((uint32) s->i);
+            return 1;
+        case MOJOSHADER_AST_DATATYPE_HALF:  // !!! FIXME: round to half?
+        case MOJOSHADER_AST_DATATYPE_FLOAT:
+            if (!(fabs(s->f) <= FLT_MAX))  // this catches NaN, too.
+                return 0;
+            s->f = (double) ((float) s->f);
+            return 1;
+        case MOJOSHADER_AST_DATATYPE_DOUBLE:
+            return (fabs(s->f) <= DBL_MAX);
+        default:
+            return 0;
+    } // switch
+} // fold_store
+
+// Convert an element from one scalar type to another, if it fits.
+static int fold_convert(FoldScalar *s, const MOJOSHADER_astDataTypeType from,
+                        const MOJOSHADER_astDataTypeType to)
+{
+    if (fold_isfloat(from))
+    {
+        const double f = s->f;
+        if (to == MOJOSHADER_AST_DATATYPE_BOOL)
+            s->i = (f != 0.0);
+        else if (to == MOJOSHADER_AST_DATATYPE_INT)
+        {
+            if (!((f > -2147483649.0) && (f < 2147483648.0)))
+                return 0;
+            s->i = (int64) f;  // truncates toward zero.
+        } // else if
+        else if (to == MOJOSHADER_AST_DATATYPE_UINT)
+        {
+            if (!((f > -1.0) && (f < 4294967296.0)))
+                return 0;
+            s->i = (int64) f;  // truncates toward zero.
+        } // else if
+    } // if
+    else if (fold_isfloat(to))
+    {
+        s->f = (double) s->i;
+    } // else if
+
+    return fold_store(s, to);
+} // fold_convert
+
+static inline double fold_double(const FoldValue *val, const int idx)
+{
+    const FoldScalar *s = &val->value[idx];
+    return fold_isfloat(val->shape.type) ? s->f : (double) s->i;
+} // fold_double
+
+// Is this already as simple as folding would make it?
+static int fold_is_scalar_literal(Context *ctx,
+                                  const MOJOSHADER_astExpression *expr)
+{
+    if (expr->ast.type == MOJOSHADER_AST_OP_CAST)
+    {
+        // uint, half and double don't have literals, so these need a cast.
+        const MOJOSHADER_astDataType *dt = reduce_datatype(ctx, expr->datatype);
+        if ((dt == NULL) || ((dt->type != MOJOSHADER_AST_DATATYPE_UINT) &&
+                             (dt->type != MOJOSHADER_AST_DATATYPE_HALF) &&
+                             (dt->type != MOJOSHADER_AST_DATATYPE_DOUBLE)))
+            return 0;
+        expr = ((const MOJOSHADER_astExpressionCast *) expr)->operand;
+    } // if
+
+    switch (expr->ast.type)
+    {
+        case MOJOSHADER_AST_OP_INT_LITERAL:
+        case MOJOSHADER_AST_OP_FLOAT_LITERAL:
+        case MOJOSHADER_AST_OP_BOOLEAN_LITERAL:
+            return 1;
+        default:
+            return 0;
+    } // switch
+} // fold_is_scalar_literal
+
+static int fold_is_literal(Context *ctx, const MOJOSHADER_astExpression *expr)
+{
+    const MOJOSHADER_astArguments *arg;
+
+    if (expr->ast.type != MOJOSHADER_AST_OP_CONSTRUCTOR)
+        return fold_is_scalar_literal(ctx, expr);
+
+    arg = ((const MOJOSHADER_astExpressionConstructor *) expr)->args;
+    for (; arg != NULL; arg = arg->next)
+    {
+        if (!fold_is_scalar_literal(ctx, arg->argument))
+            return 0;
+    } // for
+
+    return 1;
+} // fold_is_literal
+
+static MOJOSHADER_astExpression *fold_build_scalar(Context *ctx,
+                                        const MOJOSHADER_astDataTypeType type,
+                                        const FoldScalar *s)
+{
+    MOJOSHADER_astExpression *literal = NULL;
+
+    switch (type)
+    {
+        case MOJOSHADER_AST_DATATYPE_BOOL:
+            return new_literal_boolean_expr(ctx, (int) s->i);
+        case MOJOSHADER_AST_DATATYPE_INT:
+            return new_literal_int_expr(ctx, (int) s->i);
+        case MOJOSHADER_AST_DATATYPE_FLOAT:
+            return new_literal_float_expr(ctx, s->f);
+        case MOJOSHADER_AST_DATATYPE_UINT:
+            literal = new_literal_int_expr(ctx, (int) ((uint32) s->i));
+            break;
+        default:
+            literal = new_literal_float_expr(ctx, s->f);
+            break;
+    } // switch
+
+    if (literal == NULL)
+        return NULL;
+    return new_cast_expr(ctx, scalar_datatype(ctx, type), literal);
+} // fold_build_scalar
+
+static MOJOSHADER_astExpression *fold_build(Context *ctx,
+                                            const MOJOSHADER_astDataType *dt,
+                                            const FoldValue *val)
+{
+    MOJOSHADER_astArguments *args = NULL;
+    int i;
+
+    dt = reduce_datatype(ctx, dt);
+    if (scalar_datatype(ctx, dt->type) != NULL)
+        return fold_build_scalar(ctx, val->shape.type, &val->value[0]);
+
+    for (i = val->shape.elems - 1; i >= 0; i--)
+    {
+        MOJOSHADER_astExpression *expr;
+        MOJOSHADER_astArguments *arg = NULL;
+        expr = fold_build_scalar(ctx, val->shape.type, &val->value[i]);
+        if (expr != NULL)
+            arg = new_argument(ctx, expr);
+        if (arg == NULL)
+            return NULL;  // out of memory.
+        arg->next = args;
+        args = arg;
+    } // for
+
+    return new_constructor_expr(ctx, dt, args);
+} // fold_build
+
+// never trust a value that doesn't match what the AST says it is.
+static int fold_matches_datatype(Context *ctx,
+                                 const MOJOSHADER_astExpression *expr,
+                                 const FoldValue *val)
+{
+    FoldShape shape;
+    return ( (fold_shape(ctx, expr->datatype, &shape)) &&
+             (fold_same_shape(&shape, &val->shape)) );
+} // fold_matches_datatype
+
+// Swap a constant expression for literals, unless it's already that simple.
+static void fold_replace(Context *ctx, MOJOSHADER_astExpression **_expr,
+                         const FoldValue *val)
+{
+    MOJOSHADER_astExpression *expr = *_expr;
+    const char *prev_sourcefile = ctx->sourcefile;
+    const unsigned int prev_sourceline = ctx->sourceline;
+
+    if (fold_is_literal(ctx, expr))
+        return;
+
+    // so the new nodes report the same source position, but put the
+    //  position back afterwards so we don't skew later error messages.
+    ctx->sourcefile = expr->ast.filename;
+    ctx->sourceline = expr->ast.line;
+    expr = fold_build(ctx, expr->datatype, val);
+    ctx->sourcefile = prev_sourcefile;
+    ctx->sourceline = prev_sourceline;
+
+    if (expr != NULL)
+        *_expr = expr;
+} // fold_replace
+
+// Operands are replaced with literals as soon as we know they're constant,
+//  so it doesn't matter if the expression they belong to can't be folded.
+static int fold_operand(Context *ctx, Folding *fold,
+                        MOJOSHADER_astExpression **_expr, FoldValue *val)
+{
+    if (!fold_expr(ctx, fold, _expr, val))
+        return 0;
+    fold_replace(ctx, _expr, val);
+    return 1;
+} // fold_operand
+
+static void fold_slot(Context *ctx, Folding *fold,
+                      MOJOSHADER_astExpression **_expr)
+{
+    FoldValue val;
+    fold_operand(ctx, fold, _expr, &val);
+} // fold_slot
+
+// Assignment targets can't be folded, but array indexes inside them can.
+static void fold_lvalue(Context *ctx, Folding *fold,
+                        MOJOSHADER_astExpression *expr)
+{
+    while (expr != NULL)
+    {
+        if (expr->ast.type == MOJOSHADER_AST_OP_DEREF_ARRAY)
+        {
+            MOJOSHADER_astExpressionBinary *deref;
+            deref = (MOJOSHADER_astExpressionBinary *) expr;
+            fold_slot(ctx, fold, &deref->right);
+            expr = deref->left;
+        } // if
+        else if (expr->ast.type == MOJOSHADER_AST_OP_DEREF_STRUCT)
+            expr = ((MOJOSHADER_astExpressionDerefStruct *) expr)->identifier;
+        else
+            break;
+    } // while
+} // fold_lvalue
+
+static int fold_identifier(Context *ctx, Folding *fold,
+                           const MOJOSHADER_astExpressionIdentifier *ast,
+                           FoldValue *val)
+{
+    const void *value = NULL;
+    const FoldConstant *constant;
+
+    if (ast->index >= 0)
+        return 0;  // locals are never constant here.
+    else if (!hash_find(fold->globals, ast->identifier, &value))
+        return 0;
+
+    constant = (const FoldConstant *) value;
+    if (!constant->usable)
+        return 0;
+
+    memcpy(val, &constant->value, sizeof (*val));
+    return 1;
+} // fold_identifier
+
+static int fold_unary(Context *ctx, Folding *fold,
+                      MOJOSHADER_astExpressionUnary *ast, FoldValue *val)
+{
+    MOJOSHADER_astDataTypeType type;
+    int isflt;
+    int i;
+
+    if (!fold_operand(ctx, fold, &ast->operand, val))
+        return 0;
+
+    type = val->shape.type;
+    isflt = fold_isfloat(type);
+    switch (ast->ast.type)
+    {
+        case MOJOSHADER_AST_OP_NEGATE:
+            if (type == MOJOSHADER_AST_DATATYPE_BOOL)
+                return 0;
+            for (i = 0; i < val->shape.elems; i++)
+            {
+                FoldScalar *s = &val->value[i];
+                if (isflt)
+                    s->f = -s->f;
+                else
+                    s->i = -s->i;
+                fold_store(s, type);
+            } // for
+            return 1;
+
+        case MOJOSHADER_AST_OP_COMPLEMENT:
+            if ((type != MOJOSHADER_AST_DATATYPE_INT) &&
+                (type != MOJOSHADER_AST_DATATYPE_UINT))
+                return 0;
+            for (i = 0; i < val->shape.elems; i++)
+            {
+                val->value[i].i = ~val->value[i].i;
+                fold_store(&val->value[i], type);
+            } // for
+            return 1;
+
+        case MOJOSHADER_AST_OP_NOT:
+            if (val->shape.elems != 1)
+                return 0;
+            if (isflt)
+                val->value[0].i = (val->value[0].f == 0.0);
+            else
+                val->value[0].i = (val->value[0].i == 0);
+            fold_scalar_shape(&val->shape, MOJOSHADER_AST_DATATYPE_BOOL);
+            return 1;
+
+        default: break;
+    } // switch
+
+    return 0;
+} // fold_unary
+
+// Does (*x = *x op *y), if the answer is knowable here.
+static int fold_binop(const MOJOSHADER_astNodeType op, const int isflt,
+                      FoldScalar *x, const FoldScalar *y)
+{
+    if (isflt)
+    {
+        const double a = x->f;
+        const double b = y->f;
+        switch (op)
+        {
+            case MOJOSHADER_AST_OP_MULTIPLY: x->f = a * b; return 1;
+            case MOJOSHADER_AST_OP_ADD: x->f = a + b; return 1;
+            case MOJOSHADER_AST_OP_SUBTRACT: x->f = a - b; return 1;
+            case MOJOSHADER_AST_OP_DIVIDE:
+                if (b == 0.0)
+                    return 0;
+                x->f = a / b;
+                return 1;
+            case MOJOSHADER_AST_OP_LESSTHAN: x->i = (a < b); return 1;
+            case MOJOSHADER_AST_OP_GREATERTHAN: x->i = (a > b); return 1;
+            case MOJOSHADER_AST_OP_LESSTHANOREQUAL: x->i = (a <= b); return 1;
+            case MOJOSHADER_AST_OP_GREATERTHANOREQUAL: x->i = (a >= b); return 1;
+            case MOJOSHADER_AST_OP_EQUAL: x->i = (a == b); return 1;
+            case MOJOSHADER_AST_OP_NOTEQUAL: x->i = (a != b); return 1;
+            case MOJOSHADER_AST_OP_LOGICALAND: x->i = ((a != 0.0) && (b != 0.0)); return 1;
+            case MOJOSHADER_AST_OP_LOGICALOR: x->i = ((a != 0.0) || (b != 0.0)); return 1;
+            default: return 0;  // the rest need integers.
+        } // switch
+    } // if
+
+    else
+    {
+        // do these unsigned, so they wrap instead of overflowing.
+        const int64 a = x->i;
+        const int64 b = y->i;
+        switch (op)
+        {
+            case MOJOSHADER_AST_OP_MULTIPLY: x->i = (int64) ((uint64) a * (uint64) b); return 1;
+            case MOJOSHADER_AST_OP_ADD: x->i = (int64) ((uint64) a + (uint64) b); return 1;
+            case MOJOSHADER_AST_OP_SUBTRACT: x->i = (int64) ((uint64) a - (uint64) b); return 1;
+            case MOJOSHADER_AST_OP_DIVIDE:
+                if (b == 0)
+                    return 0;
+                x->i = a / b;
+                return 1;
+            case MOJOSHADER_AST_OP_MODULO:
+                if (b == 0)
+                    return 0;
+                x->i = a % b;
+                return 1;
+            case MOJOSHADER_AST_OP_LSHIFT:
+                if ((b < 0) || (b > 31))
+                    return 0;
+                x->i = (int64) ((uint64) a << b);
+                return 1;
+            case MOJOSHADER_AST_OP_RSHIFT:  // uints are never negative here.
+                if ((b < 0) || (b > 31))
+                    return 0;
+                x->i = (a < 0) ? ~((~a) >> b) : (a >> b);
+                return 1;
+            case MOJOSHADER_AST_OP_BINARYAND: x->i = a & b; return 1;
+            case MOJOSHADER_AST_OP_BINARYXOR: x->i = a ^ b; return 1;
+            case MOJOSHADER_AST_OP_BINARYOR: x->i = a | b; return 1;
+            case MOJOSHADER_AST_OP_LESSTHAN: x->i = (a < b); return 1;
+            case MOJOSHADER_AST_OP_GREATERTHAN: x->i = (a > b); return 1;
+            case MOJOSHADER_AST_OP_LESSTHANOREQUAL: x->i = (a <= b); return 1;
+            case MOJOSHADER_AST_OP_GREATERTHANOREQUAL: x->i = (a >= b); return 1;
+            case MOJOSHADER_AST_OP_EQUAL: x->i = (a == b); return 1;
+            case MOJOSHADER_AST_OP_NOTEQUAL: x->i = (a != b); return 1;
+            case MOJOSHADER_AST_OP_LOGICALAND: x->i = ((a != 0) && (b != 0)); return 1;
+            case MOJOSHADER_AST_OP_LOGICALOR: x->i = ((a != 0) || (b != 0)); return 1;
+            default: return 0;
+        } // switch
+    } // else
+
+    return 0;
+} // fold_binop
+
+// Fold a left-associative binary operator whose left operand has already
+//  been folded. If (lconst) is non-zero, that operand was constant and its
+//  value is in (val).
+static int fold_link(Context *ctx, Folding *fold,
+                     MOJOSHADER_astExpressionBinary *ast, const int lconst,
+                     FoldValue *val)
+{
+    const MOJOSHADER_astNodeType op = ast->ast.type;
+    FoldValue right;
+    FoldShape shape;
+    int isflt;
+    int i;
+
+    if (!fold_operand(ctx, fold, &ast->right, &right))
+        return 0;
+    else if (!lconst)
+        return 0;
+    else if (op == MOJOSHADER_AST_OP_COMMA)
+    {
+        memcpy(val, &right, sizeof (*val));  // left side does nothing.
+        return 1;
+    } // else if
+    else if (!fold_same_shape(&val->shape, &right.shape))
+        return 0;
+    else if (!fold_shape(ctx, ast->datatype, &shape))
+        return 0;
+
+    switch (op)
+    {
+        case MOJOSHADER_AST_OP_LESSTHAN:
+        case MOJOSHADER_AST_OP_GREATERTHAN:
+        case MOJOSHADER_AST_OP_LESSTHANOREQUAL:
+        case MOJOSHADER_AST_OP_GREATERTHANOREQUAL:
+        case MOJOSHADER_AST_OP_EQUAL:
+        case MOJOSHADER_AST_OP_NOTEQUAL:
+        case MOJOSHADER_AST_OP_LOGICALAND:
+        case MOJOSHADER_AST_OP_LOGICALOR:
+            // !!! FIXME: these are componentwise on vectors.
+            if ((val->shape.elems != 1) || (shape.elems != 1) ||
+                (shape.type != MOJOSHADER_AST_DATATYPE_BOOL))
+                return 0;
+            break;
+
+        case MOJOSHADER_AST_OP_BINARYAND:
+        case MOJOSHADER_AST_OP_BINARYXOR:
+        case MOJOSHADER_AST_OP_BINARYOR:
+            if (!fold_same_shape(&shape, &val->shape))
+                return 0;
+            break;
+
+        default:
+            if (!fold_same_shape(&shape, &val->shape))
+                return 0;
+            else if (shape.type == MOJOSHADER_AST_DATATYPE_BOOL)
+                return 0;
+            break;
+    } // switch
+
+    isflt = fold_isfloat(val->shape.type);
+    for (i = 0; i < val->shape.elems; i++)
+    {
+        if (!fold_binop(op, isflt, &val->value[i], &right.value[i]))
+            return 0;
+        else if (!fold_store(&val->value[i], shape.type))
+            return 0;
+    } // for
+
+    val->shape = shape;
+    return 1;
+} // fold_link
+
+// This folds a whole chain of left-associative operators without recursing
+//  down it, the same way semantic analysis checks them; see
+//  push_left_chain().
+static int fold_binary(Context *ctx, Folding *fold,
+                       MOJOSHADER_astExpressionBinary *ast, FoldValue *val)
+{
+    const size_t base = ctx->walk_count;
+    MOJOSHADER_astExpressionBinary *link = push_left_chain(ctx, ast);
+    int isconst = fold_operand(ctx, fold, &link->left, val);
+
+    isconst = fold_link(ctx, fold, link, isconst, val);
+    while (ctx->walk_count > base)
+    {
+        MOJOSHADER_astExpressionBinary *parent;
+        parent = (MOJOSHADER_astExpressionBinary *) walk_pop(ctx);
+
+        // this is what fold_operand() does with the link we just finished.
+        assert(parent->left == (MOJOSHADER_astExpression *) link);
+        if (isconst)
+            isconst = fold_matches_datatype(ctx, parent->left, val);
+        if (isconst)
+            fold_replace(ctx, &parent->left, val);
+
+        link = parent;
+        isconst = fold_link(ctx, fold, link, isconst, val);
+    } // while
+
+    return isconst;
+} // fold_binary
+
+static int fold_deref_array(Context *ctx, Folding *fold,
+                            MOJOSHADER_astExpressionBinary *ast,
+                            FoldValue *val)
+{
+    const int lconst = fold_operand(ctx, fold, &ast->left, val);
+    FoldValue index;
+    FoldShape shape;
+    int64 idx;
+
+    if (!fold_operand(ctx, fold, &ast->right, &index))
+        return 0;
+    else if ((!lconst) || (val->shape.ismatrix))  // !!! FIXME: matrix rows?
+        return 0;
+    else if ((index.shape.elems != 1) || (fold_isfloat(index.shape.type)))
+        return 0;
+    else if (!fold_shape(ctx, ast->datatype, &shape))
+        return 0;
+    else if ((shape.elems != 1) || (shape.type != val->shape.type))
+        return 0;
+
+    idx = index.value[0].i;
+    if ((idx < 0) || (idx >= val->shape.elems))
+        return 0;  // leave it for runtime to sort out.
+
+    val->value[0] = val->value[idx];
+    val->shape = shape;
+    return 1;
+} // fold_deref_array
+
+static int fold_deref_struct(Context *ctx, Folding *fold,
+                             MOJOSHADER_astExpressionDerefStruct *ast,
+                             FoldValue *val)
+{
+    FoldScalar swizzled[4];
+    FoldShape shape;
+    int i;
+
+    if (!fold_operand(ctx, fold, &ast->identifier, val))
+        return 0;
+    else if (!ast->isswizzle)
+        return 0;  // !!! FIXME: constant structs?
+    else if ((val->shape.ismatrix) || (!fold_shape(ctx, ast->datatype, &shape)))
+        return 0;
+    else if ((shape.type != val->shape.type) || (shape.elems > 4))
+        return 0;
+    else if (strlen(ast->member) != (size_t) shape.elems)
+        return 0;
+
+    for (i = 0; i < shape.elems; i++)
+    {
+        const int chan = (int) swiz_to_channel(ast->member[i]);
+        if (chan >= val->shape.elems)
+            return 0;
+        swizzled[i] = val->value[chan];
+    } // for
+
+    memcpy(val->value, swizzled, sizeof (swizzled[0]) * shape.elems);
+    val->shape = shape;
+    return 1;
+} // fold_deref_struct
+
+static int fold_conditional(Context *ctx, Folding *fold,
+                            MOJOSHADER_astExpressionTernary *ast,
+                            FoldValue *val)
+{
+    // HLSL evaluates both sides, so we can't drop one unless both are
+    //  constant, in case the other has side effects.
+    FoldValue test;
+    FoldValue other;
+    const int tconst = fold_operand(ctx, fold, &ast->left, &test);
+    const int cconst = fold_operand(ctx, fold, &ast->center, val);
+    const int rconst = fold_operand(ctx, fold, &ast->right, &other);
+
+    if ((!tconst) || (!cconst) || (!rconst))
+        return 0;
+    else if (test.shape.elems != 1)
+        return 0;  // !!! FIXME: componentwise select.
+    else if (!fold_same_shape(&val->shape, &other.shape))
+        return 0;
+    else if (fold_double(&test, 0) == 0.0)
+        memcpy(val, &other, sizeof (*val));
+
+    return 1;
+} // fold_conditional
+
+static int fold_cast(Context *ctx, Folding *fold,
+                     MOJOSHADER_astExpressionCast *ast, FoldValue *val)
+{
+    FoldShape shape;
+    int i;
+
+    if (!fold_operand(ctx, fold, &ast->operand, val))
+        return 0;
+    else if (!fold_shape(ctx, ast->datatype, &shape))
+        return 0;
+
+    if (val->shape.elems == 1)  // splat a scalar out to every element.
+    {
+        FoldScalar s = val->value[0];
+        if (!fold_convert(&s, val->shape.type, shape.type))
+            return 0;
+        for (i = 0; i < shape.elems; i++)
+            val->value[i] = s;
+    } // if
+
+    // same size, or chopping the end off a vector.
+    else if ( ((val->shape.elems == shape.elems) &&
+               (val->shape.ismatrix == shape.ismatrix)) ||
+              ((val->shape.elems > shape.elems) &&
+               (!val->shape.ismatrix) && (!shape.ismatrix)) )
+    {
+        for (i = 0; i < shape.elems; i++)
+        {
+            if (!fold_convert(&val->value[i], val->shape.type, shape.type))
+                return 0;
+        } // for
+    } // else if
+
+    else
+    {
+        return 0;  // !!! FIXME: matrix truncation.
+    } // else
+
+    val->shape = shape;
+    return 1;
+} // fold_cast
+
+static int fold_constructor(Context *ctx, Folding *fold,
+                            MOJOSHADER_astExpressionConstructor *ast,
+                            FoldValue *val)
+{
+    MOJOSHADER_astArguments *arg;
+    FoldValue argval;
+    FoldShape shape;
+    int isconst = fold_shape(ctx, ast->datatype, &shape);
+    int count = 0;
+    int i;
+
+    for (arg = ast->args; arg != NULL; arg = arg->next)
+    {
+        if (!fold_operand(ctx, fold, &arg->argument, &argval))
+            isconst = 0;
+        else if ((isconst) && (count + argval.shape.elems > shape.elems))
+            isconst = 0;
+
+        for (i = 0; (isconst) && (i < argval.shape.elems); i++)
+        {
+            FoldScalar *s = &val->value[count++];
+            *s = argval.value[i];
+            isconst = fold_convert(s, argval.shape.type, shape.type);
+        } // for
+    } // for
+
+    if ((!isconst) || (count != shape.elems))
+        return 0;
+
+    val->shape = shape;
+    return 1;
+} // fold_constructor
+
+static double fold_degrees(double x) { return x * 57.295779513082320876798; }
+static double fold_radians(double x) { return x * 0.017453292519943295769; }
+static double fold_frac(double x) { return x - floor(x); }
+static double fold_rsqrt(double x) { return 1.0 / sqrt(x); }
+static double fold_exp2(double x) { return pow(2.0, x); }
+static double fold_log2(double x) { return log(x) / log(2.0); }
+static double fold_trunc(double x) { return (x < 0.0) ? ceil(x) : floor(x); }
+static double fold_min(double x, double y) { return (x < y) ? x : y; }
+static double fold_max(double x, double y) { return (x > y) ? x : y; }
+static double fold_step(double y, double x) { return (x >= y) ? 1.0 : 0.0; }
+static double fold_saturate(double x) { return fold_min(fold_max(x, 0.0), 1.0); }
+static double fold_clamp(double x, double lo, double hi) { return fold_min(fold_max(x, lo), hi); }
+static double fold_lerp(double x, double y, double s) { return x + s * (y - x); }
+
+static double fold_sign(double x)
+{
+    return (x > 0.0) ? 1.0 : ((x < 0.0) ? -1.0 : 0.0);
+} // fold_sign
+
+static double fold_round(double x)
+{
+    // halfway cases round to even, like the hardware.
+    double retval = floor(x);
+    const double diff = x - retval;
+    if ((diff > 0.5) || ((diff == 0.5) && (fmod(retval, 2.0) != 0.0)))
+        retval += 1.0;
+    return retval;
+} // fold_round
+
+static double fold_pow(double x, double y)
+{
+    // the hardware does exp2(y * log2(x)), so a negative x is NaN there,
+    //  and x == 0 gives exp2(y * -inf): NaN for y == 0, inf for y < 0. C's
+    //  pow() says 1 and inf (with a pole error) for those, so leave them
+    //  for runtime, too.
+    if ((x < 0.0) || ((x == 0.0) && (y <= 0.0)))
+        return HUGE_VAL;
+    return pow(x, y);
+} // fold_pow
+
+static double fold_smoothstep(double lo, double hi, double x)
+{
+    double t;
+    if (lo == hi)
+        return HUGE_VAL;  // undefined, so leave it for runtime.
+    t = fold_saturate((x - lo) / (hi - lo));
+    return t * t * (3.0 - (2.0 * t));
+} // fold_smoothstep
+
+typedef enum FoldIntrinsicType
+{
+    FOLDFN_EACH,  // componentwise; one of the function pointers does it.
+    FOLDFN_DOT,
+    FOLDFN_LENGTH,
+    FOLDFN_DISTANCE,
+    FOLDFN_NORMALIZE,
+    FOLDFN_CROSS
+} FoldIntrinsicType;
+
+typedef struct FoldIntrinsic
+{
+    const char *name;
+    FoldIntrinsicType type;
+    int argc;
+    double (*fn1)(double);
+    double (*fn2)(double, double);
+    double (*fn3)(double, double, double);
+} FoldIntrinsic;
+
+static const FoldIntrinsic fold_intrinsics[] = {
+    { "abs", FOLDFN_EACH, 1, fabs, NULL, NULL },
+    { "acos", FOLDFN_EACH, 1, acos, NULL, NULL },
+    { "asin", FOLDFN_EACH, 1, asin, NULL, NULL },
+    { "atan", FOLDFN_EACH, 1, atan, NULL, NULL },
+    { "atan2", FOLDFN_EACH, 2, NULL, atan2, NULL },
+    { "ceil", FOLDFN_EACH, 1, ceil, NULL, NULL },
+    { "clamp", FOLDFN_EACH, 3, NULL, NULL, fold_clamp },
+    { "cos", FOLDFN_EACH, 1, cos, NULL, NULL },
+    { "cosh", FOLDFN_EACH, 1, cosh, NULL, NULL },
+    { "cross", FOLDFN_CROSS, 2, NULL, NULL, NULL },
+    { "degrees", FOLDFN_EACH, 1, fold_degrees, NULL, NULL },
+    { "distance", FOLDFN_DISTANCE, 2, NULL, NULL, NULL },
+    { "dot", FOLDFN_DOT, 2, NULL, NULL, NULL },
+    { "exp", FOLDFN_EACH, 1, exp, NULL, NULL },
+    { "exp2", FOLDFN_EACH, 1, fold_exp2, NULL, NULL },
+    { "floor", FOLDFN_EACH, 1, floor, NULL, NULL },
+    { "fmod", FOLDFN_EACH, 2, NULL, fmod, NULL },
+    { "frac", FOLDFN_EACH, 1, fold_frac, NULL, NULL },
+    { "length", FOLDFN_LENGTH, 1, NULL, NULL, NULL },
+    { "lerp", FOLDFN_EACH, 3, NULL, NULL, fold_lerp },
+    { "log", FOLDFN_EACH, 1, log, NULL, NULL },
+    { "log10", FOLDFN_EACH, 1, log10, NULL, NULL },
+    { "log2", FOLDFN_EACH, 1, fold_log2, NULL, NULL },
+    { "max", FOLDFN_EACH, 2, NULL, fold_max, NULL },
+    { "min", FOLDFN_EACH, 2, NULL, fold_min, NULL },
+    { "normalize", FOLDFN_NORMALIZE, 1, NULL, NULL, NULL },
+    { "pow", FOLDFN_EACH, 2, NULL, fold_pow, NULL },
+    { "radians", FOLDFN_EACH, 1, fold_radians, NULL, NULL },
+    { "round", FOLDFN_EACH, 1, fold_round, NULL, NULL },
+    { "rsqrt", FOLDFN_EACH, 1, fold_rsqrt, NULL, NULL },
+    { "saturate", FOLDFN_EACH, 1, fold_saturate, NULL, NULL },
+    { "sign", FOLDFN_EACH, 1, fold_sign, NULL, NULL },
+    { "sin", FOLDFN_EACH, 1, sin, NULL, NULL },
+    { "sinh", FOLDFN_EACH, 1, sinh, NULL, NULL },
+    { "smoothstep", FOLDFN_EACH, 3, NULL, NULL, fold_smoothstep },
+    { "sqrt", FOLDFN_EACH, 1, sqrt, NULL, NULL },
+    { "step", FOLDFN_EACH, 2, NULL, fold_step, NULL },
+    { "tan", FOLDFN_EACH, 1, tan, NULL, NULL },
+    { "tanh", FOLDFN_EACH, 1, tanh, NULL, NULL },
+    { "trunc", FOLDFN_EACH, 1, fold_trunc, NULL, NULL },
+};
+
+static const FoldIntrinsic *fold_find_intrinsic(const char *name)
+{
+    int i;
+    for (i = 0; i < STATICARRAYLEN(fold_intrinsics); i++)
+    {
+        if (strcmp(fold_intrinsics[i].name, name) == 0)
+            return &fold_intrinsics[i];
+    } // for
+    return NULL;
+} // fold_find_intrinsic
+
+static int fold_intrinsic(Context *ctx, const FoldIntrinsic *fn,
+                          const FoldValue *args,
+                          const MOJOSHADER_astDataType *dt, FoldValue *val)
+{
+    const int elems = args[0].shape.elems;
+    double result[16];
+    double sum = 0.0;
+    FoldShape shape;
+    int i;
+
+    if (!fold_shape(ctx, dt, &shape))
+        return 0;
+    for (i = 1; i < fn->argc; i++)
+    {
+        if (!fold_same_shape(&args[0].shape, &args[i].shape))
+            return 0;
+    } // for
+
+    switch (fn->type)
+    {
+        case FOLDFN_EACH:
+            if (shape.elems != elems)
+                return 0;
+            for (i = 0; i < elems; i++)
+            {
+                const double x = fold_double(&args[0], i);
+                if (fn->argc == 1)
+                    result[i] = fn->fn1(x);
+                else if (fn->argc == 2)
+                    result[i] = fn->fn2(x, fold_double(&args[1], i));
+                else
+                {
+                    result[i] = fn->fn3(x, fold_double(&args[1], i),
+                                           fold_double(&args[2], i));
+                } // else
+            } // for
+            break;
+
+        case FOLDFN_DOT:
+        case FOLDFN_LENGTH:
+        case FOLDFN_DISTANCE:
+        case FOLDFN_NORMALIZE:
+            for (i = 0; i < elems; i++)
+            {
+                const double x = fold_double(&args[0], i);
+                if (fn->type == FOLDFN_DOT)
+                    sum += x * fold_double(&args[1], i);
+                else if (fn->type == FOLDFN_DISTANCE)
+                {
+                    const double diff = x - fold_double(&args[1], i);
+                    sum += diff * diff;
+                } // else if
+                else
+                {
+                    sum += x * x;
+                } // else
+            } // for
+
+            if (fn->type == FOLDFN_DOT)
+                result[0] = sum;
+            else if (fn->type != FOLDFN_NORMALIZE)
+                result[0] = sqrt(sum);
+            else if ((sum == 0.0) || (shape.elems != elems))
+                return 0;  // a zero vector doesn't have a direction.
+            else
+            {
+                const double len = sqrt(sum);
+                for (i = 0; i < elems; i++)
+                    result[i] = fold_double(&args[0], i) / len;
+            } // else
+            break;
+
+        case FOLDFN_CROSS:
+            if ((elems != 3) || (shape.elems != 3))
+                return 0;
+            #define FOLDCROSS(a, b) \
+                ((fold_double(&args[0], a) * fold_double(&args[1], b)) - \
+                 (fold_double(&args[0], b) * fold_double(&args[1], a)))
+            result[0] = FOLDCROSS(1, 2);
+            result[1] = FOLDCROSS(2, 0);
+            result[2] = FOLDCROSS(0, 1);
+            #undef FOLDCROSS
+            break;
+
+        default:
+            assert(0 && "unexpected intrinsic type");
+            return 0;
+    } // switch
+
+    for (i = 0; i < shape.elems; i++)
+    {
+        val->value[i].f = result[i];
+        if (!fold_convert(&val->value[i], MOJOSHADER_AST_DATATYPE_DOUBLE,
+                          shape.type))
+            return 0;
+    } // for
+
+    val->shape = shape;
+    return 1;
+} // fold_intrinsic
+
+static int fold_call(Context *ctx, Folding *fold,
+                     MOJOSHADER_astExpressionCallFunction *ast,
+                     FoldValue *val)
+{
+    const FoldIntrinsic *fn = NULL;
+    MOJOSHADER_astArguments *arg;
+    FoldValue args[3];
+    int isconst = 1;
+    int argc = 0;
+
+    if (ast->identifier->index < 0)  // negative indexes are intrinsics.
+        fn = fold_find_intrinsic(ast->identifier->identifier);
+
+    for (arg = ast->args; arg != NULL; arg = arg->next, argc++)
+    {
+        if ((fn == NULL) || (argc >= fn->argc))
+        {
+            fold_slot(ctx, fold, &arg->argument);
+            isconst = 0;
+        } // if
+        else if (!fold_operand(ctx, fold, &arg->argument, &args[argc]))
+            isconst = 0;
+    } // for
+
+    if ((!isconst) || (fn == NULL) || (argc != fn->argc))
+        return 0;
+
+    return fold_intrinsic(ctx, fn, args, ast->datatype, val);
+} // fold_call
+
+static int fold_node(Context *ctx, Folding *fold, MOJOSHADER_astNode *ast,
+                     FoldValue *val)
+{
+    switch (ast->ast.type)
+    {
+        case MOJOSHADER_AST_OP_INT_LITERAL:
+            fold_scalar_shape(&val->shape, MOJOSHADER_AST_DATATYPE_INT);
+            val->value[0].i = ast->intliteral.value;
+            return 1;
+
+        case MOJOSHADER_AST_OP_FLOAT_LITERAL:
+            fold_scalar_shape(&val->shape, MOJOSHADER_AST_DATATYPE_FLOAT);
+            val->value[0].f = ast->floatliteral.value;
+            return fold_store(&val->value[0], val->shape.type);
+
+        case MOJOSHADER_AST_OP_BOOLEAN_LITERAL:
+            fold_scalar_shape(&val->shape, MOJOSHADER_AST_DATATYPE_BOOL);
+            val->value[0].i = ast->boolliteral.value;
+            return 1;
+
+        case MOJOSHADER_AST_OP_IDENTIFIER:
+            return fold_identifier(ctx, fold, &ast->identifier, val);
+
+        case MOJOSHADER_AST_OP_NEGATE:
+        case MOJOSHADER_AST_OP_COMPLEMENT:
+        case MOJOSHADER_AST_OP_NOT:
+            return fold_unary(ctx, fold, &ast->unary, val);
+
+        case MOJOSHADER_AST_OP_CAST:
+            return fold_cast(ctx, fold, &ast->cast, val);
+
+        case MOJOSHADER_AST_OP_PREINCREMENT:
+        case MOJOSHADER_AST_OP_PREDECREMENT:
+        case MOJOSHADER_AST_OP_POSTINCREMENT:
+        case MOJOSHADER_AST_OP_POSTDECREMENT:
+            fold_lvalue(ctx, fold, ast->unary.operand);
+            return 0;
+
+        case MOJOSHADER_AST_OP_COMMA:
+        case MOJOSHADER_AST_OP_MULTIPLY:
+        case MOJOSHADER_AST_OP_DIVIDE:
+        case MOJOSHADER_AST_OP_MODULO:
+        case MOJOSHADER_AST_OP_ADD:
+        case MOJOSHADER_AST_OP_SUBTRACT:
+        case MOJOSHADER_AST_OP_LSHIFT:
+        case MOJOSHADER_AST_OP_RSHIFT:
+        case MOJOSHADER_AST_OP_LESSTHAN:
+        case MOJOSHADER_AST_OP_GREATERTHAN:
+        case MOJOSHADER_AST_OP_LESSTHANOREQUAL:
+        case MOJOSHADER_AST_OP_GREATERTHANOREQUAL:
+        case MOJOSHADER_AST_OP_EQUAL:
+        case MOJOSHADER_AST_OP_NOTEQUAL:
+        case MOJOSHADER_AST_OP_BINARYAND:
+        case MOJOSHADER_AST_OP_BINARYXOR:
+        case MOJOSHADER_AST_OP_BINARYOR:
+        case MOJOSHADER_AST_OP_LOGICALAND:
+        case MOJOSHADER_AST_OP_LOGICALOR:
+            return fold_binary(ctx, fold, &ast->binary, val);
+
+        case MOJOSHADER_AST_OP_ASSIGN:
+        case MOJOSHADER_AST_OP_MULASSIGN:
+        case MOJOSHADER_AST_OP_DIVASSIGN:
+        case MOJOSHADER_AST_OP_MODASSIGN:
+        case MOJOSHADER_AST_OP_ADDASSIGN:
+        case MOJOSHADER_AST_OP_SUBASSIGN:
+        case MOJOSHADER_AST_OP_LSHIFTASSIGN:
+        case MOJOSHADER_AST_OP_RSHIFTASSIGN:
+        case MOJOSHADER_AST_OP_ANDASSIGN:
+        case MOJOSHADER_AST_OP_XORASSIGN:
+        case MOJOSHADER_AST_OP_ORASSIGN:
+            fold_lvalue(ctx, fold, ast->binary.left);
+            fold_slot(ctx, fold, &ast->binary.right);
+            return 0;
+
+        case MOJOSHADER_AST_OP_DEREF_ARRAY:
+            return fold_deref_array(ctx, fold, &ast->binary, val);
+
+        case MOJOSHADER_AST_OP_DEREF_STRUCT:
+            return fold_deref_struct(ctx, fold, &ast->derefstruct, val);
+
+        case MOJOSHADER_AST_OP_CONDITIONAL:
+            return fold_conditional(ctx, fold, &ast->ternary, val);
+
+        case MOJOSHADER_AST_OP_CALLFUNC:
+            return fold_call(ctx, fold, &ast->callfunc, val);
+
+        case MOJOSHADER_AST_OP_CONSTRUCTOR:
+            return fold_constructor(ctx, fold, &ast->constructor, val);
+
+        default: break;  // strings, etc.
+    } // switch
+
+    return 0;
+} // fold_node
+
+static int fold_expr(Context *ctx, Folding *fold,
+                     MOJOSHADER_astExpression **_expr, FoldValue *val)
+{
+    MOJOSHADER_astExpression *expr = *_expr;
+
+    if ((expr == NULL) || (ctx->out_of_memory))
+        return 0;
+    else if (!fold_node(ctx, fold, (MOJOSHADER_astNode *) expr, val))
+        return 0;
+
+    return fold_matches_datatype(ctx, expr, val);
+} // fold_expr
+
+static void fold_vardecl(Context *ctx, Folding *fold,
+                         MOJOSHADER_astVariableDeclaration *decl)
+{
+    for (; decl != NULL; decl = decl->next)
+        fold_slot(ctx, fold, &decl->initializer);
+} // fold_vardecl
+
+static void fold_statements(Context *ctx, Folding *fold,
+                            MOJOSHADER_astStatement *stmt)
+{
+    for (; stmt != NULL; stmt = stmt->next)
+    {
+        MOJOSHADER_astNode *ast = (MOJOSHADER_astNode *) stmt;
+        MOJOSHADER_astSwitchCases *cases;
+        switch (stmt->ast.type)
+        {
+            case MOJOSHADER_AST_STATEMENT_BLOCK:
+                fold_statements(ctx, fold, ast->blockstmt.statements);
+                break;
+
+            case MOJOSHADER_AST_STATEMENT_EXPRESSION:
+                fold_slot(ctx, fold, &ast->exprstmt.expr);
+                break;
+
+            case MOJOSHADER_AST_STATEMENT_IF:
+                fold_slot(ctx, fold, &ast->ifstmt.expr);
+                fold_statements(ctx, fold, ast->ifstmt.statement);
+                fold_statements(ctx, fold, ast->ifstmt.else_statement);
+                break;
+
+            case MOJOSHADER_AST_STATEMENT_SWITCH:
+                fold_slot(ctx, fold, &ast->switchstmt.expr);
+                for (cases = ast->switchstmt.cases; cases; cases = cases->next)
+                {
+                    fold_slot(ctx, fold, &cases->expr);
+                    fold_statements(ctx, fold, cases->statement);
+                } // for
+                break;
+
+            case MOJOSHADER_AST_STATEMENT_FOR:
+                fold_vardecl(ctx, fold, ast->forstmt.var_decl);
+                fold_slot(ctx, fold, &ast->forstmt.initializer);
+                fold_slot(ctx, fold, &ast->forstmt.looptest);
+                fold_slot(ctx, fold, &ast->forstmt.counter);
+                fold_statements(ctx, fold, ast->forstmt.statement);
+                break;
+
+            case MOJOSHADER_AST_STATEMENT_DO:
+                fold_statements(ctx, fold, ast->dostmt.statement);
+                fold_slot(ctx, fold, &ast->dostmt.expr);
+                break;
+
+            case MOJOSHADER_AST_STATEMENT_WHILE:
+                fold_slot(ctx, fold, &ast->whilestmt.expr);
+                fold_statements(ctx, fold, ast->whilestmt.statement);
+                break;
+
+            case MOJOSHADER_AST_STATEMENT_RETURN:
+                fold_slot(ctx, fold, &ast->returnstmt.expr);
+                break;
+
+            case MOJOSHADER_AST_STATEMENT_VARDECL:
+                fold_vardecl(ctx, fold, ast->vardeclstmt.declaration);
+                break;
+
+            default: break;  // nothing in there to fold.
+        } // switch
+    } // for
+} // fold_statements
+
+// Globals are folded in order, so by the time a function mentions a
+//  "static const" variable, we know if it's a constant.
+static void fold_globals(Context *ctx, Folding *fold,
+                         MOJOSHADER_astVariableDeclaration *decl)
+{
+    const int isconst = MOJOSHADER_AST_VARATTR_STATIC |
+                        MOJOSHADER_AST_VARATTR_CONST;
+
+    for (; decl != NULL; decl = decl->next)
+    {
+        const char *name = decl->details->identifier;
+        const void *value = NULL;
+        FoldConstant *constant;
+
+        constant = (FoldConstant *) ArenaMalloc(ctx, sizeof (*constant));
+        if (constant == NULL)
+            return;
+
+        // anything else can be changed at runtime, or by the app.
+        constant->usable = 0;
+        if ((decl->attributes & isconst) == isconst)
+        {
+            constant->usable = fold_operand(ctx, fold, &decl->initializer,
+                                            &constant->value);
+        } // if
+        else
+        {
+            fold_slot(ctx, fold, &decl->initializer);
+        } // else
+
+        // declared twice? Don't trust either one.
+        if (hash_find(fold->globals, name, &value))
+            ((FoldConstant *) value)->usable = 0;
+        else if (hash_insert(fold->globals, name, constant) != 1)
+            return;  // out of memory.
+    } // for
+} // fold_globals
+
+// Evaluate everything we can at compile time, so the IR doesn't have to.
+static void fold_constants(Context *ctx)
+{
+    MOJOSHADER_astCompilationUnit *unit;
+    Folding fold;
+    int i = 0;
+
+    fold.globals = hash_create(ctx, hash_hash_string, hash_keymatch_string,
+                               fold_nuke, 0, MallocBridge, FreeBridge, ctx);
+    if (fold.globals == NULL)
+        return;  // the IR can cope without this.
+
+    for (unit = &ctx->ast->compunit; unit != NULL; unit = unit->next, i++)
+    {
+        MOJOSHADER_astNode *ast = (MOJOSHADER_astNode *) unit;
+        if (!unit_is_reachable(ctx, i))
+            continue;  // never type checked, so don't look at it.
+        else if (unit->ast.type == MOJOSHADER_AST_COMPUNIT_VARIABLE)
+            fold_globals(ctx, &fold, ast->varunit.declaration);
+        else if (unit->ast.type == MOJOSHADER_AST_COMPUNIT_FUNCTION)
+            fold_statements(ctx, &fold, ast->funcunit.definition);
+    } // for
+
+    hash_destroy(fold.globals);
+} // fold_constants
+
+
+
+static MOJOSHADER_astData MOJOSHADER_out_of_mem_ast_data = {
+    1, &MOJOSHADER_out_of_mem_error, 0, 0, 0, 0, 0, 0
+};
+
+
+// !!! FIXME: cut and paste from assembler.
+static const MOJOSHADER_astData *build_failed_ast(Context *ctx)
+{
+    assert(isfail(ctx));
+
+    if (ctx->out_of_memory)
+        return &MOJOSHADER_out_of_mem_ast_data;
+        
+    MOJOSHADER_astData *retval = NULL;
+    retval = (MOJOSHADER_astData *) Malloc(ctx, sizeof (MOJOSHADER_astData));
+    if (retval == NULL)
+        return &MOJOSHADER_out_of_mem_ast_data;
+
+    memset(retval, '\0', sizeof (MOJOSHADER_astData));
+    retval->source_profile = ctx->source_profile;
+    retval->malloc = (ctx->malloc == MOJOSHADER_internal_malloc) ? NULL : ctx->malloc;
+    retval->free = (ctx->free == MOJOSHADER_internal_free) ? NULL : ctx->free;
+    retval->malloc_data = ctx->malloc_data;
+    retval->error_count = errorlist_count(ctx->errors);
+    retval->errors = errorlist_flatten(ctx->errors);
+
+    if (ctx->out_of_memory)
+    {
+        Free(ctx, retval);
+        return &MOJOSHADER_out_of_mem_ast_data;
+    } // if
+
+    return retval;
+} // build_failed_ast
+
+
+static const MOJOSHADER_astData *build_astdata(Context *ctx)
+{
+    MOJOSHADER_astData *retval = NULL;
+
+    if (ctx->out_of_memory)
+        return &MOJOSHADER_out_of_mem_ast_data;
 
     retval = (MOJOSHADER_astData *) Malloc(ctx, sizeof (MOJOSHADER_astData));
     if (retval == NULL)
@@ -6023,126 +7386,705 @@ static const MOJOSHADER_astData *build_astdata(Context *ctx)
 
     if (!isfail(ctx))
     {
-        retval->source_profile = ctx->source_profile;
-        retval->ast = ctx->ast;
+        retval->source_profile = ctx->source_profile;
+        retval->ast = ctx->ast;
+    } // if
+
+    retval->error_count = errorlist_count(ctx->errors);
+    retval->errors = errorlist_flatten(ctx->errors);
+    if (ctx->out_of_memory)
+    {
+        Free(ctx, retval);
+        return &MOJOSHADER_out_of_mem_ast_data;
+    } // if
+
+    retval->opaque = ctx;
+
+    return retval;
+} // build_astdata
+
+
+static void choose_src_profile(Context *ctx, const char *srcprofile)
+{
+    ctx->source_profile = srcprofile;
+
+    #define TEST_PROFILE(x) if (strcmp(srcprofile, x) == 0) { return; }
+
+    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_VS_1_1);
+    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_VS_2_0);
+    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_VS_3_0);
+    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_PS_1_1);
+    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_PS_1_2);
+    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_PS_1_3);
+    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_PS_1_4);
+    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_PS_2_0);
+    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_PS_3_0);
+
+    #undef TEST_PROFILE
+
+    fail(ctx, "Unknown profile");
+} // choose_src_profile
+
+
+static MOJOSHADER_compileData MOJOSHADER_out_of_mem_compile_data = {
+    1, &MOJOSHADER_out_of_mem_error, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+
+// !!! FIXME: cut and paste from assembler.
+static const MOJOSHADER_compileData *build_failed_compile(Context *ctx)
+{
+    assert(isfail(ctx));
+
+    MOJOSHADER_compileData *retval = NULL;
+    retval = (MOJOSHADER_compileData *) Malloc(ctx, sizeof (MOJOSHADER_compileData));
+    if (retval == NULL)
+        return &MOJOSHADER_out_of_mem_compile_data;
+
+    memset(retval, '\0', sizeof (MOJOSHADER_compileData));
+    retval->malloc = (ctx->malloc == MOJOSHADER_internal_malloc) ? NULL : ctx->malloc;
+    retval->free = (ctx->free == MOJOSHADER_internal_free) ? NULL : ctx->free;
+    retval->malloc_data = ctx->malloc_data;
+    retval->source_profile = ctx->source_profile;
+    retval->error_count = errorlist_count(ctx->errors);
+    retval->errors = errorlist_flatten(ctx->errors);
+    retval->warning_count = errorlist_count(ctx->warnings);
+    retval->warnings = errorlist_flatten(ctx->warnings);
+
+    if (ctx->out_of_memory)  // in case something failed up there.
+    {
+        MOJOSHADER_freeCompileData(retval);
+        return &MOJOSHADER_out_of_mem_compile_data;
+    } // if
+
+    return retval;
+} // build_failed_compile
+
+
+static const MOJOSHADER_compileData *build_compiledata(Context *ctx)
+{
+    assert(!isfail(ctx));
+
+    MOJOSHADER_compileData *retval = NULL;
+
+    retval = (MOJOSHADER_compileData *) Malloc(ctx, sizeof (MOJOSHADER_compileData));
+    if (retval == NULL)
+        return &MOJOSHADER_out_of_mem_compile_data;
+
+    memset(retval, '\0', sizeof (MOJOSHADER_compileData));
+    retval->malloc = (ctx->malloc == MOJOSHADER_internal_malloc) ? NULL : ctx->malloc;
+    retval->free = (ctx->free == MOJOSHADER_internal_free) ? NULL : ctx->free;
+    retval->malloc_data = ctx->malloc_data;
+    retval->source_profile = ctx->source_profile;
+
+    if (!isfail(ctx))
+    {
+        // !!! FIXME: build output and output_len here.
+    } // if
+
+    if (!isfail(ctx))
+    {
+        // !!! FIXME: build symbols and symbol_count here.
+    } // if
+
+    retval->error_count = errorlist_count(ctx->errors);
+    retval->errors = errorlist_flatten(ctx->errors);
+    retval->warning_count = errorlist_count(ctx->warnings);
+    retval->warnings = errorlist_flatten(ctx->warnings);
+
+    if (ctx->out_of_memory)  // in case something failed up there.
+    {
+        MOJOSHADER_freeCompileData(retval);
+        return &MOJOSHADER_out_of_mem_compile_data;
+    } // if
+
+    return retval;
+} // build_compiledata
+
+
+// API entry point...
+
+// !!! FIXME: move this (and a lot of other things) to mojoshader_ast.c.
+DLLEXPORT
+const MOJOSHADER_astData *MOJOSHADER_parseAstWithIncludeCache(
+                                    MOJOSHADER_includeCache *include_cache,
+                                    const char *srcprofile,
+                                    const char *filename, const char *source,
+                                    unsigned int sourcelen,
+                                    const MOJOSHADER_preprocessorDefine *defs,
+                                    unsigned int define_count,
+                                    MOJOSHADER_includeOpen include_open,
+                                    MOJOSHADER_includeClose include_close,
+                                    MOJOSHADER_malloc m, MOJOSHADER_free f,
+                                    void *d)
+{
+    const MOJOSHADER_astData *retval = NULL;
+    MOJOSHADER_allocPhase phase;
+    Context *ctx = NULL;
+
+    if ( ((m == NULL) && (f != NULL)) || ((m != NULL) && (f == NULL)) )
+        return &MOJOSHADER_out_of_mem_ast_data;  // supply both or neither.
+
+    phase = alloc_phase(m, d, MOJOSHADER_ALLOCPHASE_CONTEXT);
+    ctx = build_context(m, f, d);
+    if (ctx == NULL)
+    {
+        alloc_phase(m, d, phase);
+        return &MOJOSHADER_out_of_mem_ast_data;
+    } // if
+
+    choose_src_profile(ctx, srcprofile);
+
+    if (!isfail(ctx))
+    {
+        parse_source(ctx, filename, source, sourcelen, defs, define_count,
+                     include_open, include_close, include_cache);
     } // if
 
-    retval->error_count = errorlist_count(ctx->errors);
-    retval->errors = errorlist_flatten(ctx->errors);
-    if (ctx->out_of_memory)
+    set_alloc_phase(ctx, MOJOSHADER_ALLOCPHASE_PARSEDATA);
+    if (!isfail(ctx))
+        retval = build_astdata(ctx);  // ctx isn't destroyed yet!
+    else
     {
-        Free(ctx, retval);
-        return &MOJOSHADER_out_of_mem_ast_data;
+        retval = (MOJOSHADER_astData *) build_failed_ast(ctx);
+        destroy_context(ctx);
+    } // else
+
+    alloc_phase(m, d, phase);
+    return retval;
+} // MOJOSHADER_parseAstWithIncludeCache
+
+
+const MOJOSHADER_astData *MOJOSHADER_parseAst(const char *srcprofile,
+                                    const char *filename, const char *source,
+                                    unsigned int sourcelen,
+                                    const MOJOSHADER_preprocessorDefine *defs,
+                                    unsigned int define_count,
+                                    MOJOSHADER_includeOpen include_open,
+                                    MOJOSHADER_includeClose include_close,
+                                    MOJOSHADER_malloc m, MOJOSHADER_free f,
+                                    void *d)
+{
+    return MOJOSHADER_parseAstWithIncludeCache(NULL, srcprofile, filename,
+                          source, sourcelen, defs, define_count,
+                          include_open, include_close, m, f, d);
+} // MOJOSHADER_parseAst
+
+
+void MOJOSHADER_freeAstData(const MOJOSHADER_astData *_data)
+{
+    MOJOSHADER_astData *data = (MOJOSHADER_astData *) _data;
+    if ((data == NULL) || (data == &MOJOSHADER_out_of_mem_ast_data))
+        return;  // no-op.
+
+    // !!! FIXME: this needs to live for deleting the stringcache and the ast.
+    Context *ctx = (Context *) data->opaque;
+    MOJOSHADER_free f = (data->free == NULL) ? MOJOSHADER_internal_free : data->free;
+    void *d = data->malloc_data;
+    int i;
+
+    // we don't f(data->source_profile), because that's internal static data.
+
+    for (i = 0; i < data->error_count; i++)
+    {
+        f((void *) data->errors[i].error, d);
+        f((void *) data->errors[i].filename, d);
+    } // for
+    f((void *) data->errors, d);
+
+    // don't delete data->ast (it'll delete with the context).
+    f(data, d);
+
+    destroy_context(ctx);  // finally safe to destroy this.
+} // MOJOSHADER_freeAstData
+
+
+// Compact AST...
+
+typedef struct CompactAstPending
+{
+    const MOJOSHADER_astNode *node;
+    unsigned int parent;
+} CompactAstPending;
+
+typedef struct CompactAstBuilder
+{
+    MOJOSHADER_malloc malloc;
+    MOJOSHADER_free free;
+    void *malloc_data;
+    MOJOSHADER_astCompactNode *nodes;
+    unsigned int *lines;
+    unsigned int *files;
+    unsigned int node_count;
+    unsigned int node_space;
+    const char **filenames;
+    unsigned int filename_count;
+    unsigned int filename_space;
+    CompactAstPending *pending;
+    unsigned int pending_count;
+    unsigned int pending_space;
+    int out_of_memory;
+} CompactAstBuilder;
+
+// Returns a copy of the first (count) elements of (ptr) in a buffer with
+//  room for (space) elements, or NULL if out of memory. The old buffer is
+//  freed on success, and left alone on failure.
+static void *compact_grow(CompactAstBuilder *b, void *ptr, const size_t len,
+                          const unsigned int count, const unsigned int space)
+{
+    void *retval = b->malloc((int) (len * space), b->malloc_data);
+    if (retval == NULL)
+    {
+        b->out_of_memory = 1;
+        return NULL;
     } // if
 
-    retval->opaque = ctx;
+    if (ptr != NULL)
+    {
+        memcpy(retval, ptr, len * count);
+        b->free(ptr, b->malloc_data);
+    } // if
 
     return retval;
-} // build_astdata
+} // compact_grow
 
+static unsigned int compact_filename(CompactAstBuilder *b, const char *fname)
+{
+    unsigned int i;
 
-static void choose_src_profile(Context *ctx, const char *srcprofile)
+    if (fname == NULL)
+        return MOJOSHADER_AST_NO_NODE;
+
+    // filenames are interned, so comparing pointers is enough, and there
+    //  are rarely more than a handful of them.
+    for (i = 0; i < b->filename_count; i++)
+    {
+        if (b->filenames[i] == fname)
+            return i;
+    } // for
+
+    if (b->filename_count == b->filename_space)
+    {
+        const unsigned int space = b->filename_space ? b->filename_space * 2 : 4;
+        const char **ptr = (const char **) compact_grow(b, b->filenames,
+                            sizeof (char *), b->filename_count, space);
+        if (ptr == NULL)
+            return MOJOSHADER_AST_NO_NODE;
+        b->filenames = ptr;
+        b->filename_space = space;
+    } // if
+
+    b->filenames[b->filename_count] = fname;
+    return b->filename_count++;
+} // compact_filename
+
+static void compact_push(CompactAstBuilder *b, const void *node,
+                         const unsigned int parent)
 {
-    ctx->source_profile = srcprofile;
+    if ((node == NULL) || (b->out_of_memory))
+        return;
 
-    #define TEST_PROFILE(x) if (strcmp(srcprofile, x) == 0) { return; }
+    if (b->pending_count == b->pending_space)
+    {
+        const unsigned int space = b->pending_space ? b->pending_space * 2 : 64;
+        CompactAstPending *ptr = (CompactAstPending *) compact_grow(b,
+                b->pending, sizeof (CompactAstPending), b->pending_count, space);
+        if (ptr == NULL)
+            return;
+        b->pending = ptr;
+        b->pending_space = space;
+    } // if
 
-    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_VS_1_1);
-    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_VS_2_0);
-    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_VS_3_0);
-    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_PS_1_1);
-    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_PS_1_2);
-    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_PS_1_3);
-    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_PS_1_4);
-    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_PS_2_0);
-    TEST_PROFILE(MOJOSHADER_SRC_PROFILE_HLSL_PS_3_0);
+    b->pending[b->pending_count].node = (const MOJOSHADER_astNode *) node;
+    b->pending[b->pending_count].parent = parent;
+    b->pending_count++;
+} // compact_push
 
-    #undef TEST_PROFILE
+#define COMPACT_PUSH_LIST(type, list) { \
+    const type *item; \
+    for (item = (list); item != NULL; item = item->next) \
+        compact_push(b, item, parent); \
+}
 
-    fail(ctx, "Unknown profile");
-} // choose_src_profile
+// Queue (node)'s children in field order. Every kind of statement starts
+//  with a "next" pointer, so statement fields are always treated as lists.
+static void compact_push_children(CompactAstBuilder *b,
+                                  const MOJOSHADER_astNode *node,
+                                  const unsigned int parent)
+{
+    const MOJOSHADER_astNodeType type = node->ast.type;
 
+    if (operator_is_unary(type))  // this includes casts.
+    {
+        compact_push(b, node->unary.operand, parent);
+        return;
+    } // if
 
-static MOJOSHADER_compileData MOJOSHADER_out_of_mem_compile_data = {
-    1, &MOJOSHADER_out_of_mem_error, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-};
+    else if (operator_is_binary(type))
+    {
+        compact_push(b, node->binary.left, parent);
+        compact_push(b, node->binary.right, parent);
+        return;
+    } // else if
 
+    else if (operator_is_ternary(type))
+    {
+        compact_push(b, node->ternary.left, parent);
+        compact_push(b, node->ternary.center, parent);
+        compact_push(b, node->ternary.right, parent);
+        return;
+    } // else if
 
-// !!! FIXME: cut and paste from assembler.
-static const MOJOSHADER_compileData *build_failed_compile(Context *ctx)
+    switch (type)
+    {
+        case MOJOSHADER_AST_OP_DEREF_STRUCT:
+            compact_push(b, node->derefstruct.identifier, parent);
+            break;
+
+        case MOJOSHADER_AST_OP_CALLFUNC:
+            compact_push(b, node->callfunc.identifier, parent);
+            COMPACT_PUSH_LIST(MOJOSHADER_astArguments, node->callfunc.args);
+            break;
+
+        case MOJOSHADER_AST_OP_CONSTRUCTOR:
+            COMPACT_PUSH_LIST(MOJOSHADER_astArguments, node->constructor.args);
+            break;
+
+        case MOJOSHADER_AST_ARGUMENTS:
+            compact_push(b, node->arguments.argument, parent);
+            break;
+
+        case MOJOSHADER_AST_COMPUNIT_FUNCTION:
+            compact_push(b, node->funcunit.declaration, parent);
+            COMPACT_PUSH_LIST(MOJOSHADER_astStatement, node->funcunit.definition);
+            break;
+
+        case MOJOSHADER_AST_COMPUNIT_TYPEDEF:
+            compact_push(b, node->typedefunit.type_info, parent);
+            break;
+
+        case MOJOSHADER_AST_COMPUNIT_STRUCT:
+            compact_push(b, node->structunit.struct_info, parent);
+            break;
+
+        case MOJOSHADER_AST_COMPUNIT_VARIABLE:
+            COMPACT_PUSH_LIST(MOJOSHADER_astVariableDeclaration,
+                              node->varunit.declaration);
+            break;
+
+        case MOJOSHADER_AST_FUNCTION_SIGNATURE:
+            COMPACT_PUSH_LIST(MOJOSHADER_astFunctionParameters,
+                              node->funcsig.params);
+            break;
+
+        case MOJOSHADER_AST_FUNCTION_PARAMS:
+            compact_push(b, node->params.initializer, parent);
+            break;
+
+        case MOJOSHADER_AST_SCALAR_OR_ARRAY:
+            compact_push(b, node->soa.dimension, parent);
+            break;
+
+        case MOJOSHADER_AST_TYPEDEF:
+            compact_push(b, node->typdef.details, parent);
+            break;
+
+        case MOJOSHADER_AST_VARIABLE_LOWLEVEL:
+            compact_push(b, node->varlowlevel.packoffset, parent);
+            break;
+
+        case MOJOSHADER_AST_ANNOTATION:
+            compact_push(b, node->annotations.initializer, parent);
+            break;
+
+        case MOJOSHADER_AST_VARIABLE_DECLARATION:
+            compact_push(b, node->vardecl.anonymous_datatype, parent);
+            compact_push(b, node->vardecl.details, parent);
+            COMPACT_PUSH_LIST(MOJOSHADER_astAnnotations,
+                              node->vardecl.annotations);
+            compact_push(b, node->vardecl.initializer, parent);
+            compact_push(b, node->vardecl.lowlevel, parent);
+            break;
+
+        case MOJOSHADER_AST_STRUCT_DECLARATION:
+            COMPACT_PUSH_LIST(MOJOSHADER_astStructMembers,
+                              node->structdecl.members);
+            break;
+
+        case MOJOSHADER_AST_STRUCT_MEMBER:
+            compact_push(b, node->structmembers.details, parent);
+            break;
+
+        case MOJOSHADER_AST_SWITCH_CASE:
+            compact_push(b, node->cases.expr, parent);
+            COMPACT_PUSH_LIST(MOJOSHADER_astStatement, node->cases.statement);
+            break;
+
+        case MOJOSHADER_AST_STATEMENT_BLOCK:
+            COMPACT_PUSH_LIST(MOJOSHADER_astStatement,
+                              node->blockstmt.statements);
+            break;
+
+        case MOJOSHADER_AST_STATEMENT_EXPRESSION:
+            compact_push(b, node->exprstmt.expr, parent);
+            break;
+
+        case MOJOSHADER_AST_STATEMENT_RETURN:
+            compact_push(b, node->returnstmt.expr, parent);
+            break;
+
+        case MOJOSHADER_AST_STATEMENT_IF:
+            compact_push(b, node->ifstmt.expr, parent);
+            COMPACT_PUSH_LIST(MOJOSHADER_astStatement, node->ifstmt.statement);
+            COMPACT_PUSH_LIST(MOJOSHADER_astStatement,
+                              node->ifstmt.else_statement);
+            break;
+
+        case MOJOSHADER_AST_STATEMENT_SWITCH:
+            compact_push(b, node->switchstmt.expr, parent);
+            COMPACT_PUSH_LIST(MOJOSHADER_astSwitchCases,
+                              node->switchstmt.cases);
+            break;
+
+        case MOJOSHADER_AST_STATEMENT_FOR:
+            COMPACT_PUSH_LIST(MOJOSHADER_astVariableDeclaration,
+                              node->forstmt.var_decl);
+            compact_push(b, node->forstmt.initializer, parent);
+            compact_push(b, node->forstmt.looptest, parent);
+            compact_push(b, node->forstmt.counter, parent);
+            COMPACT_PUSH_LIST(MOJOSHADER_astStatement, node->forstmt.statement);
+            break;
+
+        case MOJOSHADER_AST_STATEMENT_DO:
+        case MOJOSHADER_AST_STATEMENT_WHILE:
+            compact_push(b, node->whilestmt.expr, parent);
+            COMPACT_PUSH_LIST(MOJOSHADER_astStatement,
+                              node->whilestmt.statement);
+            break;
+
+        case MOJOSHADER_AST_STATEMENT_TYPEDEF:
+            compact_push(b, node->typedefstmt.type_info, parent);
+            break;
+
+        case MOJOSHADER_AST_STATEMENT_STRUCT:
+            compact_push(b, node->structstmt.struct_info, parent);
+            break;
+
+        case MOJOSHADER_AST_STATEMENT_VARDECL:
+            COMPACT_PUSH_LIST(MOJOSHADER_astVariableDeclaration,
+                              node->vardeclstmt.declaration);
+            break;
+
+        default: break;  // no children.
+    } // switch
+} // compact_push_children
+
+#undef COMPACT_PUSH_LIST
+
+// Reverse the pending entries from (first) to the top of the stack, so
+//  children that were queued in field order come back off it in that order.
+static void compact_reverse_pending(CompactAstBuilder *b, unsigned int first)
 {
-    assert(isfail(ctx));
+    unsigned int last = b->pending_count;
+    while (first + 1 < last)
+    {
+        const CompactAstPending tmp = b->pending[first];
+        b->pending[first++] = b->pending[--last];
+        b->pending[last] = tmp;
+    } // while
+} // compact_reverse_pending
 
-    MOJOSHADER_compileData *retval = NULL;
-    retval = (MOJOSHADER_compileData *) Malloc(ctx, sizeof (MOJOSHADER_compileData));
-    if (retval == NULL)
-        return &MOJOSHADER_out_of_mem_compile_data;
+static void compact_add_node(CompactAstBuilder *b, const CompactAstPending *p)
+{
+    const MOJOSHADER_astNode *node = p->node;
+    MOJOSHADER_astCompactNode *cnode;
 
-    memset(retval, '\0', sizeof (MOJOSHADER_compileData));
-    retval->malloc = (ctx->malloc == MOJOSHADER_internal_malloc) ? NULL : ctx->malloc;
-    retval->free = (ctx->free == MOJOSHADER_internal_free) ? NULL : ctx->free;
-    retval->malloc_data = ctx->malloc_data;
-    retval->source_profile = ctx->source_profile;
-    retval->error_count = errorlist_count(ctx->errors);
-    retval->errors = errorlist_flatten(ctx->errors);
-    retval->warning_count = errorlist_count(ctx->warnings);
-    retval->warnings = errorlist_flatten(ctx->warnings);
+    if (b->node_count == b->node_space)
+    {
+        const unsigned int space = b->node_space ? b->node_space * 2 : 256;
+        const unsigned int count = b->node_count;
+        MOJOSHADER_astCompactNode *nodes;
+        unsigned int *lines;
+        unsigned int *files;
+
+        nodes = (MOJOSHADER_astCompactNode *) compact_grow(b, b->nodes,
+                                      sizeof (*nodes), count, space);
+        if (nodes == NULL)
+            return;
+        b->nodes = nodes;
+        lines = (unsigned int *) compact_grow(b, b->lines, sizeof (*lines),
+                                              count, space);
+        if (lines == NULL)
+            return;
+        b->lines = lines;
+        files = (unsigned int *) compact_grow(b, b->files, sizeof (*files),
+                                              count, space);
+        if (files == NULL)
+            return;
+        b->files = files;
+        b->node_space = space;
+    } // if
+
+    cnode = &b->nodes[b->node_count];
+    cnode->type = node->ast.type;
+    cnode->parent = p->parent;
+    cnode->subtree_size = 1;  // descendants are added in later.
+    cnode->child_count = 0;
+    cnode->node = node;
+    b->lines[b->node_count] = node->ast.line;
+    b->files[b->node_count] = compact_filename(b, node->ast.filename);
+
+    if (p->parent != MOJOSHADER_AST_NO_NODE)
+        b->nodes[p->parent].child_count++;
+
+    b->node_count++;
+} // compact_add_node
+
+static void compact_free_builder(CompactAstBuilder *b)
+{
+    if (b->nodes != NULL) b->free(b->nodes, b->malloc_data);
+    if (b->lines != NULL) b->free(b->lines, b->malloc_data);
+    if (b->files != NULL) b->free(b->files, b->malloc_data);
+    if (b->filenames != NULL) b->free(b->filenames, b->malloc_data);
+    if (b->pending != NULL) b->free(b->pending, b->malloc_data);
+} // compact_free_builder
+
+DLLEXPORT
+const MOJOSHADER_astCompact *MOJOSHADER_compactAst(
+                                            const MOJOSHADER_astData *data)
+{
+    MOJOSHADER_astCompact *retval = NULL;
+    CompactAstBuilder builder;
+    CompactAstBuilder *b = &builder;
+    MOJOSHADER_allocPhase phase;
+    unsigned int i;
+
+    if ((data == NULL) || (data == &MOJOSHADER_out_of_mem_ast_data))
+        return NULL;
+
+    memset(b, '\0', sizeof (CompactAstBuilder));
+    b->malloc = (data->malloc == NULL) ? MOJOSHADER_internal_malloc : data->malloc;
+    b->free = (data->free == NULL) ? MOJOSHADER_internal_free : data->free;
+    b->malloc_data = data->malloc_data;
+
+    phase = alloc_phase(data->malloc, data->malloc_data,
+                        MOJOSHADER_ALLOCPHASE_AST);
+
+    // the top of the tree is a list of compilation units.
+    if (data->ast != NULL)
+    {
+        const MOJOSHADER_astCompilationUnit *unit;
+        for (unit = &data->ast->compunit; unit != NULL; unit = unit->next)
+            compact_push(b, unit, MOJOSHADER_AST_NO_NODE);
+        compact_reverse_pending(b, 0);
+    } // if
+
+    // depth-first with an explicit stack, so deep trees can't overflow ours.
+    while ((b->pending_count > 0) && (!b->out_of_memory))
+    {
+        const CompactAstPending p = b->pending[--b->pending_count];
+        const unsigned int index = b->node_count;
+        compact_add_node(b, &p);
+        if (!b->out_of_memory)
+        {
+            const unsigned int first = b->pending_count;
+            compact_push_children(b, p.node, index);
+            compact_reverse_pending(b, first);
+        } // if
+    } // while
 
-    if (ctx->out_of_memory)  // in case something failed up there.
+    if (!b->out_of_memory)
     {
-        MOJOSHADER_freeCompileData(retval);
-        return &MOJOSHADER_out_of_mem_compile_data;
+        // parents always come before their children, so walking backwards
+        //  finishes each subtree before it gets added to its parent.
+        i = b->node_count;
+        while (i-- > 0)
+        {
+            const unsigned int parent = b->nodes[i].parent;
+            if (parent != MOJOSHADER_AST_NO_NODE)
+                b->nodes[parent].subtree_size += b->nodes[i].subtree_size;
+        } // while
+
+        retval = (MOJOSHADER_astCompact *)
+                    b->malloc(sizeof (MOJOSHADER_astCompact), b->malloc_data);
     } // if
 
+    if (retval == NULL)
+        compact_free_builder(b);
+    else
+    {
+        if (b->pending != NULL)
+            b->free(b->pending, b->malloc_data);
+        retval->node_count = b->node_count;
+        retval->nodes = b->nodes;
+        retval->lines = b->lines;
+        retval->files = b->files;
+        retval->filename_count = b->filename_count;
+        retval->filenames = b->filenames;
+        retval->malloc = data->malloc;
+        retval->free = data->free;
+        retval->malloc_data = data->malloc_data;
+    } // else
+
+    alloc_phase(data->malloc, data->malloc_data, phase);
     return retval;
-} // build_failed_compile
+} // MOJOSHADER_compactAst
 
 
-static const MOJOSHADER_compileData *build_compiledata(Context *ctx)
+DLLEXPORT
+void MOJOSHADER_visitCompactAst(const MOJOSHADER_astCompact *ast,
+                                unsigned int index,
+                                MOJOSHADER_astCompactVisitor visitor,
+                                void *data)
 {
-    assert(!isfail(ctx));
-
-    MOJOSHADER_compileData *retval = NULL;
+    unsigned int end;
 
-    retval = (MOJOSHADER_compileData *) Malloc(ctx, sizeof (MOJOSHADER_compileData));
-    if (retval == NULL)
-        return &MOJOSHADER_out_of_mem_compile_data;
-
-    memset(retval, '\0', sizeof (MOJOSHADER_compileData));
-    retval->malloc = (ctx->malloc == MOJOSHADER_internal_malloc) ? NULL : ctx->malloc;
-    retval->free = (ctx->free == MOJOSHADER_internal_free) ? NULL : ctx->free;
-    retval->malloc_data = ctx->malloc_data;
-    retval->source_profile = ctx->source_profile;
-
-    if (!isfail(ctx))
+    if ((ast == NULL) || (visitor == NULL))
+        return;
+    else if (index == MOJOSHADER_AST_NO_NODE)
     {
-        // !!! FIXME: build output and output_len here.
-    } // if
+        index = 0;
+        end = ast->node_count;
+    } // else if
+    else if (index >= ast->node_count)
+        return;
+    else
+        end = index + ast->nodes[index].subtree_size;
 
-    if (!isfail(ctx))
+    while (index < end)
     {
-        // !!! FIXME: build symbols and symbol_count here.
-    } // if
+        if (visitor(ast, index, data))
+            index++;  // descend: the first child is always next.
+        else
+            index += ast->nodes[index].subtree_size;  // skip the subtree.
+    } // while
+} // MOJOSHADER_visitCompactAst
 
-    retval->error_count = errorlist_count(ctx->errors);
-    retval->errors = errorlist_flatten(ctx->errors);
-    retval->warning_count = errorlist_count(ctx->warnings);
-    retval->warnings = errorlist_flatten(ctx->warnings);
 
-    if (ctx->out_of_memory)  // in case something failed up there.
-    {
-        MOJOSHADER_freeCompileData(retval);
-        return &MOJOSHADER_out_of_mem_compile_data;
-    } // if
+DLLEXPORT
+void MOJOSHADER_freeCompactAst(const MOJOSHADER_astCompact *_ast)
+{
+    MOJOSHADER_astCompact *ast = (MOJOSHADER_astCompact *) _ast;
+    MOJOSHADER_free f;
+    void *d;
 
-    return retval;
-} // build_compiledata
+    if (ast == NULL)
+        return;  // no-op.
 
+    f = (ast->free == NULL) ? MOJOSHADER_internal_free : ast->free;
+    d = ast->malloc_data;
+    f((void *) ast->nodes, d);
+    f((void *) ast->lines, d);
+    f((void *) ast->files, d);
+    f((void *) ast->filenames, d);
+    f(ast, d);
+} // MOJOSHADER_freeCompactAst
 
-// API entry point...
 
-// !!! FIXME: move this (and a lot of other things) to mojoshader_ast.c.
-const MOJOSHADER_astData *MOJOSHADER_parseAst(const char *srcprofile,
+DLLEXPORT
+const MOJOSHADER_compileData *MOJOSHADER_compileWithIncludeCache(
+                                    MOJOSHADER_includeCache *include_cache,
+                                    const char *srcprofile,
                                     const char *filename, const char *source,
                                     unsigned int sourcelen,
                                     const MOJOSHADER_preprocessorDefine *defs,
@@ -6152,107 +8094,483 @@ const MOJOSHADER_astData *MOJOSHADER_parseAst(const char *srcprofile,
                                     MOJOSHADER_malloc m, MOJOSHADER_free f,
                                     void *d)
 {
-    const MOJOSHADER_astData *retval = NULL;
+    // !!! FIXME: cut and paste from MOJOSHADER_parseAst().
+    MOJOSHADER_compileData *retval = NULL;
+    MOJOSHADER_allocPhase phase;
     Context *ctx = NULL;
 
     if ( ((m == NULL) && (f != NULL)) || ((m != NULL) && (f == NULL)) )
-        return &MOJOSHADER_out_of_mem_ast_data;  // supply both or neither.
+        return &MOJOSHADER_out_of_mem_compile_data;  // supply both or neither.
 
+    phase = alloc_phase(m, d, MOJOSHADER_ALLOCPHASE_CONTEXT);
     ctx = build_context(m, f, d);
     if (ctx == NULL)
-        return &MOJOSHADER_out_of_mem_ast_data;
+    {
+        alloc_phase(m, d, phase);
+        return &MOJOSHADER_out_of_mem_compile_data;
+    } // if
 
     choose_src_profile(ctx, srcprofile);
 
     if (!isfail(ctx))
     {
         parse_source(ctx, filename, source, sourcelen, defs, define_count,
-                     include_open, include_close);
+                     include_open, include_close, include_cache);
     } // if
 
+    set_alloc_phase(ctx, MOJOSHADER_ALLOCPHASE_AST);
     if (!isfail(ctx))
-        retval = build_astdata(ctx);  // ctx isn't destroyed yet!
+        semantic_analysis(ctx);
+    if (!isfail(ctx))
+        fold_constants(ctx);
+
+    set_alloc_phase(ctx, MOJOSHADER_ALLOCPHASE_IR);
+    if (!isfail(ctx))
+        intermediate_representation(ctx);
+
+    set_alloc_phase(ctx, MOJOSHADER_ALLOCPHASE_PARSEDATA);
+    if (isfail(ctx))
+        retval = (MOJOSHADER_compileData *) build_failed_compile(ctx);
     else
-    {
-        retval = (MOJOSHADER_astData *) build_failed_ast(ctx);
-        destroy_context(ctx);
-    } // else
+        retval = (MOJOSHADER_compileData *) build_compiledata(ctx);
 
+    destroy_context(ctx);
+    alloc_phase(m, d, phase);
     return retval;
-} // MOJOSHADER_parseAst
+} // MOJOSHADER_compileWithIncludeCache
 
 
-void MOJOSHADER_freeAstData(const MOJOSHADER_astData *_data)
+const MOJOSHADER_compileData *MOJOSHADER_compile(const char *srcprofile,
+                                    const char *filename, const char *source,
+                                    unsigned int sourcelen,
+                                    const MOJOSHADER_preprocessorDefine *defs,
+                                    unsigned int define_count,
+                                    MOJOSHADER_includeOpen include_open,
+                                    MOJOSHADER_includeClose include_close,
+                                    MOJOSHADER_malloc m, MOJOSHADER_free f,
+                                    void *d)
 {
-    MOJOSHADER_astData *data = (MOJOSHADER_astData *) _data;
-    if ((data == NULL) || (data == &MOJOSHADER_out_of_mem_ast_data))
-        return;  // no-op.
+    return MOJOSHADER_compileWithIncludeCache(NULL, srcprofile, filename,
+                          source, sourcelen, defs, define_count,
+                          include_open, include_close, m, f, d);
+} // MOJOSHADER_compile
 
-    // !!! FIXME: this needs to live for deleting the stringcache and the ast.
-    Context *ctx = (Context *) data->opaque;
-    MOJOSHADER_free f = (data->free == NULL) ? MOJOSHADER_internal_free : data->free;
-    void *d = data->malloc_data;
-    int i;
 
-    // we don't f(data->source_profile), because that's internal static data.
+// Reachability...
 
-    for (i = 0; i < data->error_count; i++)
+// This works on names alone, before semantic analysis, so it has to be
+//  conservative: a call reaches every overload with that name, and a local
+//  variable that shadows a global keeps the global alive, too.
+
+typedef struct Reachability
+{
+    CompactAstBuilder walk;  // only its pending stack is used.
+    HashTable *names;  // every name that reachable code mentions.
+    HashTable *declared;  // name -> units that declare it.
+    const MOJOSHADER_astCompilationUnit **units;
+    uint8 *reachable;
+} Reachability;
+
+static void reach_nuke(const void *k, const void *v, void *d) {/*no-op*/}
+
+static void reach_name(Context *ctx, Reachability *r, const char *name)
+{
+    const void *value = NULL;
+    void *iter = NULL;
+
+    if ((name == NULL) || (hash_find(r->names, name, NULL)))
+        return;
+    else if (hash_insert(r->names, name, NULL) != 1)
+        return;  // out of memory.
+
+    while (hash_iter(r->declared, name, &value, &iter))
     {
-        f((void *) data->errors[i].error, d);
-        f((void *) data->errors[i].filename, d);
+        const MOJOSHADER_astCompilationUnit **unit;
+        unit = (const MOJOSHADER_astCompilationUnit **) value;
+        const size_t idx = (size_t) (unit - r->units);
+        if (!r->reachable[idx])
+        {
+            r->reachable[idx] = 1;
+            compact_push(&r->walk, *unit, 0);
+        } // if
+    } // while
+} // reach_name
+
+static void reach_datatype(Context *ctx, Reachability *r,
+                           const MOJOSHADER_astDataType *dt)
+{
+    // these haven't been resolved yet; user types are just names for now.
+    while (dt != NULL)
+    {
+        if (dt->type == MOJOSHADER_AST_DATATYPE_USER)
+        {
+            reach_name(ctx, r, dt->user.name);
+            return;
+        } // if
+        else if (dt->type != MOJOSHADER_AST_DATATYPE_ARRAY)
+            return;
+        dt = dt->array.base;
+    } // while
+} // reach_datatype
+
+static void reach_node(Context *ctx, Reachability *r,
+                       const MOJOSHADER_astNode *node)
+{
+    switch (node->ast.type)
+    {
+        case MOJOSHADER_AST_OP_IDENTIFIER:
+            reach_name(ctx, r, node->identifier.identifier);
+            break;
+        case MOJOSHADER_AST_OP_CAST:
+            reach_datatype(ctx, r, node->cast.datatype);
+            break;
+        case MOJOSHADER_AST_OP_CONSTRUCTOR:
+            reach_datatype(ctx, r, node->constructor.datatype);
+            break;
+        case MOJOSHADER_AST_FUNCTION_SIGNATURE:
+            reach_datatype(ctx, r, node->funcsig.datatype);
+            break;
+        case MOJOSHADER_AST_FUNCTION_PARAMS:
+            reach_datatype(ctx, r, node->params.datatype);
+            break;
+        case MOJOSHADER_AST_VARIABLE_DECLARATION:
+            reach_datatype(ctx, r, node->vardecl.datatype);
+            break;
+        case MOJOSHADER_AST_STRUCT_MEMBER:
+            reach_datatype(ctx, r, node->structmembers.datatype);
+            break;
+        case MOJOSHADER_AST_TYPEDEF:
+            reach_datatype(ctx, r, node->typdef.datatype);
+            break;
+        case MOJOSHADER_AST_ANNOTATION:
+            reach_datatype(ctx, r, node->annotations.datatype);
+            break;
+        default: break;
+    } // switch
+
+    compact_push_children(&r->walk, node, 0);
+} // reach_node
+
+static int reach_declare(Reachability *r, const char *name,
+                         const MOJOSHADER_astCompilationUnit **unit)
+{
+    return (name == NULL) || (hash_insert(r->declared, name, unit) == 1);
+} // reach_declare
+
+// Figure out which compilation units the entry points can possibly use, so
+//  semantic analysis and IR generation can skip the rest. Leaves
+//  ctx->reachable_units alone (so everything is used) if anything fails.
+static void find_reachable_units(Context *ctx,
+                                 const char * const *entry_points,
+                                 const unsigned int entry_count)
+{
+    const MOJOSHADER_astCompilationUnit *unit;
+    Reachability r;
+    unsigned int count = 0;
+    unsigned int i;
+    int okay = 1;
+
+    memset(&r, '\0', sizeof (r));
+    r.walk.malloc = MallocBridge;
+    r.walk.free = FreeBridge;
+    r.walk.malloc_data = ctx;
+
+    for (unit = &ctx->ast->compunit; unit != NULL; unit = unit->next)
+        count++;
+
+    r.units = (const MOJOSHADER_astCompilationUnit **)
+                    Malloc(ctx, sizeof (*r.units) * count);
+    r.reachable = (uint8 *) Malloc(ctx, count);
+    r.names = hash_create(ctx, hash_hash_string, hash_keymatch_string,
+                          reach_nuke, 0, MallocBridge, FreeBridge, ctx);
+    r.declared = hash_create(ctx, hash_hash_string, hash_keymatch_string,
+                             reach_nuke, 1, MallocBridge, FreeBridge, ctx);
+    okay = (r.units && r.reachable && r.names && r.declared);
+
+    if (okay)
+        memset(r.reachable, '\0', count);
+
+    for (i = 0, unit = &ctx->ast->compunit; okay && unit; unit = unit->next)
+    {
+        const MOJOSHADER_astNode *node = (const MOJOSHADER_astNode *) unit;
+        const MOJOSHADER_astVariableDeclaration *decl;
+        r.units[i] = unit;
+        switch (unit->ast.type)
+        {
+            case MOJOSHADER_AST_COMPUNIT_FUNCTION:
+                okay = reach_declare(&r, node->funcunit.declaration->identifier,
+                                     &r.units[i]);
+                // signatures are always checked, so their types are needed.
+                compact_push(&r.walk, node->funcunit.declaration, 0);
+                break;
+
+            case MOJOSHADER_AST_COMPUNIT_TYPEDEF:
+                okay = reach_declare(&r,
+                            node->typedefunit.type_info->details->identifier,
+                            &r.units[i]);
+                break;
+
+            case MOJOSHADER_AST_COMPUNIT_STRUCT:
+                okay = reach_declare(&r, node->structunit.struct_info->name,
+                                     &r.units[i]);
+                break;
+
+            case MOJOSHADER_AST_COMPUNIT_VARIABLE:
+                decl = node->varunit.declaration;
+                if (decl->anonymous_datatype != NULL)
+                {
+                    okay = reach_declare(&r, decl->anonymous_datatype->name,
+                                         &r.units[i]);
+                } // if
+                for (; okay && (decl != NULL); decl = decl->next)
+                {
+                    okay = reach_declare(&r, decl->details->identifier,
+                                         &r.units[i]);
+                } // for
+                break;
+
+            default:
+                assert(0 && "unexpected compilation unit");
+                r.reachable[i] = 1;  // keep it, whatever it is.
+                break;
+        } // switch
+        i++;
     } // for
-    f((void *) data->errors, d);
 
-    // don't delete data->ast (it'll delete with the context).
-    f(data, d);
+    for (i = 0; okay && (i < entry_count); i++)
+        reach_name(ctx, &r, entry_points[i]);
 
-    destroy_context(ctx);  // finally safe to destroy this.
-} // MOJOSHADER_freeAstData
+    while ((okay) && (r.walk.pending_count > 0))
+    {
+        const CompactAstPending *p = &r.walk.pending[--r.walk.pending_count];
+        reach_node(ctx, &r, p->node);
+    } // while
 
+    if ((okay) && (!r.walk.out_of_memory) && (!ctx->out_of_memory))
+    {
+        ctx->reachable_units = r.reachable;
+        r.reachable = NULL;
+    } // if
 
-const MOJOSHADER_compileData *MOJOSHADER_compile(const char *srcprofile,
-                                    const char *filename, const char *source,
-                                    unsigned int sourcelen,
-                                    const MOJOSHADER_preprocessorDefine *defs,
-                                    unsigned int define_count,
-                                    MOJOSHADER_includeOpen include_open,
-                                    MOJOSHADER_includeClose include_close,
-                                    MOJOSHADER_malloc m, MOJOSHADER_free f,
-                                    void *d)
+    Free(ctx, r.walk.pending);
+    Free(ctx, r.units);
+    Free(ctx, r.reachable);
+    if (r.names != NULL)
+        hash_destroy(r.names);
+    if (r.declared != NULL)
+        hash_destroy(r.declared);
+} // find_reachable_units
+
+
+typedef enum EntryPointStatus
 {
-    // !!! FIXME: cut and paste from MOJOSHADER_parseAst().
-    MOJOSHADER_compileData *retval = NULL;
+    ENTRYPOINT_FOUND,
+    ENTRYPOINT_MISSING,
+    ENTRYPOINT_OVERLOADED
+} EntryPointStatus;
+
+static EntryPointStatus find_entry_point(Context *ctx, const char *name)
+{
+    const MOJOSHADER_astCompilationUnit *ast = NULL;
+    const MOJOSHADER_astCompilationUnitFunction *astfn = NULL;
+    int matches = 0;
+
+    for (ast = &ctx->ast->compunit; ast != NULL; ast = ast->next)
+    {
+        if (ast->ast.type != MOJOSHADER_AST_COMPUNIT_FUNCTION)
+            continue;
+
+        astfn = (const MOJOSHADER_astCompilationUnitFunction *) ast;
+        if (astfn->definition == NULL)  // just a predeclare; skip.
+            continue;
+        else if (strcmp(astfn->declaration->identifier, name) == 0)
+            matches++;
+    } // for
+
+    if (matches == 0)
+        return ENTRYPOINT_MISSING;
+    else if (matches > 1)
+        return ENTRYPOINT_OVERLOADED;
+    return ENTRYPOINT_FOUND;
+} // find_entry_point
+
+
+static void free_error_array(Context *ctx, MOJOSHADER_error *errors,
+                             const int count)
+{
+    int i;
+    if (errors == NULL)
+        return;
+
+    for (i = 0; i < count; i++)
+    {
+        Free(ctx, (void *) errors[i].error);
+        Free(ctx, (void *) errors[i].filename);
+    } // for
+    Free(ctx, errors);
+} // free_error_array
+
+
+static void add_error_array(ErrorList *list, const MOJOSHADER_error *errors,
+                            const int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        errorlist_add(list, errors[i].filename, errors[i].error_position,
+                      errors[i].error);
+    } // for
+} // add_error_array
+
+
+// Each entry point gets its own copy of everything reported while parsing
+//  and checking the shared source, plus anything wrong with the entry
+//  point itself.
+static const MOJOSHADER_compileData *build_entry_point_compiledata(
+                                    Context *ctx, const char *name,
+                                    const EntryPointStatus status,
+                                    const MOJOSHADER_error *errors,
+                                    const int error_count,
+                                    const MOJOSHADER_error *warnings,
+                                    const int warning_count)
+{
+    const int wasfail = ctx->isfail;
+    const MOJOSHADER_compileData *retval = NULL;
+
+    add_error_array(ctx->errors, errors, error_count);
+    add_error_array(ctx->warnings, warnings, warning_count);
+
+    // if the source itself failed, don't pile on.
+    if ((!wasfail) && (status == ENTRYPOINT_MISSING))
+    {
+        ctx->isfail = 1;
+        errorlist_add_fmt(ctx->errors, NULL, MOJOSHADER_POSITION_NONE,
+                          "Entry point '%s' not found", name);
+    } // if
+    else if ((!wasfail) && (status == ENTRYPOINT_OVERLOADED))
+    {
+        ctx->isfail = 1;
+        errorlist_add_fmt(ctx->errors, NULL, MOJOSHADER_POSITION_NONE,
+                          "Entry point '%s' is overloaded", name);
+    } // else if
+
+    if (ctx->out_of_memory)
+        retval = &MOJOSHADER_out_of_mem_compile_data;
+    else if (isfail(ctx))
+        retval = build_failed_compile(ctx);
+    else
+        retval = build_compiledata(ctx);
+
+    ctx->isfail = wasfail;
+    return retval;
+} // build_entry_point_compiledata
+
+
+DLLEXPORT
+void MOJOSHADER_compileEntryPoints(MOJOSHADER_includeCache *include_cache,
+                                   const char *srcprofile,
+                                   const char * const *entry_points,
+                                   unsigned int entry_count,
+                                   const MOJOSHADER_compileData **results,
+                                   const char *filename, const char *source,
+                                   unsigned int sourcelen,
+                                   const MOJOSHADER_preprocessorDefine *defs,
+                                   unsigned int define_count,
+                                   MOJOSHADER_includeOpen include_open,
+                                   MOJOSHADER_includeClose include_close,
+                                   MOJOSHADER_malloc m, MOJOSHADER_free f,
+                                   void *d)
+{
+    // !!! FIXME: cut and paste from MOJOSHADER_compile().
+    EntryPointStatus *status = NULL;
+    MOJOSHADER_error *errors = NULL;
+    MOJOSHADER_error *warnings = NULL;
+    int error_count = 0;
+    int warning_count = 0;
+    MOJOSHADER_allocPhase phase;
     Context *ctx = NULL;
+    unsigned int i;
 
-    if ( ((m == NULL) && (f != NULL)) || ((m != NULL) && (f == NULL)) )
-        return &MOJOSHADER_out_of_mem_compile_data;  // supply both or neither.
+    for (i = 0; i < entry_count; i++)
+        results[i] = &MOJOSHADER_out_of_mem_compile_data;
+
+    if (entry_count == 0)
+        return;
+    else if ( ((m == NULL) && (f != NULL)) || ((m != NULL) && (f == NULL)) )
+        return;  // supply both or neither.
 
+    phase = alloc_phase(m, d, MOJOSHADER_ALLOCPHASE_CONTEXT);
     ctx = build_context(m, f, d);
     if (ctx == NULL)
-        return &MOJOSHADER_out_of_mem_compile_data;
+    {
+        alloc_phase(m, d, phase);
+        return;
+    } // if
+
+    status = (EntryPointStatus *) Malloc(ctx, sizeof (*status) * entry_count);
+    if (status == NULL)
+    {
+        destroy_context(ctx);
+        alloc_phase(m, d, phase);
+        return;
+    } // if
 
     choose_src_profile(ctx, srcprofile);
 
     if (!isfail(ctx))
     {
         parse_source(ctx, filename, source, sourcelen, defs, define_count,
-                     include_open, include_close);
+                     include_open, include_close, include_cache);
     } // if
 
+    set_alloc_phase(ctx, MOJOSHADER_ALLOCPHASE_AST);
     if (!isfail(ctx))
+    {
+        find_reachable_units(ctx, entry_points, entry_count);
         semantic_analysis(ctx);
+    } // if
+    if (!isfail(ctx))
+        fold_constants(ctx);
+
+    // look these up now; building IR throws the AST away.
+    for (i = 0; i < entry_count; i++)
+    {
+        if (isfail(ctx))
+            status[i] = ENTRYPOINT_MISSING;  // won't be reported.
+        else
+            status[i] = find_entry_point(ctx, entry_points[i]);
+    } // for
 
+    // The IR is built once, for the whole source, and shared by every
+    //  entry point.
+    set_alloc_phase(ctx, MOJOSHADER_ALLOCPHASE_IR);
     if (!isfail(ctx))
         intermediate_representation(ctx);
 
-    if (isfail(ctx))
-        retval = (MOJOSHADER_compileData *) build_failed_compile(ctx);
-    else
-        retval = (MOJOSHADER_compileData *) build_compiledata(ctx);
+    set_alloc_phase(ctx, MOJOSHADER_ALLOCPHASE_PARSEDATA);
+    error_count = errorlist_count(ctx->errors);
+    errors = errorlist_flatten(ctx->errors);
+    warning_count = errorlist_count(ctx->warnings);
+    warnings = errorlist_flatten(ctx->warnings);
+    if (errors == NULL)
+        error_count = 0;  // none, or out of memory.
+    if (warnings == NULL)
+        warning_count = 0;  // none, or out of memory.
+
+    for (i = 0; i < entry_count; i++)
+    {
+        results[i] = build_entry_point_compiledata(ctx, entry_points[i],
+                                                   status[i], errors,
+                                                   error_count, warnings,
+                                                   warning_count);
+    } // for
 
+    free_error_array(ctx, errors, error_count);
+    free_error_array(ctx, warnings, warning_count);
+    Free(ctx, status);
     destroy_context(ctx);
-    return retval;
-} // MOJOSHADER_compile
+    alloc_phase(m, d, phase);
+} // MOJOSHADER_compileEntryPoints
 
 
 void MOJOSHADER_freeCompileData(const MOJOSHADER_compileData *_data)
@@ -12,14 +12,159 @@
 
 #include <math.h>
 
+int run_preshader_instruction(const MOJOSHADER_preshader *preshader,
+                              const MOJOSHADER_preshaderInstruction *inst,
+                              const float *inregs, const float *outregs,
+                              const double *temps, double *dst)
+{
+    const int scalarstart = (int) MOJOSHADER_PRESHADEROP_SCALAR_OPS;
+    double src[3][4] = { { 0, 0, 0, 0 }, { 0, 0, 0, 0 }, { 0, 0, 0, 0 } };
+    const double *src0 = &src[0][0];
+    const double *src1 = &src[1][0];
+    const double *src2 = &src[2][0];
+
+    const MOJOSHADER_preshaderOperand *operand = inst->operands;
+    const int elems = inst->element_count;
+    const int elemsbytes = sizeof (double) * elems;
+    const int isscalarop = (inst->opcode >= scalarstart);
+
+    assert(elems >= 0);
+    assert(elems <= 4);
+
+    // load up our operands...
+    int opiter, elemiter;
+    for (opiter = 0; opiter < inst->operand_count-1; opiter++, operand++)
+    {
+        const int isscalar = ((isscalarop) && (opiter == 0));
+        unsigned int index = operand->index;
+        switch (operand->type)
+        {
+            case MOJOSHADER_PRESHADEROPERAND_LITERAL:
+            {
+                const double *lit = &preshader->literals[index];
+                assert((index + elems) <= preshader->literal_count);
+                if (!isscalar)
+                    memcpy(&src[opiter][0], lit, elemsbytes);
+                else
+                {
+                    const double val = *lit;
+                    for (elemiter = 0; elemiter < elems; elemiter++)
+                        src[opiter][elemiter] = val;
+                } // else
+                break;
+            } // case
+
+            case MOJOSHADER_PRESHADEROPERAND_INPUT:
+                if (operand->indexingType == 2) {
+                    index = index+inregs[operand->indexingIndex]*4;
+                }
+                if (isscalar)
+                    src[opiter][0] = inregs[index];
+                else
+                {
+                    int cpy;
+                    for (cpy = 0; cpy < elems; cpy++)
+                        src[opiter][cpy] = inregs[index+cpy];
+                } // else
+                break;
+
+            case MOJOSHADER_PRESHADEROPERAND_OUTPUT:
+                if (isscalar)
+                    src[opiter][0] = outregs[index];
+                else
+                {
+                    int cpy;
+                    for (cpy = 0; cpy < elems; cpy++)
+                        src[opiter][cpy] = outregs[index+cpy];
+                } // else
+                break;
+
+            case MOJOSHADER_PRESHADEROPERAND_TEMP:
+                if (temps != NULL)
+                {
+                    if (isscalar)
+                        src[opiter][0] = temps[index];
+                    else
+                        memcpy(src[opiter], temps + index, elemsbytes);
+                } // if
+                break;
+
+            default:
+                assert(0 && "unexpected preshader operand type.");
+                return 0;
+        } // switch
+    } // for
+
+    // run the actual instruction, store result to dst.
+    int i;
+    switch (inst->opcode)
+    {
+        #define OPCODE_CASE(op, val) \
+            case MOJOSHADER_PRESHADEROP_##op: \
+                for (i = 0; i < elems; i++) { dst[i] = val; } \
+                break;
+
+        //OPCODE_CASE(NOP, 0.0)  // not a real instruction.
+        OPCODE_CASE(MOV, src0[i])
+        OPCODE_CASE(NEG, -src0[i])
+        OPCODE_CASE(RCP, 1.0 / src0[i])
+        OPCODE_CASE(FRC, src0[i] - floor(src0[i]))
+        OPCODE_CASE(EXP, exp(src0[i]))
+        OPCODE_CASE(LOG, log(src0[i]))
+        OPCODE_CASE(RSQ, 1.0 / sqrt(src0[i]))
+        OPCODE_CASE(SIN, sin(src0[i]))
+        OPCODE_CASE(COS, cos(src0[i]))
+        OPCODE_CASE(ASIN, asin(src0[i]))
+        OPCODE_CASE(ACOS, acos(src0[i]))
+        OPCODE_CASE(ATAN, atan(src0[i]))
+        OPCODE_CASE(MIN, (src0[i] < src1[i]) ? src0[i] : src1[i])
+        OPCODE_CASE(MAX, (src0[i] > src1[i]) ? src0[i] : src1[i])
+        OPCODE_CASE(LT, (src0[i] < src1[i]) ? 1.0 : 0.0)
+        OPCODE_CASE(GE, (src0[i] >= src1[i]) ? 1.0 : 0.0)
+        OPCODE_CASE(ADD, src0[i] + src1[i])
+        OPCODE_CASE(MUL,  src0[i] * src1[i])
+        OPCODE_CASE(ATAN2, atan2(src0[i], src1[i]))
+        OPCODE_CASE(DIV, src0[i] / src1[i])
+        OPCODE_CASE(CMP, (src0[i] >= 0.0) ? src1[i] : src2[i])
+        //OPCODE_CASE(NOISE, ???)  // !!! FIXME: don't know what this does
+        //OPCODE_CASE(MOVC, ???)  // !!! FIXME: don't know what this does
+        OPCODE_CASE(MIN_SCALAR, (src0[0] < src1[i]) ? src0[0] : src1[i])
+        OPCODE_CASE(MAX_SCALAR, (src0[0] > src1[i]) ? src0[0] : src1[i])
+        OPCODE_CASE(LT_SCALAR, (src0[0] < src1[i]) ? 1.0 : 0.0)
+        OPCODE_CASE(GE_SCALAR, (src0[0] >= src1[i]) ? 1.0 : 0.0)
+        OPCODE_CASE(ADD_SCALAR, src0[0] + src1[i])
+        OPCODE_CASE(MUL_SCALAR, src0[0] * src1[i])
+        OPCODE_CASE(ATAN2_SCALAR, atan2(src0[0], src1[i]))
+        OPCODE_CASE(DIV_SCALAR, src0[0] / src1[i])
+        //OPCODE_CASE(DOT_SCALAR)  // !!! FIXME: isn't this just a MUL?
+        //OPCODE_CASE(NOISE_SCALAR, ???)  // !!! FIXME: ?
+        #undef OPCODE_CASE
+
+        case MOJOSHADER_PRESHADEROP_DOT:
+        {
+            double final = 0.0;
+            for (i = 0; i < elems; i++)
+                final += src0[i] * src1[i];
+            for (i = 0; i < elems; i++)
+                dst[i] = final;  // !!! FIXME: is this right?
+            break;
+        } // case
+
+        default:
+            assert(0 && "Unhandled preshader opcode!");
+            break;
+    } // switch
+
+    return 1;
+} // run_preshader_instruction
+
+
 DLLEXPORT
 void MOJOSHADER_runPreshader(const MOJOSHADER_preshader *preshader,
                              const float *inregs, float *outregs)
 {
     // this is fairly straightforward, as there aren't any branching
     //  opcodes in the preshader instruction set (at the moment, at least).
-    const int scalarstart = (int) MOJOSHADER_PRESHADEROP_SCALAR_OPS;
-
     double *temps = NULL;
     if (preshader->temp_count > 0)
     {
@@ -28,162 +173,207 @@ void MOJOSHADER_runPreshader(const MOJOSHADER_preshader *preshader,
     } // if
 
     double dst[4] = { 0, 0, 0, 0 };
-    double src[3][4] = { { 0, 0, 0, 0 }, { 0, 0, 0, 0 }, { 0, 0, 0, 0 } };
-    const double *src0 = &src[0][0];
-    const double *src1 = &src[1][0];
-    const double *src2 = &src[2][0];
 
-    MOJOSHADER_preshaderInstruction *inst = preshader->instructions;
+    const MOJOSHADER_preshaderInstruction *inst = preshader->instructions;
     int instit;
 
     for (instit = 0; instit < preshader->instruction_count; instit++, inst++)
     {
-        const MOJOSHADER_preshaderOperand *operand = inst->operands;
+        const MOJOSHADER_preshaderOperand *operand;
+        const int elems = inst->element_count;
+        int i;
+
+        if (!run_preshader_instruction(preshader, inst, inregs, outregs,
+                                       temps, dst))
+            return;
+
+        // Figure out where dst wants to be stored.
+        operand = &inst->operands[inst->operand_count-1];
+        if (operand->type == MOJOSHADER_PRESHADEROPERAND_TEMP)
+        {
+            assert(preshader->temp_count >= operand->index + elems);
+            memcpy(temps + operand->index, dst, sizeof (double) * elems);
+        } // if
+        else
+        {
+            assert(operand->type == MOJOSHADER_PRESHADEROPERAND_OUTPUT);
+            for (i = 0; i < elems; i++)
+                outregs[operand->index + i] = (float) dst[i];
+        } // else
+    } // for
+} // MOJOSHADER_runPreshader
+
+
+// Returns non-zero if any register in [first, last] is set in (mask).
+static int preshader_mask_any(const unsigned int *mask, unsigned int count,
+                              unsigned int first, unsigned int last)
+{
+    unsigned int i;
+    for (i = first; (i <= last) && (i < count); i++)
+    {
+        if (mask[i / 32] & (1u << (i % 32)))
+            return 1;
+    } // for
+    return 0;
+} // preshader_mask_any
+
+
+DLLEXPORT
+int MOJOSHADER_runPreshaderIncremental(const MOJOSHADER_preshader *preshader,
+                                       const float *inregs, float *outregs,
+                                       double *results,
+                                       const unsigned int *dirty_inputs,
+                                       unsigned int *changed_outputs)
+{
+    // Every instruction either runs or replays its result from the last
+    //  call, so temps and (outregs) end up exactly as a full run would
+    //  leave them, even if a temp is reused or (outregs) was clobbered
+    //  in the meantime. An instruction only runs if one of its sources
+    //  differs from what it saw last time.
+    const int scalarstart = (int) MOJOSHADER_PRESHADEROP_SCALAR_OPS;
+    const unsigned int incount = preshader->input_register_count;
+    const unsigned int outslots = preshader->output_register_count * 4;
+    const int everything = (dirty_inputs == NULL);
+    int any_input_dirty = everything;
+    int executed = 0;
+    unsigned int i;
+
+    double *temps = NULL;
+    uint8 *temp_dirty = NULL;
+    if (preshader->temp_count > 0)
+    {
+        temps = (double *) alloca(sizeof (double) * preshader->temp_count);
+        memset(temps, '\0', sizeof (double) * preshader->temp_count);
+        temp_dirty = (uint8 *) alloca(preshader->temp_count);
+        memset(temp_dirty, '\0', preshader->temp_count);
+    } // if
+
+    // bit 0: differs from last call, bit 1: written during this call.
+    uint8 *out_state = NULL;
+    if (outslots > 0)
+    {
+        out_state = (uint8 *) alloca(outslots);
+        memset(out_state, '\0', outslots);
+    } // if
+
+    if (changed_outputs != NULL)
+    {
+        const unsigned int words = MOJOSHADER_PRESHADER_MASK_WORDS(outslots / 4);
+        memset(changed_outputs, '\0', sizeof (unsigned int) * words);
+    } // if
+
+    if (!everything)
+    {
+        const unsigned int words = MOJOSHADER_PRESHADER_MASK_WORDS(incount);
+        for (i = 0; i < words; i++)
+        {
+            if (dirty_inputs[i])
+            {
+                any_input_dirty = 1;
+                break;
+            } // if
+        } // for
+    } // if
+
+    const MOJOSHADER_preshaderInstruction *inst = preshader->instructions;
+    double *result = results;
+    int instit;
+
+    for (instit = 0; instit < preshader->instruction_count;
+         instit++, inst++, result += 4)
+    {
+        const MOJOSHADER_preshaderOperand *dstop;
         const int elems = inst->element_count;
-        const int elemsbytes = sizeof (double) * elems;
         const int isscalarop = (inst->opcode >= scalarstart);
+        int run = everything;
+        int opiter, e;
+        double dst[4] = { 0, 0, 0, 0 };
 
-        assert(elems >= 0);
-        assert(elems <= 4);
+        if (inst->operand_count == 0)
+            continue;
 
-        // load up our operands...
-        int opiter, elemiter;
-        for (opiter = 0; opiter < inst->operand_count-1; opiter++, operand++)
+        // does anything this instruction reads differ from last time?
+        const MOJOSHADER_preshaderOperand *operand = inst->operands;
+        for (opiter = 0; (!run) && (opiter < inst->operand_count-1);
+             opiter++, operand++)
         {
-            const int isscalar = ((isscalarop) && (opiter == 0));
-            unsigned int index = operand->index;
+            const unsigned int index = operand->index;
+            const int count = ((isscalarop) && (opiter == 0)) ? 1 : elems;
             switch (operand->type)
             {
-                case MOJOSHADER_PRESHADEROPERAND_LITERAL:
-                {
-                    const double *lit = &preshader->literals[index];
-                    assert((index + elems) <= preshader->literal_count);
-                    if (!isscalar)
-                        memcpy(&src[opiter][0], lit, elemsbytes);
-                    else
-                    {
-                        const double val = *lit;
-                        for (elemiter = 0; elemiter < elems; elemiter++)
-                            src[opiter][elemiter] = val;
-                    } // else
-                    break;
-                } // case
-
                 case MOJOSHADER_PRESHADEROPERAND_INPUT:
-                    if (operand->indexingType == 2) {
-                        index = index+inregs[operand->indexingIndex]*4;
-                    }
-                    if (isscalar)
-                        src[opiter][0] = inregs[index];
-                    else
+                    if (operand->indexingType == 2)
+                        run = any_input_dirty;
+                    else if (count > 0)
                     {
-                        int cpy;
-                        for (cpy = 0; cpy < elems; cpy++)
-                            src[opiter][cpy] = inregs[index+cpy];
-                    } // else
+                        run = preshader_mask_any(dirty_inputs, incount,
+                                                 index / 4,
+                                                 (index + count - 1) / 4);
+                    } // else if
                     break;
 
                 case MOJOSHADER_PRESHADEROPERAND_OUTPUT:
-                    if (isscalar)
-                        src[opiter][0] = outregs[index];
-                    else
+                    for (e = 0; (!run) && (e < count); e++)
                     {
-                        int cpy;
-                        for (cpy = 0; cpy < elems; cpy++)
-                            src[opiter][cpy] = outregs[index+cpy];
-                    } // else
+                        // reading an output we haven't written yet sees
+                        //  whatever the caller left there, so always run.
+                        const uint8 state = out_state[index + e];
+                        run = ((state & 2) == 0) || (state & 1);
+                    } // for
                     break;
 
                 case MOJOSHADER_PRESHADEROPERAND_TEMP:
-                    if (temps != NULL)
-                    {
-                        if (isscalar)
-                            src[opiter][0] = temps[index];
-                        else
-                            memcpy(src[opiter], temps + index, elemsbytes);
-                    } // if
+                    for (e = 0; (!run) && (e < count); e++)
+                        run = temp_dirty[index + e];
                     break;
 
-                default:
-                    assert(0 && "unexpected preshader operand type.");
-                    return;
+                default: break;
             } // switch
         } // for
 
-        // run the actual instruction, store result to dst.
-        int i;
-        switch (inst->opcode)
+        int differs = 0;
+        if (!run)
+            memcpy(dst, result, sizeof (double) * elems);
+        else
         {
-            #define OPCODE_CASE(op, val) \
-                case MOJOSHADER_PRESHADEROP_##op: \
-                    for (i = 0; i < elems; i++) { dst[i] = val; } \
-                    break;
-
-            //OPCODE_CASE(NOP, 0.0)  // not a real instruction.
-            OPCODE_CASE(MOV, src0[i])
-            OPCODE_CASE(NEG, -src0[i])
-            OPCODE_CASE(RCP, 1.0 / src0[i])
-            OPCODE_CASE(FRC, src0[i] - floor(src0[i]))
-            OPCODE_CASE(EXP, exp(src0[i]))
-            OPCODE_CASE(LOG, log(src0[i]))
-            OPCODE_CASE(RSQ, 1.0 / sqrt(src0[i]))
-            OPCODE_CASE(SIN, sin(src0[i]))
-            OPCODE_CASE(COS, cos(src0[i]))
-            OPCODE_CASE(ASIN, asin(src0[i]))
-            OPCODE_CASE(ACOS, acos(src0[i]))
-            OPCODE_CASE(ATAN, atan(src0[i]))
-            OPCODE_CASE(MIN, (src0[i] < src1[i]) ? src0[i] : src1[i])
-            OPCODE_CASE(MAX, (src0[i] > src1[i]) ? src0[i] : src1[i])
-            OPCODE_CASE(LT, (src0[i] < src1[i]) ? 1.0 : 0.0)
-            OPCODE_CASE(GE, (src0[i] >= src1[i]) ? 1.0 : 0.0)
-            OPCODE_CASE(ADD, src0[i] + src1[i])
-            OPCODE_CASE(MUL,  src0[i] * src1[i])
-            OPCODE_CASE(ATAN2, atan2(src0[i], src1[i]))
-            OPCODE_CASE(DIV, src0[i] / src1[i])
-            OPCODE_CASE(CMP, (src0[i] >= 0.0) ? src1[i] : src2[i])
-            //OPCODE_CASE(NOISE, ???)  // !!! FIXME: don't know what this does
-            //OPCODE_CASE(MOVC, ???)  // !!! FIXME: don't know what this does
-            OPCODE_CASE(MIN_SCALAR, (src0[0] < src1[i]) ? src0[0] : src1[i])
-            OPCODE_CASE(MAX_SCALAR, (src0[0] > src1[i]) ? src0[0] : src1[i])
-            OPCODE_CASE(LT_SCALAR, (src0[0] < src1[i]) ? 1.0 : 0.0)
-            OPCODE_CASE(GE_SCALAR, (src0[0] >= src1[i]) ? 1.0 : 0.0)
-            OPCODE_CASE(ADD_SCALAR, src0[0] + src1[i])
-            OPCODE_CASE(MUL_SCALAR, src0[0] * src1[i])
-            OPCODE_CASE(ATAN2_SCALAR, atan2(src0[0], src1[i]))
-            OPCODE_CASE(DIV_SCALAR, src0[0] / src1[i])
-            //OPCODE_CASE(DOT_SCALAR)  // !!! FIXME: isn't this just a MUL?
-            //OPCODE_CASE(NOISE_SCALAR, ???)  // !!! FIXME: ?
-            #undef OPCODE_CASE
-
-            case MOJOSHADER_PRESHADEROP_DOT:
+            if (!run_preshader_instruction(preshader, inst, inregs, outregs,
+                                           temps, dst))
+                return executed;
+            executed++;
+            for (e = 0; e < elems; e++)
             {
-                double final = 0.0;
-                for (i = 0; i < elems; i++)
-                    final += src0[i] * src1[i];
-                for (i = 0; i < elems; i++)
-                    dst[i] = final;  // !!! FIXME: is this right?
-            } // case
-
-            default:
-                assert(0 && "Unhandled preshader opcode!");
-                break;
-        } // switch
+                if ((everything) || (dst[e] != result[e]))
+                {
+                    result[e] = dst[e];
+                    differs = 1;
+                } // if
+            } // for
+        } // else
 
-        // Figure out where dst wants to be stored.
-        if (operand->type == MOJOSHADER_PRESHADEROPERAND_TEMP)
+        dstop = &inst->operands[inst->operand_count-1];
+        if (dstop->type == MOJOSHADER_PRESHADEROPERAND_TEMP)
         {
-            assert(preshader->temp_count >=
-                    operand->index + (elemsbytes / sizeof (double)));
-            memcpy(temps + operand->index, dst, elemsbytes);
+            assert(preshader->temp_count >= dstop->index + elems);
+            memcpy(temps + dstop->index, dst, sizeof (double) * elems);
+            memset(temp_dirty + dstop->index, differs, elems);
         } // if
         else
         {
-            assert(operand->type == MOJOSHADER_PRESHADEROPERAND_OUTPUT);
-            for (i = 0; i < elems; i++)
-                outregs[operand->index + i] = (float) dst[i];
+            assert(dstop->type == MOJOSHADER_PRESHADEROPERAND_OUTPUT);
+            for (e = 0; e < elems; e++)
+            {
+                const unsigned int index = dstop->index + e;
+                const float val = (float) dst[e];
+                if ((changed_outputs != NULL) && (outregs[index] != val))
+                    changed_outputs[index / 128] |= (1u << ((index / 4) % 32));
+                outregs[index] = val;
+                out_state[index] = 2 | differs;
+            } // for
         } // else
     } // for
-} // MOJOSHADER_runPreshader
+
+    return executed;
+} // MOJOSHADER_runPreshaderIncremental
 
 static MOJOSHADER_effect MOJOSHADER_out_of_mem_effect = {
     1, &MOJOSHADER_out_of_mem_error, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
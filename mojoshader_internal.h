@@ -229,8 +229,11 @@ int errorlist_add_fmt(ErrorList *list, const char *fname,
                       const int errpos, const char *fmt, ...) ISPRINTF(4,5);
 int errorlist_add_va(ErrorList *list, const char *_fname,
                      const int errpos, const char *fmt, va_list va);
+void errorlist_set_limit(ErrorList *list, const int limit); // 0 == no limit
+int errorlist_full(ErrorList *list);
 int errorlist_count(ErrorList *list);
 MOJOSHADER_error *errorlist_flatten(ErrorList *list); // resets the list!
+void errorlist_empty(ErrorList *list);
 void errorlist_destroy(ErrorList *list);
 
 
@@ -238,7 +241,11 @@ void errorlist_destroy(ErrorList *list);
 // Dynamic buffers...
 
 typedef struct Buffer Buffer;
+typedef struct BufferPool BufferPool;
+BufferPool *bufferpool_create(MOJOSHADER_malloc m, MOJOSHADER_free f, void *d);
+void bufferpool_destroy(BufferPool *pool);
 Buffer *buffer_create(size_t blksz,MOJOSHADER_malloc m,MOJOSHADER_free f,void *d);
+Buffer *buffer_create_pooled(size_t blksz, BufferPool *pool);
 char *buffer_reserve(Buffer *buffer, const size_t len);
 int buffer_append(Buffer *buffer, const void *_data, size_t len);
 int buffer_append_fmt(Buffer *buffer, const char *fmt, ...) ISPRINTF(2,3);
@@ -253,6 +260,15 @@ ssize_t buffer_find(Buffer *buffer, const size_t start,
 
 
 
+// Numeric literals. These read at most (len) chars, stopping at the first
+//  one that isn't part of the number, and never allocate.
+
+int64 literal_int64(const char *str, unsigned int len);
+double literal_double(const char *str, const unsigned int len);
+float literal_float(const char *str, const unsigned int len);
+
+
+
 // This is the ID for a D3DXSHADER_CONSTANTTABLE in the bytecode comments.
 #define CTAB_ID 0x42415443  // 0x42415443 == 'CTAB'
 #define CTAB_SIZE 28  // sizeof (D3DXSHADER_CONSTANTTABLE).
@@ -266,6 +282,14 @@ ssize_t buffer_find(Buffer *buffer, const size_t start,
 #define CLIT_ID 0x54494C43  // 0x54494C43 == 'CLIT'
 #define FXLC_ID 0x434C5846  // 0x434C5846 == 'FXLC'
 
+// Calculate a preshader instruction's result into (dst), without storing it
+//  to the destination operand. Returns zero if the instruction can't be run.
+//  This lives in mojoshader_effects.c; the parser uses it to fold constants.
+int run_preshader_instruction(const MOJOSHADER_preshader *preshader,
+                              const MOJOSHADER_preshaderInstruction *inst,
+                              const float *inregs, const float *outregs,
+                              const double *temps, double *dst);
+
 // we need to reference these by explicit value occasionally...
 #define OPCODE_RET 28
 #define OPCODE_IF 40
@@ -290,6 +314,12 @@ void *MOJOSHADER_internal_malloc(int bytes, void *d);
 void MOJOSHADER_internal_free(void *ptr, void *d);
 #endif
 
+// Tell an allocation tracer what phase allocations belong to from now on.
+//  This is a no-op unless (m) is a MOJOSHADER_allocTracer's malloc. Returns
+//  the previous phase, so you can put it back when you're done.
+MOJOSHADER_allocPhase alloc_phase(MOJOSHADER_malloc m, void *d,
+                                  const MOJOSHADER_allocPhase phase);
+
 #if MOJOSHADER_FORCE_INCLUDE_CALLBACKS
 #define MOJOSHADER_internal_include_open NULL
 #define MOJOSHADER_internal_include_close NULL
@@ -547,6 +577,8 @@ typedef struct IncludeState
     unsigned int line;
     Conditional *conditional_stack;
     MOJOSHADER_includeClose close_callback;
+    const void *replay;  // include cache entry we're playing back, or NULL.
+    unsigned int replay_pos;
     struct IncludeState *next;
 } IncludeState;
 
@@ -560,6 +592,7 @@ Preprocessor *preprocessor_start(const char *fname, const char *source,
                             MOJOSHADER_includeClose close_callback,
                             const MOJOSHADER_preprocessorDefine *defines,
                             unsigned int define_count, int asm_comments,
+                            MOJOSHADER_includeCache *include_cache,
                             MOJOSHADER_malloc m, MOJOSHADER_free f, void *d);
 
 void preprocessor_end(Preprocessor *pp);
@@ -14,6 +14,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <assert.h>
 
 // !!! FIXME: most of these _MSC_VER should probably be _WINDOWS?
@@ -59,6 +60,7 @@ struct MOJOSHADER_glShader
     const MOJOSHADER_parseData *parseData;
     GLuint handle;
     uint32 refcount;
+    struct ShaderCacheKey *cachekey;  // NULL if not in the shader cache.
 };
 
 typedef struct
@@ -74,6 +76,28 @@ typedef struct
     GLint location;
 } AttributeMap;
 
+// One contiguous run to copy from a register file into a program's uniform
+//  array. Offsets and count are in elements (GLfloat, GLint or uint8).
+typedef struct
+{
+    uint32 src;
+    uint32 dst;
+    uint32 count;
+} UniformCopy;
+
+// The register files MOJOSHADER_glProgramReady() gathers from, in the order
+//  their runs are stored in (uniform_copies).
+typedef enum
+{
+    COPY_VS_FLOAT4,
+    COPY_VS_INT4,
+    COPY_VS_BOOL,
+    COPY_PS_FLOAT4,
+    COPY_PS_INT4,
+    COPY_PS_BOOL,
+    COPY_FILE_COUNT
+} UniformCopyFile;
+
 struct MOJOSHADER_glProgram
 {
     MOJOSHADER_glShader *vertex;
@@ -83,6 +107,8 @@ struct MOJOSHADER_glProgram
     uint32 uniform_count;
     uint32 texbem_count;
     UniformMap *uniforms;
+    UniformCopy *uniform_copies;
+    uint32 uniform_copy_count[COPY_FILE_COUNT];
     uint32 attribute_count;
     AttributeMap *attributes;
     size_t vs_uniforms_float4_count;
@@ -103,6 +129,16 @@ struct MOJOSHADER_glProgram
     size_t ps_preshader_reg_count;
     GLfloat *ps_preshader_regs;
 
+    // State for MOJOSHADER_runPreshaderIncremental(): the last results,
+    //  and a mask of the preshader_regs set since the last run.
+    double *vs_preshader_results;
+    unsigned int *vs_preshader_dirty;
+    int vs_preshader_primed;
+    double *ps_preshader_results;
+    unsigned int *ps_preshader_dirty;
+    int ps_preshader_primed;
+    int preshader_inlined;  // a shader calculates its own preshader.
+
     uint32 refcount;
 
     int uses_pointsize;
@@ -114,6 +150,8 @@ struct MOJOSHADER_glProgram
     GLint ps_float4_loc;
     GLint ps_int4_loc;
     GLint ps_bool_loc;
+    GLint vs_preshader_loc;
+    GLint ps_preshader_loc;
 };
 
 #ifndef WINGDIAPI
@@ -158,6 +196,9 @@ struct MOJOSHADER_glContext
     // This keeps track of implicitly linked programs.
     HashTable *linker_cache;
 
+    // This maps bytecode (plus swizzles and sampler map) to compiled shaders.
+    HashTable *shader_cache;
+
     // This tells us which vertex attribute arrays we have enabled.
     GLint max_attrs;
     uint8 want_attr[32];
@@ -166,13 +207,19 @@ struct MOJOSHADER_glContext
     // rarely used, so we don't touch when we don't have to.
     int pointsize_enabled;
 
+    MOJOSHADER_glProgram *bound_program;
+    char profile[16];
+    int trim_parse_data;
+
+    // Everything from here to the profile interface is filled in by
+    //  load_extensions(), and is copied as one block in and out of
+    //  MOJOSHADER_glCapabilities. Keep it together!
+
     // GL stuff...
     int opengl_major;
     int opengl_minor;
     int glsl_major;
     int glsl_minor;
-    MOJOSHADER_glProgram *bound_program;
-    char profile[16];
 
     // Extensions...
     int have_core_opengl;
@@ -245,7 +292,7 @@ struct MOJOSHADER_glContext
     PFNGLBINDPROGRAMARBPROC glBindProgramARB;
     PFNGLPROGRAMSTRINGARBPROC glProgramStringARB;
 
-    // interface for profile-specific things.
+    // interface for profile-specific things. Not part of the capabilities!
     int (*profileMaxUniforms)(MOJOSHADER_shaderType shader_type);
     int (*profileCompileShader)(const MOJOSHADER_parseData *pd, GLuint *s);
     void (*profileDeleteShader)(const GLuint shader);
@@ -263,6 +310,11 @@ struct MOJOSHADER_glContext
     int (*profileMustPushSamplers)(void);
 };
 
+// The part of MOJOSHADER_glContext that load_extensions() fills in.
+#define CAPABILITIES_START offsetof(MOJOSHADER_glContext, opengl_major)
+#define CAPABILITIES_END offsetof(MOJOSHADER_glContext, profileMaxUniforms)
+#define CAPABILITIES_SIZE (CAPABILITIES_END - CAPABILITIES_START)
+
 
 static MOJOSHADER_glContext *ctx = NULL;
 
@@ -549,6 +601,8 @@ static void impl_GLSL_FinalInitProgram(MOJOSHADER_glProgram *program)
     program->ps_float4_loc = glsl_uniform_loc(program, "ps_uniforms_vec4");
     program->ps_int4_loc = glsl_uniform_loc(program, "ps_uniforms_ivec4");
     program->ps_bool_loc = glsl_uniform_loc(program, "ps_uniforms_bool");
+    program->vs_preshader_loc = glsl_uniform_loc(program, "vs_preshader_vec4");
+    program->ps_preshader_loc = glsl_uniform_loc(program, "ps_preshader_vec4");
 } // impl_GLSL_FinalInitProgram
 
 
@@ -575,7 +629,8 @@ static void impl_GLSL_PushUniforms(void)
 {
     const MOJOSHADER_glProgram *program = ctx->bound_program;
 
-    assert(program->uniform_count > 0);  // don't call with nothing to do!
+    // don't call with nothing to do!
+    assert((program->uniform_count > 0) || (program->preshader_inlined));
 
     if (program->vs_float4_loc != -1)
     {
@@ -618,6 +673,21 @@ static void impl_GLSL_PushUniforms(void)
                           program->ps_uniforms_bool_count,
                           program->ps_uniforms_bool);
     } // if
+
+    // inlined preshaders read their inputs straight from these.
+    if ((program->vs_preshader_loc != -1) && (program->vs_preshader_regs))
+    {
+        ctx->glUniform4fv(program->vs_preshader_loc,
+                          program->vs_preshader_reg_count,
+                          program->vs_preshader_regs);
+    } // if
+
+    if ((program->ps_preshader_loc != -1) && (program->ps_preshader_regs))
+    {
+        ctx->glUniform4fv(program->ps_preshader_loc,
+                          program->ps_preshader_reg_count,
+                          program->ps_preshader_regs);
+    } // if
 } // impl_GLSL_PushUniforms
 
 
@@ -977,30 +1047,64 @@ static inline int opengl_version_atleast(const int major, const int minor)
              ((major << 16) | (minor & 0xFFFF)) );
 } // opengl_version_atleast
 
-static int verify_extension(const char *ext, int have, const char *extlist,
-                            int major, int minor)
+typedef struct
 {
-    if (have == 0)
-        return 0;  // don't bother checking, we're missing an entry point.
+    const char *name;
+    size_t len;
+    int *have;
+    int major;  // version that has this in core, or -1.
+    int minor;
+} ExtensionCheck;
 
-    else if (!ctx->have_core_opengl)
-        return 0;  // don't bother checking, we're missing basic functionality.
+// Walk the extension list once, checking each name against the extensions
+//  we still care about. Matching whole names also means one extension's name
+//  being a prefix of another's can't fool us.
+static void verify_extensions(ExtensionCheck *exts, const size_t count,
+                              const char *extlist)
+{
+    size_t pending = 0;
+    size_t i;
 
-    // See if it's in the spec for this GL implementation's version.
-    if ((major > 0) && (opengl_version_atleast(major, minor)))
-        return 1;
+    for (i = 0; i < count; i++)
+    {
+        ExtensionCheck *ext = &exts[i];
+        if (*ext->have == 0)
+            continue;  // don't bother checking, we're missing an entry point.
+        else if (!ctx->have_core_opengl)
+            *ext->have = 0;  // missing basic functionality.
+        else if ((ext->major > 0) &&
+                 (opengl_version_atleast(ext->major, ext->minor)))
+            continue;  // it's in the spec for this GL implementation's version.
+        else
+        {
+            // Not available in the GL version, check the extension list.
+            *ext->have = 0;
+            ext->len = strlen(ext->name);
+            exts[pending++] = *ext;
+        } // else
+    } // for
 
-    // Not available in the GL version, check the extension list.
-    const char *ptr = strstr(extlist, ext);
-    if (ptr == NULL)
-        return 0;
+    while ((pending > 0) && (*extlist != '\0'))
+    {
+        const char *end = extlist;
+        while ((*end != ' ') && (*end != '\0'))
+            end++;
 
-    const char endchar = ptr[strlen(ext)];
-    if ((endchar == '\0') || (endchar == ' '))
-        return 1;  // extension is in the list.
+        const size_t len = (size_t) (end - extlist);
+        for (i = 0; i < pending; i++)
+        {
+            const ExtensionCheck *ext = &exts[i];
+            if ((ext->len == len) && (memcmp(ext->name, extlist, len) == 0))
+            {
+                *ext->have = 1;  // extension is in the list.
+                exts[i] = exts[--pending];
+                break;
+            } // if
+        } // for
 
-    return 0;  // just not supported, fail.
-} // verify_extension
+        extlist = (*end == ' ') ? end + 1 : end;
+    } // while
+} // verify_extensions
 
 
 static void parse_opengl_version_str(const char *verstr, int *maj, int *min)
@@ -1105,23 +1209,27 @@ static void load_extensions(MOJOSHADER_glGetProcAddress lookup, void *d)
     } // if
 
     #define VERIFY_EXT(ext, major, minor) \
-        ctx->have_##ext = verify_extension(#ext, ctx->have_##ext, extlist, major, minor)
-
-    VERIFY_EXT(GL_ARB_vertex_program, -1, -1);
-    VERIFY_EXT(GL_ARB_fragment_program, -1, -1);
-    VERIFY_EXT(GL_ARB_shader_objects, -1, -1);
-    VERIFY_EXT(GL_ARB_vertex_shader, -1, -1);
-    VERIFY_EXT(GL_ARB_fragment_shader, -1, -1);
-    VERIFY_EXT(GL_ARB_shading_language_100, -1, -1);
-    VERIFY_EXT(GL_NV_vertex_program2_option, -1, -1);
-    VERIFY_EXT(GL_NV_fragment_program2, -1, -1);
-    VERIFY_EXT(GL_NV_vertex_program3, -1, -1);
-    VERIFY_EXT(GL_NV_half_float, -1, -1);
-    VERIFY_EXT(GL_ARB_half_float_vertex, 3, 0);
-    VERIFY_EXT(GL_OES_vertex_half_float, -1, -1);
+        { #ext, 0, &ctx->have_##ext, major, minor }
+
+    ExtensionCheck exts[] = {
+        VERIFY_EXT(GL_ARB_vertex_program, -1, -1),
+        VERIFY_EXT(GL_ARB_fragment_program, -1, -1),
+        VERIFY_EXT(GL_ARB_shader_objects, -1, -1),
+        VERIFY_EXT(GL_ARB_vertex_shader, -1, -1),
+        VERIFY_EXT(GL_ARB_fragment_shader, -1, -1),
+        VERIFY_EXT(GL_ARB_shading_language_100, -1, -1),
+        VERIFY_EXT(GL_NV_vertex_program2_option, -1, -1),
+        VERIFY_EXT(GL_NV_fragment_program2, -1, -1),
+        VERIFY_EXT(GL_NV_vertex_program3, -1, -1),
+        VERIFY_EXT(GL_NV_half_float, -1, -1),
+        VERIFY_EXT(GL_ARB_half_float_vertex, 3, 0),
+        VERIFY_EXT(GL_OES_vertex_half_float, -1, -1),
+    };
 
     #undef VERIFY_EXT
 
+    verify_extensions(exts, STATICARRAYLEN(exts), extlist);
+
     detect_glsl_version();
 } // load_extensions
 
@@ -1220,16 +1328,20 @@ static const char *profile_priorities[] = {
 #endif
 };
 
-int MOJOSHADER_glAvailableProfiles(MOJOSHADER_glGetProcAddress lookup, void *d,
-                                   const char **profs, const int size)
+struct MOJOSHADER_glCapabilities
 {
-    int retval = 0;
-    MOJOSHADER_glContext _ctx;
-    MOJOSHADER_glContext *current_ctx = ctx;
+    MOJOSHADER_malloc malloc_fn;
+    MOJOSHADER_free free_fn;
+    void *malloc_data;
+    int profile_count;
+    const char *profiles[STATICARRAYLEN(profile_priorities)];
+    uint8 state[CAPABILITIES_SIZE];  // copy of the context's capabilities.
+};
 
-    ctx = &_ctx;
-    memset(ctx, '\0', sizeof (MOJOSHADER_glContext));
-    load_extensions(lookup, d);
+// Check the profiles against (ctx), which has to have its capabilities set.
+static int available_profiles(const char **profs, const int size)
+{
+    int retval = 0;
 
     if (ctx->have_core_opengl)
     {
@@ -1246,6 +1358,22 @@ int MOJOSHADER_glAvailableProfiles(MOJOSHADER_glGetProcAddress lookup, void *d,
         } // for
     } // if
 
+    return retval;
+} // available_profiles
+
+
+int MOJOSHADER_glAvailableProfiles(MOJOSHADER_glGetProcAddress lookup, void *d,
+                                   const char **profs, const int size)
+{
+    int retval = 0;
+    MOJOSHADER_glContext _ctx;
+    MOJOSHADER_glContext *current_ctx = ctx;
+
+    ctx = &_ctx;
+    memset(ctx, '\0', sizeof (MOJOSHADER_glContext));
+    load_extensions(lookup, d);
+    retval = available_profiles(profs, size);
+
     ctx = current_ctx;
     return retval;
 } // MOJOSHADER_glAvailableProfiles
@@ -1264,11 +1392,97 @@ const char *MOJOSHADER_glBestProfile(MOJOSHADER_glGetProcAddress gpa, void *d)
 } // MOJOSHADER_glBestProfile
 
 
-MOJOSHADER_glContext *MOJOSHADER_glCreateContext(const char *profile,
+DLLEXPORT
+MOJOSHADER_glCapabilities *MOJOSHADER_glCreateCapabilities(
                                         MOJOSHADER_glGetProcAddress lookup,
                                         void *lookup_d,
                                         MOJOSHADER_malloc m, MOJOSHADER_free f,
                                         void *malloc_d)
+{
+    MOJOSHADER_glCapabilities *retval = NULL;
+    MOJOSHADER_glContext *current_ctx = ctx;
+
+    if (m == NULL) m = MOJOSHADER_internal_malloc;
+    if (f == NULL) f = MOJOSHADER_internal_free;
+
+    retval = (MOJOSHADER_glCapabilities *)
+                    m(sizeof (MOJOSHADER_glCapabilities), malloc_d);
+    if (retval == NULL)
+    {
+        out_of_memory();
+        return NULL;
+    } // if
+
+    // load_extensions() works on a context, so give it a scratch one. This
+    //  is too big to put on the stack like glAvailableProfiles does.
+    ctx = (MOJOSHADER_glContext *) m(sizeof (MOJOSHADER_glContext), malloc_d);
+    if (ctx == NULL)
+    {
+        f(retval, malloc_d);
+        ctx = current_ctx;
+        out_of_memory();
+        return NULL;
+    } // if
+
+    memset(ctx, '\0', sizeof (MOJOSHADER_glContext));
+    memset(retval, '\0', sizeof (MOJOSHADER_glCapabilities));
+    retval->malloc_fn = m;
+    retval->free_fn = f;
+    retval->malloc_data = malloc_d;
+
+    load_extensions(lookup, lookup_d);
+    retval->profile_count = available_profiles(retval->profiles,
+                                        STATICARRAYLEN(retval->profiles));
+    memcpy(retval->state, ((const uint8 *) ctx) + CAPABILITIES_START,
+           CAPABILITIES_SIZE);
+
+    f(ctx, malloc_d);
+    ctx = current_ctx;
+    return retval;
+} // MOJOSHADER_glCreateCapabilities
+
+
+DLLEXPORT
+int MOJOSHADER_glCapabilitiesAvailableProfiles(
+                                        const MOJOSHADER_glCapabilities *caps,
+                                        const char **profs, const int size)
+{
+    int i;
+    for (i = 0; (i < caps->profile_count) && (i < size); i++)
+        profs[i] = caps->profiles[i];
+    return caps->profile_count;
+} // MOJOSHADER_glCapabilitiesAvailableProfiles
+
+
+DLLEXPORT
+const char *MOJOSHADER_glCapabilitiesBestProfile(
+                                        const MOJOSHADER_glCapabilities *caps)
+{
+    if (caps->profile_count <= 0)
+    {
+        set_error("no profiles available");
+        return NULL;
+    } // if
+
+    return caps->profiles[0];  // profiles are sorted "best" to "worst."
+} // MOJOSHADER_glCapabilitiesBestProfile
+
+
+DLLEXPORT
+void MOJOSHADER_glDestroyCapabilities(MOJOSHADER_glCapabilities *caps)
+{
+    if (caps != NULL)
+        caps->free_fn(caps, caps->malloc_data);
+} // MOJOSHADER_glDestroyCapabilities
+
+
+// (caps) may be NULL, in which case we query the GL through (lookup).
+static MOJOSHADER_glContext *create_context(const char *profile,
+                                        MOJOSHADER_glGetProcAddress lookup,
+                                        void *lookup_d,
+                                        const MOJOSHADER_glCapabilities *caps,
+                                        MOJOSHADER_malloc m, MOJOSHADER_free f,
+                                        void *malloc_d)
 {
     MOJOSHADER_glContext *retval = NULL;
     MOJOSHADER_glContext *current_ctx = ctx;
@@ -1291,7 +1505,14 @@ MOJOSHADER_glContext *MOJOSHADER_glCreateContext(const char *profile,
     ctx->malloc_data = malloc_d;
     snprintf(ctx->profile, sizeof (ctx->profile), "%s", profile);
 
-    load_extensions(lookup, lookup_d);
+    if (caps == NULL)
+        load_extensions(lookup, lookup_d);
+    else
+    {
+        memcpy(((uint8 *) ctx) + CAPABILITIES_START, caps->state,
+               CAPABILITIES_SIZE);
+    } // else
+
     if (!valid_profile(profile))
         goto init_fail;
 
@@ -1374,9 +1595,30 @@ init_fail:
         f(ctx, malloc_d);
     ctx = current_ctx;
     return NULL;
+} // create_context
+
+
+MOJOSHADER_glContext *MOJOSHADER_glCreateContext(const char *profile,
+                                        MOJOSHADER_glGetProcAddress lookup,
+                                        void *lookup_d,
+                                        MOJOSHADER_malloc m, MOJOSHADER_free f,
+                                        void *malloc_d)
+{
+    return create_context(profile, lookup, lookup_d, NULL, m, f, malloc_d);
 } // MOJOSHADER_glCreateContext
 
 
+DLLEXPORT
+MOJOSHADER_glContext *MOJOSHADER_glCreateContextFromCapabilities(
+                                        const char *profile,
+                                        const MOJOSHADER_glCapabilities *caps,
+                                        MOJOSHADER_malloc m, MOJOSHADER_free f,
+                                        void *malloc_d)
+{
+    return create_context(profile, NULL, NULL, caps, m, f, malloc_d);
+} // MOJOSHADER_glCreateContextFromCapabilities
+
+
 void MOJOSHADER_glMakeContextCurrent(MOJOSHADER_glContext *_ctx)
 {
     ctx = _ctx;
@@ -1389,47 +1631,222 @@ int MOJOSHADER_glMaxUniforms(MOJOSHADER_shaderType shader_type)
 } // MOJOSHADER_glMaxUniforms
 
 
-MOJOSHADER_glShader *MOJOSHADER_glCompileShader(const unsigned char *tokenbuf,
-                                                const unsigned int bufsize,
-                                                const MOJOSHADER_swizzle *swiz,
-                                                const unsigned int swizcount,
-                                                const MOJOSHADER_samplerMap *smap,
-                                                const unsigned int smapcount)
+DLLEXPORT
+const char *MOJOSHADER_glGetContextProfile(void)
+{
+    return ctx->profile;
+} // MOJOSHADER_glGetContextProfile
+
+
+DLLEXPORT
+void MOJOSHADER_glSetParseDataTrimming(int enable)
+{
+    ctx->trim_parse_data = enable;
+} // MOJOSHADER_glSetParseDataTrimming
+
+
+DLLEXPORT
+MOJOSHADER_glShader *MOJOSHADER_glCompileShaderFromParseData(
+                                        const MOJOSHADER_parseData *pd)
 {
     MOJOSHADER_glShader *retval = NULL;
     GLuint shader = 0;
-    const MOJOSHADER_parseData *pd = MOJOSHADER_parse(ctx->profile, tokenbuf,
-                                                      bufsize, swiz, swizcount,
-                                                      smap, smapcount,
-                                                      ctx->malloc_fn,
-                                                      ctx->free_fn,
-                                                      ctx->malloc_data);
+
+    if (pd == NULL)
+    {
+        set_error("No parse data");
+        return NULL;
+    } // if
+
     if (pd->error_count > 0)
     {
         // !!! FIXME: put multiple errors in the buffer? Don't use
         // !!! FIXME:  MOJOSHADER_glGetError() for this?
         set_error(pd->errors[0].error);
-        goto compile_shader_fail;
+        return NULL;
+    } // if
+
+    if ((pd->profile == NULL) || (strcmp(pd->profile, ctx->profile) != 0))
+    {
+        set_error("Shader was translated for a different profile");
+        return NULL;
     } // if
 
     retval = (MOJOSHADER_glShader *) Malloc(sizeof (MOJOSHADER_glShader));
     if (retval == NULL)
-        goto compile_shader_fail;
+        return NULL;
 
     if (!ctx->profileCompileShader(pd, &shader))
-        goto compile_shader_fail;
+    {
+        Free(retval);
+        if (shader != 0)
+            ctx->profileDeleteShader(shader);
+        return NULL;
+    } // if
 
     retval->parseData = pd;
     retval->handle = shader;
     retval->refcount = 1;
+    retval->cachekey = NULL;
     return retval;
+} // MOJOSHADER_glCompileShaderFromParseData
+
+
+// Compiling the same bytecode with the same swizzles and sampler map twice
+//  hands back the first shader with another reference, so duplicates don't
+//  cost a second translation, and they link into the same programs. The
+//  cache doesn't own a reference: a shader leaves it when it is deleted.
+
+typedef struct ShaderCacheKey
+{
+    uint32 hash;
+    const unsigned char *tokenbuf;
+    unsigned int bufsize;
+    const MOJOSHADER_swizzle *swiz;
+    unsigned int swizcount;
+    const MOJOSHADER_samplerMap *smap;
+    unsigned int smapcount;
+} ShaderCacheKey;
+
+// this is djb's xor hashing function, like mojoshader_common.c uses.
+static uint32 hash_bytes(uint32 hash, const void *_data, size_t len)
+{
+    const uint8 *data = (const uint8 *) _data;
+    while (len--)
+        hash = ((hash << 5) + hash) ^ *(data++);
+    return hash;
+} // hash_bytes
+
+static void build_shader_key(ShaderCacheKey *key,
+                             const unsigned char *tokenbuf,
+                             const unsigned int bufsize,
+                             const MOJOSHADER_swizzle *swiz,
+                             const unsigned int swizcount,
+                             const MOJOSHADER_samplerMap *smap,
+                             const unsigned int smapcount)
+{
+    key->tokenbuf = tokenbuf;
+    key->bufsize = bufsize;
+    key->swiz = (swizcount > 0) ? swiz : NULL;
+    key->swizcount = (swiz != NULL) ? swizcount : 0;
+    key->smap = (smapcount > 0) ? smap : NULL;
+    key->smapcount = (smap != NULL) ? smapcount : 0;
+
+    uint32 hash = hash_bytes(5381, tokenbuf, bufsize);
+    hash = hash_bytes(hash, key->swiz, sizeof (*swiz) * key->swizcount);
+    hash = hash_bytes(hash, key->smap, sizeof (*smap) * key->smapcount);
+    key->hash = hash;
+} // build_shader_key
+
+static uint32 hash_shader_key(const void *sym, void *data)
+{
+    (void) data;
+    return ((const ShaderCacheKey *) sym)->hash;
+} // hash_shader_key
 
-compile_shader_fail:
-    MOJOSHADER_freeParseData(pd);
-    Free(retval);
-    if (shader != 0)
-        ctx->profileDeleteShader(shader);
-    return NULL;
+static int match_shader_key(const void *_a, const void *_b, void *data)
+{
+    (void) data;
+    const ShaderCacheKey *a = (const ShaderCacheKey *) _a;
+    const ShaderCacheKey *b = (const ShaderCacheKey *) _b;
+
+    if ( (a->hash != b->hash) || (a->bufsize != b->bufsize) ||
+         (a->swizcount != b->swizcount) || (a->smapcount != b->smapcount) )
+        return 0;
+    else if (memcmp(a->tokenbuf, b->tokenbuf, a->bufsize) != 0)
+        return 0;
+    else if ((a->swizcount) && (memcmp(a->swiz, b->swiz, sizeof (*a->swiz) * a->swizcount) != 0))
+        return 0;
+    else if ((a->smapcount) && (memcmp(a->smap, b->smap, sizeof (*a->smap) * a->smapcount) != 0))
+        return 0;
+
+    return 1;
+} // match_shader_key
+
+static void nuke_shader_key(const void *key, const void *value, void *data)
+{
+    (void) value;  // the cache doesn't own the shader.
+    (void) data;
+    Free((void *) key);
+} // nuke_shader_key
+
+// Failing to cache a shader isn't an error, so this doesn't report one.
+static void cache_shader(MOJOSHADER_glShader *shader, const ShaderCacheKey *key)
+{
+    if (ctx->shader_cache == NULL)
+    {
+        ctx->shader_cache = hash_create(NULL, hash_shader_key,
+                                        match_shader_key, nuke_shader_key,
+                                        0, ctx->malloc_fn, ctx->free_fn,
+                                        ctx->malloc_data);
+        if (ctx->shader_cache == NULL)
+            return;
+    } // if
+
+    // copy everything the key points to into one allocation.
+    const size_t swizlen = sizeof (*key->swiz) * key->swizcount;
+    const size_t smaplen = sizeof (*key->smap) * key->smapcount;
+    const size_t len = sizeof (ShaderCacheKey) + swizlen + smaplen + key->bufsize;
+    ShaderCacheKey *item = (ShaderCacheKey *) ctx->malloc_fn((int) len,
+                                                             ctx->malloc_data);
+    if (item == NULL)
+        return;
+
+    uint8 *ptr = (uint8 *) (item + 1);
+    memcpy(item, key, sizeof (ShaderCacheKey));
+    if (swizlen > 0)
+    {
+        memcpy(ptr, key->swiz, swizlen);
+        item->swiz = (const MOJOSHADER_swizzle *) ptr;
+        ptr += swizlen;
+    } // if
+    if (smaplen > 0)
+    {
+        memcpy(ptr, key->smap, smaplen);
+        item->smap = (const MOJOSHADER_samplerMap *) ptr;
+        ptr += smaplen;
+    } // if
+    memcpy(ptr, key->tokenbuf, key->bufsize);
+    item->tokenbuf = ptr;
+
+    if (hash_insert(ctx->shader_cache, item, shader) != 1)
+        Free(item);
+    else
+        shader->cachekey = item;
+} // cache_shader
+
+
+MOJOSHADER_glShader *MOJOSHADER_glCompileShader(const unsigned char *tokenbuf,
+                                                const unsigned int bufsize,
+                                                const MOJOSHADER_swizzle *swiz,
+                                                const unsigned int swizcount,
+                                                const MOJOSHADER_samplerMap *smap,
+                                                const unsigned int smapcount)
+{
+    MOJOSHADER_glShader *retval = NULL;
+    ShaderCacheKey key;
+    build_shader_key(&key, tokenbuf, bufsize, swiz, swizcount, smap, smapcount);
+
+    const void *val = NULL;
+    if ((ctx->shader_cache != NULL) && (hash_find(ctx->shader_cache, &key, &val)))
+    {
+        retval = (MOJOSHADER_glShader *) val;
+        retval->refcount++;
+        return retval;
+    } // if
+
+    const MOJOSHADER_parseData *pd = MOJOSHADER_parse(ctx->profile, tokenbuf,
+                                                      bufsize, swiz, swizcount,
+                                                      smap, smapcount,
+                                                      ctx->malloc_fn,
+                                                      ctx->free_fn,
+                                                      ctx->malloc_data);
+    retval = MOJOSHADER_glCompileShaderFromParseData(pd);
+    if (retval == NULL)
+        MOJOSHADER_freeParseData(pd);
+    else
+        cache_shader(retval, &key);
+    return retval;
 } // MOJOSHADER_glCompileShader
 
 
@@ -1449,6 +1866,8 @@ static void shader_unref(MOJOSHADER_glShader *shader)
             shader->refcount--;
         else
         {
+            if (shader->cachekey != NULL)
+                hash_remove(ctx->shader_cache, shader->cachekey);
             ctx->profileDeleteShader(shader->handle);
             MOJOSHADER_freeParseData(shader->parseData);
             Free(shader);
@@ -1471,6 +1890,10 @@ static void program_unref(MOJOSHADER_glProgram *program)
             shader_unref(program->fragment);
             Free(program->vs_preshader_regs);
             Free(program->ps_preshader_regs);
+            Free(program->vs_preshader_results);
+            Free(program->vs_preshader_dirty);
+            Free(program->ps_preshader_results);
+            Free(program->ps_preshader_dirty);
             Free(program->vs_uniforms_float4);
             Free(program->vs_uniforms_int4);
             Free(program->vs_uniforms_bool);
@@ -1478,6 +1901,7 @@ static void program_unref(MOJOSHADER_glProgram *program)
             Free(program->ps_uniforms_int4);
             Free(program->ps_uniforms_bool);
             Free(program->uniforms);
+            Free(program->uniform_copies);
             Free(program->attributes);
             Free(program);
         } // else
@@ -1629,6 +2053,51 @@ static int lookup_uniforms(MOJOSHADER_glProgram *program,
                 program->ps_preshader_regs = buf;
             } // else if
         } // if
+
+        if (pd->preshader_inlined)
+        {
+            program->preshader_inlined = 1;
+            return 1;  // the shader runs it, no CPU-side state needed.
+        } // if
+
+        const unsigned int words = MOJOSHADER_PRESHADER_MASK_WORDS(
+                                    pd->preshader->input_register_count);
+        const size_t reslen = sizeof (double) * 4 *
+                                    pd->preshader->instruction_count;
+        double *results = NULL;
+        unsigned int *dirty = NULL;
+        if (reslen > 0)
+        {
+            results = (double *) Malloc(reslen);
+            if (results == NULL)
+                return 0;
+        } // if
+        if (words > 0)
+        {
+            dirty = (unsigned int *) Malloc(sizeof (unsigned int) * words);
+            if (dirty == NULL)
+            {
+                Free(results);
+                return 0;
+            } // if
+            memset(dirty, '\0', sizeof (unsigned int) * words);
+        } // if
+
+        if (shader_type == MOJOSHADER_TYPE_VERTEX)
+        {
+            program->vs_preshader_results = results;
+            program->vs_preshader_dirty = dirty;
+        } // if
+        else if (shader_type == MOJOSHADER_TYPE_PIXEL)
+        {
+            program->ps_preshader_results = results;
+            program->ps_preshader_dirty = dirty;
+        } // else if
+        else
+        {
+            Free(results);
+            Free(dirty);
+        } // else
     } // if
 
     return 1;
@@ -1740,6 +2209,74 @@ static int build_constants_lists(MOJOSHADER_glProgram *program)
 } // build_constants_lists
 
 
+// Flatten the uniform list into runs of register file to copy every time the
+//  uniforms are pushed, merging neighbours, so ProgramReady doesn't have to
+//  look at each uniform's type and size every time.
+static int build_uniform_copies(MOJOSHADER_glProgram *program)
+{
+    const uint32 count = program->uniform_count;
+    UniformCopy *copy;
+    uint32 file, i;
+
+    if (count == 0)
+        return 1;
+
+    copy = (UniformCopy *) Malloc(sizeof (UniformCopy) * count);
+    if (copy == NULL)
+        return 0;
+    program->uniform_copies = copy;
+
+    // one pass per register file, so each file's runs are together.
+    for (file = 0; file < COPY_FILE_COUNT; file++)
+    {
+        const MOJOSHADER_shaderType shader_type = (file < COPY_PS_FLOAT4) ?
+                            MOJOSHADER_TYPE_VERTEX : MOJOSHADER_TYPE_PIXEL;
+        const uint32 filetype = file % 3;
+        UniformCopy *first = copy;
+        uint32 dst = 0;
+
+        for (i = 0; i < count; i++)
+        {
+            const UniformMap *map = &program->uniforms[i];
+            const MOJOSHADER_uniform *u = map->uniform;
+            const uint32 size = u->array_count ? u->array_count : 1;
+            uint32 src, elems;
+
+            assert(!u->constant);
+
+            if (map->shader_type != shader_type)
+                continue;
+            else if ((u->type == MOJOSHADER_UNIFORM_FLOAT) && (filetype == 0))
+                src = u->index * 4, elems = size * 4;
+            else if ((u->type == MOJOSHADER_UNIFORM_INT) && (filetype == 1))
+                src = u->index * 4, elems = size * 4;
+            else if ((u->type == MOJOSHADER_UNIFORM_BOOL) && (filetype == 2))
+                src = u->index, elems = size;
+            else
+                continue;
+
+            if ( (copy != first) &&
+                 ((copy[-1].src + copy[-1].count) == src) &&
+                 ((copy[-1].dst + copy[-1].count) == dst) )
+                copy[-1].count += elems;
+            else
+            {
+                copy->src = src;
+                copy->dst = dst;
+                copy->count = elems;
+                copy++;
+            } // else
+
+            dst += elems;
+        } // for
+
+        program->uniform_copy_count[file] = (uint32) (copy - first);
+    } // for
+
+    return 1;
+} // build_uniform_copies
+
+
 MOJOSHADER_glProgram *MOJOSHADER_glLinkProgram(MOJOSHADER_glShader *vshader,
                                                MOJOSHADER_glShader *pshader)
 {
@@ -1811,11 +2348,23 @@ MOJOSHADER_glProgram *MOJOSHADER_glLinkProgram(MOJOSHADER_glShader *vshader,
     if (!build_constants_lists(retval))
         goto link_program_fail;
 
+    if (!build_uniform_copies(retval))
+        goto link_program_fail;
+
     if (bound)  // reset the old binding.
         ctx->profileUseProgram(ctx->bound_program);
 
     ctx->profileFinalInitProgram(retval);
 
+    // linked, so we're done with the source code, etc.
+    if (ctx->trim_parse_data)
+    {
+        if (vshader != NULL)
+            MOJOSHADER_trimParseData(vshader->parseData);
+        if (pshader != NULL)
+            MOJOSHADER_trimParseData(pshader->parseData);
+    } // if
+
     return retval;
 
 link_program_fail:
@@ -2237,6 +2786,54 @@ void MOJOSHADER_glSetVertexAttribute(MOJOSHADER_usage usage,
 } // MOJOSHADER_glSetVertexAttribute
 
 
+static void mark_preshader_dirty(unsigned int *dirty, const uint idx,
+                                 const uint count)
+{
+    uint i;
+    if (dirty != NULL)
+    {
+        for (i = idx; i < idx + count; i++)
+            dirty[i / 32] |= (1u << (i % 32));
+    } // if
+} // mark_preshader_dirty
+
+
+// Returns non-zero if this changed anything in (regfile).
+static int run_preshader(const MOJOSHADER_preshader *preshader,
+                         const GLfloat *regs, GLfloat *regfile,
+                         double *results, unsigned int *dirty, int *primed)
+{
+    const uint words = MOJOSHADER_PRESHADER_MASK_WORDS(
+                                    preshader->output_register_count);
+    unsigned int *changed = NULL;
+    int retval = 0;
+    uint i;
+
+    if (results == NULL)  // no instructions?
+        return 0;
+
+    if (words > 0)
+        changed = (unsigned int *) alloca(sizeof (unsigned int) * words);
+
+    // the first run has to calculate everything.
+    MOJOSHADER_runPreshaderIncremental(preshader, regs, regfile, results,
+                                       *primed ? dirty : NULL, changed);
+    *primed = 1;
+
+    if (dirty != NULL)
+    {
+        const uint inwords = MOJOSHADER_PRESHADER_MASK_WORDS(
+                                    preshader->input_register_count);
+        memset(dirty, '\0', sizeof (unsigned int) * inwords);
+    } // if
+
+    for (i = 0; i < words; i++)
+        retval |= (changed[i] != 0);
+
+    return retval;
+} // run_preshader
+
+
 void MOJOSHADER_glSetVertexPreshaderUniformF(unsigned int idx,
                                              const float *data,
                                              unsigned int vec4n)
@@ -2251,6 +2848,8 @@ void MOJOSHADER_glSetVertexPreshaderUniformF(unsigned int idx,
         assert(sizeof (GLfloat) == sizeof (float));
         const uint cpy = (minuint(maxregs - idx, vec4n) * sizeof (*data)) * 4;
         memcpy(program->vs_preshader_regs + (idx * 4), data, cpy);
+        mark_preshader_dirty(program->vs_preshader_dirty, idx,
+                             minuint(maxregs - idx, vec4n));
         program->generation = ctx->generation-1;
     } // if
 } // MOJOSHADER_glSetVertexPreshaderUniformF
@@ -2287,6 +2886,8 @@ void MOJOSHADER_glSetPixelPreshaderUniformF(unsigned int idx,
         assert(sizeof (GLfloat) == sizeof (float));
         const uint cpy = (minuint(maxregs - idx, vec4n) * sizeof (*data)) * 4;
         memcpy(program->ps_preshader_regs + (idx * 4), data, cpy);
+        mark_preshader_dirty(program->ps_preshader_dirty, idx,
+                             minuint(maxregs - idx, vec4n));
         program->generation = ctx->generation-1;
     } // if
 } // MOJOSHADER_glSetPixelPreshaderUniformF
@@ -2347,110 +2948,113 @@ void MOJOSHADER_glProgramReady(void)
     } // if
 
     // push Uniforms to the program from our register files...
-    if ( ((program->uniform_count) || (program->texbem_count)) &&
+    if ( ((program->uniform_count) || (program->texbem_count) ||
+          (program->preshader_inlined)) &&
          (program->generation != ctx->generation))
     {
-        // vertex shader uniforms come first in program->uniforms array.
-        const uint32 count = program->uniform_count;
-        const GLfloat *srcf = ctx->vs_reg_file_f;
-        const GLint *srci = ctx->vs_reg_file_i;
-        const uint8 *srcb = ctx->vs_reg_file_b;
-        MOJOSHADER_shaderType shader_type = MOJOSHADER_TYPE_VERTEX;
-        GLfloat *dstf = program->vs_uniforms_float4;
-        GLint *dsti = program->vs_uniforms_int4;
-        GLint *dstb = program->vs_uniforms_bool;
+        // runs are stored grouped by register file, in UniformCopyFile order.
+        const UniformCopy *copy = program->uniform_copies;
         const MOJOSHADER_preshader *preshader = NULL;
+        uint32 file;
         uint32 i;
 
         // !!! FIXME: shouldn't this run even if the generation hasn't changed?
-        int ran_preshader = 0;
+        // Only instructions downstream of a changed preshader register rerun,
+        //  and other programs only need to resync if a register changed.
+        int preshader_changed = 0;
         if (program->vertex)
         {
             preshader = program->vertex->parseData->preshader;
-            if (preshader)
+            if ((preshader) && (!program->vertex->parseData->preshader_inlined))
             {
-                MOJOSHADER_runPreshader(preshader, program->vs_preshader_regs,
-                                        ctx->vs_reg_file_f);
-                ran_preshader = 1;
+                preshader_changed |= run_preshader(preshader,
+                                            program->vs_preshader_regs,
+                                            ctx->vs_reg_file_f,
+                                            program->vs_preshader_results,
+                                            program->vs_preshader_dirty,
+                                            &program->vs_preshader_primed);
             } // if
         } // if
 
         if (program->fragment)
         {
             preshader = program->fragment->parseData->preshader;
-            if (preshader)
+            if ((preshader) && (!program->fragment->parseData->preshader_inlined))
             {
-                MOJOSHADER_runPreshader(preshader, program->ps_preshader_regs,
-                                        ctx->ps_reg_file_f);
-                ran_preshader = 1;
+                preshader_changed |= run_preshader(preshader,
+                                            program->ps_preshader_regs,
+                                            ctx->ps_reg_file_f,
+                                            program->ps_preshader_results,
+                                            program->ps_preshader_dirty,
+                                            &program->ps_preshader_primed);
             } // if
         } // if
 
-        if (ran_preshader)
+        if (preshader_changed)
             ctx->generation++;
 
-        for (i = 0; i < count; i++)
+        for (file = 0; file < COPY_FILE_COUNT; file++)
         {
-            UniformMap *map = &program->uniforms[i];
-            const MOJOSHADER_shaderType uniform_shader_type = map->shader_type;
-            const MOJOSHADER_uniform *u = map->uniform;
-            const MOJOSHADER_uniformType type = u->type;
-            const int index = u->index;
-            const int size = u->array_count ? u->array_count : 1;
-
-            assert(!u->constant);
-
-            // Did we switch from vertex to pixel (to geometry, etc)?
-            if (shader_type != uniform_shader_type)
+            const uint32 runs = program->uniform_copy_count[file];
+            uint32 run;
+            switch (file)
             {
-                // we start with vertex, move to pixel, then to geometry, etc.
-                //  The array should always be sorted as such.
-                if (uniform_shader_type == MOJOSHADER_TYPE_PIXEL)
+                case COPY_VS_FLOAT4:
+                case COPY_PS_FLOAT4:
                 {
-                    assert(shader_type == MOJOSHADER_TYPE_VERTEX);
-                    srcf = ctx->ps_reg_file_f;
-                    srci = ctx->ps_reg_file_i;
-                    srcb = ctx->ps_reg_file_b;
-                    dstf = program->ps_uniforms_float4;
-                    dsti = program->ps_uniforms_int4;
-                    dstb = program->ps_uniforms_bool;
-                } // if
-                else
+                    const GLfloat *srcf = (file == COPY_VS_FLOAT4) ?
+                                    ctx->vs_reg_file_f : ctx->ps_reg_file_f;
+                    GLfloat *dstf = (file == COPY_VS_FLOAT4) ?
+                            program->vs_uniforms_float4 :
+                            program->ps_uniforms_float4;
+                    for (run = 0; run < runs; run++, copy++)
+                    {
+                        memcpy(dstf + copy->dst, srcf + copy->src,
+                               sizeof (GLfloat) * copy->count);
+                    } // for
+                    break;
+                } // case
+
+                case COPY_VS_INT4:
+                case COPY_PS_INT4:
                 {
-                    // Should be ordered vertex, then pixel, then geometry.
-                    assert(0 && "Unexpected shader type");
-                } // else
-
-                shader_type = uniform_shader_type;
-            } // if
-
-            if (type == MOJOSHADER_UNIFORM_FLOAT)
-            {
-                const size_t count = 4 * size;
-                const GLfloat *f = &srcf[index * 4];
-                memcpy(dstf, f, sizeof (GLfloat) * count);
-                dstf += count;
-            } // if
-            else if (type == MOJOSHADER_UNIFORM_INT)
-            {
-                const size_t count = 4 * size;
-                const GLint *i = &srci[index * 4];
-                memcpy(dsti, i, sizeof (GLint) * count);
-                dsti += count;
-            } // else if
-            else if (type == MOJOSHADER_UNIFORM_BOOL)
-            {
-                const size_t count = size;
-                const uint8 *b = &srcb[index];
-                size_t i;
-                for (i = 0; i < count; i++)
-                    dstb[i] = (GLint) b[i];
-                dstb += count;
-            } // else if
-
-            // !!! FIXME: set constants that overlap the array.
+                    const GLint *srci = (file == COPY_VS_INT4) ?
+                                    ctx->vs_reg_file_i : ctx->ps_reg_file_i;
+                    GLint *dsti = (file == COPY_VS_INT4) ?
+                            program->vs_uniforms_int4 :
+                            program->ps_uniforms_int4;
+                    for (run = 0; run < runs; run++, copy++)
+                    {
+                        memcpy(dsti + copy->dst, srci + copy->src,
+                               sizeof (GLint) * copy->count);
+                    } // for
+                    break;
+                } // case
+
+                case COPY_VS_BOOL:
+                case COPY_PS_BOOL:
+                {
+                    const uint8 *srcb = (file == COPY_VS_BOOL) ?
+                                    ctx->vs_reg_file_b : ctx->ps_reg_file_b;
+                    GLint *dstb = (file == COPY_VS_BOOL) ?
+                            program->vs_uniforms_bool :
+                            program->ps_uniforms_bool;
+                    for (run = 0; run < runs; run++, copy++)
+                    {
+                        // a straight loop, so the compiler can vectorize it.
+                        const uint8 *b = srcb + copy->src;
+                        GLint *d = dstb + copy->dst;
+                        const uint32 total = copy->count;
+                        for (i = 0; i < total; i++)
+                            d[i] = (GLint) b[i];
+                    } // for
+                    break;
+                } // case
+            } // switch
         } // for
 
+        // !!! FIXME: set constants that overlap the array.
+
         assert((!program->texbem_count) || (program->fragment));
         if ((program->texbem_count) && (program->fragment))
         {
@@ -2489,6 +3093,526 @@ void MOJOSHADER_glProgramReady(void)
 } // MOJOSHADER_glProgramReady
 
 
+// Command buffers...
+
+typedef enum
+{
+    COMMAND_BIND_SHADERS,
+    COMMAND_UNIFORMS,
+    COMMAND_VERTEX_ATTRIBUTE,
+    COMMAND_DRAW
+} CommandType;
+
+// Commands are packed back to back in one block of memory. Uniform commands
+//  have their register data right after the Command struct.
+typedef struct
+{
+    CommandType type;
+    uint32 size;  // in bytes, including this struct and any trailing data.
+    union
+    {
+        struct
+        {
+            MOJOSHADER_glShader *vertex;
+            MOJOSHADER_glShader *fragment;
+        } bind;
+
+        struct
+        {
+            UniformCopyFile file;
+            uint32 idx;
+            uint32 count;  // registers, not elements.
+        } uniforms;
+
+        struct
+        {
+            MOJOSHADER_usage usage;
+            int index;
+            unsigned int size;
+            MOJOSHADER_attributeType type;
+            int normalized;
+            unsigned int stride;
+            const void *ptr;
+        } attribute;
+
+        struct
+        {
+            MOJOSHADER_glDrawCallback callback;
+            void *data;
+        } draw;
+    } u;
+} Command;
+
+#define COMMAND_ALIGN(x) (((x) + 7) & ~((size_t) 7))
+
+struct MOJOSHADER_glCommandBuffer
+{
+    uint8 *commands;
+    size_t used;
+    size_t allocated;
+    uint32 draw_count;
+    int out_of_memory;
+};
+
+// A run of commands ending in a draw, which can be moved around as a unit
+//  when reordering is allowed.
+typedef struct
+{
+    size_t start;  // byte offsets into the command buffer.
+    size_t end;
+    uint32 order;  // position in the recording, to keep the sort stable.
+    int entry_known;
+    MOJOSHADER_glShader *entry_vertex;  // bound before the segment starts.
+    MOJOSHADER_glShader *entry_fragment;
+    MOJOSHADER_glShader *draw_vertex;  // bound when the segment draws.
+    MOJOSHADER_glShader *draw_fragment;
+} CommandSegment;
+
+
+DLLEXPORT
+MOJOSHADER_glCommandBuffer *MOJOSHADER_glCreateCommandBuffer(void)
+{
+    MOJOSHADER_glCommandBuffer *retval = (MOJOSHADER_glCommandBuffer *)
+                                Malloc(sizeof (MOJOSHADER_glCommandBuffer));
+    if (retval != NULL)
+        memset(retval, '\0', sizeof (MOJOSHADER_glCommandBuffer));
+    return retval;
+} // MOJOSHADER_glCreateCommandBuffer
+
+
+static Command *add_command(MOJOSHADER_glCommandBuffer *buf,
+                            const CommandType type, const size_t extra)
+{
+    const size_t size = COMMAND_ALIGN(sizeof (Command) + extra);
+    Command *cmd = NULL;
+
+    if (buf->out_of_memory)
+        return NULL;  // this buffer is already toast until it's cleared.
+
+    if ((buf->used + size) > buf->allocated)
+    {
+        size_t newsize = (buf->allocated) ? (buf->allocated * 2) : 4096;
+        while (newsize < (buf->used + size))
+            newsize *= 2;
+
+        uint8 *ptr = (uint8 *) Malloc(newsize);
+        if (ptr == NULL)
+        {
+            buf->out_of_memory = 1;
+            return NULL;
+        } // if
+
+        if (buf->used > 0)
+            memcpy(ptr, buf->commands, buf->used);
+        Free(buf->commands);
+        buf->commands = ptr;
+        buf->allocated = newsize;
+    } // if
+
+    cmd = (Command *) (buf->commands + buf->used);
+    memset(cmd, '\0', sizeof (Command));
+    cmd->type = type;
+    cmd->size = (uint32) size;
+    buf->used += size;
+    return cmd;
+} // add_command
+
+
+DLLEXPORT
+void MOJOSHADER_glCommandBindShaders(MOJOSHADER_glCommandBuffer *buf,
+                                     MOJOSHADER_glShader *vshader,
+                                     MOJOSHADER_glShader *pshader)
+{
+    Command *cmd = add_command(buf, COMMAND_BIND_SHADERS, 0);
+    if (cmd != NULL)
+    {
+        cmd->u.bind.vertex = vshader;
+        cmd->u.bind.fragment = pshader;
+    } // if
+} // MOJOSHADER_glCommandBindShaders
+
+
+// Registers past the end of the register file are dropped here, just like
+//  the immediate MOJOSHADER_glSet*ShaderUniform*() functions drop them.
+static void command_uniforms(MOJOSHADER_glCommandBuffer *buf,
+                             const UniformCopyFile file, const uint idx,
+                             const void *data, uint count)
+{
+    const int isbool = ((file == COPY_VS_BOOL) || (file == COPY_PS_BOOL));
+    const int isint = ((file == COPY_VS_INT4) || (file == COPY_PS_INT4));
+    const uint maxregs = isbool ? MAX_REG_FILE_B :
+                         isint ? MAX_REG_FILE_I : MAX_REG_FILE_F;
+    size_t len;
+    Command *cmd;
+
+    if ((idx >= maxregs) || (count == 0))
+        return;
+
+    count = minuint(maxregs - idx, count);
+    if (isbool)
+        len = count;  // stored as uint8, like the register file.
+    else
+    {
+        assert(sizeof (GLfloat) == sizeof (float));
+        assert(sizeof (GLint) == sizeof (int));
+        len = count * 4 * sizeof (GLfloat);
+    } // else
+
+    cmd = add_command(buf, COMMAND_UNIFORMS, len);
+    if (cmd == NULL)
+        return;
+
+    cmd->u.uniforms.file = file;
+    cmd->u.uniforms.idx = idx;
+    cmd->u.uniforms.count = count;
+
+    if (!isbool)
+        memcpy(cmd + 1, data, len);
+    else
+    {
+        const int *src = (const int *) data;
+        uint8 *dst = (uint8 *) (cmd + 1);
+        uint i;
+        for (i = 0; i < count; i++)
+            dst[i] = src[i] ? 1 : 0;
+    } // else
+} // command_uniforms
+
+
+DLLEXPORT
+void MOJOSHADER_glCommandSetVertexShaderUniformF(
+                                        MOJOSHADER_glCommandBuffer *buf,
+                                        unsigned int idx, const float *data,
+                                        unsigned int vec4count)
+{
+    command_uniforms(buf, COPY_VS_FLOAT4, idx, data, vec4count);
+} // MOJOSHADER_glCommandSetVertexShaderUniformF
+
+
+DLLEXPORT
+void MOJOSHADER_glCommandSetVertexShaderUniformI(
+                                        MOJOSHADER_glCommandBuffer *buf,
+                                        unsigned int idx, const int *data,
+                                        unsigned int ivec4count)
+{
+    command_uniforms(buf, COPY_VS_INT4, idx, data, ivec4count);
+} // MOJOSHADER_glCommandSetVertexShaderUniformI
+
+
+DLLEXPORT
+void MOJOSHADER_glCommandSetVertexShaderUniformB(
+                                        MOJOSHADER_glCommandBuffer *buf,
+                                        unsigned int idx, const int *data,
+                                        unsigned int bcount)
+{
+    command_uniforms(buf, COPY_VS_BOOL, idx, data, bcount);
+} // MOJOSHADER_glCommandSetVertexShaderUniformB
+
+
+DLLEXPORT
+void MOJOSHADER_glCommandSetPixelShaderUniformF(
+                                        MOJOSHADER_glCommandBuffer *buf,
+                                        unsigned int idx, const float *data,
+                                        unsigned int vec4count)
+{
+    command_uniforms(buf, COPY_PS_FLOAT4, idx, data, vec4count);
+} // MOJOSHADER_glCommandSetPixelShaderUniformF
+
+
+DLLEXPORT
+void MOJOSHADER_glCommandSetPixelShaderUniformI(
+                                        MOJOSHADER_glCommandBuffer *buf,
+                                        unsigned int idx, const int *data,
+                                        unsigned int ivec4count)
+{
+    command_uniforms(buf, COPY_PS_INT4, idx, data, ivec4count);
+} // MOJOSHADER_glCommandSetPixelShaderUniformI
+
+
+DLLEXPORT
+void MOJOSHADER_glCommandSetPixelShaderUniformB(
+                                        MOJOSHADER_glCommandBuffer *buf,
+                                        unsigned int idx, const int *data,
+                                        unsigned int bcount)
+{
+    command_uniforms(buf, COPY_PS_BOOL, idx, data, bcount);
+} // MOJOSHADER_glCommandSetPixelShaderUniformB
+
+
+DLLEXPORT
+void MOJOSHADER_glCommandSetVertexAttribute(MOJOSHADER_glCommandBuffer *buf,
+                                            MOJOSHADER_usage usage,
+                                            int index, unsigned int size,
+                                            MOJOSHADER_attributeType type,
+                                            int normalized,
+                                            unsigned int stride,
+                                            const void *ptr)
+{
+    Command *cmd = add_command(buf, COMMAND_VERTEX_ATTRIBUTE, 0);
+    if (cmd != NULL)
+    {
+        cmd->u.attribute.usage = usage;
+        cmd->u.attribute.index = index;
+        cmd->u.attribute.size = size;
+        cmd->u.attribute.type = type;
+        cmd->u.attribute.normalized = normalized;
+        cmd->u.attribute.stride = stride;
+        cmd->u.attribute.ptr = ptr;
+    } // if
+} // MOJOSHADER_glCommandSetVertexAttribute
+
+
+DLLEXPORT
+void MOJOSHADER_glCommandDraw(MOJOSHADER_glCommandBuffer *buf,
+                              MOJOSHADER_glDrawCallback callback, void *data)
+{
+    Command *cmd = add_command(buf, COMMAND_DRAW, 0);
+    if (cmd != NULL)
+    {
+        cmd->u.draw.callback = callback;
+        cmd->u.draw.data = data;
+        buf->draw_count++;
+    } // if
+} // MOJOSHADER_glCommandDraw
+
+
+static void bind_shaders_if_changed(MOJOSHADER_glShader *v,
+                                    MOJOSHADER_glShader *p)
+{
+    const MOJOSHADER_glProgram *program = ctx->bound_program;
+    if (program == NULL)
+    {
+        if ((v == NULL) && (p == NULL))
+            return;  // nothing to do.
+    } // if
+    else if ((program->vertex == v) && (program->fragment == p))
+    {
+        return;  // already bound.
+    } // else if
+
+    MOJOSHADER_glBindShaders(v, p);
+} // bind_shaders_if_changed
+
+
+static void execute_uniforms(const Command *cmd)
+{
+    const uint idx = cmd->u.uniforms.idx;
+    const uint count = cmd->u.uniforms.count;
+    void *dst = NULL;
+    size_t len = count * 4 * sizeof (GLfloat);
+
+    switch (cmd->u.uniforms.file)
+    {
+        case COPY_VS_FLOAT4: dst = ctx->vs_reg_file_f + (idx * 4); break;
+        case COPY_VS_INT4: dst = ctx->vs_reg_file_i + (idx * 4); break;
+        case COPY_VS_BOOL: dst = ctx->vs_reg_file_b + idx; len = count; break;
+        case COPY_PS_FLOAT4: dst = ctx->ps_reg_file_f + (idx * 4); break;
+        case COPY_PS_INT4: dst = ctx->ps_reg_file_i + (idx * 4); break;
+        case COPY_PS_BOOL: dst = ctx->ps_reg_file_b + idx; len = count; break;
+        default: assert(0 && "Unexpected register file"); return;
+    } // switch
+
+    // Values that didn't change don't bump the generation, so the next
+    //  ProgramReady doesn't have to push uniforms that are already current.
+    if (memcmp(dst, cmd + 1, len) != 0)
+    {
+        memcpy(dst, cmd + 1, len);
+        ctx->generation++;
+    } // if
+} // execute_uniforms
+
+
+static void execute_commands(const MOJOSHADER_glCommandBuffer *buf,
+                             size_t pos, const size_t end)
+{
+    while (pos < end)
+    {
+        const Command *cmd = (const Command *) (buf->commands + pos);
+        switch (cmd->type)
+        {
+            case COMMAND_BIND_SHADERS:
+                bind_shaders_if_changed(cmd->u.bind.vertex,
+                                        cmd->u.bind.fragment);
+                break;
+
+            case COMMAND_UNIFORMS:
+                execute_uniforms(cmd);
+                break;
+
+            // Attributes are always sent: (ptr) is usually an offset into
+            //  whatever VBO is bound, and a draw callback can change that.
+            case COMMAND_VERTEX_ATTRIBUTE:
+                MOJOSHADER_glSetVertexAttribute(cmd->u.attribute.usage,
+                                                cmd->u.attribute.index,
+                                                cmd->u.attribute.size,
+                                                cmd->u.attribute.type,
+                                                cmd->u.attribute.normalized,
+                                                cmd->u.attribute.stride,
+                                                cmd->u.attribute.ptr);
+                break;
+
+            case COMMAND_DRAW:
+                MOJOSHADER_glProgramReady();
+                cmd->u.draw.callback(cmd->u.draw.data);
+                break;
+        } // switch
+
+        pos += cmd->size;
+    } // while
+} // execute_commands
+
+
+static int cmp_segments(const void *_a, const void *_b)
+{
+    const CommandSegment *a = (const CommandSegment *) _a;
+    const CommandSegment *b = (const CommandSegment *) _b;
+    const size_t av = (size_t) a->draw_vertex;
+    const size_t bv = (size_t) b->draw_vertex;
+    const size_t af = (size_t) a->draw_fragment;
+    const size_t bf = (size_t) b->draw_fragment;
+
+    if (av != bv)
+        return (av < bv) ? -1 : 1;
+    else if (af != bf)
+        return (af < bf) ? -1 : 1;
+    else if (a->order != b->order)
+        return (a->order < b->order) ? -1 : 1;
+    return 0;
+} // cmp_segments
+
+
+DLLEXPORT
+int MOJOSHADER_glExecuteCommandBuffer(const MOJOSHADER_glCommandBuffer *buf,
+                                      int reorder)
+{
+    CommandSegment *segments = NULL;
+    MOJOSHADER_glShader *vertex = NULL;
+    MOJOSHADER_glShader *fragment = NULL;
+    MOJOSHADER_glShader *entry_vertex = NULL;
+    MOJOSHADER_glShader *entry_fragment = NULL;
+    int entry_known = 0;
+    int entry_needed = 0;
+    int known = 0;
+    uint32 total = 0;
+    uint32 first = 0;
+    size_t start = 0;
+    size_t pos = 0;
+    uint32 i;
+
+    if (buf->out_of_memory)
+    {
+        out_of_memory();
+        return 0;
+    } // if
+
+    // With one draw there's nothing to sort, so just play it back.
+    if ((!reorder) || (buf->draw_count < 2))
+    {
+        execute_commands(buf, 0, buf->used);
+        return 1;
+    } // if
+
+    segments = (CommandSegment *)
+                    Malloc(sizeof (CommandSegment) * buf->draw_count);
+    if (segments == NULL)
+    {
+        out_of_memory();
+        return 0;
+    } // if
+
+    // Split the buffer into segments that end with a draw, noting which
+    //  shaders each one starts and draws with.
+    while (pos < buf->used)
+    {
+        const Command *cmd = (const Command *) (buf->commands + pos);
+        const int isbind = (cmd->type == COMMAND_BIND_SHADERS);
+
+        if (pos == start)
+        {
+            // a segment that opens with a bind doesn't care what came before.
+            entry_known = (known && !isbind);
+            entry_needed = !isbind;
+            entry_vertex = vertex;
+            entry_fragment = fragment;
+        } // if
+
+        if (isbind)
+        {
+            known = 1;
+            vertex = cmd->u.bind.vertex;
+            fragment = cmd->u.bind.fragment;
+        } // if
+
+        pos += cmd->size;
+
+        if (cmd->type == COMMAND_DRAW)
+        {
+            CommandSegment *seg = &segments[total];
+            seg->start = start;
+            seg->end = pos;
+            seg->order = total;
+            seg->entry_known = entry_known;
+            seg->entry_vertex = entry_vertex;
+            seg->entry_fragment = entry_fragment;
+            seg->draw_vertex = vertex;
+            seg->draw_fragment = fragment;
+
+            // Until the first bind, segments use whatever was bound when we
+            //  started, so they have to run first, in order.
+            if ((entry_needed) && (!entry_known))
+                first = total + 1;
+
+            total++;
+            start = pos;
+        } // if
+    } // while
+
+    assert(total == buf->draw_count);
+
+    qsort(segments + first, total - first, sizeof (CommandSegment),
+          cmp_segments);
+
+    for (i = 0; i < total; i++)
+    {
+        const CommandSegment *seg = &segments[i];
+        if (seg->entry_known)
+            bind_shaders_if_changed(seg->entry_vertex, seg->entry_fragment);
+        execute_commands(buf, seg->start, seg->end);
+    } // for
+
+    // Anything after the last draw changes state for whoever is next.
+    if (start < buf->used)
+    {
+        if (entry_known)
+            bind_shaders_if_changed(entry_vertex, entry_fragment);
+        execute_commands(buf, start, buf->used);
+    } // if
+
+    Free(segments);
+    return 1;
+} // MOJOSHADER_glExecuteCommandBuffer
+
+
+DLLEXPORT
+void MOJOSHADER_glClearCommandBuffer(MOJOSHADER_glCommandBuffer *buf)
+{
+    buf->used = 0;
+    buf->draw_count = 0;
+    buf->out_of_memory = 0;
+} // MOJOSHADER_glClearCommandBuffer
+
+
+DLLEXPORT
+void MOJOSHADER_glDestroyCommandBuffer(MOJOSHADER_glCommandBuffer *buf)
+{
+    if (buf != NULL)
+    {
+        Free(buf->commands);
+        Free(buf);
+    } // if
+} // MOJOSHADER_glDestroyCommandBuffer
+
+
 void MOJOSHADER_glDeleteProgram(MOJOSHADER_glProgram *program)
 {
     program_unref(program);
@@ -2527,6 +3651,8 @@ void MOJOSHADER_glDestroyContext(MOJOSHADER_glContext *_ctx)
     MOJOSHADER_glBindProgram(NULL);
     if (ctx->linker_cache)
         hash_destroy(ctx->linker_cache);
+    if (ctx->shader_cache)
+        hash_destroy(ctx->shader_cache);
     lookup_entry_points(NULL, NULL);   // !!! FIXME: is there a value to this?
     Free(ctx);
     ctx = ((current_ctx == _ctx) ? NULL : current_ctx);
@@ -55,6 +55,16 @@ typedef struct Context
     StringCache *filename_cache;
     MOJOSHADER_includeOpen open_callback;
     MOJOSHADER_includeClose close_callback;
+    MOJOSHADER_includeCache *include_cache;
+    uint64 define_fingerprint;
+    IncludeState *recording;  // #include we're capturing for include_cache.
+    struct IncludeCacheEntry *record;
+    const char *record_filename;  // last filename we interned for recording.
+    const char *record_filename_cached;
+    Buffer *record_tokens;
+    Buffer *record_text;
+    Buffer *record_defines;
+    Buffer *record_params;
     MOJOSHADER_malloc malloc;
     MOJOSHADER_free free;
     void *malloc_data;
@@ -356,6 +366,228 @@ static inline uint8 hash_define(const char *sym)
 } // hash_define
 
 
+// Include cache stuff...
+
+// What a cached #include produced: the tokens it handed to the caller, and
+//  the #defines and #undefs it made along the way. Tokens come out of the
+//  cache exactly as recorded, so they are never macro-expanded twice.
+
+typedef struct IncludeCacheToken
+{
+    Token token;
+    unsigned int offset;  // into the entry's text.
+    unsigned int len;
+    unsigned int line;
+    const char *filename;  // owned by the cache's string cache.
+} IncludeCacheToken;
+
+typedef struct IncludeCacheDefine
+{
+    const char *identifier;  // all strings are owned by the cache.
+    const char *definition;
+    unsigned int first_param;  // index into the entry's params.
+    int paramcount;
+    int undef;
+} IncludeCacheDefine;
+
+// the same bytes, included under the same name, with the same macros
+//  defined, always preprocess to the same thing.
+typedef struct IncludeCacheKey
+{
+    const char *filename;
+    char *source;
+    unsigned int sourcelen;
+    uint64 fingerprint;
+    int flags;
+} IncludeCacheKey;
+
+#define INCLUDECACHE_FLAG_ASM_COMMENTS (1 << 0)
+#define INCLUDECACHE_FLAG_FILE_MACRO (1 << 1)
+#define INCLUDECACHE_FLAG_LINE_MACRO (1 << 2)
+
+typedef struct IncludeCacheEntry
+{
+    IncludeCacheKey key;
+    char *text;
+    IncludeCacheToken *tokens;
+    unsigned int token_count;
+    IncludeCacheDefine *defines;
+    unsigned int define_count;
+    const char **params;
+    int parsing_pragma;
+} IncludeCacheEntry;
+
+struct MOJOSHADER_includeCache
+{
+    HashTable *entries;
+    StringCache *strings;
+    MOJOSHADER_malloc malloc;
+    MOJOSHADER_free free;
+    void *malloc_data;
+};
+
+static uint32 hash_include_key(const void *_key, void *data)
+{
+    const IncludeCacheKey *key = (const IncludeCacheKey *) _key;
+    const char *src = key->source;
+    uint32 hash = hash_string_djbxor(key->filename);
+    unsigned int i;
+    for (i = 0; i < key->sourcelen; i++)
+        hash = ((hash << 5) + hash) ^ src[i];
+    hash ^= (uint32) key->fingerprint;
+    hash ^= (uint32) (key->fingerprint >> 32);
+    return hash ^ ((uint32) key->flags);
+} // hash_include_key
+
+static int match_include_key(const void *_a, const void *_b, void *data)
+{
+    const IncludeCacheKey *a = (const IncludeCacheKey *) _a;
+    const IncludeCacheKey *b = (const IncludeCacheKey *) _b;
+    return ( (a->fingerprint == b->fingerprint) &&
+             (a->flags == b->flags) &&
+             (a->sourcelen == b->sourcelen) &&
+             (strcmp(a->filename, b->filename) == 0) &&
+             (memcmp(a->source, b->source, a->sourcelen) == 0) );
+} // match_include_key
+
+static void free_include_entry(MOJOSHADER_includeCache *cache,
+                               IncludeCacheEntry *entry)
+{
+    if (entry != NULL)
+    {
+        cache->free(entry->key.source, cache->malloc_data);
+        cache->free(entry->text, cache->malloc_data);
+        cache->free(entry->tokens, cache->malloc_data);
+        cache->free(entry->defines, cache->malloc_data);
+        cache->free((void *) entry->params, cache->malloc_data);
+        cache->free(entry, cache->malloc_data);
+    } // if
+} // free_include_entry
+
+static void nuke_include_entry(const void *key, const void *value, void *data)
+{
+    free_include_entry((MOJOSHADER_includeCache *) data,
+                       (IncludeCacheEntry *) value);
+} // nuke_include_entry
+
+
+DLLEXPORT
+MOJOSHADER_includeCache *MOJOSHADER_createIncludeCache(MOJOSHADER_malloc m,
+                                                  MOJOSHADER_free f, void *d)
+{
+    if ( ((m == NULL) && (f != NULL)) || ((m != NULL) && (f == NULL)) )
+        return NULL;  // supply both or neither.
+
+    if (!m) m = MOJOSHADER_internal_malloc;
+    if (!f) f = MOJOSHADER_internal_free;
+
+    MOJOSHADER_includeCache *cache;
+    cache = (MOJOSHADER_includeCache *) m(sizeof (*cache), d);
+    if (cache == NULL)
+        return NULL;
+
+    memset(cache, '\0', sizeof (*cache));
+    cache->malloc = m;
+    cache->free = f;
+    cache->malloc_data = d;
+    cache->strings = stringcache_create(m, f, d);
+    cache->entries = hash_create(cache, hash_include_key, match_include_key,
+                                 nuke_include_entry, 0, m, f, d);
+    if ((cache->strings == NULL) || (cache->entries == NULL))
+    {
+        MOJOSHADER_destroyIncludeCache(cache);
+        return NULL;
+    } // if
+
+    return cache;
+} // MOJOSHADER_createIncludeCache
+
+
+DLLEXPORT
+void MOJOSHADER_destroyIncludeCache(MOJOSHADER_includeCache *cache)
+{
+    if (cache != NULL)
+    {
+        if (cache->entries != NULL)
+            hash_destroy(cache->entries);
+        if (cache->strings != NULL)
+            stringcache_destroy(cache->strings);
+        cache->free(cache, cache->malloc_data);
+    } // if
+} // MOJOSHADER_destroyIncludeCache
+
+
+// FNV-1a, including the null terminator so "ab","c" != "a","bc".
+static inline uint64 fingerprint_string(uint64 hash, const char *str)
+{
+    do
+    {
+        hash ^= (uint8) *str;
+        hash *= 0x100000001B3ULL;
+    } while (*(str++));
+    return hash;
+} // fingerprint_string
+
+// Each define hashes separately and they are xor'd together, so the
+//  fingerprint doesn't depend on the order things were #defined in, and
+//  an #undef takes its define right back out again.
+static uint64 fingerprint_define(const char *sym, const char *val,
+                                 const char **parameters, int paramcount)
+{
+    uint64 hash = 0xCBF29CE484222325ULL;
+    int i;
+    hash = fingerprint_string(hash, sym);
+    for (i = 0; i < paramcount; i++)
+        hash = fingerprint_string(hash, parameters[i]);
+    hash ^= (uint64) (paramcount + 1);
+    hash *= 0x100000001B3ULL;
+    return fingerprint_string(hash, val);
+} // fingerprint_define
+
+
+static void abandon_recording(Context *ctx)
+{
+    if (ctx->recording != NULL)
+    {
+        free_include_entry(ctx->include_cache, ctx->record);
+        ctx->record = NULL;
+        ctx->recording = NULL;
+        buffer_empty(ctx->record_tokens);
+        buffer_empty(ctx->record_text);
+        buffer_empty(ctx->record_defines);
+        buffer_empty(ctx->record_params);
+    } // if
+} // abandon_recording
+
+
+static void record_define(Context *ctx, const char *sym, const char *val,
+                          const char **parameters, int paramcount,
+                          const int undef)
+{
+    StringCache *strings = ctx->include_cache->strings;
+    IncludeCacheDefine def;
+    int i;
+
+    def.identifier = stringcache(strings, sym);
+    def.definition = undef ? NULL : stringcache(strings, val);
+    def.first_param = buffer_size(ctx->record_params) / sizeof (char *);
+    def.paramcount = paramcount;
+    def.undef = undef;
+
+    int okay = (def.identifier != NULL) && (undef || def.definition != NULL);
+    for (i = 0; okay && (i < paramcount); i++)
+    {
+        const char *param = stringcache(strings, parameters[i]);
+        okay = (param != NULL) &&
+               buffer_append(ctx->record_params, &param, sizeof (param));
+    } // for
+
+    if ((!okay) || (!buffer_append(ctx->record_defines, &def, sizeof (def))))
+        abandon_recording(ctx);
+} // record_define
+
+
+
 static int add_define(Context *ctx, const char *sym, const char *val,
                       char **parameters, int paramcount)
 {
@@ -383,6 +615,11 @@ static int add_define(Context *ctx, const char *sym, const char *val,
     bucket->paramcount = paramcount;
     bucket->next = ctx->define_hashtable[hash];
     ctx->define_hashtable[hash] = bucket;
+
+    ctx->define_fingerprint ^= fingerprint_define(sym, val, bucket->parameters,
+                                                  paramcount);
+    if (ctx->recording != NULL)
+        record_define(ctx, sym, val, bucket->parameters, paramcount, 0);
     return 1;
 } // add_define
 
@@ -416,6 +653,12 @@ static int remove_define(Context *ctx, const char *sym)
                 ctx->define_hashtable[hash] = bucket->next;
             else
                 prev->next = bucket->next;
+            ctx->define_fingerprint ^= fingerprint_define(bucket->identifier,
+                                                          bucket->definition,
+                                                          bucket->parameters,
+                                                          bucket->paramcount);
+            if (ctx->recording != NULL)
+                record_define(ctx, sym, NULL, NULL, 0, 1);
             free_define(ctx, bucket);
             return 1;
         } // if
@@ -435,12 +678,13 @@ static const Define *find_define(Context *ctx, const char *sym)
         const IncludeState *state = ctx->include_stack;
         const char *fname = state ? state->filename : "";
         const size_t len = strlen(fname) + 2;
-        char *str = (char *) Malloc(ctx, len);
+        char *str = (char *) Malloc(ctx, len + 1);
         if (!str)
             return NULL;
         str[0] = '\"';
         memcpy(str + 1, fname, len - 2);
         str[len - 1] = '\"';
+        str[len] = '\0';
         ctx->file_macro->definition = str;
         return ctx->file_macro;
     } // if
@@ -595,12 +839,222 @@ static void close_define_include(const char *data, MOJOSHADER_malloc m,
 } // close_define_include
 
 
+static int include_cache_flags(const Context *ctx)
+{
+    int flags = 0;
+    if (ctx->asm_comments)
+        flags |= INCLUDECACHE_FLAG_ASM_COMMENTS;
+    if (ctx->file_macro != NULL)
+        flags |= INCLUDECACHE_FLAG_FILE_MACRO;
+    if (ctx->line_macro != NULL)
+        flags |= INCLUDECACHE_FLAG_LINE_MACRO;
+    return flags;
+} // include_cache_flags
+
+
+// Call this right after pushing a freshly-opened #include.
+static void start_recording(Context *ctx, const char *fname,
+                            const char *source, unsigned int srclen)
+{
+    MOJOSHADER_includeCache *cache = ctx->include_cache;
+    IncludeCacheEntry *entry;
+
+    assert(ctx->recording == NULL);
+    entry = (IncludeCacheEntry *) cache->malloc(sizeof (*entry),
+                                                cache->malloc_data);
+    if (entry == NULL)
+        return;  // just don't cache this one.
+
+    memset(entry, '\0', sizeof (*entry));
+    entry->key.filename = stringcache(cache->strings, fname);
+    entry->key.source = (char *) cache->malloc(srclen + 1, cache->malloc_data);
+    if ((entry->key.filename == NULL) || (entry->key.source == NULL))
+    {
+        free_include_entry(cache, entry);
+        return;
+    } // if
+
+    memcpy(entry->key.source, source, srclen);
+    entry->key.sourcelen = srclen;
+    entry->key.fingerprint = ctx->define_fingerprint;
+    entry->key.flags = include_cache_flags(ctx);
+
+    ctx->record = entry;
+    ctx->recording = ctx->include_stack;
+    ctx->record_filename = NULL;
+} // start_recording
+
+
+static void record_token(Context *ctx, const char *tokstr,
+                         const unsigned int len, const Token token)
+{
+    const IncludeState *state = ctx->include_stack;
+    IncludeCacheToken tok;
+
+    if (token == TOKEN_PREPROCESSING_ERROR)
+    {
+        abandon_recording(ctx);  // don't remember includes that failed.
+        return;
+    } // if
+
+    if (state->filename != ctx->record_filename)
+    {
+        // macro expansions and #line can change this, but rarely.
+        ctx->record_filename = state->filename;
+        ctx->record_filename_cached = stringcache(ctx->include_cache->strings,
+                                                  state->filename);
+    } // if
+
+    tok.token = token;
+    tok.offset = (unsigned int) buffer_size(ctx->record_text);
+    tok.len = len;
+    tok.line = state->line;
+    tok.filename = ctx->record_filename_cached;
+
+    if ( (tok.filename == NULL) ||
+         (!buffer_append(ctx->record_text, tokstr, len)) ||
+         (!buffer_append(ctx->record_tokens, &tok, sizeof (tok))) )
+    {
+        abandon_recording(ctx);
+    } // if
+} // record_token
+
+
+// Call this when the include we're recording hits the end of its source.
+static void finish_recording(Context *ctx)
+{
+    MOJOSHADER_includeCache *cache = ctx->include_cache;
+    IncludeCacheEntry *entry = ctx->record;
+
+    if ((ctx->isfail) || (ctx->out_of_memory))
+    {
+        abandon_recording(ctx);
+        return;
+    } // if
+
+    const size_t token_count = buffer_size(ctx->record_tokens);
+    const size_t define_count = buffer_size(ctx->record_defines);
+    entry->token_count = token_count / sizeof (IncludeCacheToken);
+    entry->define_count = define_count / sizeof (IncludeCacheDefine);
+    entry->tokens = (IncludeCacheToken *) buffer_flatten(ctx->record_tokens);
+    entry->text = buffer_flatten(ctx->record_text);
+    entry->defines = (IncludeCacheDefine *) buffer_flatten(ctx->record_defines);
+    entry->params = (const char **) buffer_flatten(ctx->record_params);
+    entry->parsing_pragma = ctx->parsing_pragma;
+
+    ctx->record = NULL;
+    ctx->recording = NULL;
+
+    if ( (entry->tokens == NULL) || (entry->text == NULL) ||
+         (entry->defines == NULL) || (entry->params == NULL) ||
+         (hash_insert(cache->entries, &entry->key, entry) != 1) )
+    {
+        free_include_entry(cache, entry);
+        buffer_empty(ctx->record_tokens);  // in case a flatten failed.
+        buffer_empty(ctx->record_text);
+        buffer_empty(ctx->record_defines);
+        buffer_empty(ctx->record_params);
+    } // if
+} // finish_recording
+
+
+// If (source) was preprocessed before under the same conditions, push
+//  its recorded tokens instead of lexing it again. Returns zero on a miss.
+static int replay_include(Context *ctx, const char *fname,
+                          const char *source, unsigned int srclen)
+{
+    MOJOSHADER_includeCache *cache = ctx->include_cache;
+    const void *value = NULL;
+    IncludeCacheKey key;
+    unsigned int i;
+
+    key.filename = fname;
+    key.source = (char *) source;
+    key.sourcelen = srclen;
+    key.fingerprint = ctx->define_fingerprint;
+    key.flags = include_cache_flags(ctx);
+    if (!hash_find(cache->entries, &key, &value))
+        return 0;
+
+    const IncludeCacheEntry *entry = (const IncludeCacheEntry *) value;
+    ctx->close_callback(source, ctx->malloc, ctx->free, ctx->malloc_data);
+
+    // the macro state we leave behind has to match the real thing.
+    for (i = 0; i < entry->define_count; i++)
+    {
+        const IncludeCacheDefine *def = &entry->defines[i];
+        if (def->undef)
+        {
+            remove_define(ctx, def->identifier);
+            continue;
+        } // if
+
+        char *sym = StrDup(ctx, def->identifier);
+        char *val = StrDup(ctx, def->definition);
+        char **params = NULL;
+        int p = 0;
+        if (def->paramcount > 0)
+        {
+            params = (char **) Malloc(ctx, sizeof (char *) * def->paramcount);
+            if (params != NULL)
+            {
+                for (p = 0; p < def->paramcount; p++)
+                {
+                    params[p] = StrDup(ctx, entry->params[def->first_param+p]);
+                    if (params[p] == NULL)
+                        break;
+                } // for
+            } // if
+        } // if
+
+        if ( (ctx->out_of_memory) ||
+             (!add_define(ctx, sym, val, params, def->paramcount)) )
+        {
+            Free(ctx, sym);
+            Free(ctx, val);
+            while (p--)
+                Free(ctx, params[p]);
+            Free(ctx, params);
+            return 1;
+        } // if
+    } // for
+
+    if (push_source(ctx, fname, NULL, 0, 1, NULL))
+        ctx->include_stack->replay = entry;
+    return 1;
+} // replay_include
+
+
+static int replay_nexttoken(Context *ctx, IncludeState *state,
+                            const char **_str, unsigned int *_len,
+                            Token *_token)
+{
+    const IncludeCacheEntry *entry = (const IncludeCacheEntry *) state->replay;
+    if (state->replay_pos >= entry->token_count)
+    {
+        ctx->parsing_pragma = entry->parsing_pragma;
+        ctx->recursion_count = 0;
+        return 0;
+    } // if
+
+    const IncludeCacheToken *tok = &entry->tokens[state->replay_pos++];
+    // the cache outlives us, so there's no need to intern this filename.
+    state->filename = tok->filename;
+    state->line = tok->line;
+    *_str = entry->text + tok->offset;
+    *_len = tok->len;
+    *_token = tok->token;
+    return 1;
+} // replay_nexttoken
+
+
 Preprocessor *preprocessor_start(const char *fname, const char *source,
                             unsigned int sourcelen,
                             MOJOSHADER_includeOpen open_callback,
                             MOJOSHADER_includeClose close_callback,
                             const MOJOSHADER_preprocessorDefine *defines,
                             unsigned int define_count, int asm_comments,
+                            MOJOSHADER_includeCache *include_cache,
                             MOJOSHADER_malloc m, MOJOSHADER_free f, void *d)
 {
     int okay = 1;
@@ -625,6 +1079,22 @@ Preprocessor *preprocessor_start(const char *fname, const char *source,
     ctx->filename_cache = stringcache_create(MallocBridge, FreeBridge, ctx);
     okay = ((okay) && (ctx->filename_cache != NULL));
 
+    if (include_cache != NULL)
+    {
+        // recordings end up owned by the cache, so use its allocator.
+        MOJOSHADER_malloc cm = include_cache->malloc;
+        MOJOSHADER_free cf = include_cache->free;
+        void *cd = include_cache->malloc_data;
+        ctx->include_cache = include_cache;
+        ctx->record_tokens = buffer_create(4096, cm, cf, cd);
+        ctx->record_text = buffer_create(4096, cm, cf, cd);
+        ctx->record_defines = buffer_create(256, cm, cf, cd);
+        ctx->record_params = buffer_create(64, cm, cf, cd);
+        okay = ((okay) && (ctx->record_tokens != NULL) &&
+                (ctx->record_text != NULL) && (ctx->record_defines != NULL) &&
+                (ctx->record_params != NULL));
+    } // if
+
     ctx->file_macro = get_define(ctx);
     okay = ((okay) && (ctx->file_macro != NULL));
     if ((okay) && (ctx->file_macro))
@@ -683,6 +1153,15 @@ void preprocessor_end(Preprocessor *_ctx)
     if (ctx == NULL)
         return;
 
+    if (ctx->include_cache != NULL)
+    {
+        abandon_recording(ctx);  // never got to the end of it.
+        buffer_destroy(ctx->record_tokens);
+        buffer_destroy(ctx->record_text);
+        buffer_destroy(ctx->record_defines);
+        buffer_destroy(ctx->record_params);
+    } // if
+
     while (ctx->include_stack != NULL)
         pop_source(ctx);
 
@@ -736,14 +1215,10 @@ static int require_newline(IncludeState *state)
              (token == ((Token) '\n')) || (token == TOKEN_EOI) );
 } // require_newline
 
-// !!! FIXME: didn't we implement this by hand elsewhere?
 static int token_to_int(IncludeState *state)
 {
     assert(state->tokenval == TOKEN_INT_LITERAL);
-    char *buf = (char *) alloca(state->tokenlen+1);
-    memcpy(buf, state->token, state->tokenlen);
-    buf[state->tokenlen] = '\0';
-    return atoi(buf);
+    return (int) literal_int64(state->token, state->tokenlen);
 } // token_to_int
 
 
@@ -807,6 +1282,9 @@ static void handle_pp_include(Context *ctx)
         return;
     } // if
 
+    // we only cache leaf includes, so anything we're recording is out.
+    abandon_recording(ctx);
+
     if (!ctx->open_callback(incltype, filename, state->source_base,
                             &newdata, &newbytes, ctx->malloc,
                             ctx->free, ctx->malloc_data))
@@ -815,12 +1293,22 @@ static void handle_pp_include(Context *ctx)
         return;
     } // if
 
+    if (ctx->include_cache != NULL)
+    {
+        if (replay_include(ctx, filename, newdata, newbytes))
+            return;
+    } // if
+
     MOJOSHADER_includeClose callback = ctx->close_callback;
     if (!push_source(ctx, filename, newdata, newbytes, 1, callback))
     {
         assert(ctx->out_of_memory);
         ctx->close_callback(newdata, ctx->malloc, ctx->free, ctx->malloc_data);
     } // if
+    else if (ctx->include_cache != NULL)
+    {
+        start_recording(ctx, filename, newdata, newbytes);
+    } // else if
 } // handle_pp_include
 
 
@@ -1572,9 +2060,10 @@ typedef struct RpnTokens
     int value;
 } RpnTokens;
 
-static long interpret_rpn(const RpnTokens *tokens, int tokencount, int *error)
+// (stack) needs room for (tokencount) values.
+static long interpret_rpn(const RpnTokens *tokens, int tokencount,
+                          long *stack, int *error)
 {
-    long stack[128];
     size_t stacksize = 0;
 
     *error = 1;
@@ -1596,7 +2085,6 @@ static long interpret_rpn(const RpnTokens *tokens, int tokencount, int *error)
     {
         if (!tokens->isoperator)
         {
-            assert(stacksize < STATICARRAYLEN(stack));
             stack[stacksize++] = (long) tokens->value;
             tokens++;
             continue;
@@ -1644,6 +2132,23 @@ static long interpret_rpn(const RpnTokens *tokens, int tokencount, int *error)
     return stack[0];
 } // interpret_rpn
 
+// Expressions that don't fit in the arrays on the stack move to the heap,
+//  doubling as they go. (*buf) is only freed if it isn't (staticbuf).
+static int grow_rpn_buffer(Context *ctx, void **buf, size_t *alloc,
+                           const void *staticbuf, const size_t elemsize)
+{
+    const size_t newalloc = *alloc * 2;
+    void *ptr = Malloc(ctx, newalloc * elemsize);
+    if (ptr == NULL)
+        return 0;
+    memcpy(ptr, *buf, *alloc * elemsize);
+    if (*buf != staticbuf)
+        Free(ctx, *buf);
+    *buf = ptr;
+    *alloc = newalloc;
+    return 1;
+} // grow_rpn_buffer
+
 // http://en.wikipedia.org/wiki/Shunting_yard_algorithm
 //  Convert from infix to postfix, then use this for constant folding.
 //  Everything that parses should fold down to a constant value: any
@@ -1653,22 +2158,35 @@ static long interpret_rpn(const RpnTokens *tokens, int tokencount, int *error)
 static int reduce_pp_expression(Context *ctx)
 {
     IncludeState *orig_state = ctx->include_stack;
-    RpnTokens output[128];
-    Token stack[64];
+    RpnTokens static_output[128];
+    Token static_stack[64];
+    long static_values[128];
+    RpnTokens *output = static_output;
+    Token *stack = static_stack;
+    long *values = static_values;
+    size_t outputalloc = STATICARRAYLEN(static_output);
+    size_t stackalloc = STATICARRAYLEN(static_stack);
     Token previous_token = TOKEN_UNKNOWN;
     size_t outputsize = 0;
     size_t stacksize = 0;
     int matched = 0;
     int done = 0;
+    int retval = -1;
 
     #define ADD_TO_OUTPUT(op, val) \
-        assert(outputsize < STATICARRAYLEN(output)); \
+        if ( (outputsize >= outputalloc) && \
+             (!grow_rpn_buffer(ctx, (void **) &output, &outputalloc, \
+                               static_output, sizeof (*output))) ) \
+            goto reduce_pp_expression_failed; \
         output[outputsize].isoperator = op; \
         output[outputsize].value = val; \
         outputsize++;
 
     #define PUSH_TO_STACK(t) \
-        assert(stacksize < STATICARRAYLEN(stack)); \
+        if ( (stacksize >= stackalloc) && \
+             (!grow_rpn_buffer(ctx, (void **) &stack, &stackalloc, \
+                               static_stack, sizeof (*stack))) ) \
+            goto reduce_pp_expression_failed; \
         stack[stacksize] = t; \
         stacksize++;
 
@@ -1679,16 +2197,20 @@ static int reduce_pp_expression(Context *ctx)
         int isleft = 1;
         int precedence = -1;
 
+        // a value or a closing paren means this is a binary operator.
+        const int after_value = ( (previous_token == TOKEN_INT_LITERAL) ||
+                                  (previous_token == ((Token) ')')) );
+
         if ( (token == ((Token) '!')) || (token == ((Token) '~')) )
             isleft = 0;
         else if (token == ((Token) '-'))
         {
-            if ((isleft = (previous_token == TOKEN_INT_LITERAL)) == 0)
+            if ((isleft = after_value) == 0)
                 token = TOKEN_PP_UNARY_MINUS;
         } // else if
         else if (token == ((Token) '+'))
         {
-            if ((isleft = (previous_token == TOKEN_INT_LITERAL)) == 0)
+            if ((isleft = after_value) == 0)
                 token = TOKEN_PP_UNARY_PLUS;
         } // else if
 
@@ -1724,7 +2246,7 @@ static int reduce_pp_expression(Context *ctx)
                     if (token != TOKEN_IDENTIFIER)
                     {
                         fail(ctx, "operator 'defined' requires an identifier");
-                        return -1;
+                        goto reduce_pp_expression_failed;
                     } // if
                     const int found = (find_define_by_token(ctx) != NULL);
 
@@ -1733,11 +2255,12 @@ static int reduce_pp_expression(Context *ctx)
                         if (lexer(state) != ((Token) ')'))
                         {
                             fail(ctx, "Unmatched ')'");
-                            return -1;
+                            goto reduce_pp_expression_failed;
                         } // if
                     } // if
 
                     ADD_TO_OUTPUT(0, found);
+                    previous_token = TOKEN_INT_LITERAL;
                     continue;
                 } // if
 
@@ -1770,7 +2293,7 @@ static int reduce_pp_expression(Context *ctx)
                 if (!matched)
                 {
                     fail(ctx, "Unmatched ')'");
-                    return -1;
+                    goto reduce_pp_expression_failed;
                 } // if
                 break;
 
@@ -1781,7 +2304,7 @@ static int reduce_pp_expression(Context *ctx)
                 {
                     pushback(state);
                     fail(ctx, "Invalid expression");
-                    return -1;
+                    goto reduce_pp_expression_failed;
                 } // if
 
                 else  // it's an operator.
@@ -1815,7 +2338,7 @@ static int reduce_pp_expression(Context *ctx)
         if (t == ((Token) '('))
         {
             fail(ctx, "Unmatched ')'");
-            return -1;
+            goto reduce_pp_expression_failed;
         } // if
         ADD_TO_OUTPUT(1, t);
     } // while
@@ -1852,20 +2375,34 @@ static int reduce_pp_expression(Context *ctx)
     printf("\n");
     #endif
 
+    // the value stack never holds more than every value in the output.
+    if (outputsize > STATICARRAYLEN(static_values))
+    {
+        values = (long *) Malloc(ctx, sizeof (long) * outputsize);
+        if (values == NULL)
+            goto reduce_pp_expression_failed;
+    } // if
+
     int error = 0;
-    const long val = interpret_rpn(output, outputsize, &error);
+    const long val = interpret_rpn(output, outputsize, values, &error);
 
     #if DEBUG_PREPROCESSOR
     printf("PREPROCESSOR RPN RESULT: %ld%s\n", val, error ? " (ERROR)" : "");
     #endif
 
     if (error)
-    {
         fail(ctx, "Invalid expression");
-        return -1;
-    } // if
-
-    return ((val) ? 1 : 0);
+    else
+        retval = ((val) ? 1 : 0);
+
+reduce_pp_expression_failed:
+    if (values != static_values)
+        Free(ctx, values);
+    if (stack != static_stack)
+        Free(ctx, stack);
+    if (output != static_output)
+        Free(ctx, output);
+    return retval;
 } // reduce_pp_expression
 
 
@@ -2003,6 +2540,15 @@ static inline const char *_preprocessor_nexttoken(Preprocessor *_ctx,
             return NULL;  // we're done!
         } // if
 
+        if (state->replay != NULL)
+        {
+            const char *retval = NULL;
+            if (replay_nexttoken(ctx, state, &retval, _len, _token))
+                return retval;
+            pop_source(ctx);
+            continue;  // pick up again after parent's #include line.
+        } // if
+
         const Conditional *cond = state->conditional_stack;
         const int skipping = ((cond != NULL) && (cond->skipping));
 
@@ -2020,6 +2566,8 @@ static inline const char *_preprocessor_nexttoken(Preprocessor *_ctx,
                 continue;  // returns an error.
             } // if
 
+            if (state == ctx->recording)
+                finish_recording(ctx);
             pop_source(ctx);
             continue;  // pick up again after parent's #include line.
         } // if
@@ -2141,6 +2689,8 @@ const char *preprocessor_nexttoken(Preprocessor *ctx, unsigned int *len,
 {
     const char *retval = _preprocessor_nexttoken(ctx, len, token);
     print_debug_token(retval, *len, *token);
+    if (((Context *) ctx)->recording != NULL)
+        record_token((Context *) ctx, retval, *len, *token);
     return retval;
 } // preprocessor_nexttoken
 
@@ -2185,7 +2735,10 @@ static const MOJOSHADER_preprocessData out_of_mem_data_preprocessor = {
 
 // public API...
 
-const MOJOSHADER_preprocessData *MOJOSHADER_preprocess(const char *filename,
+DLLEXPORT
+const MOJOSHADER_preprocessData *MOJOSHADER_preprocessWithIncludeCache(
+                             MOJOSHADER_includeCache *include_cache,
+                             const char *filename,
                              const char *source, unsigned int sourcelen,
                              const MOJOSHADER_preprocessorDefine *defines,
                              unsigned int define_count,
@@ -2205,6 +2758,7 @@ const MOJOSHADER_preprocessData *MOJOSHADER_preprocess(const char *filename,
     char *output = NULL;
     int errcount = 0;
     size_t total_bytes = 0;
+    MOJOSHADER_allocPhase phase;
 
     // !!! FIXME: what's wrong with ENDLINE_STR?
     #ifdef _WINDOWS
@@ -2218,9 +2772,11 @@ const MOJOSHADER_preprocessData *MOJOSHADER_preprocess(const char *filename,
     if (!include_open) include_open = MOJOSHADER_internal_include_open;
     if (!include_close) include_close = MOJOSHADER_internal_include_close;
 
+    phase = alloc_phase(m, d, MOJOSHADER_ALLOCPHASE_PREPROCESSOR);
     pp = preprocessor_start(filename, source, sourcelen,
                             include_open, include_close,
-                            defines, define_count, 0, m, f, d);
+                            defines, define_count, 0, include_cache,
+                            m, f, d);
     if (pp == NULL)
         goto preprocess_out_of_mem;
 
@@ -2299,6 +2855,7 @@ const MOJOSHADER_preprocessData *MOJOSHADER_preprocess(const char *filename,
     if (output == NULL)
         goto preprocess_out_of_mem;
 
+    alloc_phase(m, d, MOJOSHADER_ALLOCPHASE_PARSEDATA);
     retval = (MOJOSHADER_preprocessData *) m(sizeof (*retval), d);
     if (retval == NULL)
         goto preprocess_out_of_mem;
@@ -2321,6 +2878,7 @@ const MOJOSHADER_preprocessData *MOJOSHADER_preprocess(const char *filename,
 
     errorlist_destroy(errors);
     preprocessor_end(pp);
+    alloc_phase(m, d, phase);
     return retval;
 
 preprocess_out_of_mem:
@@ -2331,7 +2889,23 @@ preprocess_out_of_mem:
     buffer_destroy(buffer);
     errorlist_destroy(errors);
     preprocessor_end(pp);
+    alloc_phase(m, d, phase);
     return &out_of_mem_data_preprocessor;
+} // MOJOSHADER_preprocessWithIncludeCache
+
+
+const MOJOSHADER_preprocessData *MOJOSHADER_preprocess(const char *filename,
+                             const char *source, unsigned int sourcelen,
+                             const MOJOSHADER_preprocessorDefine *defines,
+                             unsigned int define_count,
+                             MOJOSHADER_includeOpen include_open,
+                             MOJOSHADER_includeClose include_close,
+                             MOJOSHADER_malloc m, MOJOSHADER_free f, void *d)
+{
+    return MOJOSHADER_preprocessWithIncludeCache(NULL, filename, source,
+                                                 sourcelen, defines,
+                                                 define_count, include_open,
+                                                 include_close, m, f, d);
 } // MOJOSHADER_preprocess
 
 
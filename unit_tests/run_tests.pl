@@ -61,10 +61,14 @@ $tests{'output'} = sub {
     # !!! FIXME: this should go elsewhere.
     if ($module eq 'preprocessor') {
         $cmd = "$binpath/mojoshader-compiler -P '$fname' -o '$output'";
+        $cmd .= ' 2>/dev/null 1>/dev/null';
+    } elsif ($module eq 'compiler') {
+        # !!! FIXME: the compiler just dumps its IR to stdout for now.
+        $cmd = "$binpath/mojoshader-compiler -C '$fname' -o /dev/null";
+        $cmd .= " 2>/dev/null 1>'$output'";
     } else {
         return (0, "Don't know how to do this module type");
     }
-    $cmd .= ' 2>/dev/null 1>/dev/null';
 
     print("$cmd\n") if ($GPrintCmds);
 
@@ -30,91 +30,223 @@ static void *lookup(const char *fnname, void *unused)
 #include <windows.h>
 #include <malloc.h>  // for alloca().
 #define snprintf _snprintf
+#define strdup _strdup
 #else
 #include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #endif
 
 #define report printf
 
-static int do_file(const char *profile, const char *dname, const char *fn, int *total)
+// Each file in the corpus gets one of these. Worker threads fill in the
+//  results, and the main thread reports them in sorted order at the end,
+//  so the output is stable no matter how many threads ran.
+typedef struct
 {
-    int do_quit = 0;
+    char *fname;
+    int assembly;
+    int processed;
+    int passed;
+    char *error;
+    unsigned long long hash;
+    double usecs;
+} CorpusFile;
+
+typedef struct
+{
+    const char *profile;
+    CorpusFile *files;
+    int file_count;
+    int next_file;
+    int quit;
+#ifdef _MSC_VER
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t lock;
+#endif
+} Corpus;
 
-    #if FINDERRORS_COMPILE_SHADERS
-    SDL_Event e;  // pump event queue to keep OS happy.
-    while (SDL_PollEvent(&e))
+
+static double now_usecs(void)
+{
+#ifdef _MSC_VER
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return ((double) count.QuadPart * 1000000.0) / ((double) freq.QuadPart);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((double) tv.tv_sec * 1000000.0) + ((double) tv.tv_usec);
+#endif
+} // now_usecs
+
+
+// 64-bit FNV-1a. We only need this to notice that output changed.
+static unsigned long long hash_bytes(unsigned long long hash,
+                                     const void *_data, size_t len)
+{
+    const unsigned char *data = (const unsigned char *) _data;
+    while (len--)
     {
-        if (e.type == SDL_QUIT)
-            do_quit = 1;
+        hash ^= (unsigned long long) *(data++);
+        hash *= 0x100000001B3ULL;
     } // while
-    SDL_GL_SwapBuffers();
-    #endif
+    return hash;
+} // hash_bytes
+
+#define HASH_INITIAL 0xCBF29CE484222325ULL
 
-    if (do_quit)
+
+// Maps a whole file into memory, so there's no size limit and no copy.
+static const unsigned char *map_file(const char *fname, size_t *len,
+                                     void **handle)
+{
+#ifdef _MSC_VER
+    HANDLE file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    HANDLE mapping = NULL;
+    const unsigned char *retval = NULL;
+    LARGE_INTEGER size;
+
+    *handle = NULL;
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+    else if (!GetFileSizeEx(file, &size))
     {
-        report("FAIL: user requested quit!\n");
-        return 0;
+        CloseHandle(file);
+        return NULL;
+    } // else if
+
+    *len = (size_t) size.QuadPart;
+    if (*len == 0)
+    {
+        CloseHandle(file);
+        return (const unsigned char *) "";
     } // if
 
-    int assembly = 0;
-    if (strstr(fn, ".bytecode") != NULL)
-        assembly = 0;
-    else if (strstr(fn, ".disasm") != NULL)
-        assembly = 1;
-    else
-        return 1;
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL)
+        return NULL;
 
-    (*total)++;
+    retval = (const unsigned char *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (retval == NULL)
+        CloseHandle(mapping);
+    else
+        *handle = mapping;
+    return retval;
+#else
+    struct stat statbuf;
+    void *retval = NULL;
+    const int fd = open(fname, O_RDONLY);
+
+    *handle = NULL;
+    if (fd == -1)
+        return NULL;
+    else if (fstat(fd, &statbuf) == -1)
+    {
+        close(fd);
+        return NULL;
+    } // else if
 
-    char *fname = (char *) alloca(strlen(fn) + strlen(dname) + 1);
-    sprintf(fname, "%s/%s", dname, fn);
-    FILE *io = fopen(fname, "rb");
-    if (io == NULL)
+    *len = (size_t) statbuf.st_size;
+    if (*len == 0)
     {
-        report("FAIL: %s fopen() failed.\n", fname);
-        return 1;
+        close(fd);
+        return (const unsigned char *) "";  // mmap() won't map zero bytes.
     } // if
 
-    static unsigned char buf[1024 * 256];
-    int rc = fread(buf, 1, sizeof (buf), io);
-    fclose(io);
-    if (rc == -1)
+    retval = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (retval == MAP_FAILED)
+        return NULL;
+    *handle = retval;
+    return (const unsigned char *) retval;
+#endif
+} // map_file
+
+
+static void unmap_file(const unsigned char *data, size_t len, void *handle)
+{
+    if (handle == NULL)
+        return;  // zero-length file, nothing was mapped.
+#ifdef _MSC_VER
+    UnmapViewOfFile(data);
+    CloseHandle((HANDLE) handle);
+#else
+    munmap(handle, len);
+#endif
+} // unmap_file
+
+
+static void set_error(CorpusFile *file, const char *fmt, ...)
+{
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof (buf), fmt, ap);
+    va_end(ap);
+    file->passed = 0;
+    file->error = strdup(buf);
+    file->hash = hash_bytes(HASH_INITIAL, buf, strlen(buf));
+} // set_error
+
+
+static void do_file(const char *profile, MOJOSHADER_translator *translator,
+                    CorpusFile *file)
+{
+    const char *fname = file->fname;
+    const MOJOSHADER_parseData *a = NULL;
+    const unsigned char *buf = NULL;
+    void *handle = NULL;
+    size_t len = 0;
+
+    file->processed = 1;
+
+    buf = map_file(fname, &len, &handle);
+    if (buf == NULL)
     {
-        report("FAIL: %s %s\n", fname, strerror(errno));
-        return 1;
+        set_error(file, "%s open failed: %s", fname, strerror(errno));
+        return;
     } // if
 
-    if (assembly)
-    {
-        const MOJOSHADER_parseData *a;
+    const double start = now_usecs();
 
-        buf[rc] = '\0';  // make sure the source is null-terminated.
-        a = MOJOSHADER_assemble(fname, (char *) buf, rc, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const unsigned char *bytecode = buf;
+    size_t bytecode_len = len;
+    if (file->assembly)
+    {
+        a = MOJOSHADER_assemble(fname, (const char *) buf, (unsigned int) len,
+                                NULL, 0, NULL, 0, NULL, 0, NULL, NULL,
+                                NULL, NULL, NULL);
 
         if (a->error_count > 0)
         {
-            report("FAIL: %s (line %d) %s\n",
-                a->errors[0].filename ? a->errors[0].filename : "???",
-                a->errors[0].error_position,
-                a->errors[0].error);
-            return 1;
+            file->usecs = now_usecs() - start;
+            set_error(file, "%s (line %d) %s",
+                      a->errors[0].filename ? a->errors[0].filename : "???",
+                      a->errors[0].error_position, a->errors[0].error);
+            MOJOSHADER_freeParseData(a);
+            unmap_file(buf, len, handle);
+            return;
         } // if
 
-        else if (a->output_len > sizeof (buf))
-        {
-            report("FAIL: %s buffer overflow in finderrors.c\n", fname);
-            return 1;
-        } // if
-
-        rc = a->output_len;
-        memcpy(buf, a->output, rc);
-        MOJOSHADER_freeParseData(a);
+        bytecode = (const unsigned char *) a->output;
+        bytecode_len = a->output_len;
     } // if
 
     #if FINDERRORS_COMPILE_SHADERS
-    MOJOSHADER_glShader *shader = MOJOSHADER_glCompileShader(buf, rc, NULL, 0, NULL, 0);
+    MOJOSHADER_glShader *shader = MOJOSHADER_glCompileShader(bytecode,
+                                            (unsigned int) bytecode_len,
+                                            NULL, 0, NULL, 0);
     if (shader == NULL)
-        report("FAIL: %s %s\n", fname, MOJOSHADER_glGetError());
+        set_error(file, "%s %s", fname, MOJOSHADER_glGetError());
     else
     {
         const MOJOSHADER_parseData *pd = MOJOSHADER_glGetShaderParseData(shader);
@@ -122,50 +254,229 @@ static int do_file(const char *profile, const char *dname, const char *fn, int *
         MOJOSHADER_glShader *p = (pd->shader_type == MOJOSHADER_TYPE_PIXEL) ? shader : NULL;
         MOJOSHADER_glProgram *program = MOJOSHADER_glLinkProgram(v, p);
         if (program == NULL)
-            report("FAIL: %s %s\n", fname, MOJOSHADER_glGetError());
+            set_error(file, "%s %s", fname, MOJOSHADER_glGetError());
         else
         {
-            report("PASS: %s\n", fname);
+            file->passed = 1;
+            file->hash = hash_bytes(HASH_INITIAL, pd->output, pd->output_len);
             MOJOSHADER_glDeleteProgram(program);
         } // else
         MOJOSHADER_glDeleteShader(shader);
     }
     #else
-    const MOJOSHADER_parseData *pd = MOJOSHADER_parse(profile, buf, rc, NULL, 0, NULL, NULL, NULL);
+    const MOJOSHADER_parseData *pd = NULL;
+    if (translator != NULL)
+    {
+        pd = MOJOSHADER_translate(translator, profile, bytecode,
+                                  (unsigned int) bytecode_len,
+                                  NULL, 0, NULL, 0);
+    } // if
+    else
+    {
+        pd = MOJOSHADER_parse(profile, bytecode, (unsigned int) bytecode_len,
+                              NULL, 0, NULL, 0, NULL, NULL, NULL);
+    } // else
     if (pd->error_count == 0)
-        report("PASS: %s\n", fname);
-	else
-	{
-		int i;
-		for (i = 0; i < pd->error_count; i++)
-		{
-			report("FAIL: %s (position %d) %s\n", pd->errors[i].filename,
-			       pd->errors[i].error_position, pd->errors[i].error);
-		} // for
-	} // else
+    {
+        file->passed = 1;
+        file->hash = hash_bytes(HASH_INITIAL, pd->output, pd->output_len);
+    } // if
+    else
+    {
+        set_error(file, "%s (position %d) %s",
+                  pd->errors[0].filename ? pd->errors[0].filename : fname,
+                  pd->errors[0].error_position, pd->errors[0].error);
+    } // else
     MOJOSHADER_freeParseData(pd);
     #endif
 
-    return 1;
+    file->usecs = now_usecs() - start;
+
+    MOJOSHADER_freeParseData(a);
+    unmap_file(buf, len, handle);
 } // do_file
 
 
-static int do_dir(const char *dname, const char *profile)
+#if FINDERRORS_COMPILE_SHADERS
+static int pump_events(void)
+{
+    int do_quit = 0;
+    SDL_Event e;  // pump event queue to keep OS happy.
+    while (SDL_PollEvent(&e))
+    {
+        if (e.type == SDL_QUIT)
+            do_quit = 1;
+    } // while
+    SDL_GL_SwapBuffers();
+    return do_quit;
+} // pump_events
+#endif
+
+
+static void corpus_lock(Corpus *corpus)
+{
+#ifdef _MSC_VER
+    EnterCriticalSection(&corpus->lock);
+#else
+    pthread_mutex_lock(&corpus->lock);
+#endif
+} // corpus_lock
+
+static void corpus_unlock(Corpus *corpus)
+{
+#ifdef _MSC_VER
+    LeaveCriticalSection(&corpus->lock);
+#else
+    pthread_mutex_unlock(&corpus->lock);
+#endif
+} // corpus_unlock
+
+
+// Threads pull files off the list one at a time, so a few huge shaders
+//  don't leave the other threads idle.
+static void run_worker(Corpus *corpus)
+{
+    // each thread reuses one translator for all of its files.
+    MOJOSHADER_translator *translator = MOJOSHADER_createTranslator(NULL, NULL, NULL);
+
+    // we only report the first error per file.
+    if (translator != NULL)
+        MOJOSHADER_setTranslatorErrorLimit(translator, 1);
+
+    while (1)
+    {
+        int idx;
+
+        corpus_lock(corpus);
+        idx = corpus->quit ? corpus->file_count : corpus->next_file++;
+        corpus_unlock(corpus);
+
+        if (idx >= corpus->file_count)
+            break;
+
+        do_file(corpus->profile, translator, &corpus->files[idx]);
+    } // while
+
+    MOJOSHADER_destroyTranslator(translator);
+} // run_worker
+
+#ifdef _MSC_VER
+static DWORD WINAPI worker_thread(LPVOID arg)
+{
+    run_worker((Corpus *) arg);
+    return 0;
+} // worker_thread
+#else
+static void *worker_thread(void *arg)
+{
+    run_worker((Corpus *) arg);
+    return NULL;
+} // worker_thread
+#endif
+
+
+static void run_corpus(Corpus *corpus, int threads)
 {
-    int total = 0;
+#if FINDERRORS_COMPILE_SHADERS
+    // GL calls have to happen on the thread that owns the context.
+    int i;
+    (void) threads;
+    for (i = 0; i < corpus->file_count; i++)
+    {
+        if (pump_events())
+        {
+            report("FAIL: user requested quit!\n");
+            corpus->quit = 1;
+            break;
+        } // if
+        do_file(corpus->profile, NULL, &corpus->files[i]);
+    } // for
+#else
+    int i;
+    int started = 0;
+
+    if (threads > corpus->file_count)
+        threads = corpus->file_count;
 
+#ifdef _MSC_VER
+    HANDLE *tids = (HANDLE *) alloca(sizeof (HANDLE) * (threads + 1));
+    InitializeCriticalSection(&corpus->lock);
+    for (i = 1; i < threads; i++)
+    {
+        tids[started] = CreateThread(NULL, 0, worker_thread, corpus, 0, NULL);
+        if (tids[started] != NULL)
+            started++;
+    } // for
+    run_worker(corpus);  // main thread does its share, too.
+    for (i = 0; i < started; i++)
+    {
+        WaitForSingleObject(tids[i], INFINITE);
+        CloseHandle(tids[i]);
+    } // for
+    DeleteCriticalSection(&corpus->lock);
+#else
+    pthread_t *tids = (pthread_t *) alloca(sizeof (pthread_t) * (threads + 1));
+    pthread_mutex_init(&corpus->lock, NULL);
+    for (i = 1; i < threads; i++)
+    {
+        if (pthread_create(&tids[started], NULL, worker_thread, corpus) == 0)
+            started++;
+    } // for
+    run_worker(corpus);  // main thread does its share, too.
+    for (i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    pthread_mutex_destroy(&corpus->lock);
+#endif
+#endif
+} // run_corpus
+
+
+static void add_file(Corpus *corpus, int *alloc, const char *dname,
+                     const char *fn)
+{
+    int assembly = 0;
+    if (strstr(fn, ".bytecode") != NULL)
+        assembly = 0;
+    else if (strstr(fn, ".disasm") != NULL)
+        assembly = 1;
+    else
+        return;
+
+    if (corpus->file_count >= *alloc)
+    {
+        *alloc = (*alloc) ? (*alloc) * 2 : 1024;
+        corpus->files = (CorpusFile *) realloc(corpus->files,
+                                        sizeof (CorpusFile) * (*alloc));
+        if (corpus->files == NULL)
+        {
+            report("FAIL: out of memory!\n");
+            exit(1);
+        } // if
+    } // if
+
+    CorpusFile *file = &corpus->files[corpus->file_count++];
+    memset(file, '\0', sizeof (CorpusFile));
+    file->fname = (char *) malloc(strlen(dname) + strlen(fn) + 2);
+    sprintf(file->fname, "%s/%s", dname, fn);
+    file->assembly = assembly;
+} // add_file
+
+
+static void do_dir(Corpus *corpus, int *alloc, const char *dname)
+{
 #ifdef _MSC_VER
     WIN32_FIND_DATA dent;
     HANDLE dirp = INVALID_HANDLE_VALUE;
-    FindFirstFileA(dname, &dent);
+    char *wildcard = (char *) alloca(strlen(dname) + 3);
+    sprintf(wildcard, "%s\\*", dname);
+    dirp = FindFirstFileA(wildcard, &dent);
     if (dirp != INVALID_HANDLE_VALUE)
     {
         do
         {
-            if (!do_file(profile, dname, dent.cFileName, &total))
-                break;
+            add_file(corpus, alloc, dname, dent.cFileName);
         } while (FindNextFileA(dirp, &dent) != 0);
-        CloseHandle(dirp);
+        FindClose(dirp);
     } // if
 #else
     struct dirent *dent = NULL;
@@ -173,18 +484,142 @@ static int do_dir(const char *dname, const char *profile)
     if (dirp != NULL)
     {
         while ((dent = readdir(dirp)) != NULL)
-        {
-            if (!do_file(profile, dname, dent->d_name, &total))
-                break;
-        } // while
+            add_file(corpus, alloc, dname, dent->d_name);
         closedir(dirp);
     } // if
 #endif
-
-    return total;
 } // do_dir
 
 
+static int cmp_files(const void *_a, const void *_b)
+{
+    const CorpusFile *a = (const CorpusFile *) _a;
+    const CorpusFile *b = (const CorpusFile *) _b;
+    return strcmp(a->fname, b->fname);
+} // cmp_files
+
+
+// Results files are one line per shader: "PASS|FAIL hash usecs filename".
+//  A previous run's results file can be handed back in as a baseline.
+static void write_results(const Corpus *corpus, const char *fname)
+{
+    FILE *io = fopen(fname, "w");
+    int i;
+
+    if (io == NULL)
+    {
+        report("FAIL: couldn't write results to %s: %s\n", fname, strerror(errno));
+        return;
+    } // if
+
+    for (i = 0; i < corpus->file_count; i++)
+    {
+        const CorpusFile *file = &corpus->files[i];
+        if (!file->processed)
+            continue;
+        fprintf(io, "%s %016llx %.1f %s\n", file->passed ? "PASS" : "FAIL",
+                file->hash, file->usecs, file->fname);
+    } // for
+
+    fclose(io);
+} // write_results
+
+
+static CorpusFile *find_file(const Corpus *corpus, const char *fname)
+{
+    CorpusFile key;
+    key.fname = (char *) fname;
+    return (CorpusFile *) bsearch(&key, corpus->files, corpus->file_count,
+                                  sizeof (CorpusFile), cmp_files);
+} // find_file
+
+
+// Returns the number of shaders whose behavior changed.
+static int compare_baseline(const Corpus *corpus, const char *fname,
+                            const double threshold, int *slower)
+{
+    FILE *io = fopen(fname, "r");
+    char line[4096];
+    int changed = 0;
+
+    *slower = 0;
+
+    if (io == NULL)
+    {
+        report("FAIL: couldn't read baseline %s: %s\n", fname, strerror(errno));
+        return 0;
+    } // if
+
+    while (fgets(line, sizeof (line), io) != NULL)
+    {
+        char status[8];
+        unsigned long long hash = 0;
+        double usecs = 0.0;
+        int pos = 0;
+
+        if (sscanf(line, "%7s %llx %lf %n", status, &hash, &usecs, &pos) < 3)
+            continue;
+
+        char *path = line + pos;
+        path[strcspn(path, "\r\n")] = '\0';
+
+        const CorpusFile *file = find_file(corpus, path);
+        if ((file == NULL) || (!file->processed))
+            continue;  // not in this run.
+
+        const int passed = (strcmp(status, "PASS") == 0);
+        if (passed != file->passed)
+        {
+            report("CHANGED: %s now %s (was %s)\n", path,
+                   file->passed ? "passes" : "fails", status);
+            changed++;
+        } // if
+        else if (hash != file->hash)
+        {
+            report("CHANGED: %s output differs from baseline\n", path);
+            changed++;
+        } // else if
+
+        // Ignore tiny shaders; timer noise swamps them.
+        if ((usecs >= 100.0) && (file->usecs > usecs * (1.0 + threshold)))
+        {
+            report("SLOWER: %s %.1f usecs (was %.1f)\n", path,
+                   file->usecs, usecs);
+            (*slower)++;
+        } // if
+    } // while
+
+    fclose(io);
+    return changed;
+} // compare_baseline
+
+
+static int default_thread_count(void)
+{
+#ifdef _MSC_VER
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int) info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cpus > 0) ? (int) cpus : 1;
+#else
+    return 1;
+#endif
+} // default_thread_count
+
+
+static void usage(const char *argv0)
+{
+    printf("\n\nUSAGE: %s [options] <profile> [dir1] ... [dirN]\n\n", argv0);
+    printf("  -j <threads>     number of worker threads (default: CPU count)\n");
+    printf("  -o <file>        write per-shader results to <file>\n");
+    printf("  -b <file>        compare against results from a previous -o\n");
+    printf("  -t <percent>     slowdown that counts as a regression (default 25)\n");
+    printf("\n");
+} // usage
+
+
 int main(int argc, char **argv)
 {
     //printf("MojoShader finderrors\n");
@@ -192,13 +627,46 @@ int main(int argc, char **argv)
     //printf("Linked against changeset %s\n", MOJOSHADER_changeset());
     //printf("\n");
 
-    if (argc <= 2)
-        printf("\n\nUSAGE: %s <profile> [dir1] ... [dirN]\n\n", argv[0]);
+    const char *results = NULL;
+    const char *baseline = NULL;
+    double threshold = 0.25;
+    int threads = default_thread_count();
+    int retval = 0;
+    int argi;
+
+    for (argi = 1; argi < argc; argi++)
+    {
+        const char *arg = argv[argi];
+        if ((arg[0] != '-') || (argi + 1 >= argc))
+            break;
+        else if (strcmp(arg, "-j") == 0)
+            threads = atoi(argv[++argi]);
+        else if (strcmp(arg, "-o") == 0)
+            results = argv[++argi];
+        else if (strcmp(arg, "-b") == 0)
+            baseline = argv[++argi];
+        else if (strcmp(arg, "-t") == 0)
+            threshold = atof(argv[++argi]) / 100.0;
+        else
+            break;
+    } // for
+
+    if (threads < 1)
+        threads = 1;
+
+    if (argc - argi < 2)
+        usage(argv[0]);
     else
     {
-        int total = 0;
+        int passed = 0;
+        int failed = 0;
+        int alloc = 0;
+        double cpu_usecs = 0.0;
         int i;
-        const char *profile = argv[1];
+        Corpus corpus;
+
+        memset(&corpus, '\0', sizeof (corpus));
+        corpus.profile = argv[argi];
 
         #if FINDERRORS_COMPILE_SHADERS
         SDL_Init(SDL_INIT_VIDEO);
@@ -206,7 +674,7 @@ int main(int argc, char **argv)
         SDL_SetVideoMode(640, 480, 0, SDL_OPENGL);
         printf("Best profile is '%s'\n", MOJOSHADER_glBestProfile(lookup, 0));
         MOJOSHADER_glContext *ctx;
-        ctx = MOJOSHADER_glCreateContext(profile, lookup, 0, 0, 0, 0);
+        ctx = MOJOSHADER_glCreateContext(corpus.profile, lookup, 0, 0, 0, 0);
         if (ctx == NULL)
         {
             printf("MOJOSHADER_glCreateContext() fail: %s\n", MOJOSHADER_glGetError());
@@ -216,10 +684,57 @@ int main(int argc, char **argv)
         MOJOSHADER_glMakeContextCurrent(ctx);
         #endif
 
-        for (i = 2; i < argc; i++)
-            total += do_dir(argv[i], profile);
+        for (i = argi + 1; i < argc; i++)
+            do_dir(&corpus, &alloc, argv[i]);
+
+        qsort(corpus.files, corpus.file_count, sizeof (CorpusFile), cmp_files);
 
-        printf("Saw %d files.\n", total);
+        const double start = now_usecs();
+        run_corpus(&corpus, threads);
+        const double elapsed = now_usecs() - start;
+
+        for (i = 0; i < corpus.file_count; i++)
+        {
+            const CorpusFile *file = &corpus.files[i];
+            if (!file->processed)
+                continue;
+            else if (file->passed)
+            {
+                report("PASS: %s\n", file->fname);
+                passed++;
+            } // else if
+            else
+            {
+                report("FAIL: %s\n", file->error);
+                failed++;
+            } // else
+            cpu_usecs += file->usecs;
+        } // for
+
+        printf("Saw %d files.\n", corpus.file_count);
+        printf("%d passed, %d failed, %.3f seconds (%.3f seconds of work, %d threads).\n",
+               passed, failed, elapsed / 1000000.0, cpu_usecs / 1000000.0,
+               threads);
+
+        if (results != NULL)
+            write_results(&corpus, results);
+
+        if (baseline != NULL)
+        {
+            int slower = 0;
+            const int changed = compare_baseline(&corpus, baseline,
+                                                 threshold, &slower);
+            printf("%d changed, %d slower than baseline.\n", changed, slower);
+            if ((changed) || (slower))
+                retval = 1;
+        } // if
+
+        for (i = 0; i < corpus.file_count; i++)
+        {
+            free(corpus.files[i].fname);
+            free(corpus.files[i].error);
+        } // for
+        free(corpus.files);
 
         #if FINDERRORS_COMPILE_SHADERS
         MOJOSHADER_glDestroyContext(ctx);
@@ -227,7 +742,7 @@ int main(int argc, char **argv)
         #endif
     } // else
 
-    return 0;
+    return retval;
 } // main
 
 // end of finderrors.c ...
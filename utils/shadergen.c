@@ -0,0 +1,672 @@
+/**
+ * MojoShader; generate synthetic shaders of arbitrary size, and time how
+ *  MojoShader scales with them.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+// This generates synthetic shaders of arbitrary size, so we can see where
+//  the various stages of MojoShader stop scaling linearly. It can write a
+//  single generated shader to stdout, sweep one parameter over a range of
+//  sizes and print timings in a format gnuplot can eat directly, or sweep
+//  every parameter in turn and write out the data files plus a gnuplot
+//  script that plots all of them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "mojoshader.h"
+
+#ifdef _MSC_VER
+#define WIN32_LEAN_AND_MEAN 1
+#include <windows.h>
+#define snprintf _snprintf
+#else
+#include <sys/time.h>
+#endif
+
+typedef enum
+{
+    GEN_VS_ASM,
+    GEN_PS_ASM,
+    GEN_VS_BYTECODE,
+    GEN_PS_BYTECODE,
+    GEN_HLSL,
+    GEN_PREPROCESSOR,
+} GenKind;
+
+typedef struct
+{
+    int instructions;
+    int constants;
+    int defs;
+    int nesting;
+    int macros;
+    int includes;
+} GenParams;
+
+static const struct { const char *name; GenKind kind; } kinds[] = {
+    { "vs_asm", GEN_VS_ASM },
+    { "ps_asm", GEN_PS_ASM },
+    { "vs_bytecode", GEN_VS_BYTECODE },
+    { "ps_bytecode", GEN_PS_BYTECODE },
+    { "hlsl", GEN_HLSL },
+    { "preprocessor", GEN_PREPROCESSOR },
+};
+
+
+static void fail(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputs("\n", stderr);
+    exit(1);
+} // fail
+
+
+// Simple growable string we build the generated sources in.
+typedef struct
+{
+    char *str;
+    size_t len;
+    size_t alloc;
+} GenBuffer;
+
+static void gen(GenBuffer *buf, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    if ((buf->len + len + 1) > buf->alloc)
+    {
+        size_t newalloc = buf->alloc ? buf->alloc : 4096;
+        while ((buf->len + len + 1) > newalloc)
+            newalloc *= 2;
+        buf->str = (char *) realloc(buf->str, newalloc);
+        if (buf->str == NULL)
+            fail("Out of memory");
+        buf->alloc = newalloc;
+    } // if
+
+    va_start(ap, fmt);
+    vsnprintf(buf->str + buf->len, len + 1, fmt, ap);
+    va_end(ap);
+    buf->len += len;
+} // gen
+
+
+static inline void gen_indent(GenBuffer *buf, const int depth)
+{
+    int i;
+    for (i = 0; i < depth; i++)
+        gen(buf, "    ");
+} // gen_indent
+
+
+// Macros are defined as a binary tree (macro N uses 2N+1 and 2N+2), so
+//  expanding the first one touches every macro without recursing deeply.
+static void gen_macros(GenBuffer *buf, const char *prefix, const int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        const int left = (i * 2) + 1;
+        const int right = left + 1;
+        if (right < count)
+        {
+            gen(buf, "#define %s%d (%s%d + %s%d)\n",
+                prefix, i, prefix, left, prefix, right);
+        } // if
+        else if (left < count)
+            gen(buf, "#define %s%d (%s%d + %d)\n", prefix, i, prefix, left, i);
+        else
+            gen(buf, "#define %s%d %d\n", prefix, i, i);
+    } // for
+} // gen_macros
+
+
+static void gen_preamble(GenBuffer *buf, const GenParams *p)
+{
+    int i;
+    for (i = 0; i < p->includes; i++)
+        gen(buf, "#include \"gen%d.h\"\n", i);
+    gen_macros(buf, "GENMACRO", p->macros);
+} // gen_preamble
+
+
+// The root of every macro tree, ours and each include file's, is expanded
+//  through (fmt), so the preprocessor has to do real work for all of them.
+//  (fmt) gets the macro's name twice: once to name the use, once to use it.
+static void gen_macro_uses(GenBuffer *buf, const GenParams *p, const char *fmt)
+{
+    char name[32];
+    int i;
+
+    if (p->macros > 0)
+        gen(buf, fmt, "GENMACRO0", "GENMACRO0");
+
+    for (i = 0; i < p->includes; i++)
+    {
+        snprintf(name, sizeof (name), "GENINC%d_0", i);
+        gen(buf, fmt, name, name);
+    } // for
+} // gen_macro_uses
+
+
+static void gen_asm(GenBuffer *buf, const GenParams *p, const int pixel)
+{
+    // vs_3_0/ps_3_0 have 224-256 float constants; keep everything in range
+    //  so the output stays valid at any size.
+    const int maxconsts = pixel ? 224 : 256;
+    const int consts = (p->constants < maxconsts) ? p->constants : maxconsts;
+    const int defs = (p->defs < maxconsts) ? p->defs : maxconsts;
+    int depth = 0;
+    int i;
+
+    // the version token has to come first, even before preprocessor output.
+    gen(buf, "%s\n", pixel ? "ps_3_0" : "vs_3_0");
+    gen_preamble(buf, p);
+
+    // DEF only takes literal numbers, so the macros get expanded in an #if
+    //  that guards a real DEF, in the first register the DEF runs leave free.
+    if ((p->macros > 0) || (p->includes > 0))
+    {
+        gen(buf, "#if 0");
+        gen_macro_uses(buf, p, " + %.0s%s");
+        gen(buf, " > 0\n");
+        gen(buf, "def c%d, 1.0, 0.0, 0.0, 0.0\n",
+            (defs < maxconsts) ? (maxconsts - 1 - defs) : 0);
+        gen(buf, "#endif\n");
+    } // if
+
+    if (pixel)
+        gen(buf, "dcl_texcoord0 v0\n");
+    else
+    {
+        gen(buf, "dcl_position v0\n");
+        gen(buf, "dcl_position o0\n");
+    } // else
+
+    // DEF runs go at the top of the constant file, uniforms at the bottom,
+    //  so they only overlap when both are huge.
+    for (i = 0; i < defs; i++)
+    {
+        gen(buf, "def c%d, %d.0, %d.5, -%d.0, 0.25\n",
+            maxconsts - 1 - i, i, i, i);
+    } // for
+
+    gen(buf, "mov r0, v0\n");
+
+    for (depth = 0; depth < p->nesting; depth++)
+    {
+        gen_indent(buf, depth);
+        gen(buf, "rep i%d\n", depth % 16);
+    } // for
+
+    for (i = 0; i < p->instructions; i++)
+    {
+        gen_indent(buf, depth);
+        if (consts == 0)
+            gen(buf, "add r%d, r0, r0\n", (i % 8) + 1);
+        else if (i % 3 == 0)
+            gen(buf, "mad r0, r0, c%d, r%d\n", i % consts, i % 8);
+        else if (i % 3 == 1)
+            gen(buf, "dp4 r%d.x, r0, c%d\n", (i % 8) + 1, i % consts);
+        else
+            gen(buf, "add r%d, r0, c%d\n", (i % 8) + 1, i % consts);
+    } // for
+
+    while (depth--)
+    {
+        gen_indent(buf, depth);
+        gen(buf, "endrep\n");
+    } // while
+
+    gen(buf, "mov %s, r0\n", pixel ? "oC0" : "o0");
+} // gen_asm
+
+
+static void gen_hlsl(GenBuffer *buf, const GenParams *p)
+{
+    int depth;
+    int i;
+
+    gen_preamble(buf, p);
+    gen_macro_uses(buf, p, "static const float use_%s = %s;\n");
+
+    for (i = 0; i < p->constants; i++)
+        gen(buf, "float4 gen_uniform%d;\n", i);
+    for (i = 0; i < p->defs; i++)
+        gen(buf, "static const float4 gen_const%d = float4(%d.0, %d.5, -%d.0, 0.25);\n", i, i, i, i);
+
+    gen(buf, "\nfloat4 main(float4 pos : POSITION) : POSITION\n{\n");
+    gen(buf, "    float4 r = pos;\n");
+    for (depth = 0; depth < p->nesting; depth++)
+    {
+        gen_indent(buf, depth + 1);
+        gen(buf, "if (r.x > %d.0)\n", depth);
+        gen_indent(buf, depth + 1);
+        gen(buf, "{\n");
+    } // for
+
+    for (i = 0; i < p->instructions; i++)
+    {
+        gen_indent(buf, depth + 1);
+        if (p->constants > 0)
+            gen(buf, "r = r * gen_uniform%d + r.yzwx;\n", i % p->constants);
+        else if (p->defs > 0)
+            gen(buf, "r = r * gen_const%d + r.yzwx;\n", i % p->defs);
+        else
+            gen(buf, "r = r * r.wzyx + %d.0;\n", i);
+    } // for
+
+    while (depth--)
+    {
+        gen_indent(buf, depth + 1);
+        gen(buf, "}\n");
+    } // while
+
+    gen(buf, "    return r;\n}\n");
+} // gen_hlsl
+
+
+static void gen_preprocessor(GenBuffer *buf, const GenParams *p)
+{
+    int depth;
+    int i;
+
+    gen_preamble(buf, p);
+
+    for (depth = 0; depth < p->nesting; depth++)
+        gen(buf, "#if GENNEST%d || !defined(GENNEST%d)\n", depth, depth);
+
+    for (i = 0; i < p->instructions; i++)
+    {
+        if (p->macros > 0)
+            gen(buf, "line%d = GENMACRO%d;\n", i, i % p->macros);
+        else
+            gen(buf, "line%d = %d;\n", i, i);
+    } // for
+
+    gen_macro_uses(buf, p, "use_%s = %s;\n");
+
+    while (depth--)
+        gen(buf, "#endif\n");
+} // gen_preprocessor
+
+
+// The include files are generated on demand: "genN.h" defines its own set of
+//  (macros) macros, so include fan-out and macro count scale independently.
+static GenParams include_params;
+
+static int open_include(MOJOSHADER_includeType inctype, const char *fname,
+                        const char *parent, const char **outdata,
+                        unsigned int *outbytes, MOJOSHADER_malloc m,
+                        MOJOSHADER_free f, void *d)
+{
+    GenBuffer buf;
+    char prefix[32];
+    int idx = 0;
+
+    if (sscanf(fname, "gen%d.h", &idx) != 1)
+        return 0;
+
+    memset(&buf, '\0', sizeof (buf));
+    snprintf(prefix, sizeof (prefix), "GENINC%d_", idx);
+    gen(&buf, "#ifndef GENINC%d_H\n#define GENINC%d_H\n", idx, idx);
+    gen_macros(&buf, prefix, include_params.macros ? include_params.macros : 1);
+    gen(&buf, "#endif\n");
+    *outdata = buf.str;
+    *outbytes = (unsigned int) buf.len;
+    return 1;
+} // open_include
+
+
+static void close_include(const char *data, MOJOSHADER_malloc m,
+                          MOJOSHADER_free f, void *d)
+{
+    free((void *) data);
+} // close_include
+
+
+static void generate(GenBuffer *buf, const GenKind kind, const GenParams *p)
+{
+    buf->len = 0;
+    include_params = *p;
+    switch (kind)
+    {
+        case GEN_VS_ASM: case GEN_VS_BYTECODE: gen_asm(buf, p, 0); break;
+        case GEN_PS_ASM: case GEN_PS_BYTECODE: gen_asm(buf, p, 1); break;
+        case GEN_HLSL: gen_hlsl(buf, p); break;
+        case GEN_PREPROCESSOR: gen_preprocessor(buf, p); break;
+    } // switch
+} // generate
+
+
+static double now_usecs(void)
+{
+#ifdef _MSC_VER
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return ((double) count.QuadPart * 1000000.0) / ((double) freq.QuadPart);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((double) tv.tv_sec * 1000000.0) + ((double) tv.tv_usec);
+#endif
+} // now_usecs
+
+
+// Runs the generated source through the stage it exercises. Returns the
+//  error count. For bytecode, (bytecode) gets the assembled shader; the
+//  assembly isn't timed in that case, just the MOJOSHADER_parse() call.
+static int run_once(const GenKind kind, const GenBuffer *buf,
+                    const char *profile, double *usecs)
+{
+    static const char *fname = "generated";
+    int errors = 0;
+    double start;
+
+    if ((kind == GEN_VS_BYTECODE) || (kind == GEN_PS_BYTECODE))
+    {
+        const MOJOSHADER_parseData *a;
+        const MOJOSHADER_parseData *pd;
+        a = MOJOSHADER_assemble(fname, buf->str, buf->len, NULL, 0, NULL, 0,
+                                NULL, 0, open_include, close_include,
+                                NULL, NULL, NULL);
+        if (a->error_count > 0)
+        {
+            errors = a->error_count;
+            *usecs = 0.0;
+        } // if
+        else
+        {
+            start = now_usecs();
+            pd = MOJOSHADER_parse(profile, (const unsigned char *) a->output,
+                                  a->output_len, NULL, 0, NULL, 0,
+                                  NULL, NULL, NULL);
+            *usecs = now_usecs() - start;
+            errors = pd->error_count;
+            MOJOSHADER_freeParseData(pd);
+        } // else
+        MOJOSHADER_freeParseData(a);
+    } // if
+
+    else if ((kind == GEN_VS_ASM) || (kind == GEN_PS_ASM))
+    {
+        const MOJOSHADER_parseData *pd;
+        start = now_usecs();
+        pd = MOJOSHADER_assemble(fname, buf->str, buf->len, NULL, 0, NULL, 0,
+                                 NULL, 0, open_include, close_include,
+                                 NULL, NULL, NULL);
+        *usecs = now_usecs() - start;
+        errors = pd->error_count;
+        MOJOSHADER_freeParseData(pd);
+    } // else if
+
+    else if (kind == GEN_HLSL)
+    {
+        const MOJOSHADER_astData *ad;
+        start = now_usecs();
+        ad = MOJOSHADER_parseAst(MOJOSHADER_SRC_PROFILE_HLSL_VS_3_0, fname,
+                                 buf->str, buf->len, NULL, 0,
+                                 open_include, close_include,
+                                 NULL, NULL, NULL);
+        *usecs = now_usecs() - start;
+        errors = ad->error_count;
+        MOJOSHADER_freeAstData(ad);
+    } // else if
+
+    else
+    {
+        const MOJOSHADER_preprocessData *pp;
+        start = now_usecs();
+        pp = MOJOSHADER_preprocess(fname, buf->str, buf->len, NULL, 0,
+                                   open_include, close_include,
+                                   NULL, NULL, NULL);
+        *usecs = now_usecs() - start;
+        errors = pp->error_count;
+        MOJOSHADER_freePreprocessData(pp);
+    } // else
+
+    return errors;
+} // run_once
+
+
+static const char *param_names[] = {
+    "instructions", "constants", "defs", "nesting", "macros", "includes"
+};
+
+static int *param_by_name(GenParams *p, const char *name)
+{
+    if (strcmp(name, "instructions") == 0) return &p->instructions;
+    if (strcmp(name, "constants") == 0) return &p->constants;
+    if (strcmp(name, "defs") == 0) return &p->defs;
+    if (strcmp(name, "nesting") == 0) return &p->nesting;
+    if (strcmp(name, "macros") == 0) return &p->macros;
+    if (strcmp(name, "includes") == 0) return &p->includes;
+    return NULL;
+} // param_by_name
+
+
+// Plain preprocessor sources don't have constants of either sort.
+static int param_applies(const GenKind kind, const char *name)
+{
+    if (kind != GEN_PREPROCESSOR)
+        return 1;
+    return ((strcmp(name, "constants") != 0) && (strcmp(name, "defs") != 0));
+} // param_applies
+
+
+static GenKind kind_by_name(const char *name)
+{
+    size_t i;
+    for (i = 0; i < sizeof (kinds) / sizeof (kinds[0]); i++)
+    {
+        if (strcmp(kinds[i].name, name) == 0)
+            return kinds[i].kind;
+    } // for
+    fail("Unknown shader kind '%s'", name);
+    return GEN_VS_ASM;  // shouldn't hit this.
+} // kind_by_name
+
+
+static void do_emit(const GenKind kind, const GenParams *p)
+{
+    GenBuffer buf;
+    memset(&buf, '\0', sizeof (buf));
+    generate(&buf, kind, p);
+
+    if ((kind == GEN_VS_BYTECODE) || (kind == GEN_PS_BYTECODE))
+    {
+        const MOJOSHADER_parseData *a;
+        a = MOJOSHADER_assemble("generated", buf.str, buf.len, NULL, 0,
+                                NULL, 0, NULL, 0, open_include, close_include,
+                                NULL, NULL, NULL);
+        if (a->error_count > 0)
+        {
+            fail("%s:%d: %s", a->errors[0].filename ? a->errors[0].filename : "???",
+                 a->errors[0].error_position, a->errors[0].error);
+        } // if
+        fwrite(a->output, a->output_len, 1, stdout);
+        MOJOSHADER_freeParseData(a);
+    } // if
+    else
+    {
+        fwrite(buf.str, buf.len, 1, stdout);
+    } // else
+
+    free(buf.str);
+} // do_emit
+
+
+// Doubles (param) from 1 to (maxval), timing each step. Output is
+//  whitespace-separated columns, so this works as-is:
+//   shadergen sweep vs_bytecode glsl instructions 65536 > x.dat
+//   gnuplot -e "plot 'x.dat' using 1:4 with linespoints; pause -1"
+static void do_sweep(FILE *out, const GenKind kind, GenParams *p,
+                     const char *profile, const char *param,
+                     const int maxval, const int runs)
+{
+    int *val = param_by_name(p, param);
+    int origval;
+    GenBuffer buf;
+
+    if (val == NULL)
+        fail("Unknown parameter '%s'", param);
+
+    origval = *val;
+    memset(&buf, '\0', sizeof (buf));
+
+    fprintf(out, "# %s: %s (profile %s, best of %d runs)\n", "sweep", param, profile, runs);
+    fprintf(out, "# %s\tbytes\terrors\tusecs\tusecs_per_unit\n", param);
+
+    for (*val = 1; *val <= maxval; *val *= 2)
+    {
+        double best = 0.0;
+        int errors = 0;
+        int i;
+
+        generate(&buf, kind, p);
+        for (i = 0; i < runs; i++)
+        {
+            double usecs = 0.0;
+            errors = run_once(kind, &buf, profile, &usecs);
+            if ((i == 0) || (usecs < best))
+                best = usecs;
+        } // for
+
+        fprintf(out, "%d\t%u\t%d\t%.1f\t%.3f\n", *val, (unsigned int) buf.len,
+                errors, best, best / (double) *val);
+        fflush(out);
+    } // for
+
+    *val = origval;
+    free(buf.str);
+} // do_sweep
+
+
+// Sweeps every parameter that matters for (kind) in turn, the others staying
+//  at their base values. Each one goes to "(prefix)-(param).dat", and
+//  "(prefix).gp" plots them all, time against size, on log-log axes:
+//   shadergen suite vs_bytecode glsl 65536 vsbc && gnuplot vsbc.gp
+static void do_suite(const GenKind kind, GenParams *p, const char *profile,
+                     const int maxval, const int runs, const char *prefix)
+{
+    char fname[256];
+    FILE *gp;
+    int plotted = 0;
+    size_t i;
+
+    snprintf(fname, sizeof (fname), "%s.gp", prefix);
+    gp = fopen(fname, "w");
+    if (gp == NULL)
+        fail("Couldn't open '%s' for writing", fname);
+
+    fprintf(gp, "set title \"%s (profile %s)\"\n", prefix, profile);
+    fprintf(gp, "set xlabel \"size\"\nset ylabel \"usecs\"\n");
+    fprintf(gp, "set logscale xy\nset key left top\n");
+
+    for (i = 0; i < sizeof (param_names) / sizeof (param_names[0]); i++)
+    {
+        FILE *out;
+        if (!param_applies(kind, param_names[i]))
+            continue;
+
+        snprintf(fname, sizeof (fname), "%s-%s.dat", prefix, param_names[i]);
+        out = fopen(fname, "w");
+        if (out == NULL)
+            fail("Couldn't open '%s' for writing", fname);
+
+        fprintf(stderr, "shadergen: sweeping %s...\n", param_names[i]);
+        do_sweep(out, kind, p, profile, param_names[i], maxval, runs);
+        fclose(out);
+
+        fprintf(gp, "%s \"%s\" using 1:4 with linespoints title \"%s\"",
+                plotted++ ? ", \\\n   " : "plot", fname, param_names[i]);
+    } // for
+
+    fprintf(gp, "\npause -1\n");
+    fclose(gp);
+} // do_suite
+
+
+static void usage(const char *argv0)
+{
+    size_t i;
+    printf("\n\nUSAGE: %s [options] emit <kind>\n", argv0);
+    printf("       %s [options] sweep <kind> <profile> <param> <max>\n", argv0);
+    printf("       %s [options] suite <kind> <profile> <max> <prefix>\n\n", argv0);
+    printf("kinds:");
+    for (i = 0; i < sizeof (kinds) / sizeof (kinds[0]); i++)
+        printf(" %s", kinds[i].name);
+    printf("\nparams: instructions constants defs nesting macros includes\n");
+    printf("options: --<param>=<n> to set a base value, --runs=<n>\n\n");
+} // usage
+
+
+int main(int argc, char **argv)
+{
+    GenParams params;
+    int runs = 5;
+    int i;
+
+    memset(&params, '\0', sizeof (params));
+    params.instructions = 64;
+    params.constants = 8;
+
+    for (i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *eq = strchr(arg, '=');
+        char name[64];
+        int *val;
+
+        if ((strncmp(arg, "--", 2) != 0) || (eq == NULL))
+            break;
+
+        snprintf(name, sizeof (name), "%.*s", (int) (eq - (arg + 2)), arg + 2);
+        if (strcmp(name, "runs") == 0)
+            runs = atoi(eq + 1);
+        else if ((val = param_by_name(&params, name)) != NULL)
+            *val = atoi(eq + 1);
+        else
+            fail("Unknown option '%s'", arg);
+    } // for
+
+    if (runs < 1)
+        runs = 1;
+
+    if ((argc - i == 2) && (strcmp(argv[i], "emit") == 0))
+        do_emit(kind_by_name(argv[i+1]), &params);
+    else if ((argc - i == 5) && (strcmp(argv[i], "sweep") == 0))
+    {
+        do_sweep(stdout, kind_by_name(argv[i+1]), &params, argv[i+2],
+                 argv[i+3], atoi(argv[i+4]), runs);
+    } // else if
+    else if ((argc - i == 5) && (strcmp(argv[i], "suite") == 0))
+    {
+        do_suite(kind_by_name(argv[i+1]), &params, argv[i+2],
+                 atoi(argv[i+3]), runs, argv[i+4]);
+    } // else if
+    else
+    {
+        usage(argv[0]);
+        return 1;
+    } // else
+
+    return 0;
+} // main
+
+// end of shadergen.c ...
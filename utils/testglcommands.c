@@ -0,0 +1,407 @@
+/**
+ * MojoShader; check GL command buffer playback against a stub GL.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+// This plays command buffers back against a fake GL that just records what
+//  it was asked to do, so we can check the playback logic without a real
+//  GL context (or a display) around.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GL_GLEXT_LEGACY 1
+#include "GL/gl.h"
+#include "GL/glext.h"
+
+#include "mojoshader.h"
+
+static int failures = 0;
+
+#define check(x, what) { \
+    if (!(x)) { \
+        printf("FAIL: %s (line %d)\n", what, __LINE__); \
+        failures++; \
+    } \
+}
+
+
+// the fake GL...
+
+static GLuint stub_next_handle = 1;
+static GLuint stub_current_program = 0;
+static int stub_uniform4fv_calls = 0;
+static GLfloat stub_last_uniform[4];
+
+static const GLubyte * APIENTRY stub_glGetString(GLenum name)
+{
+    switch (name)
+    {
+        case GL_VERSION: return (const GLubyte *) "2.1";
+        case GL_SHADING_LANGUAGE_VERSION: return (const GLubyte *) "1.20";
+        case GL_EXTENSIONS: return (const GLubyte *) "";
+    } // switch
+    return NULL;
+} // stub_glGetString
+
+static GLenum APIENTRY stub_glGetError(void)
+{
+    return GL_NO_ERROR;
+} // stub_glGetError
+
+static void APIENTRY stub_glGetIntegerv(GLenum pname, GLint *params)
+{
+    *params = 1024;
+} // stub_glGetIntegerv
+
+static void APIENTRY stub_glEnableDisable(GLenum cap) {}
+static void APIENTRY stub_glUint(GLuint obj) {}
+static void APIENTRY stub_glUintUint(GLuint a, GLuint b) {}
+
+static GLuint APIENTRY stub_glCreateShader(GLenum type)
+{
+    return stub_next_handle++;
+} // stub_glCreateShader
+
+static GLuint APIENTRY stub_glCreateProgram(void)
+{
+    return stub_next_handle++;
+} // stub_glCreateProgram
+
+static void APIENTRY stub_glGetObjectiv(GLuint obj, GLenum pname,
+                                        GLint *params)
+{
+    *params = 1;  // everything compiles and links, and has a 1 char log.
+} // stub_glGetObjectiv
+
+static void APIENTRY stub_glGetInfoLog(GLuint obj, GLsizei bufsize,
+                                       GLsizei *length, GLchar *log)
+{
+    if (length != NULL)
+        *length = 0;
+    if (bufsize > 0)
+        *log = '\0';
+} // stub_glGetInfoLog
+
+static GLint APIENTRY stub_glGetAttribLocation(GLuint program,
+                                               const GLchar *name)
+{
+    return 0;
+} // stub_glGetAttribLocation
+
+static GLint APIENTRY stub_glGetUniformLocation(GLuint program,
+                                                const GLchar *name)
+{
+    // only the vertex shader float array exists in the programs we link.
+    return (strcmp(name, "vs_uniforms_vec4") == 0) ? 0 : -1;
+} // stub_glGetUniformLocation
+
+static void APIENTRY stub_glShaderSource(GLuint shader, GLsizei count,
+                                         const GLchar **string,
+                                         const GLint *length) {}
+
+static void APIENTRY stub_glUniform1i(GLint location, GLint v0) {}
+
+static void APIENTRY stub_glUniformiv(GLint location, GLsizei count,
+                                      const GLint *value) {}
+
+static void APIENTRY stub_glUniform4fv(GLint location, GLsizei count,
+                                       const GLfloat *value)
+{
+    stub_uniform4fv_calls++;
+    memcpy(stub_last_uniform, value, sizeof (stub_last_uniform));
+} // stub_glUniform4fv
+
+static void APIENTRY stub_glUseProgram(GLuint program)
+{
+    stub_current_program = program;
+} // stub_glUseProgram
+
+static void APIENTRY stub_glVertexAttribPointer(GLuint index, GLint size,
+                                                GLenum type,
+                                                GLboolean normalized,
+                                                GLsizei stride,
+                                                const GLvoid *pointer) {}
+
+static void *stub_lookup(const char *fnname, void *data)
+{
+    static const struct { const char *name; void *fn; } entries[] = {
+        #define STUB(name, fn) { #name, (void *) fn }
+        STUB(glGetString, stub_glGetString),
+        STUB(glGetError, stub_glGetError),
+        STUB(glGetIntegerv, stub_glGetIntegerv),
+        STUB(glEnable, stub_glEnableDisable),
+        STUB(glDisable, stub_glEnableDisable),
+        STUB(glDeleteShader, stub_glUint),
+        STUB(glDeleteProgram, stub_glUint),
+        STUB(glAttachShader, stub_glUintUint),
+        STUB(glCompileShader, stub_glUint),
+        STUB(glCreateShader, stub_glCreateShader),
+        STUB(glCreateProgram, stub_glCreateProgram),
+        STUB(glDisableVertexAttribArray, stub_glUint),
+        STUB(glEnableVertexAttribArray, stub_glUint),
+        STUB(glGetAttribLocation, stub_glGetAttribLocation),
+        STUB(glGetProgramInfoLog, stub_glGetInfoLog),
+        STUB(glGetShaderInfoLog, stub_glGetInfoLog),
+        STUB(glGetShaderiv, stub_glGetObjectiv),
+        STUB(glGetProgramiv, stub_glGetObjectiv),
+        STUB(glGetUniformLocation, stub_glGetUniformLocation),
+        STUB(glLinkProgram, stub_glUint),
+        STUB(glShaderSource, stub_glShaderSource),
+        STUB(glUniform1i, stub_glUniform1i),
+        STUB(glUniform1iv, stub_glUniformiv),
+        STUB(glUniform4fv, stub_glUniform4fv),
+        STUB(glUniform4iv, stub_glUniformiv),
+        STUB(glUseProgram, stub_glUseProgram),
+        STUB(glVertexAttribPointer, stub_glVertexAttribPointer),
+        #undef STUB
+    };
+
+    size_t i;
+    for (i = 0; i < sizeof (entries) / sizeof (entries[0]); i++)
+    {
+        if (strcmp(entries[i].name, fnname) == 0)
+            return entries[i].fn;
+    } // for
+
+    return NULL;  // everything else is "missing."
+} // stub_lookup
+
+
+// an allocator we can make fail on demand...
+
+static int fail_allocations = 0;
+
+static void *test_malloc(int bytes, void *data)
+{
+    return fail_allocations ? NULL : malloc(bytes);
+} // test_malloc
+
+static void test_free(void *ptr, void *data)
+{
+    free(ptr);
+} // test_free
+
+
+// draw callbacks...
+
+typedef struct DrawRecord
+{
+    GLuint expected_program;
+    float expected_uniform;
+    GLuint program;
+    float uniform;
+    int uniform_calls;
+    int sequence;
+} DrawRecord;
+
+static int draw_sequence = 0;
+
+static void record_draw(void *data)
+{
+    DrawRecord *draw = (DrawRecord *) data;
+    draw->program = stub_current_program;
+    draw->uniform = stub_last_uniform[0];
+    draw->uniform_calls = stub_uniform4fv_calls;
+    draw->sequence = draw_sequence++;
+} // record_draw
+
+static void reset_draws(DrawRecord *draws, const int count)
+{
+    memset(draws, '\0', sizeof (DrawRecord) * count);
+    draw_sequence = 0;
+} // reset_draws
+
+
+static MOJOSHADER_glShader *compile_vertex_shader(const char *source)
+{
+    MOJOSHADER_glShader *retval = NULL;
+    const MOJOSHADER_parseData *pd;
+
+    pd = MOJOSHADER_assemble(NULL, source, (unsigned int) strlen(source),
+                             NULL, 0, NULL, 0, NULL, 0, NULL, NULL,
+                             NULL, NULL, NULL);
+    if (pd->error_count > 0)
+        printf("FAIL: assembling shader: %s\n", pd->errors[0].error);
+    else
+    {
+        const unsigned char *bytecode = (const unsigned char *) pd->output;
+        retval = MOJOSHADER_glCompileShader(bytecode, pd->output_len,
+                                            NULL, 0, NULL, 0);
+        if (retval == NULL)
+            printf("FAIL: compiling shader: %s\n", MOJOSHADER_glGetError());
+    } // else
+
+    MOJOSHADER_freeParseData(pd);
+    return retval;
+} // compile_vertex_shader
+
+static GLuint program_for(MOJOSHADER_glShader *vshader)
+{
+    stub_current_program = 0;
+    MOJOSHADER_glBindShaders(vshader, NULL);
+    MOJOSHADER_glProgramReady();
+    return stub_current_program;
+} // program_for
+
+static void record_bind_and_draw(MOJOSHADER_glCommandBuffer *buf,
+                                 MOJOSHADER_glShader *vshader,
+                                 const float value, DrawRecord *draw)
+{
+    const float vec4[4] = { value, value, value, value };
+    MOJOSHADER_glCommandBindShaders(buf, vshader, NULL);
+    MOJOSHADER_glCommandSetVertexShaderUniformF(buf, 0, vec4, 1);
+    MOJOSHADER_glCommandDraw(buf, record_draw, draw);
+    draw->expected_uniform = value;
+} // record_bind_and_draw
+
+
+// the actual tests...
+
+static void test_reorder(MOJOSHADER_glShader *vsa, const GLuint proga,
+                         MOJOSHADER_glShader *vsb, const GLuint progb)
+{
+    MOJOSHADER_glCommandBuffer *buf = MOJOSHADER_glCreateCommandBuffer();
+    DrawRecord draws[3];
+    int i;
+
+    reset_draws(draws, 3);
+    record_bind_and_draw(buf, vsa, 1.0f, &draws[0]);
+    record_bind_and_draw(buf, vsb, 2.0f, &draws[1]);
+    record_bind_and_draw(buf, vsa, 3.0f, &draws[2]);
+    draws[0].expected_program = draws[2].expected_program = proga;
+    draws[1].expected_program = progb;
+
+    check(MOJOSHADER_glExecuteCommandBuffer(buf, 1), "reordered execute");
+    check(draw_sequence == 3, "every reordered draw ran");
+
+    for (i = 0; i < 3; i++)
+    {
+        check(draws[i].program == draws[i].expected_program,
+              "reordered draw runs with the program bound for it");
+        check(draws[i].uniform == draws[i].expected_uniform,
+              "reordered draw sees the uniforms set for it");
+    } // for
+
+    // both draws with shader A should have been moved next to each other.
+    check(abs(draws[0].sequence - draws[2].sequence) == 1,
+          "draws with the same shaders run together");
+
+    MOJOSHADER_glDestroyCommandBuffer(buf);
+} // test_reorder
+
+static void test_redundant_uniforms(MOJOSHADER_glShader *vsa)
+{
+    MOJOSHADER_glCommandBuffer *buf = MOJOSHADER_glCreateCommandBuffer();
+    const float same[4] = { 5.0f, 5.0f, 5.0f, 5.0f };
+    const float changed[4] = { 6.0f, 6.0f, 6.0f, 6.0f };
+    DrawRecord draws[3];
+    int calls = 0;
+
+    reset_draws(draws, 3);
+    MOJOSHADER_glCommandBindShaders(buf, vsa, NULL);
+    MOJOSHADER_glCommandSetVertexShaderUniformF(buf, 0, same, 1);
+    MOJOSHADER_glCommandDraw(buf, record_draw, &draws[0]);
+    MOJOSHADER_glCommandSetVertexShaderUniformF(buf, 0, same, 1);
+    MOJOSHADER_glCommandDraw(buf, record_draw, &draws[1]);
+    MOJOSHADER_glCommandSetVertexShaderUniformF(buf, 0, changed, 1);
+    MOJOSHADER_glCommandDraw(buf, record_draw, &draws[2]);
+
+    calls = stub_uniform4fv_calls;
+    check(MOJOSHADER_glExecuteCommandBuffer(buf, 0), "in-order execute");
+    check(draw_sequence == 3, "every in-order draw ran");
+    check(draws[0].uniform_calls > calls, "new uniforms get pushed");
+    check(draws[1].uniform_calls == draws[0].uniform_calls,
+          "identical uniforms don't get pushed again");
+    check(draws[2].uniform_calls > draws[1].uniform_calls,
+          "changed uniforms get pushed");
+    check(draws[2].uniform == 6.0f, "changed uniform value reaches the GL");
+
+    MOJOSHADER_glDestroyCommandBuffer(buf);
+} // test_redundant_uniforms
+
+static void test_out_of_memory(MOJOSHADER_glShader *vsa,
+                               MOJOSHADER_glShader *vsb)
+{
+    MOJOSHADER_glCommandBuffer *buf = MOJOSHADER_glCreateCommandBuffer();
+    const char *err = NULL;
+    DrawRecord draws[2];
+    int rc = 0;
+
+    reset_draws(draws, 2);
+    record_bind_and_draw(buf, vsa, 7.0f, &draws[0]);
+    record_bind_and_draw(buf, vsb, 8.0f, &draws[1]);
+
+    // reordering needs scratch memory, so this should fail cleanly.
+    fail_allocations = 1;
+    rc = MOJOSHADER_glExecuteCommandBuffer(buf, 1);
+    fail_allocations = 0;
+
+    err = MOJOSHADER_glGetError();
+    check(rc == 0, "reordered execute fails when allocation fails");
+    check(strstr(err, "out of memory") != NULL,
+          "failed reorder reports out of memory");
+    check(draw_sequence == 0, "failed reorder draws nothing");
+
+    MOJOSHADER_glDestroyCommandBuffer(buf);
+} // test_out_of_memory
+
+
+int main(int argc, char **argv)
+{
+    MOJOSHADER_glContext *ctx = NULL;
+    MOJOSHADER_glShader *vsa = NULL;
+    MOJOSHADER_glShader *vsb = NULL;
+    GLuint proga = 0;
+    GLuint progb = 0;
+
+    ctx = MOJOSHADER_glCreateContext(MOJOSHADER_PROFILE_GLSL, stub_lookup,
+                                     NULL, test_malloc, test_free, NULL);
+    if (ctx == NULL)
+    {
+        printf("FAIL: couldn't create context: %s\n", MOJOSHADER_glGetError());
+        return 1;
+    } // if
+
+    MOJOSHADER_glMakeContextCurrent(ctx);
+
+    // two different shaders, so they link to two different programs.
+    vsa = compile_vertex_shader("vs_2_0\n"
+                                "dcl_position v0\n"
+                                "mul oPos, v0, c0\n");
+    vsb = compile_vertex_shader("vs_2_0\n"
+                                "dcl_position v0\n"
+                                "add oPos, v0, c0\n");
+
+    if ((vsa == NULL) || (vsb == NULL))
+        failures++;
+    else
+    {
+        proga = program_for(vsa);
+        progb = program_for(vsb);
+        MOJOSHADER_glBindShaders(NULL, NULL);
+        check((proga != 0) && (progb != 0) && (proga != progb),
+              "shaders link to separate programs");
+
+        test_reorder(vsa, proga, vsb, progb);
+        test_redundant_uniforms(vsa);
+        test_out_of_memory(vsa, vsb);
+    } // else
+
+    if (vsa != NULL)
+        MOJOSHADER_glDeleteShader(vsa);
+    if (vsb != NULL)
+        MOJOSHADER_glDeleteShader(vsb);
+    MOJOSHADER_glMakeContextCurrent(NULL);
+    MOJOSHADER_glDestroyContext(ctx);
+
+    if (failures == 0)
+        printf("All command buffer tests passed.\n");
+    return (failures == 0) ? 0 : 1;
+} // main
+
+// end of testglcommands.c ...
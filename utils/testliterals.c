@@ -0,0 +1,135 @@
+/**
+ * MojoShader; check the numeric literal parsers against the C runtime.
+ *
+ * Please see the file LICENSE.txt in the source's root directory.
+ *
+ *  This file written by Ryan C. Gordon.
+ */
+
+// literal_double() and literal_float() take shortcuts for the common cases,
+//  so this throws a pile of random literals at them and makes sure they
+//  round exactly like strtod() and strtof() do.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// these are internal functions, but the shared library exports them.
+#define __MOJOSHADER_INTERNAL__ 1
+#include "mojoshader_internal.h"
+
+static int failures = 0;
+
+// Simple xorshift, so every run (and every platform) tests the same set.
+static uint64 rng_state = 0x9E3779B97F4A7C15ULL;
+static uint32 rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32) (rng_state >> 32);
+} // rng
+
+static void random_digits(char *buf, size_t *pos, const int maxdigits)
+{
+    const int count = 1 + (int) (rng() % maxdigits);
+    int i;
+    for (i = 0; i < count; i++)
+        buf[(*pos)++] = '0' + (char) (rng() % 10);
+} // random_digits
+
+// Builds things like "123", "0.5", ".25e-3", "12345678901234567890.1E+40".
+static void random_literal(char *buf)
+{
+    size_t pos = 0;
+    // mostly short literals, like shaders have, but some long ones, too.
+    const int maxdigits = ((rng() % 4) == 0) ? 30 : 8;
+
+    if ((rng() % 8) != 0)
+        random_digits(buf, &pos, maxdigits);
+
+    if ((pos == 0) || ((rng() % 2) == 0))
+    {
+        buf[pos++] = '.';
+        random_digits(buf, &pos, maxdigits);
+    } // if
+
+    if ((rng() % 3) == 0)
+    {
+        buf[pos++] = ((rng() % 2) == 0) ? 'e' : 'E';
+        switch (rng() % 3)
+        {
+            case 0: buf[pos++] = '-'; break;
+            case 1: buf[pos++] = '+'; break;
+            default: break;
+        } // switch
+        pos += sprintf(buf + pos, "%d", (int) (rng() % 60));
+    } // if
+
+    buf[pos] = '\0';
+} // random_literal
+
+static void check_literal(const char *str)
+{
+    // tokens aren't null-terminated in the source buffer, so stick a type
+    //  suffix and some junk after the number to make sure it stops there.
+    char token[128];
+    const unsigned int len = (unsigned int) strlen(str);
+    snprintf(token, sizeof (token), "%sf;0123", str);
+
+    const double d = literal_double(token, len + 1);
+    const double wantd = strtod(str, NULL);
+    if (memcmp(&d, &wantd, sizeof (d)) != 0)
+    {
+        printf("FAIL: literal_double(\"%s\") == %.17g, strtod says %.17g\n",
+               str, d, wantd);
+        failures++;
+    } // if
+
+    const float f = literal_float(token, len + 1);
+    const float wantf = strtof(str, NULL);
+    if (memcmp(&f, &wantf, sizeof (f)) != 0)
+    {
+        printf("FAIL: literal_float(\"%s\") == %.9g, strtof says %.9g\n",
+               str, (double) f, (double) wantf);
+        failures++;
+    } // if
+} // check_literal
+
+int main(int argc, char **argv)
+{
+    // cases right at the edges of the fast paths, and ones that used to be
+    //  rounded twice.
+    static const char *fixed[] = {
+        "0", "0.0", ".0", "1", "1.0", "0.1", "0.5", "3.14159265358979323846",
+        "9007199254740992", "9007199254740993", "9007199254740992e22",
+        "1e22", "1e23", "1e-22", "1e-23", "16777216", "16777217",
+        "16777217e10", "1e10", "1e11", "1e-10", "1e-11",
+        "1.00000005960464477539062499", "1.000000059604644775390625",
+        "1.00000005960464477539062501", "3.4028235e38", "3.4028236e38",
+        "1e39", "1e-46", "1.4e-45", "1e309", "2.2250738585072011e-308",
+        "4.9e-324", "12345678901234567890123", "0.000000000000000000001",
+        "123456789012345678901234567890e-30",
+    };
+    unsigned long count = 1000000;
+    unsigned long i;
+    char buf[128];
+
+    if (argc > 1)
+        count = strtoul(argv[1], NULL, 10);
+
+    for (i = 0; i < STATICARRAYLEN(fixed); i++)
+        check_literal(fixed[i]);
+
+    for (i = 0; i < count; i++)
+    {
+        random_literal(buf);
+        check_literal(buf);
+    } // for
+
+    if (failures == 0)
+        printf("All literal tests passed.\n");
+    return (failures == 0) ? 0 : 1;
+} // main
+
+// end of testliterals.c ...
@@ -15,28 +15,50 @@
 #define snprintf _snprintf
 #endif
 
+// These stay NULL (use MojoShader's default allocator) unless we're tracing.
+static MOJOSHADER_malloc Malloc = NULL;
+static MOJOSHADER_free Free = NULL;
+static void *MallocData = NULL;
+
 #if MOJOSHADER_DEBUG_MALLOC
-static void *Malloc(int len)
-{
-    void *ptr = malloc(len + sizeof (int));
-    int *store = (int *) ptr;
-    printf("malloc() %d bytes (%p)\n", len, ptr);
-    if (ptr == NULL) return NULL;
-    *store = len;
-    return (void *) (store + 1);
-} // Malloc
+static MOJOSHADER_allocTracer *tracer = NULL;
 
+static void print_histogram(const char *title, const unsigned int *buckets)
+{
+    int i;
+    printf("  %s:\n", title);
+    for (i = 0; i < MOJOSHADER_ALLOC_HISTOGRAM_BUCKETS; i++)
+    {
+        if (buckets[i] == 0)
+            continue;
+        else if (i == 0)
+            printf("    0: %u\n", buckets[i]);
+        else
+            printf("    %llu+: %u\n", 1ULL << (i-1), buckets[i]);
+    } // for
+} // print_histogram
 
-static void Free(void *_ptr)
+static void print_alloc_stats(void)
 {
-    int *ptr = (((int *) _ptr) - 1);
-    int len = *ptr;
-    printf("free() %d bytes (%p)\n", len, ptr);
-    free(ptr);
-} // Free
-#else
-#define Malloc NULL
-#define Free NULL
+    int i;
+    printf("ALLOCATIONS:\n");
+    for (i = 0; i <= MOJOSHADER_ALLOCPHASE_TOTAL; i++)
+    {
+        const MOJOSHADER_allocPhase phase = (MOJOSHADER_allocPhase) i;
+        const MOJOSHADER_allocStats *st = MOJOSHADER_getAllocStats(tracer, phase);
+        if ((st->allocations == 0) && (st->failures == 0))
+            continue;
+        printf("  %-12s %8u allocs %8u frees %10llu bytes %10llu peak"
+               " %8u live %u failed\n", MOJOSHADER_allocPhaseName(phase),
+               st->allocations, st->frees, st->bytes, st->peak_bytes,
+               st->live_allocations, st->failures);
+    } // for
+
+    const MOJOSHADER_allocStats *total = MOJOSHADER_getAllocStats(tracer,
+                                                MOJOSHADER_ALLOCPHASE_TOTAL);
+    print_histogram("sizes (bytes)", total->sizes);
+    print_histogram("lifetimes (allocations)", total->lifetimes);
+} // print_alloc_stats
 #endif
 
 static inline void do_indent(const unsigned int indent)
@@ -490,7 +512,7 @@ static int do_parse(const char *fname, const unsigned char *buf,
     {
         const MOJOSHADER_effect *effect;
         effect = MOJOSHADER_parseEffect(prof, buf, len, NULL, 0,
-                                        NULL, 0, Malloc, Free, 0);
+                                        NULL, 0, Malloc, Free, MallocData);
         retval = (effect->error_count == 0);
         printf("EFFECT: %s\n", fname);
         print_effect(fname, effect, 1);
@@ -499,7 +521,7 @@ static int do_parse(const char *fname, const unsigned char *buf,
     else if ( buf[1] == 0x02 && buf[2] == 0x58 && buf[3] == 0x46)
     {
         //special preshader-only block
-        MOJOSHADER_parseData* pd = MOJOSHADER_parseExpression(buf, len, Malloc, Free, 0);
+        MOJOSHADER_parseData* pd = MOJOSHADER_parseExpression(buf, len, Malloc, Free, MallocData);
         retval = (pd->error_count == 0);
         print_preshader(pd->preshader, 0);
         
@@ -521,7 +543,7 @@ static int do_parse(const char *fname, const unsigned char *buf,
     {
         const MOJOSHADER_parseData *pd;
         pd = MOJOSHADER_parse(prof, buf, len, NULL, 0,
-                              NULL, 0, Malloc, Free, NULL);
+                              NULL, 0, Malloc, Free, MallocData);
         retval = (pd->error_count == 0);
         printf("SHADER: %s\n", fname);
         print_shader(fname, pd, 1);
@@ -548,6 +570,11 @@ int main(int argc, char **argv)
         const char *profile = argv[1];
         int i;
 
+        #if MOJOSHADER_DEBUG_MALLOC
+        tracer = MOJOSHADER_createAllocTracer(NULL, NULL, NULL);
+        MOJOSHADER_getAllocTracerCallbacks(tracer, &Malloc, &Free, &MallocData);
+        #endif
+
         for (i = 2; i < argc; i++)
         {
             FILE *io = fopen(argv[i], "rb");
@@ -563,6 +590,11 @@ int main(int argc, char **argv)
                 free(buf);
             } // else
         } // for
+
+        #if MOJOSHADER_DEBUG_MALLOC
+        print_alloc_stats();
+        MOJOSHADER_destroyAllocTracer(tracer);
+        #endif
     } // else
 
     return retval;